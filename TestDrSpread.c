@@ -34,12 +34,24 @@ DRSP_EXPORT
 int
 drsp_evaluate_function(DrSpreadCtx* ctx, SheetHandle func, size_t nargs, const StringView*_Null_unspecified args, DrSpreadResult* outval);
 
+#ifndef DRSP_TEST_DYLINK
 static
 SheetHandle _Null_unspecified*_Nullable
 drsp_sheet_get_dependants(DrSpreadCtx* ctx, SheetHandle h, size_t* n);
 
 static _Bool drsp_sheet_is_dirty(DrSpreadCtx* ctx, SheetHandle h);
 
+static size_t drsp_sheet_dirty_cell_count(DrSpreadCtx* ctx, SheetHandle h);
+
+static intptr_t drsp_sheet_column_capacity(DrSpreadCtx* ctx, SheetHandle h, intptr_t col);
+
+static size_t drsp_parsed_node_count(DrSpreadCtx* ctx, const char* txt, size_t len);
+
+static size_t drsp_parse_cache_count(DrSpreadCtx* ctx);
+
+static int drsp_intern_concurrently(DrSpreadCtx* ctx, int nthreads, int n);
+#endif
+
 
 #define EXPECT_NO_LEAKS() do { \
     int leaks = drsp_report_leaks(); \
@@ -52,21 +64,33 @@ static TestFunc TestSpreadsheet1;
 static TestFunc TestSpreadsheet2;
 static TestFunc TestBinOps;
 static TestFunc TestUnOps;
+static TestFunc TestCompiledFormulas;
+static TestFunc TestSharedParses;
+static TestFunc TestNumericCells;
+static TestFunc TestRangeCursors;
+static TestFunc TestNumberArrays;
+static TestFunc TestArrayErrorPrecedence;
 static TestFunc TestFuncs;
 static TestFunc TestFuncsV;
 static TestFunc TestFuncsRowArray;
+static TestFunc TestSortedLookups;
 static TestFunc TestMod;
 static TestFunc TestBugs;
 static TestFunc TestBugs2;
 static TestFunc TestBugs3;
 static TestFunc TestDirectlyRecursiveShouldError;
 static TestFunc TestIndirectlyRecursiveShouldError;
+static TestFunc TestDeepChains;
+static TestFunc TestSparseCells;
+static TestFunc TestColumnAggregates;
+static TestFunc TestLargeArrays;
 static TestFunc TestMultisheet;
 static TestFunc TestColFunc;
 static TestFunc TestRanges;
 static TestFunc TestBadRanges;
 static TestFunc TestNames;
 static TestFunc TestComplexMultisheet;
+static TestFunc TestManySheets;
 static TestFunc TestCaching;
 static TestFunc TestUserFunctions;
 static TestFunc TestShortColNames;
@@ -74,8 +98,23 @@ static TestFunc TestDeleteColNames;
 static TestFunc TestExtraDimensional;
 static TestFunc TestEditing;
 static TestFunc TestNamedCells;
+static TestFunc TestSharedBindings;
+static TestFunc TestThreadedRecalc;
+static TestFunc TestThreadedPartialRecalc;
+static TestFunc TestThreadedSheet;
+static TestFunc TestBulkLoad;
+static TestFunc TestDisplayBatching;
+static TestFunc TestChangedCells;
+static TestFunc TestLoadDelimited;
+static TestFunc TestSnapshot;
 static TestFunc TestDependants;
 static TestFunc TestDependantsF;
+static TestFunc TestIncrementalRecalc;
+static TestFunc TestNameChangesRecalc;
+static TestFunc TestColumnLookups;
+static TestFunc TestConstantFolding;
+static TestFunc TestFillDown;
+static TestFunc TestConcurrentInterning;
 static TestFunc TestErrorMessages;
 
 int main(int argc, char*_Null_unspecified*_Null_unspecified argv){
@@ -87,19 +126,31 @@ int main(int argc, char*_Null_unspecified*_Null_unspecified argv){
         RegisterTest(TestSpreadsheet2);
         RegisterTest(TestBinOps);
         RegisterTest(TestUnOps);
+        RegisterTest(TestCompiledFormulas);
+        RegisterTest(TestSharedParses);
+        RegisterTest(TestNumericCells);
+        RegisterTest(TestRangeCursors);
+        RegisterTest(TestNumberArrays);
+        RegisterTest(TestArrayErrorPrecedence);
         RegisterTest(TestFuncs);
         RegisterTest(TestFuncsV);
         RegisterTest(TestFuncsRowArray);
+        RegisterTest(TestSortedLookups);
         RegisterTest(TestMod);
         RegisterTest(TestBugs);
         RegisterTest(TestBugs2);
         RegisterTest(TestBugs3);
         RegisterTest(TestDirectlyRecursiveShouldError);
         RegisterTest(TestIndirectlyRecursiveShouldError);
+        RegisterTest(TestDeepChains);
+        RegisterTest(TestSparseCells);
+        RegisterTest(TestColumnAggregates);
+        RegisterTest(TestLargeArrays);
         RegisterTest(TestMultisheet);
         RegisterTest(TestColFunc);
         RegisterTest(TestNames);
         RegisterTest(TestComplexMultisheet);
+        RegisterTest(TestManySheets);
         RegisterTest(TestCaching);
         RegisterTest(TestUserFunctions);
         RegisterTest(TestShortColNames);
@@ -107,9 +158,24 @@ int main(int argc, char*_Null_unspecified*_Null_unspecified argv){
         RegisterTest(TestExtraDimensional);
         RegisterTest(TestEditing);
         RegisterTest(TestNamedCells);
+        RegisterTest(TestSharedBindings);
+        RegisterTest(TestThreadedRecalc);
+        RegisterTest(TestThreadedPartialRecalc);
+        RegisterTest(TestThreadedSheet);
+        RegisterTest(TestBulkLoad);
+        RegisterTest(TestDisplayBatching);
+        RegisterTest(TestChangedCells);
+        RegisterTest(TestLoadDelimited);
+    RegisterTest(TestSnapshot);
         #ifndef DRSP_TEST_DYLINK
         RegisterTest(TestDependants);
         RegisterTest(TestDependantsF);
+        RegisterTest(TestIncrementalRecalc);
+        RegisterTest(TestNameChangesRecalc);
+        RegisterTest(TestColumnLookups);
+        RegisterTest(TestConstantFolding);
+        RegisterTest(TestFillDown);
+        RegisterTest(TestConcurrentInterning);
         #endif
         RegisterTest(TestErrorMessages);
     }
@@ -811,6 +877,141 @@ TestFunction(TestUnOps){
     return test_spreadsheet(__func__, input, expected, arrlen(expected), 6);
 }
 
+TestFunction(TestCompiledFormulas){
+    // Simple formulas are compiled instead of walking the expression, but
+    // they should give the same results.
+    const char* input =
+        "1 | 2 | x |  | =a$+1           | =-a$      | =!a$         | =-(a$+b$)\n"
+        "3 | 4 | y |  | =a$*2+b$/4      | =c$ = 'x' | =c$ != 'y'   | =c$ < 'y'\n"
+        "5 | 6 | z |  | =a$ + c$        | =c$ + 1   | =-c$         | =-(a$ + c$)\n"
+        "7 | 8 | x |  | =d$ + 1         | =1 + d$   | =-d$         | =sum(a) + a$\n"
+        "9 | 0 | y |  | =zz$ + 1        | =+(a$+1)  | =(a$)        | =a1+a2+a3\n"
+        "2 | 1 | z |  | =a$ > 2         | =-sum(c)  | =b$/a$ - 1/2 | =-(zz$ + 1)\n"
+        "4 | 3 | x |  | =f(a(1)+a$) + 1 | =-a(1)    | =e$ + 1      | =e1 - e2\n"
+    ;
+    SheetRow expected[] = {
+        ROW("1", "2", "x", "", "2", "-1", "0", "-3"),
+        ROW("3", "4", "y", "", "7", "0", "0", "error: only '=' and '!=' supported for strings"),
+        ROW("5", "6", "z", "", "error: rhs not a number", "error: rhs not a string", "error: error (boog)", "error: error (boog)"),
+        ROW("7", "8", "x", "", "", "", "error: error (boog)", "38"),
+        ROW("9", "0", "y", "", "", "10", "9", "9"),
+        ROW("2", "1", "z", "", "0", "0", "0", "error: error (boog)"),
+        ROW("4", "3", "x", "", "6", "error: error (boog)", "7", "-5"),
+    };
+    return test_spreadsheet(__func__, input, expected, arrlen(expected), 8);
+}
+
+TestFunction(TestSharedParses){
+    // Cells with the same formula share the parsed expression, so evaluating
+    // one must not change what the others see.
+    const char* input =
+        "=sum(floor(a(1.5, 2.5)) * 2)   | =sum(floor(a(1.5, 2.5)) * 2)\n"
+        "=sum(pow(a(2, 3), 2) + 1)      | =sum(pow(a(2, 3), 2) + 1)\n"
+        "=sum(1 - a(1, 2) * a(3, 4))    | =sum(1 - a(1, 2) * a(3, 4))\n"
+        "=f(cat(a('x'), 'y'))           | =f(cat(a('x'), 'y'))\n"
+        "=f(cat('w', a('x')))           | =f(cat('w', a('x')))\n"
+        "=f(cat(a('x'), 'y', a('z')))   | =f(cat(a('x'), 'y', a('z')))\n"
+    ;
+    SheetRow expected[] = {
+        ROW("6", "6"),
+        ROW("15", "15"),
+        ROW("-9", "-9"),
+        ROW("xy", "xy"),
+        ROW("wx", "wx"),
+        ROW("xyz", "xyz"),
+    };
+    return test_spreadsheet(__func__, input, expected, arrlen(expected), 0);
+}
+
+TestFunction(TestNumericCells){
+    // Numbers are parsed when the cell is set. Cells that only look like
+    // numbers are still strings.
+    const char* input =
+        "1.5   | =a$*2         | =sum(a)\n"
+        "-     | =cat(a$, 'x') | =count(a)\n"
+        "1.2.3 | =cat(a$, 'x') | =avg(a)\n"
+        "-2e1  | =a$*2         | =max(a)\n"
+        ".5    | =a$+1         | =tlu(-20, a, b)\n"
+        "-.    | =cat(a$, 'x') | =find('-', a)\n"
+    ;
+    SheetRow expected[] = {
+        ROW("1.5",   "3",      "-18"),
+        ROW("-",     "-x",     "6"),
+        ROW("1.2.3", "1.2.3x", "-6"),
+        ROW("-20",   "-40",    "1.5"),
+        ROW("0.5",   "1.5",    "-40"),
+        ROW("-.",    "-.x",    "2"),
+    };
+    return test_spreadsheet(__func__, input, expected, arrlen(expected), 0);
+}
+
+TestFunction(TestRangeCursors){
+    // Ranges that are only read from are evaluated as they are walked, so
+    // cells that are never reached (c2) don't matter.
+    const char* input =
+        "1 | x | =1    | =sum(tlu(a3:a4, a, c))\n"
+        "2 | y | =-'q' | =f(c3:c5)\n"
+        "3 |   | 30    | =sum(a1:a3 - row('a', 'c', 5))\n"
+        "4 | z | 40    | =sum(row('a', 'c', 5) - a1:a3)\n"
+        "5 | 6 | 50    | =sum(a1:a3 * row('a', 'c', 5))\n"
+        "  |   |       | =f(cat(b1:b2, '-', b1:b2, '!'))\n"
+        "  |   |       | =sum(if(a1:a3 > 1, c3:c5, 0))\n"
+        "  |   |       | =sum(pow(a1:a2, a1:a2))\n"
+    ;
+    SheetRow expected[] = {
+        ROW("1", "x", "1",                   "70"),
+        ROW("2", "y", "error: error (boog)", "30"),
+        ROW("3", "",  "30",                  "-55"),
+        ROW("4", "z", "40",                  "55"),
+        ROW("5", "6", "50",                  "167"),
+        ROW("",  "",  "",                    "x-x!"),
+        ROW("",  "",  "",                    "90"),
+        ROW("",  "",  "",                    "5"),
+    };
+    return test_spreadsheet(__func__, input, expected, arrlen(expected), 1);
+}
+
+TestFunction(TestNumberArrays){
+    // Element-wise numeric results are held unboxed, with blanks masked off.
+    const char* input =
+        "1 | x | =sum(a*2)                | =find(a3, a+1)         | =sum(pow(a, 2) - a*a)\n"
+        "2 | y | =count(a*2)              | =tlu(10, a*2, b)       | =avg(abs(a - 3))\n"
+        "  | x | =max(10 - a)             | =tlu('z', b, a*3)      | =min(mod(a*4))\n"
+        "4 |   | =sum(b = 'x')            | =sum(num(a, 100))      | =count(if(a > 1, a, 0))\n"
+        "5 | z | =find(4, floor(a*2 - 4)) | =sum(a*a)              | =sum(b*2)\n"
+    ;
+    SheetRow expected[] = {
+        ROW("1", "x", "24", "3",   "0"),
+        ROW("2", "y", "4",  "z",   "1.5"),
+        ROW("",  "x", "9",  "15",  "-3"),
+        ROW("4", "",  "2",  "112", "5"),
+        ROW("5", "z", "4",  "46",  "error: lhs is not a number"),
+    };
+    return test_spreadsheet(__func__, input, expected, arrlen(expected), 1);
+}
+
+TestFunction(TestArrayErrorPrecedence){
+    // An element of an array that is an error is the result, even if an
+    // element before it is of the wrong type.
+    const char* input =
+        "x          | =sum([a, 1:3]*2)\n"
+        "=cat(1, 2) | =sum(floor([a, 1:3]))\n"
+        "3          | =sum([a, 1:3] = 'x')\n"
+        "           | =min([a, 1:3] + [a, 1:3])\n"
+        "           | =sum(2 * [a, 1:3])\n"
+        "           | =sum([a, 1:3] - a(1, 2, 3))\n"
+    ;
+    SheetRow expected[] = {
+        ROW("x",                                            "error: argument 1 to cat() must be a string"),
+        ROW("error: argument 1 to cat() must be a string", "error: argument 1 to cat() must be a string"),
+        ROW("3",                                            "error: argument 1 to cat() must be a string"),
+        ROW("",                                             "error: argument 1 to cat() must be a string"),
+        ROW("",                                             "error: argument 1 to cat() must be a string"),
+        ROW("",                                             "error: argument 1 to cat() must be a string"),
+    };
+    return test_spreadsheet(__func__, input, expected, arrlen(expected), 7);
+}
+
 TestFunction(TestFuncs){
     const char* input =
         "=sum(b)          | -1.5\n"
@@ -1176,6 +1377,42 @@ TestFunction(TestFuncsV){
     };
     return test_spreadsheet(__func__, input, expected, arrlen(expected), 1);
 }
+TestFunction(TestSortedLookups){
+    const char* input =
+        "0     | 10 | =stlu(5000, a, b)\n"
+        "10000 | 12 | =stlu(40000, a, b)\n"
+        "40000 | 22 | =stlu(1000000, a, b)\n"
+        "90000 | 24 | =stlu(-1, a, b, 'none')\n"
+        // Runs past the end of the table.
+        "      |    | =sfind(1000000, a1:a8)\n"
+        "      |    | =sfind(39999, a)\n"
+        "      |    | =sfind(2.5, a(1, 2, 3))\n"
+        "      |    | =sfind(.5, a(1, 2, 3), 0)\n"
+        "      |    | =sfind(5, a(1, 2, 3)*2)\n"
+        "      |    | =sum(stlu(a(5, 15000, 95000), a, b))\n"
+        "      |    | =find(5, a, 0)\n"
+        "      |    | =stlu(-1, a, b)\n"
+        "      |    | =stlu('x', a, b, 0)\n"
+        "      |    | =sfind('', a)\n"
+    ;
+    SheetRow expected[] = {
+        ROW("0", "10", "10"),
+        ROW("10000", "12", "22"),
+        ROW("40000", "22", "24"),
+        ROW("90000", "24", "none"),
+        ROW("", "", "4"),
+        ROW("", "", "2"),
+        ROW("", "", "2"),
+        ROW("", "", "0"),
+        ROW("", "", "2"),
+        ROW("", "", "46"),
+        ROW("", "", "0"),
+        ROW("", "", "error: Didn't find needle in haystack"),
+        ROW("", "", "error: argument 1 to stlu() must be a number"),
+        ROW("", "", "error: first argument to sfind() must be a number"),
+    };
+    return test_spreadsheet(__func__, input, expected, arrlen(expected), 3);
+}
 TestFunction(TestFuncsRowArray){
     const char* input =
     //   a     b    c       d       e      f      g   h    i    j    k    l    m      n   o   p
@@ -1390,7 +1627,7 @@ TestFunction(TestDirectlyRecursiveShouldError){
         "=a$\n"
     ;
     SheetRow expected[] = {
-        ROW("error: oom"),
+        ROW("error: circular reference"),
     };
     return test_spreadsheet(__func__, input, expected, arrlen(expected), 1);
 }
@@ -1400,12 +1637,302 @@ TestFunction(TestIndirectlyRecursiveShouldError){
         "=a1\n"
     ;
     SheetRow expected[] = {
-        ROW("error: oom"),
-        ROW("error: oom"),
+        ROW("error: circular reference"),
+        ROW("error: circular reference"),
     };
     return test_spreadsheet(__func__, input, expected, arrlen(expected), 2);
 }
 
+TestFunction(TestDeepChains){
+    TESTBEGIN();
+    // A running balance is a chain of references much deeper than we can
+    // recurse.
+    enum {N=1000};
+    for(int cyclic = 0; cyclic < 2; cyclic++){
+        size_t cap = 32*N;
+        char* input = drsp_alloc(0, NULL, cap, 1);
+        TestAssert(input);
+        size_t len = 0;
+        // Making the first row depend on the last one makes the whole
+        // chain a cycle. Reaching a cycle is always an error, even in try().
+        if(cyclic)
+            len += snprintf(input+len, cap-len, "=a%d+1 | =try(a$, 'c')\n", N);
+        else
+            len += snprintf(input+len, cap-len, "1 | =try(a$, 'c')\n");
+        for(int i = 1; i < N; i++)
+            len += snprintf(input+len, cap-len, "=a%d+1 | =try(a$, 'c')\n", i);
+        SpreadSheet sheet = {0};
+        int err = read_csv_from_string(&sheet, input);
+        drsp_alloc(cap, input, 0, 1);
+        TestAssertFalse(err);
+        TestAssertEquals(sheet.rows, N);
+        SheetOps ops = sheet_ops();
+        DrSpreadCtx* ctx = drsp_create_ctx(&ops);
+        TestAssert(ctx);
+        SheetHandle sheethandle = (SheetHandle)&sheet;
+        err = drsp_set_sheet_name(ctx, sheethandle, "sheet", 5);
+        TestAssertFalse(err);
+        for(intptr_t r = 0; r < sheet.rows; r++){
+            const SheetRow* row = &sheet.cells[r];
+            for(int c = 0; c < row->n; c++){
+                err = drsp_set_cell_str(ctx, sheethandle, r, c, row->data[c], row->lengths[c]);
+                // don't bloat the stats
+                if(err) TestAssertFalse(err);
+            }
+        }
+        int nerr = drsp_evaluate_formulas(ctx);
+        TestExpectEquals(nerr, cyclic?2*N:0);
+        if(cyclic){
+            TestExpectEquals2(streq, sheet.display[0].data[0], "error: circular reference");
+            TestExpectEquals2(streq, sheet.display[N/2].data[0], "error: circular reference");
+            TestExpectEquals2(streq, sheet.display[N-1].data[0], "error: circular reference");
+            TestExpectEquals2(streq, sheet.display[N-1].data[1], "error: circular reference");
+        }
+        else {
+            TestExpectEquals2(streq, sheet.display[0].data[0], "1");
+            TestExpectEquals2(streq, sheet.display[N/2].data[0], "501");
+            TestExpectEquals2(streq, sheet.display[N-1].data[0], "1000");
+            TestExpectEquals2(streq, sheet.display[N-1].data[1], "1000");
+        }
+        DrSpreadResult result;
+        err = drsp_evaluate_string(ctx, sheethandle, "a1000 - a1", sizeof "a1000 - a1" - 1, &result, -1, -1);
+        if(cyclic){
+            TestExpectTrue(err);
+        }
+        else {
+            TestExpectFalse(err);
+            TestExpectEquals(result.kind, DRSP_RESULT_NUMBER);
+            TestExpectEquals(result.d, N-1);
+        }
+        drsp_destroy_ctx(ctx);
+        cleanup_sheet(&sheet);
+    }
+    EXPECT_NO_LEAKS();
+    TESTEND();
+}
+
+TestFunction(TestSparseCells){
+    TESTBEGIN();
+    // Cells far away from the others are stored differently, but should
+    // behave the same.
+    SpreadSheet sheet = {0};
+    int err = read_csv_from_string(&sheet, "1\n");
+    TestAssertFalse(err);
+    SheetOps ops = sheet_ops();
+    DrSpreadCtx* ctx = drsp_create_ctx(&ops);
+    TestAssert(ctx);
+    SheetHandle sheethandle = (SheetHandle)&sheet;
+    err = drsp_set_sheet_name(ctx, sheethandle, "sheet", 5);
+    TestAssertFalse(err);
+    err = drsp_set_cell_str(ctx, sheethandle, 0, 0, "1", 1);
+    TestAssertFalse(err);
+    err = drsp_set_cell_str(ctx, sheethandle, 999, 0, "2", 1);
+    TestAssertFalse(err);
+    err = drsp_set_cell_str(ctx, sheethandle, 499, 0, "3", 1);
+    TestAssertFalse(err);
+    err = drsp_set_cell_str(ctx, sheethandle, 9, 300, "=a$+1", 5);
+    TestAssertFalse(err);
+    err = drsp_set_col_name(ctx, sheethandle, 300, "far", 3);
+    TestAssertFalse(err);
+    // Filling in the column afterwards reaches the far cells.
+    for(int r = 1; r < 600; r++){
+        err = drsp_set_cell_str(ctx, sheethandle, r, 0, "1", 1);
+        if(err) TestAssertFalse(err);
+    }
+    err = drsp_set_cell_str(ctx, sheethandle, 499, 0, "=a1+1", 5);
+    TestAssertFalse(err);
+    err = drsp_set_cell_str(ctx, sheethandle, 700, 0, "", 0);
+    TestAssertFalse(err);
+    int nerr = drsp_evaluate_formulas(ctx);
+    TestExpectEquals(nerr, 0);
+    struct {
+        StringView input;
+        double value;
+    } test_cases[] = {
+        {SV("=a500"),        2},
+        {SV("=a1000*a500"),  4},
+        {SV("=sum(a)"),      603},
+        {SV("=count(a)"),    601},
+        {SV("=far10"),       2},
+        {SV("=sum(far)"),    2},
+    };
+    for(size_t i = 0; i < arrlen(test_cases); i++){
+        StringView input = test_cases[i].input;
+        DrSpreadResult result = {0};
+        err = drsp_evaluate_string(ctx, sheethandle, input.text, input.length, &result, -1, -1);
+        TestExpectFalse(err);
+        TestExpectEquals((int)result.kind, DRSP_RESULT_NUMBER);
+        TestExpectEquals(result.d, test_cases[i].value);
+    }
+    drsp_destroy_ctx(ctx);
+    cleanup_sheet(&sheet);
+    EXPECT_NO_LEAKS();
+    TESTEND();
+}
+
+TestFunction(TestColumnAggregates){
+    TESTBEGIN();
+    // Aggregates over columns of literals and already computed formulas
+    // skip evaluating each cell, which should give the same results as
+    // evaluating them.
+    enum {N = 1003};
+    static char csv[N*64];
+    size_t len = 0;
+    double sum = 0, min = 1e32, max = -1e32;
+    int count = 0, nstrings = 0;
+    for(int i = 0; i < N; i++){
+        // Column c is a copy of a with an error in the middle.
+        char c[16];
+        if(i == N/2) snprintf(c, sizeof c, "=-'x'");
+        else snprintf(c, sizeof c, "=a%d", i+1);
+        if(i % 7 == 3)
+            len += snprintf(csv+len, sizeof csv - len, "|=a%d|%s\n", i+1, c);
+        else if(i % 11 == 5){
+            len += snprintf(csv+len, sizeof csv - len, "x|=a%d|%s\n", i+1, c);
+            nstrings++;
+        }
+        else {
+            double v = ((i % 13) - 6) * (i + 1) / 4.;
+            len += snprintf(csv+len, sizeof csv - len, "%.2f|=a%d*2|%s\n", v, i+1, c);
+            sum += v;
+            if(v < min) min = v;
+            if(v > max) max = v;
+            count++;
+        }
+    }
+    SpreadSheet sheet = {0};
+    int err = read_csv_from_string(&sheet, csv);
+    TestAssertFalse(err);
+    SheetOps ops = sheet_ops();
+    DrSpreadCtx* ctx = drsp_create_ctx(&ops);
+    TestAssert(ctx);
+    SheetHandle sheethandle = (SheetHandle)&sheet;
+    err = drsp_set_sheet_name(ctx, sheethandle, "sheet", 5);
+    TestAssertFalse(err);
+    for(intptr_t r = 0; r < sheet.rows; r++){
+        const SheetRow* row = &sheet.cells[r];
+        for(int c = 0; c < row->n; c++){
+            if(!row->lengths[c]) continue;
+            err = drsp_set_cell_str(ctx, sheethandle, r, c, row->data[c], row->lengths[c]);
+            if(err) TestAssertFalse(err);
+        }
+    }
+    struct {
+        StringView input;
+        double value;
+    } test_cases[] = {
+        {SV("=sum(a)"),       sum},
+        {SV("=sum(b)"),       2*sum},
+        {SV("=avg(a)"),       sum/count},
+        {SV("=avg(b)"),       2*sum/count},
+        {SV("=min(a)"),       min},
+        {SV("=min(b)"),       2*min},
+        {SV("=max(a)"),       max},
+        {SV("=max(b)"),       2*max},
+        {SV("=count(a)"),     count+nstrings},
+        {SV("=count(b)"),     count+nstrings},
+        {SV("=prod(a1:a3)"),  -11.25},
+        {SV("=prod(b1:b3)"),  -90},
+        // N is 1003, so this leaves out the first and last rows.
+        {SV("=sum(a2:a1002)"), sum + 1.5 - (((N-1) % 13) - 6) * N / 4.},
+        {SV("=count(a1500:a2000)"), 0},
+    };
+    // Once before evaluating the formulas, so the ones in b are evaluated
+    // as they are reached, and once after.
+    for(int pass = 0; pass < 2; pass++){
+        if(pass){
+            int nerr = drsp_evaluate_formulas(ctx);
+            TestExpectEquals(nerr, 1);
+        }
+        for(size_t i = 0; i < arrlen(test_cases); i++){
+            StringView input = test_cases[i].input;
+            DrSpreadResult result = {0};
+            err = drsp_evaluate_string(ctx, sheethandle, input.text, input.length, &result, -1, -1);
+            TestExpectFalse(err);
+            TestExpectEquals((int)result.kind, DRSP_RESULT_NUMBER);
+            TestExpectEquals(result.d, test_cases[i].value);
+        }
+        DrSpreadResult result = {0};
+        err = drsp_evaluate_string(ctx, sheethandle, "=sum(c)", 7, &result, -1, -1);
+        TestExpectTrue(err);
+        TestExpectEquals((int)result.kind, DRSP_RESULT_ERROR);
+    }
+    // The numbers aren't added up in order: element i goes into lane i%4
+    // and the lanes are added at the end. In order this would be 1, with
+    // the lanes it is (1e16+1) + (-1e16+1), which rounds to 0. Column e
+    // isn't evaluated yet, so it is the per-row path, which has to agree.
+    const char* cancel[] = {"10000000000000000", "1", "-10000000000000000", "1"};
+    for(int r = 0; r < 4; r++){
+        err = drsp_set_cell_str(ctx, sheethandle, r, 3, cancel[r], strlen(cancel[r]));
+        TestAssertFalse(err);
+        char buff[8];
+        int n = snprintf(buff, sizeof buff, "=d%d", r+1);
+        err = drsp_set_cell_str(ctx, sheethandle, r, 4, buff, n);
+        TestAssertFalse(err);
+    }
+    StringView cancel_cases[] = {SV("=sum(d)"), SV("=sum(e)"), SV("=avg(d)")};
+    for(size_t i = 0; i < arrlen(cancel_cases); i++){
+        DrSpreadResult result = {0};
+        err = drsp_evaluate_string(ctx, sheethandle, cancel_cases[i].text, cancel_cases[i].length, &result, -1, -1);
+        TestExpectFalse(err);
+        TestExpectEquals((int)result.kind, DRSP_RESULT_NUMBER);
+        TestExpectEquals(result.d, 0.);
+    }
+    drsp_destroy_ctx(ctx);
+    cleanup_sheet(&sheet);
+    EXPECT_NO_LEAKS();
+    TESTEND();
+}
+
+TestFunction(TestLargeArrays){
+    TESTBEGIN();
+    // The arrays for these don't fit in the context's scratch buffer.
+    // There's no SpreadSheet as that would allocate too much for
+    // RECORD_ALLOCATIONS.
+    enum {N = 20000};
+    SheetOps ops = {0};
+    DrSpreadCtx* ctx = drsp_create_ctx(&ops);
+    TestAssert(ctx);
+    SheetHandle sheethandle = (SheetHandle)&ops;
+    int err = drsp_set_sheet_name(ctx, sheethandle, "sheet", 5);
+    TestAssertFalse(err);
+    for(int i = 0; i < N; i++){
+        char buff[16];
+        int len = snprintf(buff, sizeof buff, "%d", i+1);
+        err = drsp_set_cell_str(ctx, sheethandle, i, 0, buff, len);
+        if(err) TestAssertFalse(err);
+        err = drsp_set_cell_str(ctx, sheethandle, i, 1, i%2?"1":"0", 1);
+        if(err) TestAssertFalse(err);
+    }
+    double sum = (double)N*(N+1)/2;
+    struct {
+        StringView input;
+        double value;
+    } test_cases[] = {
+        {SV("=sum(a*2)"),           2*sum},
+        // b is 1 next to the even numbers.
+        {SV("=sum(a*b+a)"),         sum + N/2*(N/2+1.)},
+        {SV("=sum(a+a+a)"),         3*sum},
+        {SV("=max(a*a)"),           (double)N*N},
+        {SV("=count(a-b)"),         N},
+        {SV("=sum(tlu(a, a, b))"),  N/2},
+    };
+    // Twice, the second time from the segments that were kept.
+    for(int pass = 0; pass < 2; pass++){
+        for(size_t i = 0; i < arrlen(test_cases); i++){
+            StringView input = test_cases[i].input;
+            DrSpreadResult result = {0};
+            err = drsp_evaluate_string(ctx, sheethandle, input.text, input.length, &result, -1, -1);
+            TestExpectFalse(err);
+            TestExpectEquals((int)result.kind, DRSP_RESULT_NUMBER);
+            TestExpectEquals(result.d, test_cases[i].value);
+        }
+    }
+    drsp_destroy_ctx(ctx);
+    EXPECT_NO_LEAKS();
+    TESTEND();
+}
+
 static
 struct
 TestStats
@@ -1862,6 +2389,72 @@ TestFunction(TestComplexMultisheet){
     TESTEND();
 }
 
+TestFunction(TestManySheets){
+    TESTBEGIN();
+    // Each sheet refers to the one before it. Deleting and renaming
+    // sheets changes what the references refer to.
+    enum {N = 200};
+    static char input[N*64];
+    size_t len = 0;
+    for(int i = 0; i < N; i++){
+        if(i) len += snprintf(input+len, sizeof input - len, "s%d\n\n%d | =[s%d, a, 1]+1\n---\n", i, i, i-1);
+        else len += snprintf(input+len, sizeof input - len, "s0\n\n0 | =1\n---\n");
+    }
+    MultiSpreadSheet ms = {0};
+    int err = read_multi_csv_from_string(&ms, input);
+    TestAssertFalse(err);
+    TestAssertEquals(ms.n, N);
+    SheetOps ops = multisheet_ops(&ms);
+    DrSpreadCtx* ctx = drsp_create_ctx(&ops);
+    TestAssert(ctx);
+    for(int i = 0; i < ms.n; i++){
+        SpreadSheet* sheet = &ms.sheets[i];
+        err = drsp_set_sheet_name(ctx, (SheetHandle)sheet, sheet->name.text, sheet->name.length);
+        TestAssertFalse(err);
+        for(intptr_t r = 0; r < sheet->rows; r++){
+            const SheetRow* row = &sheet->cells[r];
+            for(int c = 0; c < row->n; c++){
+                err = drsp_set_cell_str(ctx, (SheetHandle)sheet, r, c, row->data[c], row->lengths[c]);
+                if(err) TestAssertFalse(err);
+            }
+        }
+    }
+    int nerr = drsp_evaluate_formulas(ctx);
+    TestExpectEquals(nerr, 0);
+    TestExpectEquals2(streq, ms.sheets[1].display[0].data[1], "1");
+    TestExpectEquals2(streq, ms.sheets[101].display[0].data[1], "101");
+    TestExpectEquals2(streq, ms.sheets[N-1].display[0].data[1], "199");
+
+    // The last sheet takes the place of the deleted one.
+    err = drsp_del_sheet(ctx, (SheetHandle)&ms.sheets[100]);
+    TestAssertFalse(err);
+    nerr = drsp_evaluate_formulas(ctx);
+    TestExpectEquals(nerr, 1);
+    TestExpectEquals2(streq, ms.sheets[101].display[0].data[1], "error: error (boog)");
+    TestExpectEquals2(streq, ms.sheets[N-1].display[0].data[1], "199");
+
+    // Failed lookups don't record a dependency, so the referring cell has
+    // to be set again.
+    err = drsp_set_sheet_alias(ctx, (SheetHandle)&ms.sheets[50], "S100", 4);
+    TestAssertFalse(err);
+    err = drsp_set_cell_str(ctx, (SheetHandle)&ms.sheets[101], 0, 1, "=[s100, a, 1]+1", 15);
+    TestAssertFalse(err);
+    nerr = drsp_evaluate_formulas(ctx);
+    TestExpectEquals(nerr, 0);
+    TestExpectEquals2(streq, ms.sheets[101].display[0].data[1], "51");
+
+    err = drsp_set_sheet_name(ctx, (SheetHandle)&ms.sheets[50], "t50", 3);
+    TestAssertFalse(err);
+    nerr = drsp_evaluate_formulas(ctx);
+    TestExpectEquals(nerr, 1);
+    TestExpectEquals2(streq, ms.sheets[51].display[0].data[1], "error: error (boog)");
+    TestExpectEquals2(streq, ms.sheets[101].display[0].data[1], "51");
+    drsp_destroy_ctx(ctx);
+    cleanup_multisheet(&ms);
+    EXPECT_NO_LEAKS();
+    TESTEND();
+}
+
 TestFunction(TestCaching){
     struct TestStats TEST_stats = {0};
     SpreadSheet sheet = {0};
@@ -2589,53 +3182,948 @@ TestFunction(TestNamedCells){
     TESTEND();
 }
 
-TestFunction(TestDependants){
+TestFunction(TestSharedBindings){
+    TESTBEGIN();
+    // Formulas are only parsed once, so the same nodes are evaluated on
+    // both sheets, where the names are different columns or cells.
+    SheetOps ops = {0};
+    DrSpreadCtx* ctx = drsp_create_ctx(&ops);
+    TestAssert(ctx);
+    int one, two;
+    SheetHandle h1 = (SheetHandle)&one, h2 = (SheetHandle)&two;
+    int err = drsp_set_sheet_name(ctx, h1, "one", 3);
+    TestAssertFalse(err);
+    err = drsp_set_sheet_name(ctx, h2, "two", 3);
+    TestAssertFalse(err);
+    const char* cells[2][2] = {{"1", "2"}, {"10", "20"}};
+    for(int c = 0; c < 2; c++){
+        err = drsp_set_cell_str(ctx, h1, 0, c, cells[0][c], strlen(cells[0][c]));
+        TestAssertFalse(err);
+        err = drsp_set_cell_str(ctx, h2, 0, c, cells[1][c], strlen(cells[1][c]));
+        TestAssertFalse(err);
+    }
+    err = drsp_set_col_name(ctx, h1, 1, "foo", 3);
+    TestAssertFalse(err);
+    err = drsp_set_col_name(ctx, h2, 0, "foo", 3);
+    TestAssertFalse(err);
+    err = drsp_set_named_cell(ctx, h2, "bar", 3, 0, 1);
+    TestAssertFalse(err);
+    struct {
+        SheetHandle h;
+        StringView q;
+        double d; // NAN for an error
+    } cases[] = {
+        {h1, SV("[foo, 1]"), 2},
+        {h2, SV("[foo, 1]"), 10},
+        {h1, SV("sum(foo)"), 2},
+        {h2, SV("sum(foo)"), 10},
+        {h1, SV("[foo, 1] + [two, foo, 1]"), 12},
+        {h2, SV("[one, foo, 1]"), 2},
+        {h1, SV("bar"), NAN},
+        {h2, SV("bar"), 20},
+        {h1, SV("[two, bar]"), 20},
+    };
+    DrSpreadResult val;
+    for(int pass = 0; pass < 3; pass++){
+        if(pass == 1){
+            // Renaming changes where the name goes.
+            err = drsp_set_col_name(ctx, h1, 0, "foo", 3);
+            TestAssertFalse(err);
+            cases[0].d = 1;
+            cases[2].d = 1;
+            cases[4].d = 11;
+            cases[5].d = 1;
+        }
+        if(pass == 2){
+            err = drsp_set_named_cell(ctx, h1, "bar", 3, 0, 0);
+            TestAssertFalse(err);
+            err = drsp_clear_named_cell(ctx, h2, "bar", 3);
+            TestAssertFalse(err);
+            cases[6].d = 1;
+            cases[7].d = NAN;
+            cases[8].d = NAN;
+        }
+        for(size_t i = 0; i < arrlen(cases); i++){
+            err = drsp_evaluate_string(ctx, cases[i].h, cases[i].q.text, cases[i].q.length, &val, -1, -1);
+            if(cases[i].d != cases[i].d){
+                TestExpectTrue(err);
+                continue;
+            }
+            TestAssertFalse(err);
+            TestAssertEquals((int)val.kind, DRSP_RESULT_NUMBER);
+            TestExpectEquals(val.d, cases[i].d);
+        }
+    }
+    drsp_destroy_ctx(ctx);
+    EXPECT_NO_LEAKS();
+    TESTEND();
+}
+
+TestFunction(TestThreadedRecalc){
     TESTBEGIN();
     const char* input =
 
-        "Sheet1\n"
+        "Prices\n"
         // -------
-        "\n"
-        "=cell('Sheet2', 'a', 1)\n"
-        "=3\n"
+        "item | price | label\n"
+        "apple | 1.5 | =cat(a$, ': ', b$)\n"
+        "pear  | 2   | =cat(a$, ': ', b$)\n"
+        "plum  | =b1+b2 | =cat(a$, ': ', b$)\n"
+        "fig   | =sum(b1:b3) | =tlu('pear', a, b)\n"
         "---\n"
 
-        "Sheet2\n"
+        "Counts\n"
         // -------
         "\n"
-        "2\n"
-        "=cell('Sheet1', 'a', 1)\n"
+        "1 | =a1*2 | =find(4, b)\n"
+        "2 | =a2*2 | =sum(a)\n"
+        "3 | =a3*2 | =nosuch(c2)\n"
+        "4 | =a4*2 | =c1/c2\n"
         "---\n"
 
-        "Sheet3\n"
+        // Reaches the other sheets, so it can't be done by a worker.
+        "Totals\n"
         // -------
         "\n"
-        "=cell('Sheet1', 'a', 2)\n"
-        " \n"
+        "=sum([Prices, price]) | =[Counts, b, 3]\n"
+        "=a1*b1 | =cell('Counts', 'c', 2)\n"
         "---\n"
 
-        "Sheet4\n"
+        "Chain\n"
+        // -------
         "\n"
-        "=cell('Sheet2', 'a', 1)\n"
-        "=a1\n"
+        "1\n"
+        "=a1+1\n"
+        "=a2+1\n"
+        "=a3+1\n"
+        "=sum(a1:a4)\n"
         "---\n"
         ;
-    MultiSpreadSheet ms = {0};
-    {
-        int err = read_multi_csv_from_string(&ms, input);
+    // The same sheets, evaluated on one thread and on several.
+    MultiSpreadSheet ms[2] = {0};
+    DrSpreadCtx* ctxs[2];
+    for(int k = 0; k < 2; k++){
+        int err = read_multi_csv_from_string(&ms[k], input);
         TestAssertFalse(err);
-    }
-    SheetOps ops = multisheet_ops(&ms);
-    DrSpreadCtx* ctx = drsp_create_ctx(&ops);
-    for(int i = 0; i < ms.n; i++){
-        SpreadSheet* sheet = &ms.sheets[i];
-        int e = drsp_set_sheet_name(ctx, (SheetHandle)sheet, sheet->name.text, sheet->name.length);
-        TestAssertFalse(e);
-        for(int i = 0; i < sheet->colnames.n; i++){
-            int e = drsp_set_col_name(ctx, (SheetHandle)sheet, i, sheet->colnames.data[i], sheet->colnames.lengths[i]);
+        SheetOps ops = multisheet_ops(&ms[k]);
+        ctxs[k] = drsp_create_ctx(&ops);
+        TestAssert(ctxs[k]);
+        for(int i = 0; i < ms[k].n; i++){
+            SpreadSheet* sheet = &ms[k].sheets[i];
+            int e = drsp_set_sheet_name(ctxs[k], (SheetHandle)sheet, sheet->name.text, sheet->name.length);
             TestAssertFalse(e);
-        }
-        SheetHandle sheethandle = (SheetHandle)sheet;
+            for(int c = 0; c < sheet->colnames.n; c++){
+                e = drsp_set_col_name(ctxs[k], (SheetHandle)sheet, c, sheet->colnames.data[c], sheet->colnames.lengths[c]);
+                TestAssertFalse(e);
+            }
+            for(intptr_t r = 0; r < sheet->rows; r++){
+                const SheetRow* row = &sheet->cells[r];
+                for(int c = 0; c < row->n; c++){
+                    e = drsp_set_cell_str(ctxs[k], (SheetHandle)sheet, r, c, row->data[c], row->lengths[c]);
+                    // don't bloat the stats
+                    if(e) TestAssertFalse(e);
+                }
+            }
+        }
+    }
+    TestAssertFalse(drsp_set_thread_count(ctxs[1], 4));
+    struct {
+        int sheet, row, col;
+        const char* txt;
+    } edits[] = {
+        {-1},
+        {0, 0, 1, "4"},
+        {1, 0, 0, "10"},
+        {3, 0, 0, "=1/0"},
+    };
+    for(size_t t = 0; t < arrlen(edits); t++){
+        int nerr[2];
+        for(int k = 0; k < 2; k++){
+            if(edits[t].sheet >= 0){
+                int err = drsp_set_cell_str(ctxs[k], (SheetHandle)&ms[k].sheets[edits[t].sheet], edits[t].row, edits[t].col, edits[t].txt, strlen(edits[t].txt));
+                TestAssertFalse(err);
+            }
+            nerr[k] = drsp_evaluate_formulas(ctxs[k]);
+        }
+        TestExpectEquals(nerr[0], nerr[1]);
+        for(int i = 0; i < ms[0].n; i++){
+            const SpreadSheet* serial = &ms[0].sheets[i];
+            const SpreadSheet* threaded = &ms[1].sheets[i];
+            TestAssertEquals(serial->rows, threaded->rows);
+            for(intptr_t r = 0; r < serial->rows; r++){
+                const SheetRow* d = &threaded->display[r];
+                const SheetRow* e = &serial->display[r];
+                TestAssertEquals(d->n, e->n);
+                for(int j = 0; j < d->n; j++)
+                    TestExpectEquals2(streq, d->data[j], e->data[j]);
+            }
+        }
+    }
+    TestExpectEquals2(streq, ms[1].sheets[0].display[3].data[2], "2");
+    TestExpectEquals2(streq, ms[1].sheets[2].display[0].data[0], "24");
+    TestExpectEquals2(streq, ms[1].sheets[3].display[4].data[0], "inf");
+    for(int k = 0; k < 2; k++){
+        drsp_destroy_ctx(ctxs[k]);
+        cleanup_multisheet(&ms[k]);
+    }
+    EXPECT_NO_LEAKS();
+    TESTEND();
+}
+
+TestFunction(TestThreadedPartialRecalc){
+    TESTBEGIN();
+    const char* input =
+        "Data\n"
+        "\n"
+        "1 | =a1*2\n"
+        "2 | =a2*2\n"
+        "---\n"
+
+        "Report\n"
+        "\n"
+        "=[Data, b, 1] | =a1+1 | =1/'x'\n"
+        "=b1*2         | 5     | =nosuch(1)\n"
+        "---\n"
+
+        "Other\n"
+        "\n"
+        "1 | =a1+1\n"
+        "---\n"
+        ;
+    // Only the cells downstream of the edits are redone, even when one of
+    // them reaches another sheet and can't be done by a worker, so the
+    // results and error counts are the same as on one thread.
+    MultiSpreadSheet ms[2] = {0};
+    DrSpreadCtx* ctxs[2];
+    for(int k = 0; k < 2; k++){
+        int err = read_multi_csv_from_string(&ms[k], input);
+        TestAssertFalse(err);
+        SheetOps ops = multisheet_ops(&ms[k]);
+        ctxs[k] = drsp_create_ctx(&ops);
+        TestAssert(ctxs[k]);
+        for(int i = 0; i < ms[k].n; i++){
+            SpreadSheet* sheet = &ms[k].sheets[i];
+            err = drsp_set_sheet_name(ctxs[k], (SheetHandle)sheet, sheet->name.text, sheet->name.length);
+            TestAssertFalse(err);
+            for(intptr_t r = 0; r < sheet->rows; r++){
+                const SheetRow* row = &sheet->cells[r];
+                for(int c = 0; c < row->n; c++){
+                    err = drsp_set_cell_str(ctxs[k], (SheetHandle)sheet, r, c, row->data[c], row->lengths[c]);
+                    if(err) TestAssertFalse(err);
+                }
+            }
+        }
+    }
+    TestAssertFalse(drsp_set_thread_count(ctxs[1], 4));
+    // Other is edited each time so that there is more than one sheet to
+    // hand out.
+    struct {
+        int sheet, row, col;
+        const char* txt;
+        const char* other;
+        int nerr;
+    } edits[] = {
+        {-1, 0, 0, NULL, NULL, 2},
+        {1, 1, 1, "=[Data, b, 2]+1", "2", 0},
+        {1, 0, 0, "=[Data, b, 2]", "3", 0},
+        {0, 0, 0, "5", "4", 2},
+    };
+    for(size_t t = 0; t < arrlen(edits); t++){
+        int nerr[2];
+        for(int k = 0; k < 2; k++){
+            if(edits[t].sheet >= 0){
+                int err = drsp_set_cell_str(ctxs[k], (SheetHandle)&ms[k].sheets[edits[t].sheet], edits[t].row, edits[t].col, edits[t].txt, strlen(edits[t].txt));
+                TestAssertFalse(err);
+                err = drsp_set_cell_str(ctxs[k], (SheetHandle)&ms[k].sheets[2], 0, 0, edits[t].other, strlen(edits[t].other));
+                TestAssertFalse(err);
+            }
+            nerr[k] = drsp_evaluate_formulas(ctxs[k]);
+        }
+        TestExpectEquals(nerr[0], edits[t].nerr);
+        TestExpectEquals(nerr[1], edits[t].nerr);
+        for(int i = 0; i < ms[0].n; i++){
+            const SpreadSheet* serial = &ms[0].sheets[i];
+            const SpreadSheet* threaded = &ms[1].sheets[i];
+            TestAssertEquals(serial->rows, threaded->rows);
+            for(intptr_t r = 0; r < serial->rows; r++){
+                const SheetRow* d = &threaded->display[r];
+                const SheetRow* e = &serial->display[r];
+                TestAssertEquals(d->n, e->n);
+                for(int j = 0; j < d->n; j++)
+                    TestExpectEquals2(streq, d->data[j], e->data[j]);
+            }
+        }
+    }
+    TestExpectEquals2(streq, ms[1].sheets[1].display[0].data[0], "4");
+    TestExpectEquals2(streq, ms[1].sheets[1].display[1].data[0], "10");
+    TestExpectEquals2(streq, ms[1].sheets[1].display[1].data[1], "5");
+    TestExpectEquals2(streq, ms[1].sheets[2].display[0].data[1], "5");
+    for(int k = 0; k < 2; k++){
+        drsp_destroy_ctx(ctxs[k]);
+        cleanup_multisheet(&ms[k]);
+    }
+    EXPECT_NO_LEAKS();
+    TESTEND();
+}
+
+TestFunction(TestThreadedSheet){
+    TESTBEGIN();
+    // Big enough to be split between the threads, with a chain running
+    // through all of the chunks, a cycle and lookups across them.
+    enum {N = 600};
+    static char csv[N*64];
+    size_t len = 0;
+    for(int i = 0; i < N; i++){
+        char c[24], d[32];
+        if(i) snprintf(c, sizeof c, "=c%d+b$", i);
+        else snprintf(c, sizeof c, "=b$");
+        if(i == N/2 || i == N/2+1)
+            snprintf(d, sizeof d, "=d%d", i == N/2? i+2 : i);
+        else if(i % 50 == 7)
+            snprintf(d, sizeof d, "=tlu(%d, a, c)", N-i);
+        else
+            snprintf(d, sizeof d, "=sum(a1:a%d)", i+1);
+        len += snprintf(csv+len, sizeof csv - len, "%d | =a$*2 | %s | %s\n", i+1, c, d);
+    }
+    SpreadSheet sheets[2] = {0};
+    DrSpreadCtx* ctxs[2];
+    for(int k = 0; k < 2; k++){
+        int err = read_csv_from_string(&sheets[k], csv);
+        TestAssertFalse(err);
+        TestAssertEquals(sheets[k].rows, N);
+        SheetOps ops = sheet_ops();
+        ctxs[k] = drsp_create_ctx(&ops);
+        TestAssert(ctxs[k]);
+        SheetHandle sheethandle = (SheetHandle)&sheets[k];
+        err = drsp_set_sheet_name(ctxs[k], sheethandle, "sheet", 5);
+        TestAssertFalse(err);
+        for(intptr_t r = 0; r < sheets[k].rows; r++){
+            const SheetRow* row = &sheets[k].cells[r];
+            for(int c = 0; c < row->n; c++){
+                err = drsp_set_cell_str(ctxs[k], sheethandle, r, c, row->data[c], row->lengths[c]);
+                // don't bloat the stats
+                if(err) TestAssertFalse(err);
+            }
+        }
+    }
+    TestAssertFalse(drsp_set_thread_count(ctxs[1], 4));
+    struct {
+        int row, col;
+        const char* txt;
+    } edits[] = {
+        {-1},
+        {0, 0, "5"},
+        {N-1, 0, "0"},
+        // Breaks the cycle.
+        {N/2, 3, "1"},
+    };
+    for(size_t t = 0; t < arrlen(edits); t++){
+        int nerr[2];
+        for(int k = 0; k < 2; k++){
+            if(edits[t].row >= 0){
+                int err = drsp_set_cell_str(ctxs[k], (SheetHandle)&sheets[k], edits[t].row, edits[t].col, edits[t].txt, strlen(edits[t].txt));
+                TestAssertFalse(err);
+            }
+            nerr[k] = drsp_evaluate_formulas(ctxs[k]);
+        }
+        TestExpectEquals(nerr[0], nerr[1]);
+        for(intptr_t r = 0; r < N; r++){
+            const SheetRow* d = &sheets[1].display[r];
+            const SheetRow* e = &sheets[0].display[r];
+            TestAssertEquals(d->n, e->n);
+            for(int j = 0; j < d->n; j++)
+                TestExpectEquals2(streq, d->data[j], e->data[j]);
+        }
+    }
+    // 2*(1+...+600) + 2*(5-1) - 2*600
+    TestExpectEquals2(streq, sheets[1].display[N-1].data[2], "359408");
+    TestExpectEquals2(streq, sheets[1].display[N/2+1].data[3], "1");
+    for(int k = 0; k < 2; k++){
+        drsp_destroy_ctx(ctxs[k]);
+        cleanup_sheet(&sheets[k]);
+    }
+    EXPECT_NO_LEAKS();
+    TESTEND();
+}
+
+TestFunction(TestBulkLoad){
+    TESTBEGIN();
+    // The same sheet, loaded a cell at a time and a column at a time.
+    enum {N = 300};
+    static char csv[N*64];
+    size_t len = 0;
+    for(int i = 0; i < N; i++){
+        if(i) len += snprintf(csv+len, sizeof csv - len, " %d | =a$*2 | =c%d+b$\n", i+1, i);
+        else len += snprintf(csv+len, sizeof csv - len, " %d | =a$*2 | =b$\n", i+1);
+    }
+    // Room to display a row that isn't loaded at first.
+    len += snprintf(csv+len, sizeof csv - len, " | | \n");
+    SpreadSheet sheets[2] = {0};
+    DrSpreadCtx* ctxs[2];
+    for(int k = 0; k < 2; k++){
+        int err = read_csv_from_string(&sheets[k], csv);
+        TestAssertFalse(err);
+        SheetOps ops = sheet_ops();
+        ctxs[k] = drsp_create_ctx(&ops);
+        TestAssert(ctxs[k]);
+        err = drsp_set_sheet_name(ctxs[k], (SheetHandle)&sheets[k], "sheet", 5);
+        TestAssertFalse(err);
+    }
+    for(intptr_t r = 0; r < N; r++){
+        const SheetRow* row = &sheets[0].cells[r];
+        for(int c = 0; c < row->n; c++){
+            int err = drsp_set_cell_str(ctxs[0], (SheetHandle)&sheets[0], r, c, row->data[c], row->lengths[c]);
+            if(err) TestAssertFalse(err);
+        }
+    }
+    for(int c = 0; c < 3; c++){
+        const char* texts[N];
+        size_t lengths[N];
+        for(intptr_t r = 0; r < N; r++){
+            texts[r] = sheets[1].cells[r].data[c];
+            lengths[r] = sheets[1].cells[r].lengths[c];
+        }
+        int err = drsp_set_column_bulk(ctxs[1], (SheetHandle)&sheets[1], c, 0, N, texts, lengths);
+        TestAssertFalse(err);
+    }
+    struct {
+        intptr_t rows[3], cols[3];
+        const char* texts[3];
+    } edits[] = {
+        {{-1}},
+        {{0, 10, N-1}, {0, 0, 1}, {"5", " 7 ", "=a$*3"}},
+        // Grows the sheet.
+        {{N/2, N, N}, {2, 0, 1}, {"=1", "1", "=a$+c1"}},
+    };
+    for(size_t t = 0; t < arrlen(edits); t++){
+        if(edits[t].rows[0] >= 0){
+            size_t lengths[3];
+            for(int i = 0; i < 3; i++){
+                lengths[i] = strlen(edits[t].texts[i]);
+                int err = drsp_set_cell_str(ctxs[0], (SheetHandle)&sheets[0], edits[t].rows[i], edits[t].cols[i], edits[t].texts[i], lengths[i]);
+                TestAssertFalse(err);
+            }
+            int err = drsp_set_cells_bulk(ctxs[1], (SheetHandle)&sheets[1], 3, edits[t].rows, edits[t].cols, edits[t].texts, lengths);
+            TestAssertFalse(err);
+        }
+        int nerr[2];
+        for(int k = 0; k < 2; k++)
+            nerr[k] = drsp_evaluate_formulas(ctxs[k]);
+        TestExpectEquals(nerr[0], nerr[1]);
+        TestAssertEquals(sheets[0].rows, sheets[1].rows);
+        for(intptr_t r = 0; r < sheets[0].rows; r++){
+            const SheetRow* d = &sheets[1].display[r];
+            const SheetRow* e = &sheets[0].display[r];
+            TestAssertEquals(d->n, e->n);
+            for(int j = 0; j < d->n; j++)
+                TestExpectEquals2(streq, d->data[j], e->data[j]);
+        }
+    }
+    TestExpectEquals2(streq, sheets[1].display[10].data[1], "14");
+    TestExpectEquals2(streq, sheets[1].display[N].data[1], "11");
+    for(int k = 0; k < 2; k++){
+        drsp_destroy_ctx(ctxs[k]);
+        cleanup_sheet(&sheets[k]);
+    }
+    EXPECT_NO_LEAKS();
+    TESTEND();
+}
+
+static
+int
+load_multisheet(DrSpreadCtx* ctx, MultiSpreadSheet* ms){
+    for(int i = 0; i < ms->n; i++){
+        SpreadSheet* sheet = &ms->sheets[i];
+        int err = drsp_set_sheet_name(ctx, (SheetHandle)sheet, sheet->name.text, sheet->name.length);
+        if(err) return err;
+        for(intptr_t r = 0; r < sheet->rows; r++){
+            const SheetRow* row = &sheet->cells[r];
+            for(int c = 0; c < row->n; c++){
+                if(!row->lengths[c]) continue;
+                err = drsp_set_cell_str(ctx, (SheetHandle)sheet, r, c, row->data[c], row->lengths[c]);
+                if(err) return err;
+            }
+        }
+    }
+    return 0;
+}
+
+static
+void
+apply_display_updates(DrSpreadCtx* ctx){
+    const DrspDisplayUpdate* updates;
+    size_t n = drsp_get_display_updates(ctx, &updates);
+    for(size_t i = 0; i < n; i++){
+        const DrspDisplayUpdate* u = &updates[i];
+        switch(u->value.kind){
+            case DRSP_RESULT_NUMBER:
+                sheet_set_display_number(NULL, u->sheet, u->row, u->col, u->value.d);
+                break;
+            case DRSP_RESULT_STRING:
+                sheet_set_display_string(NULL, u->sheet, u->row, u->col, u->value.s.text, u->value.s.length);
+                break;
+            default:
+                sheet_set_display_error(NULL, u->sheet, u->row, u->col, u->value.s.text, u->value.s.length);
+                break;
+        }
+    }
+}
+
+TestFunction(TestDisplayBatching){
+    TESTBEGIN();
+    const char* input =
+        "one\n"
+        "\n"
+        "=b1+1   | =[two, a, 1] | =a1 & 'x'\n"
+        "=b2*2   | 3            | =cell('nope', 'a', 1)\n"
+        "=a1+a2  | =b1+b2       | 'y'\n"
+        "---\n"
+        "two\n"
+        "\n"
+        "4 | =[one, a, 1]\n"
+        "---\n"
+    ;
+    MultiSpreadSheet direct = {0}, batched = {0};
+    int err = read_multi_csv_from_string(&direct, input);
+    TestAssertFalse(err);
+    err = read_multi_csv_from_string(&batched, input);
+    TestAssertFalse(err);
+    SheetOps ops = multisheet_ops(&direct);
+    DrSpreadCtx* dctx = drsp_create_ctx(&ops);
+    TestAssert(dctx);
+    // Calling the callbacks would crash.
+    SheetOps no_ops = {0};
+    DrSpreadCtx* bctx = drsp_create_ctx(&no_ops);
+    TestAssert(bctx);
+    err = drsp_set_display_batching(bctx, 1);
+    TestAssertFalse(err);
+    // The updates shouldn't depend on how the sheets were evaluated.
+    err = drsp_set_thread_count(bctx, 2);
+    TestAssertFalse(err);
+    err = load_multisheet(dctx, &direct);
+    TestAssertFalse(err);
+    err = load_multisheet(bctx, &batched);
+    TestAssertFalse(err);
+    for(int pass = 0; pass < 2; pass++){
+        if(pass){
+            err = drsp_set_cell_str(dctx, (SheetHandle)&direct.sheets[1], 0, 0, "10", 2);
+            TestAssertFalse(err);
+            err = drsp_set_cell_str(bctx, (SheetHandle)&batched.sheets[1], 0, 0, "10", 2);
+            TestAssertFalse(err);
+        }
+        int nerr = drsp_evaluate_formulas(dctx);
+        TestExpectEquals(drsp_evaluate_formulas(bctx), nerr);
+        const DrspDisplayUpdate* updates;
+        size_t n = drsp_get_display_updates(bctx, &updates);
+        TestAssert(n);
+        for(size_t i = 1; i < n; i++){
+            if(updates[i].sheet != updates[i-1].sheet) continue;
+            _Bool ordered = updates[i-1].row < updates[i].row || (updates[i-1].row == updates[i].row && updates[i-1].col < updates[i].col);
+            TestExpectTrue(ordered);
+        }
+        // Only what changed.
+        if(pass) TestExpectEquals(n, 6);
+        apply_display_updates(bctx);
+        for(int s = 0; s < direct.n; s++){
+            const SpreadSheet* ds = &direct.sheets[s];
+            const SpreadSheet* bs = &batched.sheets[s];
+            for(intptr_t r = 0; r < ds->rows; r++)
+                for(int c = 0; c < ds->display[r].n; c++)
+                    TestExpectEquals2(streq, bs->display[r].data[c], ds->display[r].data[c]);
+        }
+    }
+    TestExpectEquals2(streq, batched.sheets[0].display[2].data[1], "13");
+    TestExpectEquals2(streq, batched.sheets[1].display[0].data[1], "11");
+    drsp_destroy_ctx(dctx);
+    drsp_destroy_ctx(bctx);
+    cleanup_multisheet(&direct);
+    cleanup_multisheet(&batched);
+    EXPECT_NO_LEAKS();
+    TESTEND();
+}
+
+TestFunction(TestChangedCells){
+    TESTBEGIN();
+    SheetOps ops = {0};
+    DrSpreadCtx* ctx = drsp_create_ctx(&ops);
+    TestAssert(ctx);
+    int err = drsp_set_display_batching(ctx, 1);
+    TestAssertFalse(err);
+    int sheet;
+    SheetHandle h = (SheetHandle)&sheet;
+    err = drsp_set_sheet_name(ctx, h, "s", 1);
+    TestAssertFalse(err);
+    // a: 1..10, b: running total, c: whether b is over 20.
+    enum {N = 10};
+    for(int r = 0; r < N; r++){
+        char buff[64];
+        int n = snprintf(buff, sizeof buff, "%d", r+1);
+        err = drsp_set_cell_str(ctx, h, r, 0, buff, n);
+        TestAssertFalse(err);
+        n = r? snprintf(buff, sizeof buff, "=b%d+a%d", r, r+1) : snprintf(buff, sizeof buff, "=a1");
+        err = drsp_set_cell_str(ctx, h, r, 1, buff, n);
+        TestAssertFalse(err);
+        n = snprintf(buff, sizeof buff, "=if(b%d > 20, 'big', 'small')", r+1);
+        err = drsp_set_cell_str(ctx, h, r, 2, buff, n);
+        TestAssertFalse(err);
+    }
+    int nerr = drsp_evaluate_formulas(ctx);
+    TestAssertEquals(nerr, 0);
+    DrspChangeIter it = {0};
+    SheetHandle sh;
+    intptr_t row, col;
+    DrSpreadResult result;
+    int count = 0;
+    while(drsp_next_changed(ctx, &it, &sh, &row, &col, &result)){
+        TestExpectEquals((void*)sh, (void*)h);
+        if(col == 1 && row == N-1){
+            TestAssertEquals((int)result.kind, DRSP_RESULT_NUMBER);
+            TestExpectEquals(result.d, 55.);
+        }
+        count++;
+    }
+    TestExpectEquals(count, 3*N);
+    // The end stays the end.
+    TestExpectFalse(drsp_next_changed(ctx, &it, &sh, &row, &col, &result));
+
+    // Nothing changed.
+    nerr = drsp_evaluate_formulas(ctx);
+    TestAssertEquals(nerr, 0);
+    it = (DrspChangeIter){0};
+    TestExpectFalse(drsp_next_changed(ctx, &it, &sh, &row, &col, &result));
+
+    // a5 = 0 changes itself, b5 through b10 and c6, which drops back under
+    // 20.
+    err = drsp_set_cell_str(ctx, h, 4, 0, "0", 1);
+    TestAssertFalse(err);
+    nerr = drsp_evaluate_formulas(ctx);
+    TestAssertEquals(nerr, 0);
+    it = (DrspChangeIter){0};
+    count = 0;
+    while(drsp_next_changed(ctx, &it, &sh, &row, &col, &result)){
+        if(col == 2){
+            TestExpectEquals(row, 5);
+            TestAssertEquals((int)result.kind, DRSP_RESULT_STRING);
+            TestExpectEquals2(sv_equals, ((StringView){result.s.length, result.s.text}), SV("small"));
+        }
+        else if(col == 0)
+            TestExpectEquals(row, 4);
+        else
+            TestExpectEquals(col, 1);
+        count++;
+    }
+    TestExpectEquals(count, 8);
+    drsp_destroy_ctx(ctx);
+    EXPECT_NO_LEAKS();
+    TESTEND();
+}
+
+TestFunction(TestLoadDelimited){
+    TESTBEGIN();
+    // Long enough to cross a few blocks, with crlf lines, empty cells and
+    // lines and no newline at the end.
+    const char* text =
+        "1\t2\t=a1+b1\r\n"
+        "  3 \t\t=a2*2\n"
+        "\t4\t=b3 & ' is a long enough string that this crosses a block'\n"
+        "5\t6\t=sum(a)\r\n"
+        "\n"
+        "=sum(b)\t'x'\t=c4+1\t\n"
+        "7\t=a7*a7\t=count(a)"
+    ;
+    const char* input =
+        "s\n"
+        "\n"
+        "1\t2\t=a1+b1\n"
+        "  3 \t\t=a2*2\n"
+        "\t4\t=b3 & ' is a long enough string that this crosses a block'\n"
+        "5\t6\t=sum(a)\n"
+        "\n"
+        "=sum(b)\t'x'\t=c4+1\t\n"
+        "7\t=a7*a7\t=count(a)\n"
+        "---\n"
+    ;
+    MultiSpreadSheet direct = {0}, loaded = {0};
+    int err = read_multi_csv_from_string(&direct, input);
+    TestAssertFalse(err);
+    err = read_multi_csv_from_string(&loaded, input);
+    TestAssertFalse(err);
+    SheetOps ops = multisheet_ops(&direct);
+    DrSpreadCtx* dctx = drsp_create_ctx(&ops);
+    TestAssert(dctx);
+    SheetOps no_ops = {0};
+    DrSpreadCtx* lctx = drsp_create_ctx(&no_ops);
+    TestAssert(lctx);
+    err = drsp_set_display_batching(lctx, 1);
+    TestAssertFalse(err);
+    err = load_multisheet(dctx, &direct);
+    TestAssertFalse(err);
+    SheetHandle h = (SheetHandle)&loaded.sheets[0];
+    err = drsp_set_sheet_name(lctx, h, "s", 1);
+    TestAssertFalse(err);
+    TestExpectTrue(drsp_load_delimited(lctx, h, text, strlen(text), '\n'));
+    err = drsp_load_delimited(lctx, h, text, strlen(text), '\t');
+    TestAssertFalse(err);
+    int nerr = drsp_evaluate_formulas(dctx);
+    TestExpectEquals(drsp_evaluate_formulas(lctx), nerr);
+    apply_display_updates(lctx);
+    const SpreadSheet* ds = &direct.sheets[0];
+    const SpreadSheet* ls = &loaded.sheets[0];
+    for(intptr_t r = 0; r < ds->rows; r++)
+        for(int c = 0; c < ds->display[r].n; c++)
+            TestExpectEquals2(streq, ls->display[r].data[c], ds->display[r].data[c]);
+    TestExpectEquals2(streq, ls->display[3].data[2], "77");
+    TestExpectEquals2(streq, ls->display[6].data[2], "5");
+    // Enough lines that the columns are sized from the first few, which
+    // are shorter than the rest.
+    char many[2048];
+    size_t len = 0;
+    for(int i = 0; i < 100; i++)
+        len += snprintf(many+len, sizeof many - len, "%d\t%s\n", i+1, i < 16? "" : "=a$*2");
+    SheetHandle h2 = (SheetHandle)&no_ops;
+    err = drsp_set_sheet_name(lctx, h2, "t", 1);
+    TestAssertFalse(err);
+    err = drsp_load_delimited(lctx, h2, many, len, '\t');
+    TestAssertFalse(err);
+    DrSpreadResult result = {0};
+    err = drsp_evaluate_string(lctx, h2, "=sum(a) + sum(b)", 16, &result, -1, -1);
+    TestExpectFalse(err);
+    TestExpectEquals((int)result.kind, DRSP_RESULT_NUMBER);
+    TestExpectEquals(result.d, 5050. + 2*(5050-136));
+    #ifndef DRSP_TEST_DYLINK
+    {
+        // Short lines followed by long ones would guess at many more lines
+        // than there are.
+        enum {NLONG = 260, LONG_WIDTH = 1000};
+        size_t cap = 16*2 + NLONG*LONG_WIDTH*9 + 1;
+        char* text = drsp_alloc(0, NULL, cap, 1);
+        TestAssert(text);
+        size_t n = 0;
+        for(int i = 0; i < 16; i++){
+            __builtin_memcpy(text+n, "1\n", 2);
+            n += 2;
+        }
+        for(int i = 0; i < NLONG; i++){
+            for(int c = 0; c < LONG_WIDTH; c++){
+                __builtin_memcpy(text+n, "12345678\t", 9);
+                n += 9;
+            }
+            text[n-1] = '\n';
+        }
+        TestAssert(n/2 > 1 << 20);
+        SheetHandle h3 = (SheetHandle)&result;
+        err = drsp_set_sheet_name(lctx, h3, "u", 1);
+        TestAssertFalse(err);
+        err = drsp_load_delimited(lctx, h3, text, n, '\t');
+        TestAssertFalse(err);
+        TestExpectTrue(drsp_sheet_column_capacity(lctx, h3, 0) <= 1 << 20);
+        err = drsp_evaluate_string(lctx, h3, "=sum(a) + count(b)", 18, &result, -1, -1);
+        TestExpectFalse(err);
+        TestExpectEquals((int)result.kind, DRSP_RESULT_NUMBER);
+        TestExpectEquals(result.d, 16 + NLONG*12345678. + NLONG);
+        drsp_alloc(cap, text, 0, 1);
+    }
+    #endif
+    drsp_destroy_ctx(dctx);
+    drsp_destroy_ctx(lctx);
+    cleanup_multisheet(&direct);
+    cleanup_multisheet(&loaded);
+    EXPECT_NO_LEAKS();
+    TESTEND();
+}
+
+static
+const DrspDisplayUpdate*_Nullable
+find_display_update(const DrspDisplayUpdate* updates, size_t n, SheetHandle sheet, intptr_t row, intptr_t col){
+    for(size_t i = 0; i < n; i++)
+        if(updates[i].sheet == sheet && updates[i].row == row && updates[i].col == col)
+            return &updates[i];
+    return NULL;
+}
+
+TestFunction(TestSnapshot){
+    TESTBEGIN();
+    const char* input =
+        "one\n"
+        "x | y | z\n"
+        "1 | =x1*2     | =[two, a, 1] + y1\n"
+        "2 | =sum(x)   | 'total'\n"
+        "3 | =total+1  | =[second, b, 1]\n"
+        "4 | =cell('nope', 'a', 1) | =b1+b2\n"
+        "---\n"
+        "two\n"
+        "a\n"
+        "4 | =a1*3\n"
+        "---\n"
+    ;
+    MultiSpreadSheet orig = {0}, loaded = {0};
+    int err = read_multi_csv_from_string(&orig, input);
+    TestAssertFalse(err);
+    err = read_multi_csv_from_string(&loaded, input);
+    TestAssertFalse(err);
+    SheetOps ops = multisheet_ops(&orig);
+    DrSpreadCtx* ctx = drsp_create_ctx(&ops);
+    TestAssert(ctx);
+    err = load_multisheet(ctx, &orig);
+    TestAssertFalse(err);
+    SheetHandle one = (SheetHandle)&orig.sheets[0];
+    SheetHandle two = (SheetHandle)&orig.sheets[1];
+    for(int s = 0; s < orig.n; s++){
+        SpreadSheet* sheet = &orig.sheets[s];
+        for(int i = 0; i < sheet->colnames.n; i++){
+            err = drsp_set_col_name(ctx, (SheetHandle)sheet, i, sheet->colnames.data[i], sheet->colnames.lengths[i]);
+            TestAssertFalse(err);
+        }
+    }
+    err = drsp_set_sheet_alias(ctx, two, "Second", 6);
+    TestAssertFalse(err);
+    err = drsp_set_named_cell(ctx, one, "total", 5, 1, 1);
+    TestAssertFalse(err);
+    // Far enough out to not be in a column.
+    err = drsp_set_cell_str(ctx, one, 5000, 1, "=b1+1", 5);
+    TestAssertFalse(err);
+    err = drsp_set_extra_dimensional_str(ctx, one, 0, "=b1*100", 7);
+    TestAssertFalse(err);
+    int nerr = drsp_evaluate_formulas(ctx);
+    TestExpectEquals(nerr, 1);
+
+    const void* data;
+    size_t size = drsp_save_snapshot(ctx, &data);
+    TestAssert(size);
+    // The snapshot has to outlive the context it is loaded into.
+    unsigned char* snap = drsp_alloc(0, NULL, size, 8);
+    TestAssert(snap);
+    memcpy(snap, data, size);
+    drsp_destroy_ctx(ctx);
+
+    SheetOps no_ops = {0};
+    DrSpreadCtx* lctx = drsp_create_ctx(&no_ops);
+    TestAssert(lctx);
+    err = drsp_set_display_batching(lctx, 1);
+    TestAssertFalse(err);
+    SheetHandle lone = (SheetHandle)&loaded.sheets[0];
+    SheetHandle ltwo = (SheetHandle)&loaded.sheets[1];
+    // Only one of the sheets.
+    err = drsp_set_sheet_name(lctx, lone, "one", 3);
+    TestAssertFalse(err);
+    TestExpectTrue(drsp_load_snapshot(lctx, snap, size));
+    drsp_destroy_ctx(lctx);
+
+    lctx = drsp_create_ctx(&no_ops);
+    TestAssert(lctx);
+    err = drsp_set_display_batching(lctx, 1);
+    TestAssertFalse(err);
+    err = drsp_set_sheet_name(lctx, lone, "one", 3);
+    TestAssertFalse(err);
+    err = drsp_set_sheet_name(lctx, ltwo, "two", 3);
+    TestAssertFalse(err);
+    TestExpectTrue(drsp_load_snapshot(lctx, snap, size-8));
+    snap[0] ^= 1;
+    TestExpectTrue(drsp_load_snapshot(lctx, snap, size));
+    snap[0] ^= 1;
+    err = drsp_load_snapshot(lctx, snap, size);
+    TestAssertFalse(err);
+    apply_display_updates(lctx);
+    for(int s = 0; s < orig.n; s++){
+        const SpreadSheet* os = &orig.sheets[s];
+        const SpreadSheet* ls = &loaded.sheets[s];
+        for(intptr_t r = 0; r < os->rows; r++)
+            for(int c = 0; c < os->display[r].n; c++)
+                TestExpectEquals2(streq, ls->display[r].data[c], os->display[r].data[c]);
+    }
+    TestExpectEquals2(streq, loaded.sheets[0].display[0].data[2], "6");
+    TestExpectEquals2(streq, loaded.sheets[0].display[2].data[2], "12");
+    const DrspDisplayUpdate* updates;
+    size_t n = drsp_get_display_updates(lctx, &updates);
+    const DrspDisplayUpdate* u = find_display_update(updates, n, lone, 5000, 1);
+    TestAssert(u);
+    TestExpectEquals((int)u->value.kind, DRSP_RESULT_NUMBER);
+    TestExpectEquals(u->value.d, 3.);
+    u = find_display_update(updates, n, lone, DRSP_IDX_EXTRA_DIMENSIONAL, 0);
+    TestAssert(u);
+    TestExpectEquals(u->value.d, 200.);
+
+    // Nothing is stale, so nothing is evaluated.
+    TestExpectEquals(drsp_evaluate_formulas(lctx), 0);
+    TestExpectEquals(drsp_get_display_updates(lctx, &updates), 0);
+
+    // But the formulas and dependencies are all there.
+    err = drsp_set_cell_str(lctx, ltwo, 0, 0, "10", 2);
+    TestAssertFalse(err);
+    err = drsp_set_cell_str(lctx, lone, 0, 0, "5", 1);
+    TestAssertFalse(err);
+    TestExpectEquals(drsp_evaluate_formulas(lctx), 1);
+    apply_display_updates(lctx);
+    n = drsp_get_display_updates(lctx, &updates);
+    TestExpectEquals2(streq, loaded.sheets[0].display[0].data[1], "10");
+    TestExpectEquals2(streq, loaded.sheets[0].display[0].data[2], "20");
+    TestExpectEquals2(streq, loaded.sheets[0].display[3].data[2], "24");
+    TestExpectEquals2(streq, loaded.sheets[0].display[2].data[1], "15");
+    TestExpectEquals2(streq, loaded.sheets[0].display[2].data[2], "30");
+    TestExpectEquals2(streq, loaded.sheets[1].display[0].data[1], "30");
+    u = find_display_update(updates, n, lone, 5000, 1);
+    TestAssert(u);
+    TestExpectEquals(u->value.d, 11.);
+    u = find_display_update(updates, n, lone, DRSP_IDX_EXTRA_DIMENSIONAL, 0);
+    TestAssert(u);
+    TestExpectEquals(u->value.d, 1000.);
+
+    drsp_destroy_ctx(lctx);
+    drsp_alloc(size, snap, 0, 8);
+    cleanup_multisheet(&orig);
+    cleanup_multisheet(&loaded);
+    EXPECT_NO_LEAKS();
+    TESTEND();
+}
+
+#ifndef DRSP_TEST_DYLINK
+TestFunction(TestDependants){
+    TESTBEGIN();
+    const char* input =
+
+        "Sheet1\n"
+        // -------
+        "\n"
+        "=cell('Sheet2', 'a', 1)\n"
+        "=3\n"
+        "---\n"
+
+        "Sheet2\n"
+        // -------
+        "\n"
+        "2\n"
+        "=cell('Sheet1', 'a', 1)\n"
+        "---\n"
+
+        "Sheet3\n"
+        // -------
+        "\n"
+        "=cell('Sheet1', 'a', 2)\n"
+        " \n"
+        "---\n"
+
+        "Sheet4\n"
+        "\n"
+        "=cell('Sheet2', 'a', 1)\n"
+        "=a1\n"
+        "---\n"
+        ;
+    MultiSpreadSheet ms = {0};
+    {
+        int err = read_multi_csv_from_string(&ms, input);
+        TestAssertFalse(err);
+    }
+    SheetOps ops = multisheet_ops(&ms);
+    DrSpreadCtx* ctx = drsp_create_ctx(&ops);
+    for(int i = 0; i < ms.n; i++){
+        SpreadSheet* sheet = &ms.sheets[i];
+        int e = drsp_set_sheet_name(ctx, (SheetHandle)sheet, sheet->name.text, sheet->name.length);
+        TestAssertFalse(e);
+        for(int i = 0; i < sheet->colnames.n; i++){
+            int e = drsp_set_col_name(ctx, (SheetHandle)sheet, i, sheet->colnames.data[i], sheet->colnames.lengths[i]);
+            TestAssertFalse(e);
+        }
+        SheetHandle sheethandle = (SheetHandle)sheet;
         for(intptr_t r = 0; r < sheet->rows; r++){
             const SheetRow* row = &sheet->cells[r];
             for(int c = 0; c < row->n; c++){
@@ -3021,6 +4509,340 @@ TestFunction(TestDependantsF){
     TESTEND();
 }
 
+TestFunction(TestIncrementalRecalc){
+    TESTBEGIN();
+    const char* input =
+        "1 | =a$*2 | =sum(b)\n"
+        "2 | =a$*2 | 5\n"
+        "3 | =a$*2 | =c2+1\n"
+    ;
+    SpreadSheet sheet = {0};
+    int err = read_csv_from_string(&sheet, input);
+    TestAssertFalse(err);
+    SheetOps ops = sheet_ops();
+    DrSpreadCtx* ctx = drsp_create_ctx(&ops);
+    TestAssert(ctx);
+    SheetHandle sheethandle = (SheetHandle)&sheet;
+    err = drsp_set_sheet_name(ctx, sheethandle, "sheet", 5);
+    TestAssertFalse(err);
+    for(intptr_t r = 0; r < sheet.rows; r++){
+        const SheetRow* row = &sheet.cells[r];
+        for(int c = 0; c < row->n; c++){
+            err = drsp_set_cell_str(ctx, sheethandle, r, c, row->data[c], row->lengths[c]);
+            // don't bloat the stats
+            if(err) TestAssertFalse(err);
+        }
+    }
+    int nerr = drsp_evaluate_formulas(ctx);
+    TestExpectEquals(nerr, 0);
+    TestExpectFalse(drsp_sheet_is_dirty(ctx, sheethandle));
+    TestExpectEquals2(streq, sheet.display[0].data[2], "12");
+
+    struct {
+        int row, col;
+        const char* txt;
+        _Bool whole_sheet;
+        size_t ndirty;
+        SheetRow expected[3];
+    } test_cases[] = {
+        // a2 -> b2 -> c1
+        {1, 0, "10", 0, 3, {ROW("1", "2", "28"), ROW("10", "20", "5"), ROW("3", "6", "6")}},
+        // c2 -> c3
+        {1, 2, "7",  0, 2, {ROW("1", "2", "28"), ROW("10", "20", "7"), ROW("3", "6", "8")}},
+        // Nothing reads b1 except c1.
+        {0, 1, "=a$*3", 0, 2, {ROW("1", "3", "29"), ROW("10", "20", "7"), ROW("3", "6", "8")}},
+        // Growing the sheet needs the whole thing to be redone.
+        {3, 1, "1", 1, 0, {ROW("1", "3", "30"), ROW("10", "20", "7"), ROW("3", "6", "8")}},
+    };
+    for(size_t t = 0; t < arrlen(test_cases); t++){
+        err = drsp_set_cell_str(ctx, sheethandle, test_cases[t].row, test_cases[t].col, test_cases[t].txt, strlen(test_cases[t].txt));
+        if(err) TestAssertFalse(err);
+        TestExpectEquals(drsp_sheet_is_dirty(ctx, sheethandle), test_cases[t].whole_sheet);
+        TestExpectEquals(drsp_sheet_dirty_cell_count(ctx, sheethandle), test_cases[t].ndirty);
+        nerr = drsp_evaluate_formulas(ctx);
+        TestExpectEquals(nerr, 0);
+        TestExpectFalse(drsp_sheet_is_dirty(ctx, sheethandle));
+        TestExpectEquals(drsp_sheet_dirty_cell_count(ctx, sheethandle), 0);
+        for(int r = 0; r < 3; r++){
+            const SheetRow* d = &sheet.display[r];
+            const SheetRow* e = &test_cases[t].expected[r];
+            TestAssertEquals(d->n, e->n);
+            for(int j = 0; j < d->n; j++)
+                TestExpectEquals2(streq, d->data[j], e->data[j]);
+        }
+    }
+    drsp_destroy_ctx(ctx);
+    cleanup_sheet(&sheet);
+    EXPECT_NO_LEAKS();
+    TESTEND();
+}
+
+TestFunction(TestNameChangesRecalc){
+    TESTBEGIN();
+    // Changing what a name refers to has to redo the cells that looked it
+    // up, even though none of the cells they read changed.
+    const char* input =
+        "one\n"
+        "\n"
+        "1 | =tot*10\n"
+        "2\n"
+        "5\n"
+        "---\n"
+        "two\n"
+        "\n"
+        "1 | =[foo, a, 3] | =[bar, a, 3]\n"
+        "---\n"
+    ;
+    MultiSpreadSheet ms = {0};
+    int err = read_multi_csv_from_string(&ms, input);
+    TestAssertFalse(err);
+    SheetOps ops = multisheet_ops(&ms);
+    DrSpreadCtx* ctx = drsp_create_ctx(&ops);
+    TestAssert(ctx);
+    err = load_multisheet(ctx, &ms);
+    TestAssertFalse(err);
+    SheetHandle one = (SheetHandle)&ms.sheets[0];
+    SheetHandle two = (SheetHandle)&ms.sheets[1];
+    err = drsp_set_named_cell(ctx, one, "tot", 3, 1, 0);
+    TestAssertFalse(err);
+    int nerr = drsp_evaluate_formulas(ctx);
+    TestExpectEquals(nerr, 2);
+    TestExpectEquals2(streq, ms.sheets[0].display[0].data[1], "20");
+    TestExpectTrue(ms.sheets[1].display[0].data[1][0] == 'e');
+    TestExpectTrue(ms.sheets[1].display[0].data[2][0] == 'e');
+
+    // a1 has nothing to do with b1.
+    err = drsp_clear_named_cell(ctx, one, "tot", 3);
+    TestAssertFalse(err);
+    err = drsp_set_cell_str(ctx, one, 0, 0, "3", 1);
+    TestAssertFalse(err);
+    nerr = drsp_evaluate_formulas(ctx);
+    // Sheet two doesn't depend on sheet one yet.
+    TestExpectEquals(nerr, 1);
+    TestExpectTrue(ms.sheets[0].display[0].data[1][0] == 'e');
+
+    err = drsp_set_named_cell(ctx, one, "tot", 3, 0, 0);
+    TestAssertFalse(err);
+    nerr = drsp_evaluate_formulas(ctx);
+    TestExpectEquals(nerr, 0);
+    TestExpectEquals2(streq, ms.sheets[0].display[0].data[1], "30");
+
+    err = drsp_set_sheet_name(ctx, one, "foo", 3);
+    TestAssertFalse(err);
+    err = drsp_set_cell_str(ctx, two, 0, 0, "4", 1);
+    TestAssertFalse(err);
+    nerr = drsp_evaluate_formulas(ctx);
+    TestExpectEquals(nerr, 1);
+    TestExpectEquals2(streq, ms.sheets[1].display[0].data[1], "5");
+    TestExpectTrue(ms.sheets[1].display[0].data[2][0] == 'e');
+
+    err = drsp_set_sheet_alias(ctx, one, "bar", 3);
+    TestAssertFalse(err);
+    nerr = drsp_evaluate_formulas(ctx);
+    TestExpectEquals(nerr, 0);
+    TestExpectEquals2(streq, ms.sheets[1].display[0].data[1], "5");
+    TestExpectEquals2(streq, ms.sheets[1].display[0].data[2], "5");
+
+    drsp_destroy_ctx(ctx);
+    cleanup_multisheet(&ms);
+    EXPECT_NO_LEAKS();
+    TESTEND();
+}
+
+TestFunction(TestColumnLookups){
+    TESTBEGIN();
+    // Lookups in a column go through an index of the column that is kept
+    // between evaluations, so they need to see the edits to it.
+    const char* input =
+        "3     | =a$*2 | p | =find(4, a)\n"
+        "x     | =a$*2 | q | =find('x', a, 0)\n"
+        "4     | =a$*2 | r | =tlu(7, a, c)\n"
+        "=a1+1 | =a$*2 | s | =find(4, a3:a5, 0)\n"
+        "7     | =a$*2 | t | =find(10, b, 0)\n"
+    ;
+    SpreadSheet sheet = {0};
+    int err = read_csv_from_string(&sheet, input);
+    TestAssertFalse(err);
+    SheetOps ops = sheet_ops();
+    DrSpreadCtx* ctx = drsp_create_ctx(&ops);
+    TestAssert(ctx);
+    SheetHandle sheethandle = (SheetHandle)&sheet;
+    err = drsp_set_sheet_name(ctx, sheethandle, "sheet", 5);
+    TestAssertFalse(err);
+    for(intptr_t r = 0; r < sheet.rows; r++){
+        const SheetRow* row = &sheet.cells[r];
+        for(int c = 0; c < row->n; c++){
+            err = drsp_set_cell_str(ctx, sheethandle, r, c, row->data[c], row->lengths[c]);
+            // don't bloat the stats
+            if(err) TestAssertFalse(err);
+        }
+    }
+    int nerr = drsp_evaluate_formulas(ctx);
+    TestExpectEquals(nerr, 1);
+    const char* initial[] = {"3", "2", "t", "1", "0"};
+    for(int r = 0; r < 5; r++)
+        TestExpectEquals2(streq, sheet.display[r].data[3], initial[r]);
+
+    struct {
+        int row, col;
+        const char* txt;
+        const char* expected[5];
+    } test_cases[] = {
+        // The 4 moves down a row, to the cell that is a formula.
+        {2, 0, "5", {"4", "2", "t", "2", "3"}},
+        // An earlier match.
+        {1, 0, "4", {"2", "0", "t", "2", "3"}},
+        // a4 is now 7, so it is found before a5.
+        {0, 0, "6", {"2", "0", "s", "0", "3"}},
+    };
+    for(size_t t = 0; t < arrlen(test_cases); t++){
+        err = drsp_set_cell_str(ctx, sheethandle, test_cases[t].row, test_cases[t].col, test_cases[t].txt, strlen(test_cases[t].txt));
+        if(err) TestAssertFalse(err);
+        nerr = drsp_evaluate_formulas(ctx);
+        TestExpectEquals(nerr, 0);
+        TestExpectFalse(drsp_sheet_is_dirty(ctx, sheethandle));
+        for(int r = 0; r < 5; r++)
+            TestExpectEquals2(streq, sheet.display[r].data[3], test_cases[t].expected[r]);
+    }
+    drsp_destroy_ctx(ctx);
+    cleanup_sheet(&sheet);
+    EXPECT_NO_LEAKS();
+    TESTEND();
+}
+
+TestFunction(TestConstantFolding){
+    TESTBEGIN();
+    SpreadSheet sheet = {0};
+    int err = read_csv_from_string(&sheet, "5\n");
+    TestAssertFalse(err);
+    SheetOps ops = sheet_ops();
+    DrSpreadCtx* ctx = drsp_create_ctx(&ops);
+    TestAssert(ctx);
+    SheetHandle sheethandle = (SheetHandle)&sheet;
+    err = drsp_set_sheet_name(ctx, sheethandle, "sheet", 5);
+    TestAssertFalse(err);
+    err = drsp_set_cell_str(ctx, sheethandle, 0, 0, "5", 1);
+    TestAssertFalse(err);
+    struct {
+        StringView input;
+        size_t nodes; // in the cached parse
+        int kind; // result of evaluating it
+        double value;
+    } test_cases[] = {
+        {SV("=2*3+4"),           1, DRSP_RESULT_NUMBER, 10},
+        {SV("=-(1+2)"),          1, DRSP_RESULT_NUMBER, -3},
+        {SV("=!(2 > 1)"),        1, DRSP_RESULT_NUMBER, 0},
+        {SV("=+(1/4)"),          1, DRSP_RESULT_NUMBER, 0.25},
+        {SV("='a' = 'a'"),       1, DRSP_RESULT_NUMBER, 1},
+        {SV("='a' != 'a'"),      1, DRSP_RESULT_NUMBER, 0},
+        {SV("=((3))"),           1, DRSP_RESULT_NUMBER, 3},
+        {SV("=1 + ''"),          1, DRSP_RESULT_NULL},
+        {SV("=if(1, 2, 3)"),     1, DRSP_RESULT_NUMBER, 2},
+        {SV("=if('', 2, 3)"),    1, DRSP_RESULT_NUMBER, 3},
+        {SV("=if(1-1, b1, 4)"),  1, DRSP_RESULT_NUMBER, 4},
+        {SV("=2*3+a1"),          3, DRSP_RESULT_NUMBER, 11},
+        {SV("=sum(a) * (1+1)"),  4, DRSP_RESULT_NUMBER, 10},
+        {SV("=if(a1, 1, 2+1)"),  4, DRSP_RESULT_NUMBER, 1},
+        // These are errors, which happen when evaluated.
+        {SV("='a' < 'b'"),       3, DRSP_RESULT_ERROR},
+        {SV("=1 + 'a'"),         3, DRSP_RESULT_ERROR},
+        {SV("=-'a'"),            2, DRSP_RESULT_ERROR},
+    };
+    for(size_t i = 0; i < arrlen(test_cases); i++){
+        StringView input = test_cases[i].input;
+        TestExpectEquals(drsp_parsed_node_count(ctx, input.text, input.length), test_cases[i].nodes);
+        DrSpreadResult result = {0};
+        err = drsp_evaluate_string(ctx, sheethandle, input.text, input.length, &result, -1, -1);
+        if(test_cases[i].kind == DRSP_RESULT_ERROR){
+            TestExpectTrue(err);
+            continue;
+        }
+        TestExpectFalse(err);
+        TestExpectEquals((int)result.kind, test_cases[i].kind);
+        if(result.kind == DRSP_RESULT_NUMBER)
+            TestExpectEquals(result.d, test_cases[i].value);
+    }
+    drsp_destroy_ctx(ctx);
+    cleanup_sheet(&sheet);
+    EXPECT_NO_LEAKS();
+    TESTEND();
+}
+
+TestFunction(TestFillDown){
+    TESTBEGIN();
+    // Formulas that were filled down with explicit rows should all share
+    // one parse, the same as if they had been written with `$`.
+    enum {N=300};
+    size_t cap = 64*N;
+    char* input = drsp_alloc(0, NULL, cap, 1);
+    TestAssert(input);
+    size_t len = 0;
+    for(int i = 1; i <= N; i++){
+        len += snprintf(input+len, cap-len, "%d | =a%d*2 | ", i, i);
+        if(i == 1)
+            len += snprintf(input+len, cap-len, "=b1");
+        else
+            len += snprintf(input+len, cap-len, "=b%d+c%d", i, i-1);
+        len += snprintf(input+len, cap-len, " | =a%d-a1 | =sum(a%d:b%d)\n", i, i, i);
+    }
+    SpreadSheet sheet = {0};
+    int err = read_csv_from_string(&sheet, input);
+    drsp_alloc(cap, input, 0, 1);
+    TestAssertFalse(err);
+    TestAssertEquals(sheet.rows, N);
+    SheetOps ops = sheet_ops();
+    DrSpreadCtx* ctx = drsp_create_ctx(&ops);
+    TestAssert(ctx);
+    SheetHandle sheethandle = (SheetHandle)&sheet;
+    err = drsp_set_sheet_name(ctx, sheethandle, "sheet", 5);
+    TestAssertFalse(err);
+    for(intptr_t r = 0; r < sheet.rows; r++){
+        const SheetRow* row = &sheet.cells[r];
+        for(int c = 0; c < row->n; c++){
+            err = drsp_set_cell_str(ctx, sheethandle, r, c, row->data[c], row->lengths[c]);
+            // don't bloat the stats
+            if(err) TestAssertFalse(err);
+        }
+    }
+    int nerr = drsp_evaluate_formulas(ctx);
+    TestExpectEquals(nerr, 0);
+    for(int i = 1; i <= N; i++){
+        const SheetRow* d = &sheet.display[i-1];
+        TestAssertEquals(d->n, 5);
+        char buff[32];
+        snprintf(buff, sizeof buff, "%d", 2*i);
+        TestExpectEquals2(streq, d->data[1], buff);
+        snprintf(buff, sizeof buff, "%d", i*(i+1));
+        TestExpectEquals2(streq, d->data[2], buff);
+        snprintf(buff, sizeof buff, "%d", i-1);
+        TestExpectEquals2(streq, d->data[3], buff);
+        snprintf(buff, sizeof buff, "%d", 3*i);
+        TestExpectEquals2(streq, d->data[4], buff);
+    }
+    // Rows near a1 see it as a relative row, so column d needs a parse for
+    // each of the first 65 rows and one for the rest. c1 is different from
+    // the rest of its column.
+    TestExpectEquals(drsp_parse_cache_count(ctx), 1 + 2 + 66 + 1);
+    drsp_destroy_ctx(ctx);
+    cleanup_sheet(&sheet);
+    EXPECT_NO_LEAKS();
+    TESTEND();
+}
+
+TestFunction(TestConcurrentInterning){
+    TESTBEGIN();
+    SheetOps ops = {0};
+    DrSpreadCtx* ctx = drsp_create_ctx(&ops);
+    TestAssert(ctx);
+    // Different counts make the threads race on growing the shards.
+    TestExpectEquals(drsp_intern_concurrently(ctx, 4, 3000), 0);
+    TestExpectEquals(drsp_intern_concurrently(ctx, 8, 20000), 0);
+    drsp_destroy_ctx(ctx);
+    EXPECT_NO_LEAKS();
+    TESTEND();
+}
+#endif
+
 TestFunction(TestErrorMessages){
     TESTBEGIN();
     const char* input =
@@ -3531,6 +5353,14 @@ TestFunction(TestErrorMessages){
             SV("tlu(a('1'), a('2', '1'), a('3'))"),
             SV("position of needle in haystack outside the bounds of values in tlu()"),
         },
+        {
+            SV("stlu(a(1), a(2), a(3))"),
+            SV("needle (argument 1) not found in haystack (argument 2) in stlu()"),
+        },
+        {
+            SV("stlu(a(3), a(1, 2), a(4))"),
+            SV("position of needle in haystack outside the bounds of values in stlu()"),
+        },
         {
             SV("tlu()"),
             SV("tlu() requires 3 or 4 arguments"),
@@ -3801,6 +5631,128 @@ drsp_sheet_is_dirty(DrSpreadCtx* ctx, SheetHandle h){
     assert(d);
     return d->dirty;
 }
+static
+size_t
+drsp_sheet_dirty_cell_count(DrSpreadCtx* ctx, SheetHandle h){
+    SheetData* d = sheet_lookup_by_handle(ctx, h);
+    assert(d);
+    size_t n = 0;
+    const RowCol* cells = (const RowCol*)d->dirty_cells.data;
+    // Skip the marks for columns.
+    for(size_t i = 0; i < d->dirty_cells.n; i++)
+        n += cells[i].row != IDX_UNSET;
+    return n;
+}
+static
+intptr_t
+drsp_sheet_column_capacity(DrSpreadCtx* ctx, SheetHandle h, intptr_t col){
+    SheetData* d = sheet_lookup_by_handle(ctx, h);
+    assert(d);
+    if((size_t)col >= d->cell_cache.ncolumns) return 0;
+    return d->cell_cache.columns[col].cap;
+}
+static
+size_t
+expr_node_count(Expression* e){
+    switch(e->kind){
+        case EXPR_GROUP:
+            return 1 + expr_node_count(((Group*)e)->expr);
+        case EXPR_UNARY:
+            return 1 + expr_node_count(((Unary*)e)->expr);
+        case EXPR_BINARY:
+            return 1 + expr_node_count(((Binary*)e)->lhs) + expr_node_count(((Binary*)e)->rhs);
+        case EXPR_FUNCTION_CALL:{
+            FunctionCall* fc = (FunctionCall*)e;
+            size_t n = 1;
+            for(int i = 0; i < fc->argc; i++)
+                n += expr_node_count(fc->argv[i]);
+            return n;
+        }
+        default:
+            return 1;
+    }
+}
+static
+size_t
+drsp_parsed_node_count(DrSpreadCtx* ctx, const char* txt, size_t len){
+    DrspAtom a = drsp_intern_str(ctx, txt, len);
+    if(!a) return 0;
+    Expression* e = parse(ctx, a);
+    if(!e) return 0;
+    return expr_node_count(e);
+}
+static
+size_t
+drsp_parse_cache_count(DrSpreadCtx* ctx){
+    return ctx->pheap.n;
+}
+
+typedef struct InternJob InternJob;
+struct InternJob {
+    DrSpreadCtx* ctx;
+    void*_Nullable records;
+    int n, offset;
+    ThreadHandle handle;
+    DrspAtom _Nullable* atoms;
+};
+
+static
+THREADFUNC(intern_worker){
+    InternJob* job = thread_arg;
+    drsp_share_allocation_records(job->records);
+    // Each thread starts somewhere else, so they race to insert.
+    for(int j = 0; j < job->n; j++){
+        int i = (j + job->offset) % job->n;
+        char buff[16];
+        int len = snprintf(buff, sizeof buff, "s%d", i);
+        job->atoms[i] = drsp_intern_str(job->ctx, buff, len);
+    }
+    drsp_share_allocation_records(NULL);
+    return 0;
+}
+
+// Interns "s0" ... on nthreads threads at once and returns how many of them
+// aren't the same atom as when interned on this thread afterwards.
+static
+int
+drsp_intern_concurrently(DrSpreadCtx* ctx, int nthreads, int n){
+    LOCK_T lock;
+    LOCK_T_init(&lock);
+    InternJob jobs[8];
+    if(nthreads > 8) return -1;
+    size_t sz = (size_t)n * sizeof(DrspAtom);
+    int t = 0;
+    for(; t < nthreads; t++){
+        jobs[t] = (InternJob){
+            .ctx = create_worker_ctx(ctx, &lock),
+            .records = drsp_allocation_records(),
+            .n = n,
+            .offset = t * n / nthreads,
+            .atoms = drsp_alloc(0, NULL, sz, _Alignof(DrspAtom)),
+        };
+    }
+    for(t = 1; t < nthreads; t++)
+        if(create_thread(&jobs[t].handle, intern_worker, &jobs[t]))
+            break;
+    intern_worker(&jobs[0]);
+    for(int i = 1; i < t; i++)
+        join_thread(jobs[i].handle);
+    int bad = 0;
+    for(int i = 0; i < n; i++){
+        char buff[16];
+        int len = snprintf(buff, sizeof buff, "s%d", i);
+        DrspAtom a = drsp_intern_str(ctx, buff, len);
+        if(!a || !sv_equals2((StringView){a->length, a->data}, buff, len))
+            bad++;
+        for(int k = 0; k < t; k++)
+            bad += jobs[k].atoms[i] != a;
+    }
+    for(t = 0; t < nthreads; t++){
+        destroy_worker_ctx(jobs[t].ctx);
+        drsp_alloc(sz, jobs[t].atoms, 0, _Alignof(DrspAtom));
+    }
+    return bad;
+}
 #ifdef __clang__
 #pragma clang assume_nonnull end
 #endif
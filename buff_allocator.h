@@ -20,11 +20,41 @@
 #endif
 #endif
 
+// A bump allocator that is reset to a checkpoint instead of freeing.
+//
+// It starts out in a fixed buffer. If BUFF_SEGMENT_ALLOC(size) and
+// BUFF_SEGMENT_FREE(ptr, size) are defined before including this, it grows
+// into more segments once that is full, otherwise buff_alloc fails.
+// Segments that were reset past are kept to be reused until
+// buff_release_segments.
+
+#ifndef BUFF_SEGMENT_ALLOC
+#define BUFF_SEGMENT_ALLOC(size) ((void)(size), (void*)0)
+#define BUFF_SEGMENT_FREE(ptr, size) ((void)(ptr), (void)(size))
+#endif
+
+enum {BUFF_SEGMENT_MIN = 256*1024};
+
+typedef struct BuffSegment BuffSegment;
+struct BuffSegment {
+    // NULL for the first segment, which comes after the fixed buffer.
+    BuffSegment*_Nullable prev;
+    BuffSegment*_Nullable next;
+    size_t size;
+    _Alignas(double) char data[];
+};
+
 typedef struct BuffAllocator BuffAllocator;
 struct BuffAllocator {
-    char* const data;
+    // Where allocations are currently coming from.
+    char* data;
     char* cursor;
-    char* const end;
+    char* end;
+    // NULL while in the fixed buffer.
+    BuffSegment*_Nullable segment;
+    BuffSegment*_Nullable first;
+    char* buff;
+    char* buff_end;
 };
 
 typedef struct BuffCheckpoint BuffCheckpoint;
@@ -32,18 +62,95 @@ struct BuffCheckpoint {
     char* const ptr;
 };
 
+static inline
+void
+buff_init(BuffAllocator* b, void* buff, size_t size){
+    *b = (BuffAllocator){
+        .data = buff,
+        .cursor = buff,
+        .end = (char*)buff + size,
+        .buff = buff,
+        .buff_end = (char*)buff + size,
+    };
+}
+
 static inline
 BuffCheckpoint
 buff_checkpoint(const BuffAllocator* b){
     return (BuffCheckpoint){b->cursor};
 }
 
+static inline
+_Bool
+buff_contains_(const char* data, const char* end, const char* p){
+    return (size_t)(p - data) <= (size_t)(end - data);
+}
+
+// Goes back to the segment the checkpoint is in.
+static
+void
+buff_set_slow(BuffAllocator* b, BuffCheckpoint c){
+    BuffSegment* seg = b->segment;
+    for(;;){
+        seg = seg?seg->prev:NULL;
+        char* data = seg?seg->data:b->buff;
+        char* end = seg?seg->data+seg->size:b->buff_end;
+        if(!seg || buff_contains_(data, end, c.ptr)){
+            b->segment = seg;
+            b->data = data;
+            b->end = end;
+            b->cursor = c.ptr;
+            return;
+        }
+    }
+}
+
 static inline
 void
 buff_set(BuffAllocator* b, BuffCheckpoint c){
-    b->cursor = c.ptr;
+    if(buff_contains_(b->data, b->end, c.ptr))
+        b->cursor = c.ptr;
+    else
+        buff_set_slow(b, c);
 }
 
+// Frees the segments from seg on.
+static
+void
+buff_free_segments_(BuffSegment*_Nullable seg){
+    while(seg){
+        BuffSegment* next = seg->next;
+        BUFF_SEGMENT_FREE(seg, sizeof *seg + seg->size);
+        seg = next;
+    }
+}
+
+// Moves on to the next segment, reusing it if it is big enough.
+static
+void*_Nullable
+buff_alloc_slow(BuffAllocator* a, size_t sz){
+    BuffSegment* cur = a->segment;
+    BuffSegment* next = cur?cur->next:a->first;
+    if(!next || next->size < sz){
+        size_t size = cur && cur->size > BUFF_SEGMENT_MIN/2? cur->size*2 : BUFF_SEGMENT_MIN;
+        if(size < sz) size = sz;
+        BuffSegment* seg = BUFF_SEGMENT_ALLOC(sizeof *seg + size);
+        if(!seg) return NULL;
+        // The ones after it were too small anyway.
+        buff_free_segments_(next);
+        seg->prev = cur;
+        seg->next = NULL;
+        seg->size = size;
+        if(cur) cur->next = seg;
+        else a->first = seg;
+        next = seg;
+    }
+    a->segment = next;
+    a->data = next->data;
+    a->end = next->data + next->size;
+    a->cursor = next->data + sz;
+    return next->data;
+}
 
 force_inline
 // static inline
@@ -52,14 +159,32 @@ __attribute__((__malloc__))
 #endif
 void*_Nullable
 buff_alloc(BuffAllocator* a, size_t sz){
-    if(a->cursor + sz > a->end)
-        return NULL;
+    if(sz > (size_t)(a->end - a->cursor))
+        return buff_alloc_slow(a, sz);
     char* result = a->cursor;
     a->cursor += sz;
     return result;
 }
 
+// Frees the segments after the current one, keeping `keep` of them for
+// reuse.
+static inline
+void
+buff_release_segments(BuffAllocator* b, size_t keep){
+    BuffSegment** link = b->segment?&b->segment->next:&b->first;
+    for(; keep && *link; keep--)
+        link = &(*link)->next;
+    buff_free_segments_(*link);
+    *link = NULL;
+}
 
+// Goes back to the start of the fixed buffer and frees every segment.
+static inline
+void
+buff_release_all(BuffAllocator* b){
+    buff_free_segments_(b->first);
+    buff_init(b, b->buff, (size_t)(b->buff_end - b->buff));
+}
 
 #ifdef __clang__
 #pragma clang assume_nonnull end
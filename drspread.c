@@ -16,6 +16,7 @@ __import ldc.intrinsics;
 #include "drspread_parse.h"
 #include "stringview.h"
 #include "drspread_types.h"
+#include "drp_merge_sort.h"
 
 
 #ifdef __clang__
@@ -54,123 +55,476 @@ __import ldc.intrinsics;
 //   'string', "string"
 //   (group)
 
+static
+int
+record_display(DrSpreadCtx* ctx, SheetHandle sheet, intptr_t row, intptr_t col, DrSpreadResult value){
+    DisplayUpdates* u = &ctx->updates;
+    if(u->count == u->capacity){
+        size_t new_cap = u->capacity?u->capacity*2:64;
+        void* p = drsp_alloc(u->capacity*sizeof *u->data, u->data, new_cap*sizeof *u->data, _Alignof(DrspDisplayUpdate));
+        if(!p) return 1;
+        u->data = p;
+        u->capacity = new_cap;
+    }
+    u->data[u->count++] = (DrspDisplayUpdate){sheet, row, col, value};
+    return 0;
+}
+
+static
+int
+display_update_cmp(void*_Null_unspecified ctx, const void* a, const void* b){
+    (void)ctx;
+    const DrspDisplayUpdate* l = a;
+    const DrspDisplayUpdate* r = b;
+    if(l->row != r->row) return l->row < r->row? -1 : 1;
+    if(l->col != r->col) return l->col < r->col? -1 : 1;
+    return 0;
+}
+
+// The updates of a sheet are recorded together, column by column, so only
+// each sheet's run needs sorting.
+static
+void
+sort_display_updates(DrSpreadCtx* ctx){
+    DrspDisplayUpdate* data = ctx->updates.data;
+    size_t n = ctx->updates.count;
+    for(size_t begin = 0, end; begin < n; begin = end){
+        _Bool sorted = 1;
+        for(end = begin+1; end < n && data[end].sheet == data[begin].sheet; end++)
+            if(sorted && display_update_cmp(NULL, &data[end-1], &data[end]) > 0)
+                sorted = 0;
+        if(sorted) continue;
+        size_t len = end - begin;
+        void* scratch = buff_alloc(ctx->a, len * sizeof *data);
+        if(scratch)
+            drp_merge_sort(scratch, data+begin, len, sizeof *data, NULL, display_update_cmp);
+        else
+            drp_binary_insertion_sort(data+begin, len, sizeof *data, NULL, display_update_cmp);
+    }
+}
+
 force_inline
 int
-sp_set_display_number(const DrSpreadCtx* ctx, SheetHandle sheet, intptr_t row, intptr_t col, double value);
+sp_set_display_number(DrSpreadCtx* ctx, SheetHandle sheet, intptr_t row, intptr_t col, double value);
 
 force_inline
 int
-sp_set_display_error(const DrSpreadCtx* ctx, SheetHandle sheet, intptr_t row, intptr_t col, const char* errmess, size_t errmess_len);
+sp_set_display_error(DrSpreadCtx* ctx, SheetHandle sheet, intptr_t row, intptr_t col, const char* errmess, size_t errmess_len);
 
 force_inline
 int
-sp_set_display_string(const DrSpreadCtx* ctx, SheetHandle sheet, intptr_t row, intptr_t col, const char* txt, size_t len);
+sp_set_display_string(DrSpreadCtx* ctx, SheetHandle sheet, intptr_t row, intptr_t col, const char* txt, size_t len);
+
+// Evaluates the cell into `out`. A result that can't be represented is an
+// error with no message.
+static
+void
+evaluate_cell(DrSpreadCtx* ctx, SheetData* sd, intptr_t row, intptr_t col, _Bool is_blank, BuffCheckpoint bc, CachedResult* out){
+    Expression* e;
+    if(is_blank){
+        buff_set(ctx->a, bc);
+        e = expr_alloc(ctx, EXPR_BLANK);
+    }
+    else {
+        do {
+            buff_set(ctx->a, bc);
+            e = evaluate(ctx, sd, row, col);
+        }while(evaluate_pending(ctx, &e));
+    }
+    // benchmarking
+    #ifdef BENCHMARKING
+        for(int i = 0; i < 100000; i++){
+            buff_set(ctx->a, bc);
+            e = evaluate(ctx, sd, row, col);
+        }
+    #endif
+    if(!e) e = Error(ctx, "oom"); // Error doesn't alloc
+    out->loc = (RowCol){row, col};
+    int err = expr_to_cached_result(ctx, e, out);
+    if(err){
+        out->kind = CACHED_RESULT_ERROR;
+        out->string = NULL;
+    }
+}
 
+static
+int
+show_result(DrSpreadCtx* ctx, SheetData* sd, const CachedResult* r){
+    intptr_t row = r->loc.row, col = r->loc.col;
+    // FIXME: If the set display function returns an
+    // error we need to delete our cache result
+    // instead of caching.
+    switch(r->kind){
+        case CACHED_RESULT_NULL:
+            sp_set_display_string(ctx, sd->handle, row, col, "", 0);
+            return 0;
+        case CACHED_RESULT_NUMBER:
+            sp_set_display_number(ctx, sd->handle, row, col, r->number);
+            return 0;
+        case CACHED_RESULT_STRING:
+            sp_set_display_string(ctx, sd->handle, row, col, r->string->data, r->string->length);
+            return 0;
+        default: break;
+    }
+    if(r->string)
+        sp_set_display_error(ctx, sd->handle, row, col, r->string->data, r->string->length);
+    else
+        sp_set_display_error(ctx, sd->handle, row, col, "error (unset)", sizeof "error (unset)" - 1);
+    return 1;
+}
+
+// Updates the display of the cell if its result changed.
+// Returns 1 if the cell is an error, 0 otherwise.
+static
+int
+display_cell(DrSpreadCtx* ctx, SheetData* sd, const CachedResult* r){
+    intptr_t row = r->loc.row, col = r->loc.col;
+    if(r->kind == CACHED_RESULT_NULL){
+        if(!has_cached_output_result(&sd->output_result_cache, row, col))
+            return 0;
+    }
+    // Not representable, don't cache the result.
+    if(r->kind == CACHED_RESULT_ERROR && !r->string)
+        return show_result(ctx, sd, r);
+    CachedResult* cr = get_cached_output_result(&sd->output_result_cache, row, col);
+    // Fallback, don't cache the result.
+    if(!cr) return show_result(ctx, sd, r); // GCOV_EXCL_LINE
+    if(cached_result_eq_ignoring_loc(cr, r))
+        return r->kind == CACHED_RESULT_ERROR;
+    *cr = *r;
+    return show_result(ctx, sd, r);
+}
+
+// Evaluates the cell and updates its display if the result changed.
+// Returns 1 if the cell is an error, 0 otherwise.
+static
+int
+evaluate_and_display_cell(DrSpreadCtx* ctx, SheetData* sd, intptr_t row, intptr_t col, _Bool is_blank, BuffCheckpoint bc){
+    CachedResult r;
+    evaluate_cell(ctx, sd, row, col, is_blank, bc, &r);
+    return display_cell(ctx, sd, &r);
+}
+
+// Some of the normal cells of a sheet, evaluated on a worker thread.
+typedef struct SheetJob SheetJob;
+struct SheetJob {
+    SheetData* sd;
+    // Big sheets are split between several jobs, each evaluating a shadow
+    // of the sheet.
+    SheetData*_Nullable shadow;
+    // Which of the cells, in the order drsp_evaluate_formulas goes through
+    // them (counting the empty slots of the columns).
+    size_t begin, end;
+    // In the order they are to be displayed.
+    CachedResult*_Nullable results;
+    size_t count;
+    size_t capacity;
+    // Set if the sheet reached another sheet or we ran out of memory, in
+    // which case the whole sheet is redone on the calling thread.
+    _Bool bailed;
+};
+
+// Splitting off fewer cells than this isn't worth a shadow of the sheet.
+enum {EVAL_CHUNK_MIN = 256};
+
+typedef struct EvalPool EvalPool;
+struct EvalPool {
+    SheetJob* jobs;
+    size_t njobs;
+    size_t next;
+    // Guards `next` and the heaps the workers share.
+    LOCK_T lock;
+    void*_Nullable records;
+};
+
+typedef struct EvalWorker EvalWorker;
+struct EvalWorker {
+    EvalPool* pool;
+    DrSpreadCtx* ctx;
+    ThreadHandle handle;
+};
+
+static
+int
+queue_cell(DrSpreadCtx* ctx, SheetJob* job, SheetData* sd, intptr_t row, intptr_t col, _Bool is_blank, BuffCheckpoint bc){
+    if(job->count >= job->capacity){
+        size_t new_cap = job->capacity?job->capacity*2:64;
+        CachedResult* results = drsp_alloc(job->capacity*sizeof *job->results, job->results, new_cap*sizeof *job->results, _Alignof(CachedResult));
+        if(!results){
+            job->bailed = 1;
+            return 1;
+        }
+        job->results = results;
+        job->capacity = new_cap;
+    }
+    evaluate_cell(ctx, sd, row, col, is_blank, bc, &job->results[job->count++]);
+    if(ctx->bailed){
+        job->bailed = 1;
+        return 1;
+    }
+    return 0;
+}
+
+// Same order as drsp_evaluate_formulas.
+static
+void
+evaluate_sheet_job(DrSpreadCtx* ctx, SheetJob* job){
+    // The cells are listed by the sheet, but the shadow is what gets
+    // evaluated (and cached into).
+    const SheetData* base = job->sd;
+    SheetData* sd = job->shadow?job->shadow:job->sd;
+    ctx->worker_sheet = sd;
+    ctx->bailed = 0;
+    BuffCheckpoint bc = buff_checkpoint(ctx->a);
+    if(!base->dirty){
+        const RowCol* cells = (const RowCol*)base->dirty_cells.data;
+        size_t end = job->end < base->dirty_cells.n? job->end : base->dirty_cells.n;
+        for(size_t j = job->begin; j < end; j++){
+            intptr_t row = cells[j].row;
+            intptr_t col = cells[j].col;
+            if(row == IDX_UNSET) continue;
+            DrspAtom a = get_cached_cell(&sd->cell_cache, row, col);
+            if(queue_cell(ctx, job, sd, row, col, !a || a == drsp_nil_atom(), bc))
+                goto finish;
+        }
+        goto finish;
+    }
+    size_t pos = 0;
+    for(size_t c = 0; c < sd->cell_cache.ncolumns && pos < job->end; c++){
+        const CellColumn* column = &sd->cell_cache.columns[c];
+        size_t len = (size_t)column->len;
+        size_t first = job->begin > pos? job->begin - pos : 0;
+        size_t last = job->end - pos < len? job->end - pos : len;
+        for(size_t row = first; row < last; row++){
+            DrspAtom a = column->atoms[row];
+            if(!a) continue;
+            if(queue_cell(ctx, job, sd, row, c, a == drsp_nil_atom(), bc))
+                goto finish;
+        }
+        pos += len;
+    }
+    if(pos < job->end){
+        RowColSv* items = (RowColSv*)sd->cell_cache.data;
+        size_t first = job->begin > pos? job->begin - pos : 0;
+        size_t last = job->end - pos < sd->cell_cache.n? job->end - pos : sd->cell_cache.n;
+        for(size_t j = first; j < last; j++){
+            intptr_t row = items[j].rc.row;
+            intptr_t col = items[j].rc.col;
+            if(queue_cell(ctx, job, sd, row, col, items[j].sv == drsp_nil_atom(), bc))
+                goto finish;
+        }
+    }
+    finish:
+    buff_set(ctx->a, bc);
+    ctx->worker_sheet = NULL;
+}
+
+static
+void
+run_sheet_jobs(EvalPool* pool, DrSpreadCtx* ctx){
+    for(;;){
+        LOCK_T_lock(&pool->lock);
+        size_t i = pool->next++;
+        LOCK_T_unlock(&pool->lock);
+        if(i >= pool->njobs) return;
+        evaluate_sheet_job(ctx, &pool->jobs[i]);
+    }
+}
+
+static
+THREADFUNC(evaluate_sheets_worker){
+    EvalWorker* w = thread_arg;
+    drsp_share_allocation_records(w->pool->records);
+    run_sheet_jobs(w->pool, w->ctx);
+    drsp_share_allocation_records(NULL);
+    return 0;
+}
+
+// How many cells evaluate_sheet_job goes through for the whole sheet.
+static
+size_t
+sheet_job_size(const SheetData* sd){
+    if(!sd->dirty) return sd->dirty_cells.n;
+    size_t n = sd->cell_cache.n;
+    for(size_t c = 0; c < sd->cell_cache.ncolumns; c++)
+        n += (size_t)sd->cell_cache.columns[c].len;
+    return n;
+}
+
+static
+size_t
+sheet_job_count(const DrSpreadCtx* ctx, const SheetData* sd){
+    if(!sd->dirty && !sd->dirty_cells.n) return 0;
+    // Function sheets are evaluated with their arguments filled in, so
+    // they aren't split.
+    if(sd->flags & DRSP_SHEET_FLAGS_IS_FUNCTION) return 1;
+    size_t n = sheet_job_size(sd) / EVAL_CHUNK_MIN;
+    if(n > (size_t)ctx->nthreads) n = ctx->nthreads;
+    return n?n:1;
+}
+
+// Evaluates the normal cells of the sheets that need it on ctx->nthreads
+// threads, including the calling one. The results are displayed afterwards,
+// in order, by drsp_evaluate_formulas.
+// Returns the number of jobs, which is 0 if everything should be done on
+// this thread instead.
+static
+size_t
+evaluate_sheets_parallel(DrSpreadCtx* ctx, SheetJob*_Nullable*_Nonnull out){
+    size_t njobs = 0;
+    for(size_t i = 0; i < ctx->map.n; i++)
+        njobs += sheet_job_count(ctx, &ctx->map.data[i]);
+    if(njobs < 2) return 0;
+    SheetJob* jobs = drsp_alloc(0, NULL, njobs*sizeof *jobs, _Alignof(SheetJob));
+    if(!jobs) return 0;
+    __builtin_memset(jobs, 0, njobs*sizeof *jobs);
+    for(size_t i = 0, j = 0; i < ctx->map.n; i++){
+        SheetData* sd = &ctx->map.data[i];
+        size_t n = sheet_job_count(ctx, sd);
+        size_t size = n > 1? sheet_job_size(sd) : SIZE_MAX;
+        for(size_t k = 0; k < n; k++){
+            SheetJob* job = &jobs[j++];
+            job->sd = sd;
+            job->begin = size/n*k;
+            job->end = k == n-1? size : size/n*(k+1);
+            if(n > 1){
+                job->shadow = create_sheet_shadow(sd);
+                if(!job->shadow) job->bailed = 1;
+            }
+        }
+    }
+    EvalPool pool = {.jobs = jobs, .njobs = njobs, .records = drsp_allocation_records()};
+    LOCK_T_init(&pool.lock);
+    size_t nworkers = (size_t)ctx->nthreads < njobs? (size_t)ctx->nthreads : njobs;
+    EvalWorker workers[EVAL_MAX_THREADS];
+    size_t n = 0;
+    for(; n < nworkers; n++){
+        DrSpreadCtx* w = create_worker_ctx(ctx, &pool.lock);
+        if(!w) break;
+        workers[n] = (EvalWorker){.pool = &pool, .ctx = w};
+    }
+    if(n){
+        // The calling thread is the first worker.
+        size_t nspawned = 1;
+        for(; nspawned < n; nspawned++)
+            if(create_thread(&workers[nspawned].handle, evaluate_sheets_worker, &workers[nspawned]))
+                break;
+        run_sheet_jobs(&pool, workers[0].ctx);
+        for(size_t i = 1; i < nspawned; i++)
+            join_thread(workers[i].handle);
+        for(size_t i = 0; i < n; i++)
+            destroy_worker_ctx(workers[i].ctx);
+    }
+    else {
+        for(size_t i = 0; i < njobs; i++)
+            jobs[i].bailed = 1;
+    }
+    for(size_t i = 0; i < njobs;){
+        SheetData* sd = jobs[i].sd;
+        size_t end = i;
+        _Bool bailed = 0;
+        for(; end < njobs && jobs[end].sd == sd; end++)
+            bailed |= jobs[end].bailed;
+        for(size_t k = i; k < end; k++){
+            if(!jobs[k].shadow) continue;
+            if(!bailed && merge_sheet_shadow(jobs[k].shadow))
+                bailed = 1;
+            destroy_sheet_shadow(jobs[k].shadow);
+            jobs[k].shadow = NULL;
+        }
+        for(; i < end; i++)
+            jobs[i].bailed = bailed;
+        if(!bailed) continue;
+        // What was cached is wrong, as the other sheets couldn't be
+        // reached. These start over on this thread, without dirtying the
+        // dependants again, before any of them are read.
+        if(sd->dirty){
+            sheet_mark_dirty(ctx, sd);
+            continue;
+        }
+        // Only the dirty cells were evaluated (and cached), so only they
+        // need to be redone.
+        const RowCol* cells = (const RowCol*)sd->dirty_cells.data;
+        for(size_t j = 0; j < sd->dirty_cells.n; j++){
+            if(cells[j].row == IDX_UNSET) continue;
+            del_cached_output_result(&sd->result_cache, cells[j].row, cells[j].col);
+            drop_column_index(&sd->col_indexes, cells[j].col);
+        }
+    }
+    *out = jobs;
+    return njobs;
+}
+
+// Returns the number of errors in the cells that were recalculated.
 DRSP_EXPORT
 int
 drsp_evaluate_formulas(DrSpreadCtx* ctx){
     int nerrs = 0;
-    #if !defined(__wasm__) && defined(FrameAddress)
-        ctx->limit = FrameAddress() - 300000;
-    #endif
     BuffCheckpoint bc = buff_checkpoint(ctx->a);
+    ctx->updates.count = 0;
+    SheetJob* jobs = NULL;
+    size_t njobs = ctx->nthreads > 1? evaluate_sheets_parallel(ctx, &jobs) : 0;
+    size_t next_job = 0;
     for(size_t i = 0; i < ctx->map.n; i++){
         SheetData* sd = &ctx->map.data[i];
-        if(!sd->dirty) continue;
+        SheetJob* job = NULL;
+        if(next_job < njobs && jobs[next_job].sd == sd)
+            job = &jobs[next_job];
+        for(; next_job < njobs && jobs[next_job].sd == sd; next_job++){
+            if(jobs[next_job].bailed) continue;
+            // Already evaluated, in the same order as below.
+            for(size_t k = 0; k < jobs[next_job].count; k++)
+                nerrs += display_cell(ctx, sd, &jobs[next_job].results[k]);
+        }
+        if(job && !job->bailed){
+            if(!sd->dirty){
+                clear_cell_set(&sd->dirty_cells);
+                continue;
+            }
+            sd->dirty = 0;
+            goto extra_dimensional;
+        }
+        if(!sd->dirty){
+            // Only the cells downstream of an edit need to be redone.
+            const RowCol* cells = (const RowCol*)sd->dirty_cells.data;
+            for(size_t j = 0; j < sd->dirty_cells.n; j++){
+                intptr_t row = cells[j].row;
+                intptr_t col = cells[j].col;
+                // Stands in for the readers of a whole column.
+                if(row == IDX_UNSET) continue;
+                DrspAtom a = get_cached_cell(&sd->cell_cache, row, col);
+                nerrs += evaluate_and_display_cell(ctx, sd, row, col, !a || a == drsp_nil_atom(), bc);
+            }
+            clear_cell_set(&sd->dirty_cells);
+            continue;
+        }
         sd->dirty = 0;
+        for(size_t c = 0; c < sd->cell_cache.ncolumns; c++){
+            const CellColumn* column = &sd->cell_cache.columns[c];
+            for(intptr_t row = 0; row < column->len; row++){
+                DrspAtom a = column->atoms[row];
+                if(!a) continue;
+                nerrs += evaluate_and_display_cell(ctx, sd, row, c, a == drsp_nil_atom(), bc);
+            }
+        }
         RowColSv* items = (RowColSv*)sd->cell_cache.data;
         for(size_t j = 0; j < sd->cell_cache.n; j++){
             intptr_t row = items[j].rc.row;
             intptr_t col = items[j].rc.col;
-            buff_set(ctx->a, bc);
-            Expression* e;
-            if(items[j].sv == drsp_nil_atom())
-                e = expr_alloc(ctx, EXPR_BLANK);
-            else
-                e = evaluate(ctx, sd, row, col);
-            if(e && e->kind == EXPR_BLANK){
-                if(!has_cached_output_result(&sd->output_result_cache, row, col))
-                    continue;
-            }
-            // benchmarking
-            #ifdef BENCHMARKING
-                for(int i = 0; i < 100000; i++){
-                    buff_set(ctx->a, bc);
-                    e = evaluate(ctx, sd, row, col);
-                }
-            #endif
-            #if 0
-            if(!e){ // OOM, don't cache the result.
-                nerrs++;
-                sp_set_display_error(ctx, sd->handle, row, col, "oom", 3);
-                continue;
-            }
-            #endif
-            if(!e) e = Error(ctx, "oom"); // Error doesn't alloc
-            CachedResult* cr = get_cached_output_result(&sd->output_result_cache, row, col);
-            if(cr){
-                CachedResult tmp_cr;
-                tmp_cr.loc = (RowCol){row, col};
-                int err = expr_to_cached_result(ctx, e, &tmp_cr);
-                if(!err){
-                    if(cached_result_eq_ignoring_loc(cr, &tmp_cr)){
-                        if(tmp_cr.kind == CACHED_RESULT_ERROR)
-                            nerrs++;
-                        continue;
-                    }
-                    *cr = tmp_cr;
-                    // FIXME: If the set display function returns an
-                    // error we need to delete our cache result
-                    // instead of caching.
-                    switch(tmp_cr.kind){
-                        case CACHED_RESULT_NULL:
-                            sp_set_display_string(ctx, sd->handle, row, col, "", 0);
-                            continue;
-                        case CACHED_RESULT_NUMBER:
-                            sp_set_display_number(ctx, sd->handle, row, col, tmp_cr.number);
-                            continue;
-                        case CACHED_RESULT_STRING:
-                            sp_set_display_string(ctx, sd->handle, row, col, tmp_cr.string->data, tmp_cr.string->length);
-                            continue;
-                        default: break;
-                    }
-                    nerrs++;
-                    if(e->kind == EXPR_ERROR){
-                        ErrorExpression* err = (ErrorExpression*)e;
-                        DrspAtom mess = err->message;
-                        sp_set_display_error(ctx, sd->handle, row, col, mess->data, mess->length);
-                    }
-                    else
-                        sp_set_display_error(ctx, sd->handle, row, col, "error (unset)", sizeof "error (unset)" - 1);
-                    continue;
-                }
-            }
-            // Fallback, don't cache the result.
-            // GCOV_EXCL_START
-            switch(e->kind){
-                case EXPR_NUMBER:
-                    sp_set_display_number(ctx, sd->handle, row, col, ((Number*)e)->value);
-                    continue;
-                case EXPR_STRING:
-                    sp_set_display_string(ctx, sd->handle, row, col, ((String*)e)->str->data, ((String*)e)->str->length);
-                    continue;
-                case EXPR_BLANK:
-                    sp_set_display_string(ctx, sd->handle, row, col, "", 0);
-                    continue;
-                default: break;
-            }
-            nerrs++;
-            sp_set_display_error(ctx, sd->handle, row, col, "error (unset)", sizeof "error (unset)" -1 );
-            // GCOV_EXCL_STOP
+            nerrs += evaluate_and_display_cell(ctx, sd, row, col, items[j].sv == drsp_nil_atom(), bc);
         }
+        extra_dimensional:
         for(unsigned i = 0; i < sd->extra_dimensional.count; i++){
             ExtraDimensionalCell* edc = &sd->extra_dimensional.cells[i];
-            buff_set(ctx->a, bc);
             // I don't remember if the row/column matter
             const intptr_t row = IDX_EXTRA_DIMENSIONAL;
             const intptr_t col = edc->id; // "col"
             // TEMP: just eval the string
-            Expression* e = evaluate(ctx, sd, row, col);
+            Expression* e;
+            do {
+                buff_set(ctx->a, bc);
+                e = evaluate(ctx, sd, row, col);
+            }while(evaluate_pending(ctx, &e));
             if(!e){ // OOM
                 nerrs++;
                 sp_set_display_error(ctx, sd->handle, row, col, "oom", 5);
@@ -224,16 +578,19 @@ drsp_evaluate_formulas(DrSpreadCtx* ctx){
             // GCOV_EXCL_STOP
         }
     }
+    for(size_t j = 0; j < njobs; j++)
+        drsp_alloc(jobs[j].capacity*sizeof *jobs[j].results, jobs[j].results, 0, _Alignof(CachedResult));
+    if(jobs) drsp_alloc(njobs*sizeof *jobs, jobs, 0, _Alignof(SheetJob));
+    if(ctx->batch_display) sort_display_updates(ctx);
     buff_set(ctx->a, bc);
+    // Keep one segment around for the next time a big array is built.
+    buff_release_segments(ctx->a, 1);
     return nerrs;
 }
 
 DRSP_EXPORT
 int
 drsp_evaluate_string(DrSpreadCtx* ctx, SheetHandle sheethandle, const char* txt, size_t len, DrSpreadResult* outval, intptr_t row, intptr_t col){
-    #if !defined(__wasm__) && defined(FrameAddress)
-        ctx->limit = FrameAddress() - 300000;
-    #endif
     BuffCheckpoint bc = buff_checkpoint(ctx->a);
     SheetData* sd = sheet_lookup_by_handle(ctx, sheethandle);
     if(!sd) {
@@ -241,7 +598,11 @@ drsp_evaluate_string(DrSpreadCtx* ctx, SheetHandle sheethandle, const char* txt,
         outval->s.length = -1 + sizeof "Invalid sheethandle";
         return 1;
     }
-    Expression* e = evaluate_string(ctx, sd, txt, len, row, col);
+    Expression* e;
+    do {
+        buff_set(ctx->a, bc);
+        e = evaluate_string(ctx, sd, txt, len, row, col);
+    }while(evaluate_pending(ctx, &e));
     int error = 0;
     if(!e){
         error = 1;
@@ -284,9 +645,6 @@ drsp_evaluate_string(DrSpreadCtx* ctx, SheetHandle sheethandle, const char* txt,
 DRSP_EXPORT
 int
 drsp_evaluate_function(DrSpreadCtx* ctx, SheetHandle func, size_t nargs, const StringView*_Null_unspecified targs, DrSpreadResult* outval){
-    #if !defined(__wasm__) && defined(FrameAddress)
-        ctx->limit = FrameAddress() - 300000;
-    #endif
     BuffCheckpoint bc = buff_checkpoint(ctx->a);
     if(nargs > 4) return 1;
     if(nargs && !targs) return 1;
@@ -297,18 +655,23 @@ drsp_evaluate_function(DrSpreadCtx* ctx, SheetHandle func, size_t nargs, const S
     Expression* args[4];
     int error = 0;
     SheetData tmp = {0};
+    Expression* e;
+    retry:
+    buff_set(ctx->a, bc);
     for(size_t i = 0; i < nargs; i++){
         // Having to pass in a sheet data is weird as we end up
         // with access to non-existent sheets...
         // Maybe we should require the caller to pass in a SheetHandle?
-        Expression* e = evaluate_string(ctx, &tmp, targs[i].text, targs[i].length, -2, -2);
+        e = evaluate_string(ctx, &tmp, targs[i].text, targs[i].length, -2, -2);
+        if(evaluate_pending(ctx, &e)) goto retry;
         if(!e || e->kind == EXPR_ERROR){
             error = 1;
             goto finish;
         }
         args[i] = e;
     }
-    Expression* e = call_udf(ctx, udf, nargs, args);
+    e = call_udf(ctx, udf, nargs, args);
+    if(evaluate_pending(ctx, &e)) goto retry;
     if(!e){
         error = 1;
         goto finish;
@@ -341,7 +704,9 @@ drsp_evaluate_function(DrSpreadCtx* ctx, SheetHandle func, size_t nargs, const S
 
 force_inline
 int
-sp_set_display_number(const DrSpreadCtx* ctx, SheetHandle sheet, intptr_t row, intptr_t col, double value){
+sp_set_display_number(DrSpreadCtx* ctx, SheetHandle sheet, intptr_t row, intptr_t col, double value){
+    if(ctx->batch_display)
+        return record_display(ctx, sheet, row, col, (DrSpreadResult){.kind = DRSP_RESULT_NUMBER, .d = value});
     #ifdef DRSPREAD_DIRECT_OPS
         (void)ctx;
         sheet_set_display_number(sheet, row, col, value);
@@ -353,7 +718,9 @@ sp_set_display_number(const DrSpreadCtx* ctx, SheetHandle sheet, intptr_t row, i
 
 force_inline
 int
-sp_set_display_error(const DrSpreadCtx* ctx, SheetHandle sheet, intptr_t row, intptr_t col, const char* errmess, size_t errmess_len){
+sp_set_display_error(DrSpreadCtx* ctx, SheetHandle sheet, intptr_t row, intptr_t col, const char* errmess, size_t errmess_len){
+    if(ctx->batch_display)
+        return record_display(ctx, sheet, row, col, (DrSpreadResult){.kind = DRSP_RESULT_ERROR, .s = {errmess_len, errmess}});
     #ifdef DRSPREAD_DIRECT_OPS
         (void)ctx;
         sheet_set_display_error(sheet, row, col, errmess, errmess_len);
@@ -365,7 +732,9 @@ sp_set_display_error(const DrSpreadCtx* ctx, SheetHandle sheet, intptr_t row, in
 
 force_inline
 int
-sp_set_display_string(const DrSpreadCtx* ctx, SheetHandle sheet, intptr_t row, intptr_t col, const char* txt, size_t len){
+sp_set_display_string(DrSpreadCtx* ctx, SheetHandle sheet, intptr_t row, intptr_t col, const char* txt, size_t len){
+    if(ctx->batch_display)
+        return record_display(ctx, sheet, row, col, (DrSpreadResult){.kind = DRSP_RESULT_STRING, .s = {len, txt}});
     #ifdef DRSPREAD_DIRECT_OPS
         (void)ctx;
         sheet_set_display_string(sheet, row, col, txt, len);
@@ -382,7 +751,9 @@ sp_set_display_string(const DrSpreadCtx* ctx, SheetHandle sheet, intptr_t row, i
 #include "drspread_parse.c"
 #include "drspread_formula_funcs.c"
 #include "drspread_evaluate.c"
+#include "drspread_bytecode.c"
 #include "drspread_types.c"
 #include "drspread_allocators.c"
 #include "drspread_colcache.c"
+#include "drspread_snapshot.c"
 #endif
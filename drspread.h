@@ -100,6 +100,54 @@ DRSP_EXPORT
 int
 drsp_evaluate_formulas(DrSpreadCtx*);
 
+// Sets how many threads drsp_evaluate_formulas uses to evaluate independent
+// sheets at the same time. 0 or 1 (the default) evaluates everything on the
+// calling thread and a negative count uses one thread per cpu. Big sheets
+// are split between the threads as well.
+// The display callbacks are only ever called from the calling thread, in the
+// same order as when evaluating on one thread.
+DRSP_EXPORT
+int
+drsp_set_thread_count(DrSpreadCtx*, int nthreads);
+
+typedef struct DrspDisplayUpdate DrspDisplayUpdate;
+struct DrspDisplayUpdate {
+    SheetHandle sheet;
+    intptr_t row, col;
+    // DRSP_RESULT_NUMBER, DRSP_RESULT_STRING or DRSP_RESULT_ERROR (with the
+    // message in s), matching which display callback would have been called.
+    DrSpreadResult value;
+};
+
+// With batching on, drsp_evaluate_formulas doesn't call the display
+// callbacks and records the new displays instead, which you then get with
+// drsp_get_display_updates and apply in one go. Off by default.
+DRSP_EXPORT
+int
+drsp_set_display_batching(DrSpreadCtx*, int on);
+
+// Sets *updates to the displays recorded by the last drsp_evaluate_formulas
+// and returns how many there are. The updates of a sheet are next to each
+// other and sorted by row, then column. They are valid until the next
+// drsp_evaluate_formulas, the strings as long as the context.
+DRSP_EXPORT
+size_t
+drsp_get_display_updates(DrSpreadCtx*, const DrspDisplayUpdate*_Nullable*_Nonnull updates);
+
+// Zero initialize before the first call to drsp_next_changed.
+typedef struct DrspChangeIter DrspChangeIter;
+struct DrspChangeIter {
+    size_t next;
+};
+
+// Walks the cells whose display changed in the last drsp_evaluate_formulas,
+// in the same order as drsp_get_display_updates (so display batching has to
+// be on). Returns 1 and sets the outputs for the next cell, or returns 0
+// once there are no more.
+DRSP_EXPORT
+int
+drsp_next_changed(DrSpreadCtx*, DrspChangeIter* iter, SheetHandle* sheet, intptr_t* row, intptr_t* col, DrSpreadResult* result);
+
 DRSP_EXPORT
 int
 drsp_evaluate_string(DrSpreadCtx*, SheetHandle sheethandle, const char* txt, size_t len, DrSpreadResult* outval, intptr_t row, intptr_t col);
@@ -156,6 +204,29 @@ DRSP_EXPORT
 int
 drsp_set_cell_atom(DrSpreadCtx*restrict ctx, SheetHandle sheet, intptr_t row, intptr_t col, DrspAtom str);
 
+// Sets n cells at once, the same as calling drsp_set_cell_str for each of
+// them in order, but the sheet is only looked up and marked dirty once and
+// its columns are sized up front. Use this for loading sheets.
+// Stops at the first cell that couldn't be set.
+DRSP_EXPORT
+int
+drsp_set_cells_bulk(DrSpreadCtx*restrict ctx, SheetHandle sheet, size_t n, const intptr_t* rows, const intptr_t* cols, const char*const* texts, const size_t* lengths);
+
+// Same as drsp_set_cells_bulk, for rows [row, row+n) of a column.
+DRSP_EXPORT
+int
+drsp_set_column_bulk(DrSpreadCtx*restrict ctx, SheetHandle sheet, intptr_t col, intptr_t row, size_t n, const char*const* texts, const size_t* lengths);
+
+// Loads delimited text (tsv, etc.) into the sheet, starting at row 0, col 0.
+// Lines are separated by '\n' (a trailing '\r' is dropped) and the cells of
+// a line by sep. Each cell is stripped like drsp_set_cell_str and empty cells
+// are skipped, so this is meant for loading into an empty sheet.
+// There is no quoting.
+// The text is scanned in place, so a host can pass an mmapped file.
+DRSP_EXPORT
+int
+drsp_load_delimited(DrSpreadCtx*restrict ctx, SheetHandle sheet, const char*restrict data, size_t length, char sep);
+
 // Sets the text of a cell that is not actually in the 2d cell grid.
 // Useful for things like summaries.
 DRSP_EXPORT
@@ -210,6 +281,30 @@ DRSP_EXPORT
 int
 drsp_set_function_output(DrSpreadCtx* restrict ctx, SheetHandle function, intptr_t row, intptr_t col);
 
+// Saves the sheets, with their cells, names and the results of the last
+// drsp_evaluate_formulas, so that they can be loaded into a new context
+// without evaluating anything. Sets *data to the snapshot and returns its
+// size, which is 0 on oom. The snapshot belongs to the context and is valid
+// until the next drsp_save_snapshot.
+// The snapshot can only be loaded on the same kind of machine (pointer size,
+// byte order) by the same version of drspread.
+DRSP_EXPORT
+size_t
+drsp_save_snapshot(DrSpreadCtx* ctx, const void*_Nullable*_Nonnull data);
+
+// Loads a snapshot into the sheets of the same names, which must have been
+// created (with drsp_set_sheet_name) and be empty. Parsed formulas aren't
+// saved, so formulas are parsed again when they are next evaluated.
+// The displays of the saved results are set like drsp_evaluate_formulas
+// would (or recorded, if display batching is on).
+// The strings are used in place, so data (an mmapped file, for example)
+// must be 8 byte aligned and outlive the context.
+// Returns 1 if the snapshot is invalid, a sheet is missing or on oom, in
+// which case the sheets could be partially loaded.
+DRSP_EXPORT
+int
+drsp_load_snapshot(DrSpreadCtx* ctx, const void* data, size_t length);
+
 #ifdef __clang__
 #pragma clang assume_nonnull end
 #pragma clang diagnostic pop
@@ -48,36 +48,65 @@ enum {N_RECORDS=10000};
 #define drsp_thread_local _Thread_local
 #endif
 #endif
-drsp_thread_local static AllocationRecord records[N_RECORDS];
-drsp_thread_local static size_t n_records = 0;
+typedef struct AllocationRecords AllocationRecords;
+struct AllocationRecords {
+    size_t count;
+    AllocationRecord items[N_RECORDS];
+};
+drsp_thread_local static AllocationRecords local_records;
+// Worker threads record into the table of the thread that spawned them, as
+// that is where what they allocate gets freed.
+drsp_thread_local static AllocationRecords*_Nullable shared_records;
+static _Bool records_lock;
 #endif
 
+static inline
+void*_Nullable
+drsp_allocation_records(void){
+#ifdef RECORD_ALLOCATIONS
+    return shared_records?shared_records:&local_records;
+#else
+    return NULL;
+#endif
+}
+
+static inline
+void
+drsp_share_allocation_records(void*_Nullable records){
+#ifdef RECORD_ALLOCATIONS
+    shared_records = records;
+#else
+    (void)records;
+#endif
+}
+
 static inline
 int
 drsp_report_leaks(void){
     int leaks = 0;
 #ifdef RECORD_ALLOCATIONS
-    for(size_t i = 0; i < n_records; i++){
-        AllocationRecord* r = &records[i];
+    AllocationRecords* rs = &local_records;
+    for(size_t i = 0; i < rs->count; i++){
+        AllocationRecord* r = &rs->items[i];
         logit("\nleak: %p %zubytes", r->ptr, r->sz);
         dump_bt(r->bt);
         free_bt(r->bt);
         leaks++;
     }
-    n_records = 0;
+    rs->count = 0;
 #endif
     return leaks;
 }
 
+#ifdef RECORD_ALLOCATIONS
 static inline
 void
-drsp_record_allocation(size_t old_sz, const void*_Nullable old, size_t new_sz, size_t alignment, void*_Nullable new_pointer){
-    #ifdef RECORD_ALLOCATIONS
+drsp_record_allocation_(AllocationRecords* rs, size_t old_sz, const void*_Nullable old, size_t new_sz, size_t alignment, void*_Nullable new_pointer){
     // free
     if(!new_sz){
         if(!old_sz && !old) return;
-        for(size_t i = 0; i < n_records; i++){
-            AllocationRecord* r = &records[i];
+        for(size_t i = 0; i < rs->count; i++){
+            AllocationRecord* r = &rs->items[i];
             if(r->ptr == old){
                 if(r->sz != old_sz){
                     logbt("bad free: size mismatch, original: %zu, freed: %zu", r->sz, old_sz);
@@ -86,8 +115,8 @@ drsp_record_allocation(size_t old_sz, const void*_Nullable old, size_t new_sz, s
                     logbt("bad free: align mismatch, original: %zu, freed: %zu", r->align, alignment);
                 }
                 free_bt(r->bt);
-                if(i != --n_records)
-                    *r = records[n_records];
+                if(i != --rs->count)
+                    *r = rs->items[rs->count];
                 return;
             }
         }
@@ -103,10 +132,10 @@ drsp_record_allocation(size_t old_sz, const void*_Nullable old, size_t new_sz, s
             logbt("mallocing zero-sized pointer");
             return;
         }
-        if(n_records == N_RECORDS){
+        if(rs->count == N_RECORDS){
             abort();
         }
-        AllocationRecord* r = &records[n_records++];
+        AllocationRecord* r = &rs->items[rs->count++];
         r->ptr = new_pointer;
         r->sz = new_sz;
         r->align = alignment;
@@ -115,8 +144,8 @@ drsp_record_allocation(size_t old_sz, const void*_Nullable old, size_t new_sz, s
     }
     // realloc
     if(old == new_pointer){
-        for(size_t i = 0; i < n_records; i++){
-            AllocationRecord* r = &records[i];
+        for(size_t i = 0; i < rs->count; i++){
+            AllocationRecord* r = &rs->items[i];
             if(r->ptr == old){
                 if(r->sz != old_sz){
                     logbt("bad realloc: size mismatch, original: %zu, freed: %zu", r->sz, old_sz);
@@ -132,15 +161,15 @@ drsp_record_allocation(size_t old_sz, const void*_Nullable old, size_t new_sz, s
             }
         }
         logbt("bad realloc: pointer not allocated %p %zubytes %zualign", old, old_sz, alignment);
-        AllocationRecord* r = &records[n_records++];
+        AllocationRecord* r = &rs->items[rs->count++];
         r->bt = get_bt();
         r->ptr = new_pointer;
         r->sz = new_sz;
         r->align = alignment;
         return;
     }
-    for(size_t i = 0; i < n_records; i++){
-        AllocationRecord* r = &records[i];
+    for(size_t i = 0; i < rs->count; i++){
+        AllocationRecord* r = &rs->items[i];
         if(r->ptr == old){
             if(r->sz != old_sz){
                 logbt("bad realloc: size mismatch, original: %zu, freed: %zu", r->sz, old_sz);
@@ -157,12 +186,23 @@ drsp_record_allocation(size_t old_sz, const void*_Nullable old, size_t new_sz, s
         }
     }
     logbt("bad realloc: pointer not allocated %p %zubytes %zualign", old, old_sz, alignment);
-    AllocationRecord* r = &records[n_records++];
+    AllocationRecord* r = &rs->items[rs->count++];
     r->bt = get_bt();
     r->ptr = new_pointer;
     r->sz = new_sz;
     r->align = alignment;
     return;
+}
+#endif
+
+static inline
+void
+drsp_record_allocation(size_t old_sz, const void*_Nullable old, size_t new_sz, size_t alignment, void*_Nullable new_pointer){
+    #ifdef RECORD_ALLOCATIONS
+    while(__atomic_test_and_set(&records_lock, __ATOMIC_ACQUIRE))
+        ;
+    drsp_record_allocation_(shared_records?shared_records:&local_records, old_sz, old, new_sz, alignment, new_pointer);
+    __atomic_clear(&records_lock, __ATOMIC_RELEASE);
     #else
     (void)old_sz, (void)old, (void)new_sz, (void)alignment, (void)new_pointer;
     #endif
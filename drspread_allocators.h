@@ -18,6 +18,16 @@ static inline
 int
 drsp_report_leaks(void);
 
+// The table allocations are recorded into (with RECORD_ALLOCATIONS), so that
+// threads spawned to help out can record into the same one.
+static inline
+void*_Nullable
+drsp_allocation_records(void);
+
+static inline
+void
+drsp_share_allocation_records(void*_Nullable records);
+
 
 #define free adsljasdk
 #define realloc akdsjaskd
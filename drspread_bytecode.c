@@ -0,0 +1,291 @@
+//
+// Copyright © 2023-2025, David Priver <david@davidpriver.com>
+//
+#ifndef DRSPREAD_BYTECODE_C
+#define DRSPREAD_BYTECODE_C
+#include "drspread_types.h"
+#include "drspread_bytecode.h"
+#include "drspread_evaluate.h"
+#include "drspread_parse.h"
+#ifdef __clang__
+#pragma clang assume_nonnull begin
+#endif
+
+// Marks formulas we already failed to compile.
+static const BcProgram bc_uncompilable;
+
+typedef struct BcCompiler BcCompiler;
+struct BcCompiler {
+    uint32_t count;
+    BcInstruction code[BC_MAX_INSTRUCTIONS];
+};
+
+static inline
+int
+bc_emit(BcCompiler* c, BcInstruction ins){
+    if(c->count >= BC_MAX_INSTRUCTIONS) return 1;
+    c->code[c->count++] = ins;
+    return 0;
+}
+
+// Emits the code to evaluate e into r[dst]. Registers above dst are free
+// to be used as temporaries.
+static
+int
+bc_compile(BcCompiler* c, Expression* e, unsigned dst, uint8_t flags){
+    if(dst >= BC_MAX_REGISTERS) return 1;
+    switch(e->kind){
+        case EXPR_NUMBER:
+            return bc_emit(c, (BcInstruction){.op = BC_NUMBER, .flags = flags, .dst = dst, .number = ((Number*)e)->value});
+        case EXPR_STRING:
+            return bc_emit(c, (BcInstruction){.op = BC_STRING, .flags = flags, .dst = dst, .atom = ((String*)e)->str});
+        case EXPR_RANGE0D:{
+            Range0D* rng = (Range0D*)e;
+            if(rng->row != (int32_t)rng->row) return 1;
+            return bc_emit(c, (BcInstruction){.op = BC_CELL, .flags = flags, .dst = dst, .row = (int32_t)rng->row, .cell = rng});
+        }
+        case EXPR_RANGE0D_FOREIGN:
+        case EXPR_FUNCTION_CALL:
+        case EXPR_USER_DEFINED_FUNC_CALL:
+            return bc_emit(c, (BcInstruction){.op = BC_EXPR, .flags = flags, .dst = dst, .expr = e});
+        case EXPR_GROUP:
+            return bc_compile(c, ((Group*)e)->expr, dst, flags);
+        case EXPR_BINARY:{
+            Binary* b = (Binary*)e;
+            if(bc_compile(c, b->lhs, dst, flags)) return 1;
+            if(bc_compile(c, b->rhs, dst+1, flags)) return 1;
+            return bc_emit(c, (BcInstruction){.op = BC_BINARY, .kind = (uint8_t)b->op, .flags = flags, .dst = dst, .a = dst, .b = dst+1});
+        }
+        case EXPR_UNARY:{
+            Unary* u = (Unary*)e;
+            BcOp op;
+            switch(u->op){
+                case UN_NEG: op = BC_NEG; break;
+                case UN_NOT: op = BC_NOT; break;
+                // unary plus gives back its operand unevaluated.
+                default: return 1;
+            }
+            if(bc_compile(c, u->expr, dst, flags | BC_FLAG_UNDER_UNARY)) return 1;
+            return bc_emit(c, (BcInstruction){.op = op, .flags = flags, .dst = dst, .a = dst});
+        }
+        // Arrays and ranges are left to evaluate_expr.
+        default:
+            return 1;
+    }
+}
+
+static
+const BcProgram*_Nullable
+compile_formula(DrSpreadCtx* ctx, Expression* root){
+    BcCompiler c;
+    c.count = 0;
+    if(bc_compile(&c, root, 0, 0)) return NULL;
+    // Nothing to gain if it is all just one expression.
+    if(c.count == 1 && c.code[0].op == BC_EXPR) return NULL;
+    BcProgram* prog = linked_arena_alloc(&heap_owner(ctx)->pheap.arena, sizeof *prog + c.count * sizeof *c.code);
+    if(!prog) return NULL;
+    prog->count = c.count;
+    __builtin_memcpy(prog->code, c.code, c.count * sizeof *c.code);
+    return prog;
+}
+
+static
+const BcProgram*_Nullable
+get_formula_program_(DrSpreadCtx* ctx, DrspAtom a);
+
+DRSP_INTERNAL
+const BcProgram*_Nullable
+get_formula_program(DrSpreadCtx* ctx, DrspAtom a){
+    heap_lock(ctx);
+    const BcProgram* prog = get_formula_program_(ctx, a);
+    heap_unlock(ctx);
+    return prog;
+}
+
+static
+const BcProgram*_Nullable
+get_formula_program_(DrSpreadCtx* ctx, DrspAtom a){
+    const BcProgram*_Nullable* slot = cached_program_slot(ctx, a);
+    if(!slot){
+        BuffCheckpoint bc = buff_checkpoint(ctx->a);
+        Expression* e = parse(ctx, a);
+        buff_set(ctx->a, bc);
+        if(!e) return NULL;
+        slot = cached_program_slot(ctx, a);
+        if(!slot) return NULL;
+    }
+    if(!*slot){
+        Expression* root = has_cached_parse(ctx, a);
+        const BcProgram* prog = root?compile_formula(ctx, root):NULL;
+        *slot = prog?prog:&bc_uncompilable;
+    }
+    if(*slot == &bc_uncompilable) return NULL;
+    return *slot;
+}
+
+static inline
+int
+bc_load(Value* v, const Expression* e){
+    switch(e->kind){
+        case EXPR_NUMBER:
+            v->kind = VALUE_NUMBER;
+            v->number = ((const Number*)e)->value;
+            return 0;
+        case EXPR_STRING:
+            v->kind = VALUE_STRING;
+            v->atom = ((const String*)e)->str;
+            return 0;
+        case EXPR_BLANK:
+            v->kind = VALUE_NULL;
+            return 0;
+        default:
+            return 1;
+    }
+}
+
+static inline
+Expression*_Nullable
+bc_error(DrSpreadCtx* ctx, const BcInstruction* ins, Expression*_Nullable e){
+    if(!e) return NULL;
+    if(ins->flags & BC_FLAG_UNDER_UNARY) return Error(ctx, "");
+    // It could be in the buff, which we're about to reset.
+    ctx->error.message = ((ErrorExpression*)e)->message;
+    return &ctx->error.e;
+}
+
+DRSP_INTERNAL
+Expression*_Nullable
+run_program(DrSpreadCtx* ctx, const BcProgram* prog, SheetData* sd, intptr_t caller_row, intptr_t caller_col, _Bool* bail){
+    Value regs[BC_MAX_REGISTERS];
+    BuffCheckpoint bc = buff_checkpoint(ctx->a);
+    Expression* err;
+    const BcInstruction* ins = prog->code;
+    const BcInstruction* end = prog->code + prog->count;
+    for(; ins != end; ins++){
+        Value* dst = &regs[ins->dst];
+        switch(ins->op){
+            case BC_NUMBER:
+                dst->kind = VALUE_NUMBER;
+                dst->number = ins->number;
+                continue;
+            case BC_STRING:
+                dst->kind = VALUE_STRING;
+                dst->atom = ins->atom;
+                continue;
+            case BC_CELL:{
+                intptr_t r = ins->row;
+                r = resolve_row_idx(r, caller_row);
+                intptr_t c;
+                Range0D* cell = ins->cell;
+                if(cell->col_name == drsp_dollar_atom())
+                    c = caller_col;
+                else
+                    c = sp_bound_col_idx(sd, cell->col_name, &cell->col_binding);
+                if(c == IDX_DOLLAR) c = caller_col;
+                if(c == -1){
+                    err = Error(ctx, "column not found");
+                    goto fail;
+                }
+                Expression* e = evaluate(ctx, sd, r, c);
+                if(!e || e->kind == EXPR_ERROR){
+                    err = e;
+                    goto fail;
+                }
+                if(bc_load(dst, e)) goto bailout;
+                buff_set(ctx->a, bc);
+                continue;
+            }
+            case BC_EXPR:{
+                Expression* e = evaluate_expr(ctx, sd, ins->expr, caller_row, caller_col);
+                if(!e || e->kind == EXPR_ERROR){
+                    err = e;
+                    goto fail;
+                }
+                if(bc_load(dst, e)) goto bailout;
+                buff_set(ctx->a, bc);
+                continue;
+            }
+            case BC_BINARY:{
+                const Value* l = &regs[ins->a];
+                const Value* r = &regs[ins->b];
+                if(l->kind == VALUE_NULL || r->kind == VALUE_NULL){
+                    dst->kind = VALUE_NULL;
+                    continue;
+                }
+                BinaryKind op = ins->kind;
+                if(l->kind == VALUE_STRING){
+                    if(r->kind != VALUE_STRING){
+                        err = Error(ctx, "rhs not a string");
+                        goto fail;
+                    }
+                    _Bool cmp;
+                    switch(op){
+                        case BIN_EQ: cmp = l->atom == r->atom; break;
+                        case BIN_NE: cmp = l->atom != r->atom; break;
+                        default:
+                            err = Error(ctx, "only '=' and '!=' supported for strings");
+                            goto fail;
+                    }
+                    dst->kind = VALUE_NUMBER;
+                    dst->number = cmp;
+                    continue;
+                }
+                if(r->kind != VALUE_NUMBER){
+                    err = Error(ctx, "rhs not a number");
+                    goto fail;
+                }
+                double value = double_bin_cmp(op, l->number, r->number);
+                dst->kind = VALUE_NUMBER;
+                dst->number = value;
+                continue;
+            }
+            case BC_NEG:
+            case BC_NOT:{
+                const Value* v = &regs[ins->a];
+                if(v->kind != VALUE_NUMBER){
+                    err = Error(ctx, "");
+                    goto fail;
+                }
+                double d = v->number;
+                dst->kind = VALUE_NUMBER;
+                dst->number = ins->op == BC_NEG? -d : !d;
+                continue;
+            }
+            // GCOV_EXCL_START
+            default:
+                __builtin_trap();
+            // GCOV_EXCL_STOP
+        }
+    }
+    switch(regs[0].kind){
+        case VALUE_NUMBER:{
+            Number* n = expr_alloc(ctx, EXPR_NUMBER);
+            if(!n) return NULL;
+            n->value = regs[0].number;
+            return &n->e;
+        }
+        case VALUE_STRING:{
+            String* s = expr_alloc(ctx, EXPR_STRING);
+            if(!s) return NULL;
+            s->str = regs[0].atom;
+            return &s->e;
+        }
+        default:
+            return expr_alloc(ctx, EXPR_BLANK);
+    }
+
+    fail:
+    err = bc_error(ctx, ins, err);
+    buff_set(ctx->a, bc);
+    return err;
+
+    bailout:
+    *bail = 1;
+    buff_set(ctx->a, bc);
+    return NULL;
+}
+
+#ifdef __clang__
+#pragma clang assume_nonnull end
+#endif
+#endif
@@ -0,0 +1,81 @@
+//
+// Copyright © 2023-2025, David Priver <david@davidpriver.com>
+//
+#ifndef DRSPREAD_BYTECODE_H
+#define DRSPREAD_BYTECODE_H
+#include "drspread_types.h"
+#include <stdint.h>
+
+#ifdef __clang__
+#pragma clang assume_nonnull begin
+#else
+#ifndef _Nullable
+#define _Nullable
+#endif
+#endif
+
+// Formulas made of cell references, literals and operators are compiled
+// to a flat program the first time they are evaluated, so evaluating
+// them doesn't need to clone and walk the expression tree.
+// Anything else in the formula (function calls, foreign references) is
+// kept as an expression and evaluated with evaluate_expr.
+
+TYPED_ENUM(BcOp, uint8_t){
+    BC_NUMBER, // r[dst] = number
+    BC_STRING, // r[dst] = atom
+    BC_CELL,   // r[dst] = cell at (row, cell->col_name) of the current sheet
+    BC_EXPR,   // r[dst] = evaluate_expr(expr)
+    BC_BINARY, // r[dst] = r[a] kind r[b]
+    BC_NEG,    // r[dst] = -r[a]
+    BC_NOT,    // r[dst] = !r[a]
+};
+
+enum {
+    // Errors are replaced by an empty error when they pass through a unary
+    // operator, so the instructions below one are flagged.
+    BC_FLAG_UNDER_UNARY = 0x1,
+};
+
+enum {BC_MAX_REGISTERS = 16, BC_MAX_INSTRUCTIONS = 128};
+
+typedef struct BcInstruction BcInstruction;
+struct BcInstruction {
+    BcOp op;
+    uint8_t kind; // BinaryKind for BC_BINARY
+    uint8_t flags;
+    uint8_t dst, a, b;
+    int32_t row; // BC_CELL, can be IDX_DOLLAR or relative
+    union {
+        double number;
+        DrspAtom atom;
+        Expression* expr;
+        // The node the instruction was compiled from, as that is where the
+        // column is bound.
+        Range0D* cell;
+    };
+};
+
+struct BcProgram {
+    uint32_t count;
+    BcInstruction code[];
+};
+
+// Returns the compiled program for the formula, compiling it the first time.
+// Returns NULL if it can't be compiled, in which case the caller should parse
+// and evaluate it as an expression.
+DRSP_INTERNAL
+const BcProgram*_Nullable
+get_formula_program(DrSpreadCtx* ctx, DrspAtom a);
+
+// Runs the program with the same semantics as evaluate_expr on the
+// expression it was compiled from.
+// If a value that the program can't handle comes up (arrays), this sets
+// *bail and the formula needs to be evaluated as an expression instead.
+DRSP_INTERNAL
+Expression*_Nullable
+run_program(DrSpreadCtx* ctx, const BcProgram* prog, SheetData* sd, intptr_t caller_row, intptr_t caller_col, _Bool* bail);
+
+#ifdef __clang__
+#pragma clang assume_nonnull end
+#endif
+#endif
@@ -5,6 +5,7 @@
 #define DRSPREAD_EVALUATE_C
 #include "drspread_types.h"
 #include "drspread_evaluate.h"
+#include "drspread_bytecode.h"
 #include "drspread_parse.h"
 #include "drspread_utils.h"
 #include "parse_numbers.h"
@@ -12,21 +13,121 @@
 #pragma clang assume_nonnull begin
 #endif
 
+// Caches a circular reference error for the cell while it is being evaluated,
+// so that reading it again from inside its own evaluation hits that instead.
+static inline
+int
+mark_in_progress(DrSpreadCtx* ctx, SheetData* sd, intptr_t row, intptr_t col){
+    DrspAtom message = drsp_atomize(ctx, "circular reference", sizeof "circular reference" - 1);
+    if(!message) return 1;
+    CachedResult* cr = get_cached_output_result(&sd->result_cache, row, col);
+    if(!cr) return 1;
+    cr->kind = CACHED_RESULT_ERROR;
+    cr->string = message;
+    return 0;
+}
+
+// The cell is too deep to evaluate recursively, so it is left for
+// evaluate_pending to evaluate from the top level.
+// Only the first deferred cell of a pass is pushed, so each pending cell is
+// a dependency of the one below it. This is what lets the in progress marker
+// detect cycles that pass through the pending stack.
+static
+Expression*_Nullable
+defer_cell(DrSpreadCtx* ctx, SheetData* sd, intptr_t row, intptr_t col){
+    ctx->ndeferred++;
+    if(ctx->pushed_pending)
+        return Error(ctx, "deferred");
+    PendingCells* p = &ctx->pending;
+    if(p->count == p->capacity){
+        size_t new_cap = p->capacity?p->capacity*2:32;
+        void* data = drsp_alloc(p->capacity*sizeof *p->data, p->data, new_cap*sizeof *p->data, _Alignof(PendingCell));
+        if(!data) return NULL;
+        p->data = data;
+        p->capacity = new_cap;
+    }
+    int err = mark_in_progress(ctx, sd, row, col);
+    if(err) return NULL;
+    p->data[p->count++] = (PendingCell){sd, row, col};
+    ctx->pushed_pending = 1;
+    return Error(ctx, "deferred");
+}
+
+static
+void
+abandon_pending(DrSpreadCtx* ctx){
+    for(size_t i = 0; i < ctx->pending.count; i++){
+        PendingCell* pc = &ctx->pending.data[i];
+        del_cached_output_result(&pc->sd->result_cache, pc->row, pc->col);
+    }
+    ctx->pending.count = 0;
+    ctx->pushed_pending = 0;
+    ctx->no_defer = 0;
+}
+
+DRSP_INTERNAL
+int
+evaluate_pending(DrSpreadCtx* ctx, Expression*_Nullable*_Nonnull result){
+    if(!ctx->pending.count){
+        ctx->pushed_pending = 0;
+        ctx->no_defer = 0;
+        return 0;
+    }
+    if(!*result) goto oom;
+    while(ctx->pending.count){
+        size_t count = ctx->pending.count;
+        PendingCell pc = ctx->pending.data[count-1];
+        del_cached_output_result(&pc.sd->result_cache, pc.row, pc.col);
+        ctx->pushed_pending = 0;
+        BuffCheckpoint bc = buff_checkpoint(ctx->a);
+        Expression* e = evaluate(ctx, pc.sd, pc.row, pc.col);
+        buff_set(ctx->a, bc);
+        if(!e) goto oom;
+        if(ctx->pending.count != count){
+            // It still depends on something deeper, come back to it.
+            int err = mark_in_progress(ctx, pc.sd, pc.row, pc.col);
+            if(err) goto oom;
+            continue;
+        }
+        // Arrays aren't cached, so the retry would just defer it again.
+        if(!has_cached_output_result(&pc.sd->result_cache, pc.row, pc.col))
+            ctx->no_defer = 1;
+        ctx->pending.count--;
+    }
+    ctx->pushed_pending = 0;
+    return 1;
+
+    oom:
+    abandon_pending(ctx);
+    *result = NULL;
+    return 0;
+}
+
+// A range that is the result of a formula can be used by a cell in a different
+// row, so the rows relative to this one need to be made absolute.
+static inline
+void
+resolve_relative_range(Expression* e, intptr_t row){
+    switch(e->kind){
+        case EXPR_RANGE1D_COLUMN:
+        case EXPR_RANGE1D_COLUMN_FOREIGN:{
+            Range1DColumn* rng = (Range1DColumn*)e;
+            rng->row_start = resolve_relative_idx(rng->row_start, row);
+            rng->row_end = resolve_relative_idx(rng->row_end, row);
+        }break;
+        case EXPR_RANGE1D_ROW:
+        case EXPR_RANGE1D_ROW_FOREIGN:{
+            Range1DRow* rng = (Range1DRow*)e;
+            rng->row_idx = resolve_relative_idx(rng->row_idx, row);
+        }break;
+        default:
+            break;
+    }
+}
+
 DRSP_INTERNAL
 Expression*_Nullable
 evaluate(DrSpreadCtx* ctx, SheetData* sd, intptr_t row, intptr_t col){
-    {
-        #ifdef FrameAddress
-        uintptr_t frm = FrameAddress();
-            #ifdef __wasm__
-                uintptr_t limit = 10000;
-                if(frm < limit) return NULL;
-            #else
-                uintptr_t limit = ctx->limit;
-                if(frm < limit) return NULL;
-            #endif
-        #endif
-    }
     // HACK
     if(unlikely(sd->flags & DRSP_SHEET_FLAGS_IS_FUNCTION)){
         for(size_t i = 0; i < arrlen(sd->hacky_func_args); i++){
@@ -39,18 +140,22 @@ evaluate(DrSpreadCtx* ctx, SheetData* sd, intptr_t row, intptr_t col){
     if(row != IDX_EXTRA_DIMENSIONAL)
         if(row < 0 || col < 0 || row >= sd->height || col >= sd->width)
             return expr_alloc(ctx, EXPR_BLANK);
-    const DrspAtom a = sp_cell_atom(sd, row, col);
-    if(a == drsp_nil_atom()) return expr_alloc(ctx, EXPR_BLANK);
-    StringView sv = {a->length, a->data};
-    assert(sv.length);
-    // These `goto`s are a bit unorthodox, but it is basically a switch,
-    // with the ability of cell_number to jump to cell_other
-    // if(!sv.length) goto cell_empty;
-    if(sv.text[0] == '=')
-        goto cell_formula;
-    if((sv.text[0] >= '0' && sv.text[0] <= '9') || sv.text[0] == '.' || sv.text[0] == '-')
-        goto cell_number;
-    goto cell_other;
+    // Out of bounds reads don't need to be recorded as writing there grows
+    // the sheet, which dirties the whole thing.
+    if(ctx->dep_sheet == sd){
+        int err = cell_deps_add(&sd->deps, (RowCol){row, col}, ctx->dep_loc);
+        if(err) return NULL;
+    }
+    CellKind kind;
+    double number;
+    const DrspAtom a = sp_cell_atom(sd, row, col, &kind, &number);
+    // These `goto`s are a bit unorthodox, but it is basically a switch.
+    switch(kind){
+        case CELL_BLANK: return expr_alloc(ctx, EXPR_BLANK);
+        case CELL_FORMULA: goto cell_formula;
+        case CELL_NUMBER: goto cell_number;
+        case CELL_STRING: goto cell_other;
+    }
     /*
     {
         cell_empty:;
@@ -68,45 +173,124 @@ evaluate(DrSpreadCtx* ctx, SheetData* sd, intptr_t row, intptr_t col){
     }
     {
         cell_number:;
-        DoubleResult dr = parse_double(sv.text, sv.length);
-        if(dr.errored) goto cell_other;
-        double value = dr.result;
         Number* n = expr_alloc(ctx, EXPR_NUMBER);
         if(!n) return NULL;
-        n->value = value;
+        n->value = number;
         return &n->e;
     }
     {
         cell_formula:;
-        if(1 && !(sd->flags & DRSP_SHEET_FLAGS_IS_FUNCTION)){
-            CachedResult* cr = has_cached_output_result(&sd->result_cache, row, col);
-            if(cr) return cached_result_to_expr(ctx, cr);
+        const _Bool is_func = !!(sd->flags & DRSP_SHEET_FLAGS_IS_FUNCTION);
+        if(!is_func){
+            const CachedResult* cr = lookup_cached_result(sd, row, col);
+            if(cr){
+                // The cell deferred during this pass is marked, but it isn't
+                // one of our callers so reading it again is not a cycle.
+                if(ctx->pushed_pending){
+                    const PendingCell* pc = &ctx->pending.data[ctx->pending.count-1];
+                    if(pc->sd == sd && pc->row == row && pc->col == col){
+                        ctx->ndeferred++;
+                        return Error(ctx, "deferred");
+                    }
+                }
+                if(cr->kind == CACHED_RESULT_ERROR){
+                    // Every cell that reaches a cycle is an error, even if it
+                    // tries to catch it, so the result doesn't depend on
+                    // which cell of the cycle happened to be evaluated first.
+                    DrspAtom circular = drsp_atomize(ctx, "circular reference", sizeof "circular reference" - 1);
+                    if(!circular) return NULL;
+                    if(cr->string == circular)
+                        ctx->ncircular++;
+                }
+                return cached_result_to_expr(ctx, cr);
+            }
         }
+        if(ctx->depth >= EVAL_MAX_DEPTH) return NULL;
+        if(!is_func && ctx->depth >= EVAL_DEFER_DEPTH && !ctx->no_defer)
+            return defer_cell(ctx, sd, row, col);
+        const DrspAtom formula = canonicalize_formula(ctx, a, row);
+        if(!formula) return NULL;
         BuffCheckpoint bc = buff_checkpoint(ctx->a);
-        Expression *root = parse(ctx, a);
-        if(!root || root->kind == EXPR_ERROR){
+        const BcProgram* prog = get_formula_program(ctx, formula);
+        Expression *root = NULL;
+        if(!prog){
+            root = parse(ctx, formula);
+            if(!root || root->kind == EXPR_ERROR){
+                buff_set(ctx->a, bc);
+                return root;
+            }
+        }
+        // Reading a cell that is still in progress means it is part of a
+        // cycle, so it is marked before we start.
+        if(!is_func){
+            int err = mark_in_progress(ctx, sd, row, col);
+            if(err) return NULL;
+        }
+        SheetData* prev_dep_sheet = ctx->dep_sheet;
+        RowCol prev_dep_loc = ctx->dep_loc;
+        if(!is_func){
+            ctx->dep_sheet = sd;
+            ctx->dep_loc = (RowCol){row, col};
+        }
+        size_t ndeferred = ctx->ndeferred;
+        size_t ncircular = ctx->ncircular;
+        ctx->depth++;
+        Expression *e;
+        _Bool bail = 0;
+        if(prog)
+            e = run_program(ctx, prog, sd, row, col, &bail);
+        if(!prog || bail){
+            if(!root) root = parse(ctx, formula);
+            e = root?evaluate_expr(ctx, sd, root, row, col):NULL;
+        }
+        ctx->depth--;
+        ctx->dep_sheet = prev_dep_sheet;
+        ctx->dep_loc = prev_dep_loc;
+        if(!e || ctx->ndeferred != ndeferred){
+            // Either oom or we depend on a cell that hasn't been computed yet,
+            // so this result can't be kept.
+            if(!is_func)
+                del_cached_output_result(&sd->result_cache, row, col);
             buff_set(ctx->a, bc);
-            return root;
+            if(!e) return NULL;
+            return Error(ctx, "deferred");
         }
-        Expression *e = evaluate_expr(ctx, sd, root, row, col);
-        if(!e || e->kind == EXPR_ERROR) {
+        if(ctx->ncircular != ncircular)
+            e = Error(ctx, "circular reference");
+        if(e->kind == EXPR_ERROR){
+            DrspAtom message = ((ErrorExpression*)e)->message;
             buff_set(ctx->a, bc);
-            return e;
+            if(!is_func){
+                // Errors are cached too, otherwise retrying a deferred cell
+                // would re-walk the whole chain leading to the error.
+                CachedResult* cr = get_cached_output_result(&sd->result_cache, row, col);
+                if(!cr) return NULL;
+                cr->kind = CACHED_RESULT_ERROR;
+                cr->string = message;
+            }
+            ctx->error.message = message;
+            return &ctx->error.e;
         }
         _Alignas(union ExprU) unsigned char tmp[sizeof(union ExprU)];
         ExpressionKind kind = e->kind;
-        if(kind == EXPR_COMPUTED_ARRAY)
+        if(kind == EXPR_COMPUTED_ARRAY || kind == EXPR_NUMBER_ARRAY){
+            if(!is_func)
+                del_cached_output_result(&sd->result_cache, row, col);
             return e;
+        }
         size_t sz = expr_size(kind);
         __builtin_memcpy(tmp, e, sz);
         buff_set(ctx->a, bc);
         Expression* r = expr_alloc(ctx, kind);
         __builtin_memcpy(r, tmp, sz);
-        if(1 && !(sd->flags & DRSP_SHEET_FLAGS_IS_FUNCTION)){
+        resolve_relative_range(r, row);
+        if(!is_func){
+            // The cache could have been rehashed while evaluating, so the
+            // marker has to be looked up again.
             CachedResult* cr = get_cached_output_result(&sd->result_cache, row, col);
             if(cr){
                 int err = expr_to_cached_result_no_array(ctx, r, cr);
-                (void)err;
+                if(err) del_cached_output_result(&sd->result_cache, row, col);
             }
         }
         return r;
@@ -119,33 +303,68 @@ evaluate_string(DrSpreadCtx* ctx, SheetData* sd, const char* txt, size_t len, in
     DrspAtom a = drsp_intern_str(ctx, txt, len);
     Expression *root = parse(ctx, a);
     if(!root || root->kind == EXPR_ERROR) return root;
+    size_t ncircular = ctx->ncircular;
     Expression *e = evaluate_expr(ctx, sd, root, caller_row, caller_col);
+    if(e && ctx->ncircular != ncircular)
+        return Error(ctx, "circular reference");
     return e;
 }
 
-static inline
-double
-double_bin_cmp(BinaryKind op, double l, double r){
-    double value;
-    switch(op){
-        case BIN_ADD: value = l +  r; break;
-        case BIN_SUB: value = l -  r; break;
-        case BIN_MUL: value = l *  r; break;
-        case BIN_DIV: value = l /  r; break;
-        case BIN_LT:  value = l <  r; break;
-        case BIN_LE:  value = l <= r; break;
-        case BIN_GT:  value = l >  r; break;
-        case BIN_GE:  value = l >= r; break;
-        case BIN_EQ:  value = l == r; break;
-        case BIN_NE:  value = l != r; break;
-        // GCOV_EXCL_START
-        default: __builtin_trap();
+// Applies op between each element of an array-like expression and a scalar,
+// which has already been checked to be a string or number. The result is
+// always a NumberArray.
+static
+Expression*_Nullable
+evaluate_array_scalar_op(DrSpreadCtx* ctx, SheetData* sd, BinaryKind op, Expression* arr, Expression* scalar, _Bool array_is_lhs, intptr_t caller_row, intptr_t caller_col){
+    if(scalar->kind == EXPR_NUMBER){
+        Expression* e = convert_to_number_array(ctx, sd, arr, caller_row, caller_col, array_is_lhs?SV("lhs is not a number"):SV("rhs is not a number"));
+        if(!e || e->kind == EXPR_ERROR) return e;
+        NumberArray* na = (NumberArray*)e;
+        double s = ((Number*)scalar)->value;
+        // Blank elements are computed too, but stay masked off.
+        if(array_is_lhs)
+            for(intptr_t i = 0; i < na->length; i++)
+                na->data[i] = double_bin_cmp(op, na->data[i], s);
+        else
+            for(intptr_t i = 0; i < na->length; i++)
+                na->data[i] = double_bin_cmp(op, s, na->data[i]);
+        return e;
     }
-        // GCOV_EXCL_STOP
-    return value;
+    assert(scalar->kind == EXPR_STRING);
+    DrspAtom s = ((String*)scalar)->str;
+    RangeCursor cur;
+    if(range_cursor_init(ctx, sd, arr, &cur, caller_row, caller_col))
+        return Error(ctx, "");
+    NumberArray* na = number_array_alloc(ctx, cur.length);
+    if(!na) return NULL;
+    for(intptr_t i = 0; i < cur.length; i++){
+        BuffCheckpoint bc = buff_checkpoint(ctx->a);
+        Expression* e = range_cursor_get(ctx, &cur, i);
+        if(!e || e->kind == EXPR_ERROR) return e;
+        if(e->kind == EXPR_BLANK){
+            number_array_set_blank(na, i);
+            buff_set(ctx->a, bc);
+            continue;
+        }
+        if(e->kind != EXPR_STRING)
+            return first_element_error(ctx, &cur, i+1, array_is_lhs?Error(ctx, "lhs is not a string"):Error(ctx, "rhs is not a string"));
+        _Bool cmp;
+        switch(op){
+            case BIN_EQ:
+                cmp = ((String*)e)->str == s;
+                break;
+            case BIN_NE:
+                cmp = ((String*)e)->str != s;
+                break;
+            default:
+                return Error(ctx, "only '=' and '!=' supported for strings");
+        }
+        na->data[i] = cmp;
+        buff_set(ctx->a, bc);
+    }
+    return &na->e;
 }
 
-
 // XXX: where are lhs and rhs nullable?
 static inline
 Expression*_Nullable
@@ -166,105 +385,25 @@ evaluate_binary_op(DrSpreadCtx* ctx, SheetData* sd, BinaryKind op, Expression*_N
             if(larraylike && !rarraylike){
                 if(rhs->kind != EXPR_STRING && rhs->kind != EXPR_NUMBER)
                     BAD(Error(ctx, "rhs is not string or number"));
-                lhs = convert_to_computed_array(ctx, sd, lhs, caller_row, caller_col);
-                if(!lhs || lhs->kind == EXPR_ERROR)
-                    BAD(lhs);
-                ComputedArray* l = (ComputedArray*)lhs;
-                if(rhs->kind == EXPR_STRING){
-                    DrspAtom r = ((String*)rhs)->str;
-                    for(intptr_t i = 0; i < l->length; i++){
-                        Expression* e = l->data[i];
-                        if(e->kind == EXPR_BLANK) continue;
-                        if(e->kind != EXPR_STRING)
-                            BAD(Error(ctx, "lhs is not a string"));
-                        _Bool cmp;
-                        DrspAtom s = ((String*)e)->str;
-                        switch(op){
-                            case BIN_EQ:
-                                cmp = s == r;
-                                break;
-                            case BIN_NE:
-                                cmp = s != r;
-                                break;
-                            default:
-                                BAD(Error(ctx, "only '=' and '!=' supported for strings"));
-                        }
-                        Number* n = expr_alloc(ctx, EXPR_NUMBER);
-                        if(!n) return NULL;
-                        n->value = (double)cmp;
-                        l->data[i] = &n->e;
-                    }
-                }
-                else {
-                    assert(rhs->kind == EXPR_NUMBER);
-                    double r = ((Number*)rhs)->value;
-                    for(intptr_t i = 0; i < l->length; i++){
-                        Expression* e = l->data[i];
-                        if(e->kind == EXPR_BLANK) continue;
-                        if(e->kind != EXPR_NUMBER)
-                            BAD(Error(ctx, "lhs is not a number"));
-                        Number* n = (Number*)e;
-                        n->value = double_bin_cmp(op, n->value, r);
-                    }
-                }
-                return lhs;
+                result = evaluate_array_scalar_op(ctx, sd, op, lhs, rhs, 1, caller_row, caller_col);
+                if(!result || result->kind == EXPR_ERROR)
+                    goto cleanup;
+                return result;
             }
             else if(rarraylike && !larraylike){
                 if(lhs->kind != EXPR_STRING && lhs->kind != EXPR_NUMBER)
                     BAD(Error(ctx, "lhs is not string or number"));
-                rhs = convert_to_computed_array(ctx, sd, rhs, caller_row, caller_col);
-                if(!rhs || rhs->kind == EXPR_ERROR)
-                    BAD(rhs);
-                ComputedArray* r = (ComputedArray*)rhs;
-                if(lhs->kind == EXPR_STRING){
-                    DrspAtom l = ((String*)lhs)->str;
-                    for(intptr_t i = 0; i < r->length; i++){
-                        Expression* e = r->data[i];
-                        if(e->kind == EXPR_BLANK) continue;
-                        if(e->kind != EXPR_STRING)
-                            BAD(Error(ctx, "rhs is not a string"));
-                        _Bool cmp;
-                        DrspAtom s = ((String*)e)->str;
-                        switch(op){
-                            case BIN_EQ:
-                                cmp = s == l;
-                                break;
-                            case BIN_NE:
-                                cmp = s != l;
-                                break;
-                            default:
-                                BAD(Error(ctx, "only '=' and '!=' supported for strings"));
-                        }
-                        Number* n = expr_alloc(ctx, EXPR_NUMBER);
-                        if(!n) return NULL;
-                        n->value = (double)cmp;
-                        r->data[i] = &n->e;
-                    }
-                }
-                else {
-                    assert(lhs->kind == EXPR_NUMBER);
-                    double l = ((Number*)lhs)->value;
-                    for(intptr_t i = 0; i < r->length; i++){
-                        Expression* e = r->data[i];
-                        if(e->kind == EXPR_BLANK) continue;
-                        if(e->kind != EXPR_NUMBER)
-                            BAD(Error(ctx, "rhs is not a number"));
-                        Number* n = (Number*)e;
-                        n->value = double_bin_cmp(op, l, n->value);
-                    }
-                }
-                return rhs;
+                result = evaluate_array_scalar_op(ctx, sd, op, rhs, lhs, 0, caller_row, caller_col);
+                if(!result || result->kind == EXPR_ERROR)
+                    goto cleanup;
+                return result;
             }
             else {
                 assert(rarraylike && larraylike);
-                // XXX: we could lazily iterate over the row range, but fuck it.
-                if(rhs->kind == EXPR_RANGE1D_ROW || rhs->kind == EXPR_RANGE1D_ROW_FOREIGN){
-                    rhs = convert_to_computed_array(ctx, sd, rhs, caller_row, caller_col);
-                    if(!rhs || rhs->kind == EXPR_ERROR)
-                        BAD(rhs);
-                }
-                if(lhs->kind != EXPR_COMPUTED_ARRAY && rhs->kind == EXPR_COMPUTED_ARRAY){
-                    // Special case to avoid allocation
+                const _Bool rhs_is_column = rhs->kind == EXPR_RANGE1D_COLUMN || rhs->kind == EXPR_RANGE1D_COLUMN_FOREIGN;
+                // Rows on the rhs are walked the same way as arrays.
+                if(lhs->kind != EXPR_COMPUTED_ARRAY && lhs->kind != EXPR_NUMBER_ARRAY && !rhs_is_column){
+                    // Move the range to the rhs if the op allows it.
                     _Bool can_swap = 0;
                     // Could add swapped binary operands.
                     switch(op){
@@ -285,49 +424,70 @@ evaluate_binary_op(DrSpreadCtx* ctx, SheetData* sd, BinaryKind op, Expression*_N
                         rhs = tmp;
                     }
                 }
-                lhs = convert_to_computed_array(ctx, sd, lhs, caller_row, caller_col);
-                if(!lhs || lhs->kind == EXPR_ERROR)
-                    BAD(lhs);
-                ComputedArray* l = (ComputedArray*)lhs;
-                // XXX: we could lazily iterate over the row range, but fuck it.
-                if(rhs->kind == EXPR_RANGE1D_ROW || rhs->kind == EXPR_RANGE1D_ROW_FOREIGN){
-                    rhs = convert_to_computed_array(ctx, sd, rhs, caller_row, caller_col);
-                    if(!rhs || rhs->kind == EXPR_ERROR)
-                        BAD(rhs);
-                }
-
-                if(rhs->kind == EXPR_COMPUTED_ARRAY){
-                    ComputedArray* r = (ComputedArray*)rhs;
-                    if(l->length != r->length){
+                RangeCursor l;
+                if(range_cursor_init(ctx, sd, lhs, &l, caller_row, caller_col))
+                    BAD(Error(ctx, ""));
+                if(rhs->kind == EXPR_COMPUTED_ARRAY || rhs->kind == EXPR_NUMBER_ARRAY || rhs->kind == EXPR_RANGE1D_ROW || rhs->kind == EXPR_RANGE1D_ROW_FOREIGN){
+                    RangeCursor r;
+                    if(range_cursor_init(ctx, sd, rhs, &r, caller_row, caller_col))
+                        BAD(Error(ctx, ""));
+                    if(l.length != r.length){
                         BAD(Error(ctx, "lhs not same length as rhs"));
                     }
-                    for(intptr_t i = 0; i < l->length; i++){
-                        Expression* e = evaluate_binary_op(ctx, sd, op, l->data[i], r->data[i], caller_row, caller_col);
+                    NumberArray* res = number_array_alloc(ctx, l.length);
+                    if(!res) return NULL;
+                    for(intptr_t i = 0; i < l.length; i++){
+                        BuffCheckpoint ebc = buff_checkpoint(ctx->a);
+                        Expression* le = range_cursor_get(ctx, &l, i);
+                        if(!le || le->kind == EXPR_ERROR)
+                            BAD(le);
+                        Expression* re = range_cursor_get(ctx, &r, i);
+                        if(!re || re->kind == EXPR_ERROR)
+                            BAD(re);
+                        Expression* e = evaluate_binary_op(ctx, sd, op, le, re, caller_row, caller_col);
+                        if(e && e->kind != EXPR_ERROR && e->kind != EXPR_NUMBER && e->kind != EXPR_BLANK)
+                            e = Error(ctx, "");
+                        if(e && e->kind == EXPR_ERROR){
+                            e = first_element_error(ctx, &l, i+1, e);
+                            if(e && e->kind == EXPR_ERROR)
+                                e = first_element_error(ctx, &r, i+1, e);
+                        }
                         if(!e || e->kind == EXPR_ERROR)
                             BAD(e);
-                        l->data[i] = e;
+                        if(e->kind == EXPR_NUMBER)
+                            res->data[i] = ((Number*)e)->value;
+                        else
+                            number_array_set_blank(res, i);
+                        buff_set(ctx->a, ebc);
                     }
-                    return lhs;
+                    return &res->e;
                 }
                 SheetData* rsd = sd;
                 intptr_t col, rstart, rend;
                 if(get_range1dcol(ctx, sd, rhs, &col, &rstart, &rend, &rsd, caller_row, caller_col))
                     BAD(Error(ctx, "Bad Range"));
-                if(rend - rstart +1 != l->length)
+                if(rend - rstart +1 != l.length)
                     BAD(Error(ctx, "lhs not same length as rhs"));
+                NumberArray* res = number_array_alloc(ctx, l.length);
+                if(!res) return NULL;
                 for(intptr_t row = rstart, i = 0; row <= rend; row++, i++){
-                    BuffCheckpoint bc = buff_checkpoint(ctx->a);
-                    Expression* ld = l->data[i];
-                    if(ld->kind == EXPR_BLANK)
+                    BuffCheckpoint ebc = buff_checkpoint(ctx->a);
+                    Expression* ld = range_cursor_get(ctx, &l, i);
+                    if(!ld || ld->kind == EXPR_ERROR) BAD(ld);
+                    if(ld->kind == EXPR_BLANK){
+                        number_array_set_blank(res, i);
+                        buff_set(ctx->a, ebc);
                         continue;
-                    Expression* e = evaluate(ctx, rsd, row, col);
-                    if(!e || e->kind == EXPR_ERROR) BAD(e);
-                    if(ld->kind != e->kind){
-                        BAD(Error(ctx, "lhs not same type as rhs"));
                     }
+                    Expression* e = evaluate(ctx, rsd, row, col);
+                    if(!e) BAD(e);
+                    if(e->kind == EXPR_ERROR)
+                        BAD(first_element_error(ctx, &l, i+1, e));
+                    if(ld->kind != e->kind)
+                        BAD(first_element_error(ctx, &l, i+1, Error(ctx, "lhs not same type as rhs")));
                     if(ld->kind == EXPR_NUMBER){
-                        ((Number*)ld)->value = double_bin_cmp(op, ((Number*)ld)->value, ((Number*)e)->value);
-                        buff_set(ctx->a, bc);
+                        res->data[i] = double_bin_cmp(op, ((Number*)ld)->value, ((Number*)e)->value);
+                        buff_set(ctx->a, ebc);
                         continue;
                     }
                     if(ld->kind == EXPR_STRING){
@@ -340,17 +500,15 @@ evaluate_binary_op(DrSpreadCtx* ctx, SheetData* sd, BinaryKind op, Expression*_N
                                 cmp = ((String*)ld)->str != ((String*)e)->str;
                                 break;
                             default:
-                                BAD(Error(ctx, "only '=' and '!=' supported for strings"));
+                                BAD(first_element_error(ctx, &l, i+1, Error(ctx, "only '=' and '!=' supported for strings")));
                         }
-                        buff_set(ctx->a, bc);
-                        Number* res = expr_alloc(ctx, EXPR_NUMBER);
-                        res->value = cmp;
-                        l->data[i] = &res->e;
+                        res->data[i] = cmp;
+                        buff_set(ctx->a, ebc);
                         continue;
                     }
-                    BAD(Error(ctx, "lhs is not a string or number"));
+                    BAD(first_element_error(ctx, &l, i+1, Error(ctx, "lhs is not a string or number")));
                 }
-                return lhs;
+                return &res->e;
             }
         }
         else {
@@ -415,13 +573,14 @@ evaluate_expr(DrSpreadCtx* ctx, SheetData* sd, Expression* expr, intptr_t caller
         case EXPR_RANGE1D_ROW:
         case EXPR_RANGE1D_ROW_FOREIGN:
         case EXPR_COMPUTED_ARRAY:
+        case EXPR_NUMBER_ARRAY:
         case EXPR_STRING:
             return expr;
         case EXPR_RANGE1D_COLUMN:{
             Range1DColumn* rng = (Range1DColumn*)expr;
             if(rng->row_start == 0 && rng->row_end == -1){
                 // this could be a named cell
-                const NamedCell* cell = get_named_cell(&sd->named_cells, rng->col_name);
+                const NamedCell* cell = sp_bound_named_cell(sd, rng->col_name, &rng->cell_binding);
                 if(cell) return evaluate(ctx, sd, cell->row, cell->col);
             }
             return expr;
@@ -430,13 +589,13 @@ evaluate_expr(DrSpreadCtx* ctx, SheetData* sd, Expression* expr, intptr_t caller
             ForeignRange1DColumn* rng = (ForeignRange1DColumn*)expr;
             if(rng->r.row_start == 0 && rng->r.row_end == -1){
                 // this could be a named cell.
-                SheetData* fsd = sheet_lookup_by_name(ctx, rng->sheet_name);
+                SheetData* fsd = foreign_sheet_lookup(ctx, rng->sheet_name, &rng->binding);
                 if(fsd){
                     if(fsd != sd){
                         int err = sheet_add_dependant(ctx, fsd, sd->handle);
                         if(err) return Error(ctx, "oom");
                     }
-                    const NamedCell* cell = get_named_cell(&fsd->named_cells, rng->r.col_name);
+                    const NamedCell* cell = sp_bound_named_cell(fsd, rng->r.col_name, &rng->r.cell_binding);
                     if(cell) return evaluate(ctx, fsd, cell->row, cell->col);
                 }
             }
@@ -448,19 +607,19 @@ evaluate_expr(DrSpreadCtx* ctx, SheetData* sd, Expression* expr, intptr_t caller
         }
         case EXPR_RANGE0D_FOREIGN:{
             ForeignRange0D* rng = (ForeignRange0D*)expr;
-            SheetData* fsd = sheet_lookup_by_name(ctx, rng->sheet_name);
+            SheetData* fsd = foreign_sheet_lookup(ctx, rng->sheet_name, &rng->binding);
             if(!fsd) return Error(ctx, "");
             if(fsd != sd){
                 int err = sheet_add_dependant(ctx, fsd, sd->handle);
                 if(err) return Error(ctx, "oom");
             }
             intptr_t r = rng->r.row;
-            if(r == IDX_DOLLAR) r = caller_row;
+            r = resolve_row_idx(r, caller_row);
             intptr_t c;
             if(rng->r.col_name == drsp_dollar_atom())
                 c = caller_col;
             else
-                c = sp_name_to_col_idx(fsd, rng->r.col_name);
+                c = sp_bound_col_idx(fsd, rng->r.col_name, &rng->r.col_binding);
             if(c == IDX_DOLLAR) c = caller_col;
             if(c == -1) return Error(ctx, "column not found");
             return evaluate(ctx, fsd, r, c);
@@ -468,12 +627,12 @@ evaluate_expr(DrSpreadCtx* ctx, SheetData* sd, Expression* expr, intptr_t caller
         case EXPR_RANGE0D:{
             Range0D* rng = (Range0D*)expr;
             intptr_t r = rng->row;
-            if(r == IDX_DOLLAR) r = caller_row;
+            r = resolve_row_idx(r, caller_row);
             intptr_t c;
             if(rng->col_name == drsp_dollar_atom())
                 c = caller_col;
             else
-                c = sp_name_to_col_idx(sd, rng->col_name);
+                c = sp_bound_col_idx(sd, rng->col_name, &rng->col_binding);
             if(c == IDX_DOLLAR) c = caller_col;
             if(c == -1) return Error(ctx, "column not found");
             return evaluate(ctx, sd, r, c);
@@ -483,7 +642,7 @@ evaluate_expr(DrSpreadCtx* ctx, SheetData* sd, Expression* expr, intptr_t caller
             return evaluate_binary_op(ctx, sd, b->op, b->lhs, b->rhs, caller_row, caller_col);
         }
         case EXPR_UNARY:{
-            char* chk = ctx->a->cursor;
+            BuffCheckpoint chk = buff_checkpoint(ctx->a);
             Unary* u = (Unary*)expr;
             Expression* v = evaluate_expr(ctx, sd, u->expr, caller_row, caller_col);
             if(!v) return NULL;
@@ -499,7 +658,7 @@ evaluate_expr(DrSpreadCtx* ctx, SheetData* sd, Expression* expr, intptr_t caller
                 default: __builtin_trap();
             }
                 // GCOV_EXCL_STOP
-            ctx->a->cursor = chk;
+            buff_set(ctx->a, chk);
             Number* r = expr_alloc(ctx, EXPR_NUMBER);
             if(!r) return NULL;
             r->value = value;
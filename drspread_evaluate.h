@@ -22,6 +22,14 @@ DRSP_INTERNAL
 Expression*_Nullable
 evaluate(DrSpreadCtx*, SheetData*, intptr_t row, intptr_t col);
 
+// Call after evaluating from the top level (outside of any other evaluation).
+// If cells were deferred because the evaluation got too deep, this evaluates
+// them and returns 1, meaning the top level evaluation needs to be redone.
+// Otherwise returns 0 and leaves *result alone, or sets it to NULL on oom.
+DRSP_INTERNAL
+int
+evaluate_pending(DrSpreadCtx* ctx, Expression*_Nullable*_Nonnull result);
+
 DRSP_INTERNAL
 Expression*_Nullable
 evaluate_string(DrSpreadCtx* ctx, SheetData*, const char* txt, size_t len, intptr_t row, intptr_t col);
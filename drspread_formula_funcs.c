@@ -7,6 +7,7 @@
 #include "drspread_evaluate.h"
 #include "drspread_utils.h"
 #include "drspread_formula_funcs.h"
+#include "drspread_reduce.h"
 #include "parse_numbers.h"
 #include <stdarg.h>
 #ifdef __wasm__
@@ -44,6 +45,128 @@
 #pragma clang assume_nonnull begin
 #endif
 
+// Folds the numbers of col[start..end] into r without evaluating anything,
+// which only works if every cell is a literal or a formula that already has a
+// result.
+// Returns 1 if some cell needs to be evaluated, in which case the caller
+// starts over with evaluate.
+static
+int
+fold_column_cells(DrSpreadCtx* ctx, SheetData* sd, intptr_t col, intptr_t start, intptr_t end, Reducer* r, size_t* nstrings){
+    // The arguments of a user defined function are only visible to evaluate.
+    if(sd->flags & DRSP_SHEET_FLAGS_IS_FUNCTION) return 1;
+    // Out of bounds cells are blank.
+    if(col >= sd->width) return 0;
+    if(end >= sd->height) end = sd->height-1;
+    const CellColumn* column = (size_t)col < sd->cell_cache.ncolumns? &sd->cell_cache.columns[col] : NULL;
+    const intptr_t len = column? column->len : 0;
+    const _Bool record_deps = ctx->dep_sheet == sd;
+    for(intptr_t row = start; row <= end;){
+        // Runs of literal numbers are folded straight out of the column.
+        if(row < len && column->kinds[row] == CELL_NUMBER){
+            const intptr_t limit = end < len? end+1 : len;
+            intptr_t run = row+1;
+            // Eight kinds at a time, as this scan is most of the work.
+            for(; run + 8 <= limit; run += 8){
+                uint64_t kinds;
+                __builtin_memcpy(&kinds, column->kinds+run, sizeof kinds);
+                if(kinds != CELL_NUMBER * 0x0101010101010101u) break;
+            }
+            while(run < limit && column->kinds[run] == CELL_NUMBER)
+                run++;
+            if(record_deps){
+                for(intptr_t i = row; i < run; i++)
+                    if(cell_deps_add(&sd->deps, (RowCol){i, col}, ctx->dep_loc))
+                        return 1;
+            }
+            reducer_push_n(r, column->numbers+row, run-row);
+            row = run;
+            continue;
+        }
+        if(record_deps && cell_deps_add(&sd->deps, (RowCol){row, col}, ctx->dep_loc))
+            return 1;
+        CellKind kind;
+        double number;
+        sp_cell_atom(sd, row, col, &kind, &number);
+        switch(kind){
+            case CELL_BLANK:
+                break;
+            case CELL_NUMBER:
+                reducer_push(r, number);
+                break;
+            case CELL_STRING:
+                ++*nstrings;
+                break;
+            case CELL_FORMULA:{
+                const CachedResult* cr = lookup_cached_result(sd, row, col);
+                // Errors include cells that are in progress, which evaluate
+                // has to report.
+                if(!cr || cr->kind == CACHED_RESULT_ERROR) return 1;
+                if(cr->kind == CACHED_RESULT_NUMBER)
+                    reducer_push(r, cr->number);
+                else if(cr->kind == CACHED_RESULT_STRING)
+                    ++*nstrings;
+                break;
+            }
+        }
+        row++;
+    }
+    return 0;
+}
+
+// Folds the numbers of a column range argument into r and counts the strings
+// for count(). Blanks are skipped.
+// If a cell is itself a range, that is an error with the given message,
+// unless the message is empty.
+// Returns nonzero on failure, with the result to return in *err.
+static
+int
+fold_column_range(DrSpreadCtx* ctx, SheetData* sd, Expression* arg, intptr_t caller_row, intptr_t caller_col, StringView range_error, Reducer* r, size_t* nstrings, Expression*_Nullable*_Nonnull err){
+    intptr_t col, start, end;
+    SheetData* rsd = sd;
+    if(get_range1dcol(ctx, sd, arg, &col, &start, &end, &rsd, caller_row, caller_col) != 0){
+        *err = Error(ctx, "Invalid range");
+        return 1;
+    }
+    const double init = r->lanes[0];
+    *nstrings = 0;
+    if(!fold_column_cells(ctx, rsd, col, start, end, r, nstrings))
+        return 0;
+    reducer_init(r, r->op, init);
+    *nstrings = 0;
+    // NOTE: inclusive range
+    for(intptr_t row = start; row <= end; row++){
+        BuffCheckpoint bc = buff_checkpoint(ctx->a);
+        Expression* e = evaluate(ctx, rsd, row, col);
+        if(!e || e->kind == EXPR_ERROR){
+            *err = e;
+            return 1;
+        }
+        if(range_error.length && evaled_is_not_scalar(e)){
+            *err = Error_(ctx, range_error.text, range_error.length);
+            return 1;
+        }
+        if(e->kind == EXPR_NUMBER)
+            reducer_push(r, ((Number*)e)->value);
+        else if(e->kind == EXPR_STRING)
+            ++*nstrings;
+        buff_set(ctx->a, bc);
+    }
+    return 0;
+}
+
+static inline
+void
+fold_number_array(const NumberArray* na, Reducer* r){
+    if(!na->blank){
+        reducer_push_n(r, na->data, (size_t)na->length);
+        return;
+    }
+    for(intptr_t i = 0; i < na->length; i++)
+        if(!na->blank[i])
+            reducer_push(r, na->data[i]);
+}
+
 DRSP_INTERNAL
 FORMULAFUNC(drsp_sum){
     if(argc != 1) return Error(ctx, "sum() accepts 1 argument");
@@ -61,21 +184,20 @@ FORMULAFUNC(drsp_sum){
             sum += ((Number*)e)->value;
         }
     }
+    else if(arg->kind == EXPR_NUMBER_ARRAY){
+        Reducer r;
+        reducer_init(&r, REDUCE_SUM, 0.);
+        fold_number_array((NumberArray*)arg, &r);
+        sum = reducer_finish(&r);
+    }
     else if(arg->kind == EXPR_RANGE1D_COLUMN || arg->kind == EXPR_RANGE1D_COLUMN_FOREIGN){
-        intptr_t col, start, end;
-        SheetData* rsd = sd;
-        if(get_range1dcol(ctx, sd, arg, &col, &start, &end, &rsd, caller_row, caller_col) != 0)
-            return Error(ctx, "Invalid range");
-        // NOTE: inclusive range
-        for(intptr_t row = start; row <= end; row++){
-            BuffCheckpoint bc = buff_checkpoint(ctx->a);
-            Expression* e = evaluate(ctx, rsd, row, col);
-            if(!e || e->kind == EXPR_ERROR) return e;
-            if(evaled_is_not_scalar(e)) return Error(ctx, "Range to be summed contains range");
-            if(e->kind != EXPR_NUMBER) continue;
-            sum += ((Number*)e)->value;
-            buff_set(ctx->a, bc);
-        }
+        Reducer r;
+        reducer_init(&r, REDUCE_SUM, 0.);
+        size_t nstrings;
+        Expression* err;
+        if(fold_column_range(ctx, sd, arg, caller_row, caller_col, SV("Range to be summed contains range"), &r, &nstrings, &err))
+            return err;
+        sum = reducer_finish(&r);
     }
     else {
         intptr_t row, start, end;
@@ -116,21 +238,20 @@ FORMULAFUNC(drsp_prod){
             prod *= ((Number*)e)->value;
         }
     }
+    else if(arg->kind == EXPR_NUMBER_ARRAY){
+        Reducer r;
+        reducer_init(&r, REDUCE_PROD, 1.);
+        fold_number_array((NumberArray*)arg, &r);
+        prod = reducer_finish(&r);
+    }
     else if(arg->kind == EXPR_RANGE1D_COLUMN || arg->kind == EXPR_RANGE1D_COLUMN_FOREIGN){
-        intptr_t col, start, end;
-        SheetData* rsd = sd;
-        if(get_range1dcol(ctx, sd, arg, &col, &start, &end, &rsd, caller_row, caller_col) != 0)
-            return Error(ctx, "Invalid range");
-        // NOTE: inclusive range
-        for(intptr_t row = start; row <= end; row++){
-            BuffCheckpoint bc = buff_checkpoint(ctx->a);
-            Expression* e = evaluate(ctx, rsd, row, col);
-            if(!e || e->kind == EXPR_ERROR) return e;
-            if(evaled_is_not_scalar(e)) return Error(ctx, "Range input to prod() contains range");
-            if(e->kind != EXPR_NUMBER) continue;
-            prod *= ((Number*)e)->value;
-            buff_set(ctx->a, bc);
-        }
+        Reducer r;
+        reducer_init(&r, REDUCE_PROD, 1.);
+        size_t nstrings;
+        Expression* err;
+        if(fold_column_range(ctx, sd, arg, caller_row, caller_col, SV("Range input to prod() contains range"), &r, &nstrings, &err))
+            return err;
+        prod = reducer_finish(&r);
     }
     else {
         intptr_t row, start, end;
@@ -175,22 +296,22 @@ FORMULAFUNC(drsp_avg){
             count += 1.0;
         }
     }
+    else if(arg->kind == EXPR_NUMBER_ARRAY){
+        Reducer r;
+        reducer_init(&r, REDUCE_SUM, 0.);
+        fold_number_array((NumberArray*)arg, &r);
+        sum = reducer_finish(&r);
+        count = (double)r.count;
+    }
     else if(arg->kind == EXPR_RANGE1D_COLUMN || arg->kind == EXPR_RANGE1D_COLUMN_FOREIGN){
-        intptr_t col, start, end;
-        SheetData* rsd = sd;
-        if(get_range1dcol(ctx, sd, arg, &col, &start, &end, &rsd, caller_row, caller_col) != 0)
-            return Error(ctx, "Invalid range");
-        // NOTE: inclusive range
-        for(intptr_t row = start; row <= end; row++){
-            BuffCheckpoint bc = buff_checkpoint(ctx->a);
-            Expression* e = evaluate(ctx, rsd, row, col);
-            if(!e || e->kind == EXPR_ERROR) return e;
-            if(evaled_is_not_scalar(e)) return Error(ctx, "Range input to avg() contains range");
-            if(e->kind != EXPR_NUMBER) continue;
-            sum += ((Number*)e)->value;
-            count += 1.0;
-            buff_set(ctx->a, bc);
-        }
+        Reducer r;
+        reducer_init(&r, REDUCE_SUM, 0.);
+        size_t nstrings;
+        Expression* err;
+        if(fold_column_range(ctx, sd, arg, caller_row, caller_col, SV("Range input to avg() contains range"), &r, &nstrings, &err))
+            return err;
+        sum = reducer_finish(&r);
+        count = (double)r.count;
     }
     else {
         intptr_t row, start, end;
@@ -232,21 +353,20 @@ FORMULAFUNC(drsp_count){
             count += 1;
         }
     }
+    else if(arg->kind == EXPR_NUMBER_ARRAY){
+        NumberArray* na = (NumberArray*)arg;
+        for(intptr_t i = 0; i < na->length; i++)
+            count += !number_array_is_blank(na, i);
+    }
     else if(arg->kind == EXPR_RANGE1D_COLUMN || arg->kind == EXPR_RANGE1D_COLUMN_FOREIGN){
-        SheetData* rsd = sd;
-        intptr_t col, start, end;
-        if(get_range1dcol(ctx, sd, arg, &col, &start, &end, &rsd, caller_row, caller_col) != 0)
-            return Error(ctx, "Invalid range");
-        // NOTE: inclusive range
-        for(intptr_t row = start; row <= end; row++){
-            BuffCheckpoint bc = buff_checkpoint(ctx->a);
-            Expression* e = evaluate(ctx, rsd, row, col);
-            if(!e || e->kind == EXPR_ERROR) return e;
-            if(e->kind != EXPR_NUMBER && e->kind != EXPR_STRING)
-                continue;
-            count += 1;
-            buff_set(ctx->a, bc);
-        }
+        Reducer r;
+        reducer_init(&r, REDUCE_SUM, 0.);
+        size_t nstrings;
+        Expression* err;
+        if(fold_column_range(ctx, sd, arg, caller_row, caller_col, SV(""), &r, &nstrings, &err))
+            return err;
+        reducer_finish(&r);
+        count = (intptr_t)(r.count + nstrings);
     }
     else {
         SheetData* rsd = sd;
@@ -306,22 +426,20 @@ FORMULAFUNC(drsp_min){
                 v = ((Number*)e)->value;
         }
     }
+    else if(arg->kind == EXPR_NUMBER_ARRAY){
+        Reducer r;
+        reducer_init(&r, REDUCE_MIN, 1e32);
+        fold_number_array((NumberArray*)arg, &r);
+        v = reducer_finish(&r);
+    }
     else if(arg->kind == EXPR_RANGE1D_COLUMN || arg->kind == EXPR_RANGE1D_COLUMN_FOREIGN){
-        SheetData* rsd = sd;
-        intptr_t col, start, end;
-        if(get_range1dcol(ctx, sd, arg, &col, &start, &end, &rsd, caller_row, caller_col) != 0)
-            return Error(ctx, "Invalid range");
-        // NOTE: inclusive range
-        for(intptr_t row = start; row <= end; row++){
-            BuffCheckpoint bc = buff_checkpoint(ctx->a);
-            Expression* e = evaluate(ctx, rsd, row, col);
-            if(!e || e->kind == EXPR_ERROR) return e;
-            if(evaled_is_not_scalar(e)) return Error(ctx, "Range input to min() contains range");
-            if(e->kind != EXPR_NUMBER) continue;
-            if(((Number*)e)->value < v)
-                v = ((Number*)e)->value;
-            buff_set(ctx->a, bc);
-        }
+        Reducer r;
+        reducer_init(&r, REDUCE_MIN, 1e32);
+        size_t nstrings;
+        Expression* err;
+        if(fold_column_range(ctx, sd, arg, caller_row, caller_col, SV("Range input to min() contains range"), &r, &nstrings, &err))
+            return err;
+        v = reducer_finish(&r);
     }
     else {
         SheetData* rsd = sd;
@@ -383,22 +501,20 @@ FORMULAFUNC(drsp_max){
                 v = ((Number*)e)->value;
         }
     }
+    else if(arg->kind == EXPR_NUMBER_ARRAY){
+        Reducer r;
+        reducer_init(&r, REDUCE_MAX, -1e32);
+        fold_number_array((NumberArray*)arg, &r);
+        v = reducer_finish(&r);
+    }
     else if(arg->kind == EXPR_RANGE1D_COLUMN || arg->kind == EXPR_RANGE1D_COLUMN_FOREIGN){
-        SheetData* rsd = sd;
-        intptr_t col, start, end;
-        if(get_range1dcol(ctx, sd, arg, &col, &start, &end, &rsd, caller_row, caller_col) != 0)
-            return Error(ctx, "Invalid range");
-        // NOTE: inclusive range
-        for(intptr_t row = start; row <= end; row++){
-            BuffCheckpoint bc = buff_checkpoint(ctx->a);
-            Expression* e = evaluate(ctx, rsd, row, col);
-            if(!e || e->kind == EXPR_ERROR) return e;
-            if(evaled_is_not_scalar(e)) return Error(ctx, "Range input to max() contains range");
-            if(e->kind != EXPR_NUMBER) continue;
-            if(((Number*)e)->value > v)
-                v = ((Number*)e)->value;
-            buff_set(ctx->a, bc);
-        }
+        Reducer r;
+        reducer_init(&r, REDUCE_MAX, -1e32);
+        size_t nstrings;
+        Expression* err;
+        if(fold_column_range(ctx, sd, arg, caller_row, caller_col, SV("Range input to max() contains range"), &r, &nstrings, &err))
+            return err;
+        v = reducer_finish(&r);
     }
     else {
         SheetData* rsd = sd;
@@ -430,18 +546,11 @@ FORMULAFUNC(drsp_mod){
     Expression* arg = evaluate_expr(ctx, sd, argv[0], caller_row, caller_col);
     if(!arg || arg->kind == EXPR_ERROR) return arg;
     if(expr_is_arraylike(arg)){
-        arg = convert_to_computed_array(ctx, sd, arg, caller_row, caller_col);
+        arg = convert_to_number_array(ctx, sd, arg, caller_row, caller_col, SV("argument to mod() must be a number"));
         if(!arg || arg->kind == EXPR_ERROR) return arg;
-        ComputedArray* c = (ComputedArray*)arg;
-        for(intptr_t i = 0; i < c->length; i++){
-            Expression* e = c->data[i];
-            if(e->kind == EXPR_BLANK)
-                continue;
-            if(e->kind != EXPR_NUMBER)
-                return Error(ctx, "argument to mod() must be a number");
-            Number* n = (Number*)e;
-            n->value = __builtin_floor((n->value - 10)/2);
-        }
+        NumberArray* na = (NumberArray*)arg;
+        for(intptr_t i = 0; i < na->length; i++)
+            na->data[i] = __builtin_floor((na->data[i] - 10)/2);
         return arg;
     }
     else {
@@ -464,18 +573,11 @@ FORMULAFUNC(drsp_floor){
     Expression* arg = evaluate_expr(ctx, sd, argv[0], caller_row, caller_col);
     if(!arg || arg->kind == EXPR_ERROR) return arg;
     if(expr_is_arraylike(arg)){
-        arg = convert_to_computed_array(ctx, sd, arg, caller_row, caller_col);
+        arg = convert_to_number_array(ctx, sd, arg, caller_row, caller_col, SV("argument to floor() must be a number"));
         if(!arg || arg->kind == EXPR_ERROR) return arg;
-        ComputedArray* c = (ComputedArray*)arg;
-        for(intptr_t i = 0; i < c->length; i++){
-            Expression* e = c->data[i];
-            if(e->kind == EXPR_BLANK)
-                continue;
-            if(e->kind != EXPR_NUMBER)
-                return Error(ctx, "argument to floor() must be a number");
-            Number* n = (Number*)e;
-            n->value = __builtin_floor(n->value);
-        }
+        NumberArray* na = (NumberArray*)arg;
+        for(intptr_t i = 0; i < na->length; i++)
+            na->data[i] = __builtin_floor(na->data[i]);
         return arg;
     }
     else {
@@ -496,18 +598,11 @@ FORMULAFUNC(drsp_ceil){
     Expression* arg = evaluate_expr(ctx, sd, argv[0], caller_row, caller_col);
     if(!arg || arg->kind == EXPR_ERROR) return arg;
     if(expr_is_arraylike(arg)){
-        arg = convert_to_computed_array(ctx, sd, arg, caller_row, caller_col);
+        arg = convert_to_number_array(ctx, sd, arg, caller_row, caller_col, SV("argument to ceil() must be a number"));
         if(!arg || arg->kind == EXPR_ERROR) return arg;
-        ComputedArray* c = (ComputedArray*)arg;
-        for(intptr_t i = 0; i < c->length; i++){
-            Expression* e = c->data[i];
-            if(e->kind == EXPR_BLANK)
-                continue;
-            if(e->kind != EXPR_NUMBER)
-                return Error(ctx, "argument to ceil() must be a number");
-            Number* n = (Number*)e;
-            n->value = __builtin_ceil(n->value);
-        }
+        NumberArray* na = (NumberArray*)arg;
+        for(intptr_t i = 0; i < na->length; i++)
+            na->data[i] = __builtin_ceil(na->data[i]);
         return arg;
     }
     else {
@@ -528,18 +623,11 @@ FORMULAFUNC(drsp_trunc){
     Expression* arg = evaluate_expr(ctx, sd, argv[0], caller_row, caller_col);
     if(!arg || arg->kind == EXPR_ERROR) return arg;
     if(expr_is_arraylike(arg)){
-        arg = convert_to_computed_array(ctx, sd, arg, caller_row, caller_col);
+        arg = convert_to_number_array(ctx, sd, arg, caller_row, caller_col, SV("argument to trunc() must be a number"));
         if(!arg || arg->kind == EXPR_ERROR) return arg;
-        ComputedArray* c = (ComputedArray*)arg;
-        for(intptr_t i = 0; i < c->length; i++){
-            Expression* e = c->data[i];
-            if(e->kind == EXPR_BLANK)
-                continue;
-            if(e->kind != EXPR_NUMBER)
-                return Error(ctx, "argument to trunc() must be a number");
-            Number* n = (Number*)e;
-            n->value = __builtin_trunc(n->value);
-        }
+        NumberArray* na = (NumberArray*)arg;
+        for(intptr_t i = 0; i < na->length; i++)
+            na->data[i] = __builtin_trunc(na->data[i]);
         return arg;
     }
     else {
@@ -560,18 +648,11 @@ FORMULAFUNC(drsp_round){
     Expression* arg = evaluate_expr(ctx, sd, argv[0], caller_row, caller_col);
     if(!arg || arg->kind == EXPR_ERROR) return arg;
     if(expr_is_arraylike(arg)){
-        arg = convert_to_computed_array(ctx, sd, arg, caller_row, caller_col);
+        arg = convert_to_number_array(ctx, sd, arg, caller_row, caller_col, SV("argument to round() must be a number"));
         if(!arg || arg->kind == EXPR_ERROR) return arg;
-        ComputedArray* c = (ComputedArray*)arg;
-        for(intptr_t i = 0; i < c->length; i++){
-            Expression* e = c->data[i];
-            if(e->kind == EXPR_BLANK)
-                continue;
-            if(e->kind != EXPR_NUMBER)
-                return Error(ctx, "argument to round() must be a number");
-            Number* n = (Number*)e;
-            n->value = __builtin_round(n->value);
-        }
+        NumberArray* na = (NumberArray*)arg;
+        for(intptr_t i = 0; i < na->length; i++)
+            na->data[i] = __builtin_round(na->data[i]);
         return arg;
     }
     else {
@@ -592,18 +673,11 @@ FORMULAFUNC(drsp_abs){
     Expression* arg = evaluate_expr(ctx, sd, argv[0], caller_row, caller_col);
     if(!arg || arg->kind == EXPR_ERROR) return arg;
     if(expr_is_arraylike(arg)){
-        arg = convert_to_computed_array(ctx, sd, arg, caller_row, caller_col);
+        arg = convert_to_number_array(ctx, sd, arg, caller_row, caller_col, SV("argument to abs() must be a number"));
         if(!arg || arg->kind == EXPR_ERROR) return arg;
-        ComputedArray* c = (ComputedArray*)arg;
-        for(intptr_t i = 0; i < c->length; i++){
-            Expression* e = c->data[i];
-            if(e->kind == EXPR_BLANK)
-                continue;
-            if(e->kind != EXPR_NUMBER)
-                return Error(ctx, "argument to abs() must be a number");
-            Number* n = (Number*)e;
-            n->value = __builtin_fabs(n->value);
-        }
+        NumberArray* na = (NumberArray*)arg;
+        for(intptr_t i = 0; i < na->length; i++)
+            na->data[i] = __builtin_fabs(na->data[i]);
         return arg;
     }
     else {
@@ -624,18 +698,11 @@ FORMULAFUNC(drsp_sqrt){
     Expression* arg = evaluate_expr(ctx, sd, argv[0], caller_row, caller_col);
     if(!arg || arg->kind == EXPR_ERROR) return arg;
     if(expr_is_arraylike(arg)){
-        arg = convert_to_computed_array(ctx, sd, arg, caller_row, caller_col);
+        arg = convert_to_number_array(ctx, sd, arg, caller_row, caller_col, SV("argument to sqrt() must be a number"));
         if(!arg || arg->kind == EXPR_ERROR) return arg;
-        ComputedArray* c = (ComputedArray*)arg;
-        for(intptr_t i = 0; i < c->length; i++){
-            Expression* e = c->data[i];
-            if(e->kind == EXPR_BLANK)
-                continue;
-            if(e->kind != EXPR_NUMBER)
-                return Error(ctx, "argument to sqrt() must be a number");
-            Number* n = (Number*)e;
-            n->value = __builtin_sqrt(n->value);
-        }
+        NumberArray* na = (NumberArray*)arg;
+        for(intptr_t i = 0; i < na->length; i++)
+            na->data[i] = __builtin_sqrt(na->data[i]);
         return arg;
     }
     else {
@@ -666,18 +733,12 @@ FORMULAFUNC(drsp_log){
     }
 
     if(expr_is_arraylike(arg)){
-        arg = convert_to_computed_array(ctx, sd, arg, caller_row, caller_col);
+        arg = convert_to_number_array(ctx, sd, arg, caller_row, caller_col, SV("argument to log() must be a number"));
         if(!arg || arg->kind == EXPR_ERROR) return arg;
-        ComputedArray* c = (ComputedArray*)arg;
-        for(intptr_t i = 0; i < c->length; i++){
-            Expression* e = c->data[i];
-            if(e->kind == EXPR_BLANK)
-                continue;
-            if(e->kind != EXPR_NUMBER)
-                return Error(ctx, "argument to log() must be a number");
-            Number* n = (Number*)e;
-            n->value = __builtin_log(n->value);
-            if(base > 0) n->value /= __builtin_log(base);
+        NumberArray* na = (NumberArray*)arg;
+        for(intptr_t i = 0; i < na->length; i++){
+            na->data[i] = __builtin_log(na->data[i]);
+            if(base > 0) na->data[i] /= __builtin_log(base);
         }
         return arg;
     }
@@ -767,28 +828,37 @@ FORMULAFUNC(drsp_num){
     Expression* arg = evaluate_expr(ctx, sd, argv[0], caller_row, caller_col);
     if(!arg || arg->kind == EXPR_ERROR) return arg;
     if(expr_is_arraylike(arg)){
-        arg = convert_to_computed_array(ctx, sd, arg, caller_row, caller_col);
-        if(!arg || arg->kind == EXPR_ERROR)
+        if(arg->kind == EXPR_NUMBER_ARRAY){
+            NumberArray* na = (NumberArray*)arg;
+            if(na->blank)
+                for(intptr_t i = 0; i < na->length; i++)
+                    if(na->blank[i])
+                        na->data[i] = default_;
+            na->blank = NULL;
             return arg;
-        ComputedArray* cc = (ComputedArray*)arg;
-        for(intptr_t i = 0; i < cc->length; i++){
-            Expression* e = cc->data[i];
+        }
+        RangeCursor cur;
+        if(range_cursor_init(ctx, sd, arg, &cur, caller_row, caller_col))
+            return Error(ctx, "");
+        NumberArray* na = number_array_alloc(ctx, cur.length);
+        if(!na) return NULL;
+        for(intptr_t i = 0; i < cur.length; i++){
+            BuffCheckpoint ebc = buff_checkpoint(ctx->a);
+            Expression* e = range_cursor_get(ctx, &cur, i);
+            if(!e || e->kind == EXPR_ERROR)
+                return e;
+            double value = default_;
             if(e->kind == EXPR_NUMBER)
-                continue;
-            Number* n = expr_alloc(ctx, EXPR_NUMBER);
-            if(!n) return NULL;
-            if(e->kind == EXPR_STRING){
+                value = ((Number*)e)->value;
+            else if(e->kind == EXPR_STRING){
                 String* s = (String*)e;
-                int err = parse_leading_double(s->str->data, s->str->length, &n->value);
-                if(!err){
-                    cc->data[i] = &n->e;
-                    continue;
-                }
+                if(parse_leading_double(s->str->data, s->str->length, &value) != 0)
+                    value = default_;
             }
-            n->value = default_;
-            cc->data[i] = &n->e;
+            buff_set(ctx->a, ebc);
+            na->data[i] = value;
         }
-        return arg;
+        return &na->e;
     }
     else {
         double value;
@@ -813,9 +883,13 @@ DRSP_INTERNAL
 FORMULAFUNC(drsp_try){
     if(argc != 2) return Error(ctx, "try() requires 2 arguments");
     BuffCheckpoint bc = buff_checkpoint(ctx->a);
+    size_t ndeferred = ctx->ndeferred;
+    size_t ncircular = ctx->ncircular;
     Expression* arg = evaluate_expr(ctx, sd, argv[0], caller_row, caller_col);
     if(!arg) return NULL;
     if(arg->kind != EXPR_ERROR) return arg;
+    // Deferred cells will be retried later and cycles can't be caught.
+    if(ctx->ndeferred != ndeferred || ctx->ncircular != ncircular) return arg;
     buff_set(ctx->a, bc);
     return evaluate_expr(ctx, sd, argv[1], caller_row, caller_col);
 }
@@ -987,8 +1061,10 @@ FORMULAFUNC(drsp_col){
     if(sheetname && sheetname->length){
         ForeignRange1DColumn* result = expr_alloc(ctx, EXPR_RANGE1D_COLUMN_FOREIGN);
         if(!result) return NULL;
+        result->r.col_binding = result->r.cell_binding = 0;
         result->r.col_name = colname;
         result->sheet_name = sheetname;
+        result->binding = 0;
         result->r.row_start = rowstart;
         result->r.row_end = rowend;
         return &result->e;
@@ -996,6 +1072,7 @@ FORMULAFUNC(drsp_col){
     else {
         Range1DColumn* result = expr_alloc(ctx, EXPR_RANGE1D_COLUMN);
         if(!result) return NULL;
+        result->col_binding = result->cell_binding = 0;
         result->col_name = colname;
         result->row_end = rowend;
         result->row_start = rowstart;
@@ -1062,15 +1139,18 @@ FORMULAFUNC(drsp_row){
     if(sheetname){
         ForeignRange1DRow* result = expr_alloc(ctx, EXPR_RANGE1D_ROW_FOREIGN);
         if(!result) return NULL;
+        result->r.start_binding = result->r.end_binding = 0;
         result->r.col_start = startcol;
         result->r.col_end = endcol;
         result->r.row_idx = row_idx;
         result->sheet_name = sheetname;
+        result->binding = 0;
         return &result->e;
     }
     else {
         Range1DRow* result = expr_alloc(ctx, EXPR_RANGE1D_ROW);
         if(!result) return NULL;
+        result->start_binding = result->end_binding = 0;
         result->col_start = startcol;
         result->col_end = endcol;
         result->row_idx = row_idx;
@@ -1111,48 +1191,38 @@ FORMULAFUNC(drsp_pow){
     Expression* arg = evaluate_expr(ctx, sd, argv[0], caller_row, caller_col);
     if(!arg || arg->kind == EXPR_ERROR) return arg;
     if(expr_is_arraylike(arg)){
-        arg = convert_to_computed_array(ctx, sd, arg, caller_row, caller_col);
+        arg = convert_to_number_array(ctx, sd, arg, caller_row, caller_col, SV("argument 1 to pow() must be a number"));
         if(!arg || arg->kind == EXPR_ERROR) return arg;
-        BuffCheckpoint bc = buff_checkpoint(ctx->a);
         Expression* arg2 = evaluate_expr(ctx, sd, argv[1], caller_row, caller_col);
         if(!arg2 || arg2->kind == EXPR_ERROR) return arg;
-        ComputedArray* c = (ComputedArray*)arg;
+        NumberArray* na = (NumberArray*)arg;
         if(arg2->kind == EXPR_NUMBER){
             double exp = ((Number*)arg2)->value;
-            for(intptr_t i = 0; i < c->length; i++){
-                Expression* e = c->data[i];
-                if(e->kind == EXPR_BLANK) continue;
-                if(e->kind != EXPR_NUMBER)
-                    return Error(ctx, "argument 1 to pow() must be a number");
-                Number* n = (Number*)e;
-                n->value = __builtin_pow(n->value, exp);
-            }
+            for(intptr_t i = 0; i < na->length; i++)
+                na->data[i] = __builtin_pow(na->data[i], exp);
         }
         else if(expr_is_arraylike(arg2)){
-            arg2 = convert_to_computed_array(ctx, sd, arg2, caller_row, caller_col);
-            if(!arg2 || arg2->kind == EXPR_BLANK)
-                return arg2;
-            ComputedArray* exps = (ComputedArray*)arg2;
-            if(c->length != exps->length)
+            RangeCursor exps;
+            if(range_cursor_init(ctx, sd, arg2, &exps, caller_row, caller_col))
+                return Error(ctx, "");
+            if(na->length != exps.length)
                 return Error(ctx, "both arguments to pow() must have the same length");
-            for(intptr_t i = 0; i < c->length; i++){
-                Expression* base = c->data[i];
-                Expression* ex = exps->data[i];
-                if(base->kind == EXPR_BLANK)
+            for(intptr_t i = 0; i < na->length; i++){
+                if(number_array_is_blank(na, i))
                     continue;
-                if(base->kind != EXPR_NUMBER)
-                    return Error(ctx, "argument 1 to pow() must be a number");
+                BuffCheckpoint ebc = buff_checkpoint(ctx->a);
+                Expression* ex = range_cursor_get(ctx, &exps, i);
+                if(!ex || ex->kind == EXPR_ERROR)
+                    return ex;
                 if(ex->kind != EXPR_NUMBER)
                     return Error(ctx, "argument 2 to pow() must be a number");
-                Number* n = (Number*)base;
-                double ex_ = ((Number*)ex)->value;
-                n->value = __builtin_pow(n->value, ex_);
+                na->data[i] = __builtin_pow(na->data[i], ((Number*)ex)->value);
+                buff_set(ctx->a, ebc);
             }
         }
         else {
             return Error(ctx, "argument 2 to pow() must be a number");
         }
-        buff_set(ctx->a, bc);
         return arg;
     }
     else {
@@ -1189,7 +1259,6 @@ FORMULAFUNC(drsp_cat){
         if(expr_is_arraylike(arg)){
             arg = convert_to_computed_array(ctx, sd, arg, caller_row, caller_col);
             if(!arg || arg->kind == EXPR_ERROR) return arg;
-            BuffCheckpoint bc = buff_checkpoint(ctx->a);
             Expression* arg2 = evaluate_expr(ctx, sd, argv[1], caller_row, caller_col);
             if(!arg2 || arg2->kind == EXPR_ERROR) return arg;
             ComputedArray* c = (ComputedArray*)arg;
@@ -1211,22 +1280,27 @@ FORMULAFUNC(drsp_cat){
                     }
                     if(e->kind != EXPR_STRING)
                         return Error(ctx, "argument 1 to cat() must be a string");
-                    String* s = (String*)e;
-                    catbuff[0] = s->str;
+                    // Elements can be shared with the parsed expression,
+                    // so write a new one.
+                    String* s = expr_alloc(ctx, EXPR_STRING);
+                    if(!s) return NULL;
+                    catbuff[0] = ((String*)e)->str;
                     int err = sv_cat(ctx, 2, catbuff, &s->str);
                     if(err) return Error(ctx, "oom");
+                    c->data[i] = &s->e;
                 }
             }
             else if(expr_is_arraylike(arg2)){
-                arg2 = convert_to_computed_array(ctx, sd, arg2, caller_row, caller_col);
-                if(!arg2 || arg2->kind == EXPR_ERROR)
-                    return arg2;
-                ComputedArray* rights = (ComputedArray*)arg2;
-                if(c->length != rights->length)
+                RangeCursor rights;
+                if(range_cursor_init(ctx, sd, arg2, &rights, caller_row, caller_col))
+                    return Error(ctx, "");
+                if(c->length != rights.length)
                     return Error(ctx, "arguments to cat() must be the same length");
                 for(intptr_t i = 0; i < c->length; i++){
                     Expression* l = c->data[i];
-                    Expression* r = rights->data[i];
+                    Expression* r = range_cursor_get(ctx, &rights, i);
+                    if(!r || r->kind == EXPR_ERROR)
+                        return r;
                     if(l->kind != EXPR_BLANK && l->kind != EXPR_STRING)
                         return Error(ctx, "argument 1 to cat() must be a string");
                     if(r->kind != EXPR_BLANK && r->kind != EXPR_STRING)
@@ -1239,17 +1313,18 @@ FORMULAFUNC(drsp_cat){
                         continue;
                     assert(l->kind == EXPR_STRING);
                     assert(r->kind == EXPR_STRING);
-                    String* s = (String*)l;
-                    catbuff[0] = s->str;
+                    String* s = expr_alloc(ctx, EXPR_STRING);
+                    if(!s) return NULL;
+                    catbuff[0] = ((String*)l)->str;
                     catbuff[1] = ((String*)r)->str;
                     int err = sv_cat(ctx, 2, catbuff, &s->str);
                     if(err) return Error(ctx, "oom");
+                    c->data[i] = &s->e;
                 }
             }
             else {
                 return Error(ctx, "argument 2 to cat() must be a string");
             }
-            buff_set(ctx->a, bc);
             return arg;
         }
         else {
@@ -1274,10 +1349,12 @@ FORMULAFUNC(drsp_cat){
                     if(e->kind != EXPR_STRING)
                         return Error(ctx, "argument 2 to cat() must be a string");
                     if(arg->kind == EXPR_BLANK) continue;
-                    String* s = (String*)e;
-                    catbuff[1] = s->str;
+                    String* s = expr_alloc(ctx, EXPR_STRING);
+                    if(!s) return NULL;
+                    catbuff[1] = ((String*)e)->str;
                     int err = sv_cat(ctx, 2, catbuff, &s->str);
                     if(err) return Error(ctx, "oom");
+                    c->data[i] = &s->e;
                 }
                 return arg2;
             }
@@ -1320,27 +1397,29 @@ FORMULAFUNC(drsp_cat){
         }
     }
     else {
+        // Evaluated into our own array as argv is part of the parsed
+        // expression.
+        Expression* args[arrlen(catbuff)];
+        RangeCursor cursors[arrlen(catbuff)];
         _Bool is_arraylike = false;
         intptr_t column_length = 0;
         for(int i = 0; i < argc; i++){
-            argv[i] = evaluate_expr(ctx, sd, argv[i], caller_row, caller_col);
-            if(!argv[i] || argv[i]->kind == EXPR_ERROR){
+            args[i] = evaluate_expr(ctx, sd, argv[i], caller_row, caller_col);
+            if(!args[i] || args[i]->kind == EXPR_ERROR){
                 buff_set(ctx->a, bc);
-                return argv[i];
+                return args[i];
             }
-            if(expr_is_arraylike(argv[i])){
+            if(expr_is_arraylike(args[i])){
                 is_arraylike = true;
-                argv[i] = convert_to_computed_array(ctx, sd, argv[i], caller_row, caller_col);
-                if(!argv[i] || argv[i]->kind == EXPR_ERROR){
+                if(range_cursor_init(ctx, sd, args[i], &cursors[i], caller_row, caller_col)){
                     buff_set(ctx->a, bc);
-                    return argv[i];
+                    return Error(ctx, "");
                 }
-                ComputedArray* c = (ComputedArray*)argv[i];
-                if(c->length > column_length){
-                    column_length = c->length;
+                if(cursors[i].length > column_length){
+                    column_length = cursors[i].length;
                 }
             }
-            else if(argv[i]->kind != EXPR_STRING && argv[i]->kind != EXPR_BLANK){
+            else if(args[i]->kind != EXPR_STRING && args[i]->kind != EXPR_BLANK){
                 buff_set(ctx->a, bc);
                 return Error(ctx, "arguments to cat() must be a string");
             }
@@ -1351,8 +1430,11 @@ FORMULAFUNC(drsp_cat){
             ComputedArray* result = computed_array_alloc(ctx, column_length);
             if(!result) return Error(ctx, "oom");
             for(intptr_t r = 0; r < column_length; r++){
+                // The strings are interned, so the elements can be
+                // discarded once we have them.
+                BuffCheckpoint rbc = buff_checkpoint(ctx->a);
                 for(int i = 0; i < argc; i++){
-                    Expression* e = argv[i];
+                    Expression* e = args[i];
                     if(e->kind == EXPR_STRING){
                         catbuff[i] = ((String*)e)->str;
                     }
@@ -1360,12 +1442,13 @@ FORMULAFUNC(drsp_cat){
                         catbuff[i] = drsp_nil_atom();
                     }
                     else {
-                        ComputedArray* c = (ComputedArray*)argv[i];
-                        if(r >= c->length){
+                        if(r >= cursors[i].length){
                             catbuff[i] = drsp_nil_atom();
                         }
                         else {
-                            Expression* item = c->data[r];
+                            Expression* item = range_cursor_get(ctx, &cursors[i], r);
+                            if(!item || item->kind == EXPR_ERROR)
+                                return item;
                             if(item->kind == EXPR_STRING){
                                 catbuff[i] = ((String*)item)->str;
                             }
@@ -1379,6 +1462,7 @@ FORMULAFUNC(drsp_cat){
                         }
                     }
                 }
+                buff_set(ctx->a, rbc);
                 String* s = expr_alloc(ctx, EXPR_STRING);
                 if(!s) return NULL;
                 int err = sv_cat(ctx, argc, catbuff, &s->str);
@@ -1392,7 +1476,7 @@ FORMULAFUNC(drsp_cat){
         }
         else {
             for(int i = 0; i < argc; i++){
-                Expression* e = argv[i];
+                Expression* e = args[i];
                 if(e->kind == EXPR_BLANK){
                     catbuff[i] = drsp_nil_atom();
                 }
@@ -1412,9 +1496,33 @@ FORMULAFUNC(drsp_cat){
     }
 }
 
+// Binary searches a haystack that is sorted in ascending order for the last
+// number that is <= needle and stores its offset, or -1 if there isn't one.
+// Anything that isn't a number sorts after the numbers, so a range can
+// run past the end of the table into blanks.
+// Returns 1 on oom.
+static
+int
+sorted_lookup(DrSpreadCtx* ctx, const RangeCursor* cur, double needle, intptr_t* offset){
+    // Invariant: everything before lo is <= needle and nothing from hi on is.
+    intptr_t lo = 0, hi = cur->length;
+    BuffCheckpoint bc = buff_checkpoint(ctx->a);
+    while(lo < hi){
+        intptr_t mid = lo + (hi - lo) / 2;
+        Expression* e = range_cursor_get(ctx, cur, mid);
+        if(!e) return 1;
+        _Bool le = e->kind == EXPR_NUMBER && ((Number*)e)->value <= needle;
+        buff_set(ctx->a, bc);
+        if(le) lo = mid + 1;
+        else hi = mid;
+    }
+    *offset = lo - 1;
+    return 0;
+}
+
 static inline
 Expression*_Nullable
-arraylike_tablelookup(DrSpreadCtx* ctx, SheetData* sd, intptr_t caller_row, intptr_t caller_col, Expression* needle, int argc, Expression*_Nonnull*_Nonnull argv){
+arraylike_tablelookup(DrSpreadCtx* ctx, SheetData* sd, intptr_t caller_row, intptr_t caller_col, Expression* needle, int argc, Expression*_Nonnull*_Nonnull argv, _Bool sorted){
     needle = convert_to_computed_array(ctx, sd, needle, caller_row, caller_col);
     if(!needle || needle->kind == EXPR_ERROR)
         return needle;
@@ -1429,14 +1537,17 @@ arraylike_tablelookup(DrSpreadCtx* ctx, SheetData* sd, intptr_t caller_row, intp
     if(!haystack || haystack->kind == EXPR_ERROR)
         return haystack;
     ComputedArray* chaystack = (ComputedArray*)haystack;
+    RangeCursor chay;
+    if(sorted && range_cursor_init(ctx, sd, haystack, &chay, caller_row, caller_col))
+        return Error(ctx, "");
     argc--, argv++;
     Expression* values = evaluate_expr(ctx, sd, argv[0], caller_row, caller_col);
     if(!values || values->kind == EXPR_ERROR)
         return values;
-    values = convert_to_computed_array(ctx, sd, values, caller_row, caller_col);
-    if(!values || values->kind == EXPR_ERROR)
-        return values;
-    ComputedArray* cvalues = (ComputedArray*)values;
+    // Only the values that are looked up are evaluated.
+    RangeCursor cvalues;
+    if(!expr_is_arraylike(values) || range_cursor_init(ctx, sd, values, &cvalues, caller_row, caller_col))
+        return Error(ctx, "");
     argc--, argv++;
     Expression* default_ = NULL;
     for(intptr_t i = 0; i < cneedle->length; i++){
@@ -1449,7 +1560,14 @@ arraylike_tablelookup(DrSpreadCtx* ctx, SheetData* sd, intptr_t caller_row, intp
         intptr_t idx;
         const intptr_t haylength = chaystack->length;
         Expression*_Nonnull* data = chaystack->data;
-        if(nkind == EXPR_NUMBER){
+        if(sorted){
+            if(nkind != EXPR_NUMBER)
+                return Error(ctx, "argument 1 to stlu() must be a number");
+            if(sorted_lookup(ctx, &chay, ((Number*)n)->value, &idx))
+                return NULL;
+            if(idx < 0) idx = haylength;
+        }
+        else if(nkind == EXPR_NUMBER){
             double d = ((Number*)n)->value;
             for(idx = 0; idx < haylength; idx++){
                 const Expression* h = data[idx];
@@ -1468,7 +1586,10 @@ arraylike_tablelookup(DrSpreadCtx* ctx, SheetData* sd, intptr_t caller_row, intp
             }
         }
         if(idx == haylength){
-            if(!argc) return Error(ctx, "needle (argument 1) not found in haystack (argument 2) in tlu()");
+            if(!argc){
+                if(sorted) return Error(ctx, "needle (argument 1) not found in haystack (argument 2) in stlu()");
+                return Error(ctx, "needle (argument 1) not found in haystack (argument 2) in tlu()");
+            }
             if(!default_){
                 default_ = evaluate_expr(ctx, sd, argv[0], caller_row, caller_col);
                 if(!default_ || default_ == EXPR_ERROR) return default_;
@@ -1476,18 +1597,75 @@ arraylike_tablelookup(DrSpreadCtx* ctx, SheetData* sd, intptr_t caller_row, intp
             }
         }
         else {
-            if(idx >= cvalues->length)
+            if(idx >= cvalues.length){
+                if(sorted) return Error(ctx, "position of needle in haystack outside the bounds of values in stlu()");
                 return Error(ctx, "position of needle in haystack outside the bounds of values in tlu()");
-            cneedle->data[i] = cvalues->data[idx];
+            }
+            Expression* v = range_cursor_get(ctx, &cvalues, idx);
+            if(!v || v->kind == EXPR_ERROR)
+                return v;
+            cneedle->data[i] = v;
         }
     }
     return needle;
 }
 
-DRSP_INTERNAL
-FORMULAFUNC(drsp_tablelookup){
-    // "needle", [haystack], [values]
-    if(argc != 3 && argc != 4) return Error(ctx, "tlu() requires 3 or 4 arguments");
+// Finds the first row of the column range whose value is the needle and
+// stores its offset from start, or -1 if there isn't one.
+// The rows whose values are already known are looked up in the column's
+// index, the rest are evaluated in order like a plain scan would.
+// Returns 1 on oom.
+static
+int
+column_lookup(DrSpreadCtx* ctx, SheetData* sd, intptr_t col, intptr_t start, intptr_t end, ExpressionKind nkind, double d, DrspAtom _Nullable s, intptr_t* offset){
+    *offset = -1;
+    intptr_t row = start;
+    ColumnIndex* ci = col >= 0 && col < sd->width? get_column_index(ctx, sd, col) : NULL;
+    if(ci){
+        // Any change to the column could change which row matches.
+        if(ctx->dep_sheet == sd && cell_deps_add(&sd->deps, (RowCol){IDX_UNSET, col}, ctx->dep_loc))
+            return 1;
+        uint64_t key = nkind == EXPR_NUMBER? column_index_number_key(d) : nkind == EXPR_STRING? (uintptr_t)s : 0;
+        const ColumnIndexEntry* ent = column_index_find(ci, nkind, key);
+        if(ent){
+            intptr_t r = ent->first;
+            while(r >= 0 && r < start)
+                r = ci->next[r];
+            if(r >= 0){
+                if(r <= end) *offset = r - start;
+                return 0;
+            }
+        }
+        if(row < ci->nrows) row = ci->nrows;
+        // Past the end of the sheet everything is blank.
+        if(row >= sd->height){
+            if(nkind == EXPR_BLANK && row <= end)
+                *offset = row - start;
+            return 0;
+        }
+        if(nkind != EXPR_BLANK && end >= sd->height)
+            end = sd->height - 1;
+    }
+    BuffCheckpoint bc = buff_checkpoint(ctx->a);
+    for(; row <= end; buff_set(ctx->a, bc), row++){
+        Expression* e = evaluate(ctx, sd, row, col);
+        if(!e) return 1;
+        if(e->kind != nkind) continue;
+        if(nkind == EXPR_BLANK
+        || (nkind == EXPR_STRING && s == ((String*)e)->str)
+        || (nkind == EXPR_NUMBER && d == ((Number*)e)->value)){
+            *offset = row - start;
+            break;
+        }
+    }
+    buff_set(ctx->a, bc);
+    return 0;
+}
+
+// The body of tlu() and stlu(), which differ in how the haystack is searched.
+static
+Expression*_Nullable
+tablelookup(DrSpreadCtx* ctx, SheetData* sd, intptr_t caller_row, intptr_t caller_col, int argc, Expression*_Nonnull*_Nonnull argv, _Bool sorted){
     BuffCheckpoint bc = buff_checkpoint(ctx->a);
     ExpressionKind nkind;
     union {
@@ -1498,7 +1676,7 @@ FORMULAFUNC(drsp_tablelookup){
         Expression* needle = evaluate_expr(ctx, sd, argv[0], caller_row, caller_col);
         if(!needle || needle->kind == EXPR_ERROR) return needle;
         if(expr_is_arraylike(needle))
-            return arraylike_tablelookup(ctx, sd, caller_row, caller_col, needle, argc-1, argv+1);
+            return arraylike_tablelookup(ctx, sd, caller_row, caller_col, needle, argc-1, argv+1, sorted);
         nkind = needle->kind;
         if(nkind == EXPR_BLANK){
             if(argc == 4){
@@ -1506,6 +1684,7 @@ FORMULAFUNC(drsp_tablelookup){
             }
         }
         if(nkind != EXPR_NUMBER && nkind != EXPR_STRING) return Error(ctx, "argument 1 to tlu() must be a number or string");
+        if(sorted && nkind != EXPR_NUMBER) return Error(ctx, "argument 1 to stlu() must be a number");
         if(nkind == EXPR_NUMBER)
             nval.d = ((Number*)needle)->value;
         else
@@ -1516,7 +1695,14 @@ FORMULAFUNC(drsp_tablelookup){
     {
         Expression* haystack = evaluate_expr(ctx, sd, argv[1], caller_row, caller_col);
         if(!haystack || haystack->kind == EXPR_ERROR) return haystack;
-        if(haystack->kind == EXPR_COMPUTED_ARRAY){
+        if(sorted){
+            RangeCursor chay;
+            if(!expr_is_arraylike(haystack) || range_cursor_init(ctx, sd, haystack, &chay, caller_row, caller_col))
+                return Error(ctx, "Invalid range for haystack of tlu()");
+            if(sorted_lookup(ctx, &chay, nval.d, &offset))
+                return NULL;
+        }
+        else if(haystack->kind == EXPR_COMPUTED_ARRAY){
             ComputedArray* c = (ComputedArray*)haystack;
             if(nkind == EXPR_STRING){
                 for(intptr_t i = 0; i < c->length; i++){
@@ -1539,35 +1725,27 @@ FORMULAFUNC(drsp_tablelookup){
                 }
             }
         }
+        else if(haystack->kind == EXPR_NUMBER_ARRAY){
+            NumberArray* na = (NumberArray*)haystack;
+            // Strings are never found in one.
+            if(nkind == EXPR_NUMBER){
+                for(intptr_t i = 0; i < na->length; i++){
+                    if(nval.d == na->data[i] && !number_array_is_blank(na, i)){
+                        offset = i;
+                        break;
+                    }
+                }
+            }
+        }
         else if(haystack->kind == EXPR_RANGE1D_COLUMN || haystack->kind == EXPR_RANGE1D_COLUMN_FOREIGN){
             intptr_t col, start, end;
             SheetData* rsd = sd;
             if(get_range1dcol(ctx, sd, haystack, &col, &start, &end, &rsd, caller_row, caller_col) != 0)
                 return Error(ctx, "Invalid range for haystack of tlu()");
-
-            BuffCheckpoint loopbc = buff_checkpoint(ctx->a);
-            if(nkind == EXPR_STRING){
-                for(intptr_t row = start; row <= end; buff_set(ctx->a,loopbc), row++){
-                    Expression* e = evaluate(ctx, rsd, row, col);
-                    if(!e) return e;
-                    if(e->kind != EXPR_STRING) continue;
-                    if(nval.s == ((String*)e)->str){
-                        offset = row - start;
-                        break;
-                    }
-                }
-            }
-            else {
-                for(intptr_t row = start; row <= end; buff_set(ctx->a, loopbc), row++){
-                    Expression* e = evaluate(ctx, rsd, row, col);
-                    if(!e) return e;
-                    if(e->kind != EXPR_NUMBER) continue;
-                    if(nval.d == ((Number*)e)->value){
-                        offset = row - start;
-                        break;
-                    }
-                }
-            }
+            int err = nkind == EXPR_STRING
+                ? column_lookup(ctx, rsd, col, start, end, nkind, 0, nval.s, &offset)
+                : column_lookup(ctx, rsd, col, start, end, nkind, nval.d, NULL, &offset);
+            if(err) return NULL;
         }
         else if(haystack->kind == EXPR_RANGE1D_ROW || haystack->kind == EXPR_RANGE1D_ROW_FOREIGN){
             intptr_t row, start, end;
@@ -1618,6 +1796,12 @@ FORMULAFUNC(drsp_tablelookup){
                 return Error(ctx, "out of bounds");
             return c->data[offset];
         }
+        if(values->kind == EXPR_NUMBER_ARRAY){
+            NumberArray* na = (NumberArray*)values;
+            if(offset >= na->length)
+                return Error(ctx, "out of bounds");
+            return number_array_get(ctx, na, offset);
+        }
         if(values->kind == EXPR_RANGE1D_COLUMN || values->kind == EXPR_RANGE1D_COLUMN_FOREIGN){
             intptr_t col, start, end;
             SheetData* rsd = sd;
@@ -1640,9 +1824,26 @@ FORMULAFUNC(drsp_tablelookup){
 }
 
 DRSP_INTERNAL
-FORMULAFUNC(drsp_find){
-    // "needle", [haystack]
-    if(argc != 2 && argc != 3) return Error(ctx, "find() requires 2 or 3 arguments");
+FORMULAFUNC(drsp_tablelookup){
+    // "needle", [haystack], [values]
+    if(argc != 3 && argc != 4) return Error(ctx, "tlu() requires 3 or 4 arguments");
+    return tablelookup(ctx, sd, caller_row, caller_col, argc, argv, 0);
+}
+
+// Like tlu(), but the haystack is sorted and the last key <= needle is found
+// with a binary search.
+DRSP_INTERNAL
+FORMULAFUNC(drsp_sorted_tablelookup){
+    // "needle", [haystack], [values]
+    if(argc != 3 && argc != 4) return Error(ctx, "stlu() requires 3 or 4 arguments");
+    return tablelookup(ctx, sd, caller_row, caller_col, argc, argv, 1);
+}
+
+// The body of find() and sfind(), which differ in how the haystack is
+// searched.
+static
+Expression*_Nullable
+find_in_haystack(DrSpreadCtx* ctx, SheetData* sd, intptr_t caller_row, intptr_t caller_col, int argc, Expression*_Nonnull*_Nonnull argv, _Bool sorted){
     BuffCheckpoint bc = buff_checkpoint(ctx->a);
     ExpressionKind nkind;
     union {
@@ -1654,6 +1855,7 @@ FORMULAFUNC(drsp_find){
         if(!needle || needle->kind == EXPR_ERROR) return needle;
         nkind = needle->kind;
         if(nkind != EXPR_NUMBER && nkind != EXPR_STRING && nkind != EXPR_BLANK) return Error(ctx, "first argument to find() must be a number or a string");
+        if(sorted && nkind != EXPR_NUMBER) return Error(ctx, "first argument to sfind() must be a number");
         if(nkind == EXPR_NUMBER)
             nval.d = ((Number*)needle)->value;
         else if(nkind == EXPR_STRING)
@@ -1664,7 +1866,14 @@ FORMULAFUNC(drsp_find){
     {
         Expression* haystack = evaluate_expr(ctx, sd, argv[1], caller_row, caller_col);
         if(!haystack || haystack->kind == EXPR_ERROR) return haystack;
-        if(haystack->kind == EXPR_COMPUTED_ARRAY){
+        if(sorted){
+            RangeCursor chay;
+            if(!expr_is_arraylike(haystack) || range_cursor_init(ctx, sd, haystack, &chay, caller_row, caller_col))
+                return Error(ctx, "Invalid range");
+            if(sorted_lookup(ctx, &chay, nval.d, &offset))
+                return NULL;
+        }
+        else if(haystack->kind == EXPR_COMPUTED_ARRAY){
             ComputedArray* cc = (ComputedArray*)haystack;
             for(intptr_t i = 0; i < cc->length; i++){
                 Expression* e = cc->data[i];
@@ -1687,34 +1896,25 @@ FORMULAFUNC(drsp_find){
                 }
             }
         }
+        else if(haystack->kind == EXPR_NUMBER_ARRAY){
+            NumberArray* na = (NumberArray*)haystack;
+            for(intptr_t i = 0; i < na->length; i++){
+                _Bool blank = number_array_is_blank(na, i);
+                if(nkind == EXPR_BLANK? blank : nkind == EXPR_NUMBER && !blank && nval.d == na->data[i]){
+                    offset = i;
+                    break;
+                }
+            }
+        }
         else if(haystack->kind == EXPR_RANGE1D_COLUMN || haystack->kind == EXPR_RANGE1D_COLUMN_FOREIGN){
             intptr_t col, start, end;
             SheetData* rsd = sd;
             if(get_range1dcol(ctx, sd, haystack, &col, &start, &end, &rsd, caller_row, caller_col) != 0)
                 return Error(ctx, "Invalid range");
-
-            BuffCheckpoint loopchk = buff_checkpoint(ctx->a);
-            for(intptr_t row = start; row <= end; buff_set(ctx->a, loopchk), row++){
-                Expression* e = evaluate(ctx, rsd, row, col);
-                if(!e) return e;
-                if(e->kind != nkind) continue;
-                if(nkind == EXPR_BLANK){
-                    offset = row - start;
-                    break;
-                }
-                if(nkind == EXPR_STRING){
-                    if(nval.s == ((String*)e)->str){
-                        offset = row - start;
-                        break;
-                    }
-                }
-                else if(nkind == EXPR_NUMBER){
-                    if(nval.d == ((Number*)e)->value){
-                        offset = row - start;
-                        break;
-                    }
-                }
-            }
+            int err = nkind == EXPR_STRING
+                ? column_lookup(ctx, rsd, col, start, end, nkind, 0, nval.s, &offset)
+                : column_lookup(ctx, rsd, col, start, end, nkind, nval.d, NULL, &offset);
+            if(err) return NULL;
         }
         else {
             intptr_t row, start, end;
@@ -1758,6 +1958,22 @@ FORMULAFUNC(drsp_find){
     return &n->e;
 }
 
+DRSP_INTERNAL
+FORMULAFUNC(drsp_find){
+    // "needle", [haystack]
+    if(argc != 2 && argc != 3) return Error(ctx, "find() requires 2 or 3 arguments");
+    return find_in_haystack(ctx, sd, caller_row, caller_col, argc, argv, 0);
+}
+
+// Like find(), but the haystack is sorted and the last key <= needle is
+// found with a binary search.
+DRSP_INTERNAL
+FORMULAFUNC(drsp_sorted_find){
+    // "needle", [haystack]
+    if(argc != 2 && argc != 3) return Error(ctx, "sfind() requires 2 or 3 arguments");
+    return find_in_haystack(ctx, sd, caller_row, caller_col, argc, argv, 1);
+}
+
 DRSP_INTERNAL
 FORMULAFUNC(drsp_call){
     if(!argc) return Error(ctx, "call() requires at least 1 argument");
@@ -1781,13 +1997,12 @@ FORMULAFUNC(drsp_first){
         return arg;
     if(!expr_is_arraylike(arg))
         return Error(ctx, "");
-    arg = convert_to_computed_array(ctx, sd, arg, caller_row, caller_col);
-    if(!arg || arg->kind == EXPR_ERROR)
-        return arg;
-    ComputedArray* c = (ComputedArray*)arg;
-    if(!c->length)
+    RangeCursor c;
+    if(range_cursor_init(ctx, sd, arg, &c, caller_row, caller_col))
+        return Error(ctx, "");
+    if(!c.length)
         return Error(ctx, "");
-    return c->data[0];
+    return range_cursor_get(ctx, &c, 0);
 }
 
 typedef struct PrintBuff PrintBuff;
@@ -1816,7 +2031,7 @@ print(PrintBuff* buff, const char* fmt, ...){
 
 DRSP_INTERNAL
 void
-repr_expr(PrintBuff* buff, Expression* arg){
+repr_expr(PrintBuff* buff, Expression* arg, intptr_t caller_row){
     switch(arg->kind){
         case EXPR_ERROR:
             print(buff, "Error()");
@@ -1840,7 +2055,7 @@ repr_expr(PrintBuff* buff, Expression* arg){
                 if(i != 0){
                     print(buff, ", ");
                 }
-                repr_expr(buff, f->argv[i]);
+                repr_expr(buff, f->argv[i], caller_row);
             }
             print(buff, ")");
         }break;
@@ -1852,7 +2067,7 @@ repr_expr(PrintBuff* buff, Expression* arg){
                 if(i != 0){
                     print(buff, ", ");
                 }
-                repr_expr(buff, f->argv[i]);
+                repr_expr(buff, f->argv[i], caller_row);
             }
             print(buff, ")");
         }break;
@@ -1862,7 +2077,8 @@ repr_expr(PrintBuff* buff, Expression* arg){
             if(rng->row == IDX_DOLLAR)
                 print(buff, "[%.*s, $]", (int)rng->col_name->length, rng->col_name->data);
             else
-                print(buff, "[%.*s, %zd]", (int)rng->col_name->length, rng->col_name->data, rng->row);
+                print(buff, "[%.*s, %zd]", (int)rng->col_name->length, rng->col_name->data,
+                        resolve_relative_idx(rng->row, caller_row));
             print(buff, ")");
         }break;
         case EXPR_RANGE0D_FOREIGN:{
@@ -1871,7 +2087,7 @@ repr_expr(PrintBuff* buff, Expression* arg){
             print(buff, "[%.*s, %.*s, %zd]",
                     (int)rng->sheet_name->length, rng->sheet_name->data,
                     (int)rng->r.col_name->length, rng->r.col_name->data,
-                    rng->r.row);
+                    resolve_relative_idx(rng->r.row, caller_row));
             print(buff, ")");
         }break;
         case EXPR_RANGE1D_COLUMN:{
@@ -1884,17 +2100,18 @@ repr_expr(PrintBuff* buff, Expression* arg){
             else if(rng->row_start == IDX_DOLLAR){
                 print(buff, "[%.*s, $:%zd]",
                         (int)rng->col_name->length, rng->col_name->data,
-                         rng->row_end);
+                         resolve_relative_idx(rng->row_end, caller_row));
             }
             else if(rng->row_end == IDX_DOLLAR){
                 print(buff, "[%.*s, %zd:$]",
                         (int)rng->col_name->length, rng->col_name->data,
-                        rng->row_start);
+                        resolve_relative_idx(rng->row_start, caller_row));
             }
             else {
                 print(buff, "[%.*s, %zd:%zd]",
                         (int)rng->col_name->length, rng->col_name->data,
-                        rng->row_start, rng->row_end);
+                        resolve_relative_idx(rng->row_start, caller_row),
+                        resolve_relative_idx(rng->row_end, caller_row));
             }
             print(buff, ")");
         }break;
@@ -1904,7 +2121,8 @@ repr_expr(PrintBuff* buff, Expression* arg){
             print(buff, "[%.*s, %.*s, %zd:%zd]",
                     (int)rng->sheet_name->length, rng->sheet_name->data,
                     (int)rng->r.col_name->length, rng->r.col_name->data,
-                    rng->r.row_start, rng->r.row_end);
+                    resolve_relative_idx(rng->r.row_start, caller_row),
+                    resolve_relative_idx(rng->r.row_end, caller_row));
             print(buff, ")");
         }break;
         case EXPR_RANGE1D_ROW:{
@@ -1919,7 +2137,7 @@ repr_expr(PrintBuff* buff, Expression* arg){
                 print(buff, "[%.*s:%.*s, %zd]",
                         (int)rng->col_start->length, rng->col_start->data,
                         (int)rng->col_end->length, rng->col_end->data,
-                        rng->row_idx);
+                        resolve_relative_idx(rng->row_idx, caller_row));
             }
             print(buff, ")");
         }break;
@@ -1930,19 +2148,19 @@ repr_expr(PrintBuff* buff, Expression* arg){
                     (int)rng->sheet_name->length, rng->sheet_name->data,
                     (int)rng->r.col_start->length, rng->r.col_start->data,
                     (int)rng->r.col_end->length, rng->r.col_end->data,
-                    rng->r.row_idx);
+                    resolve_relative_idx(rng->r.row_idx, caller_row));
             print(buff, ")");
         }break;
         case EXPR_GROUP:{
             Group* g = (Group*)arg;
             print(buff, "Group(");
-            repr_expr(buff, g->expr);
+            repr_expr(buff, g->expr, caller_row);
             print(buff, ")");
         }break;
         case EXPR_BINARY:{
             Binary* b = (Binary*)arg;
             print(buff, "Binary(");
-            repr_expr(buff, b->lhs);
+            repr_expr(buff, b->lhs, caller_row);
             switch(b->op){
                 case BIN_ADD: print(buff, "+"); break;
                 case BIN_SUB: print(buff, "-"); break;
@@ -1955,7 +2173,7 @@ repr_expr(PrintBuff* buff, Expression* arg){
                 case BIN_EQ:  print(buff, "="); break;
                 case BIN_NE:  print(buff, "!="); break;
             }
-            repr_expr(buff, b->rhs);
+            repr_expr(buff, b->rhs, caller_row);
             print(buff, ")");
         }break;
         case EXPR_UNARY:{
@@ -1966,24 +2184,27 @@ repr_expr(PrintBuff* buff, Expression* arg){
                 case UN_NEG: print(buff, "-"); break;
                 case UN_NOT: print(buff, "!"); break;
             }
-            repr_expr(buff, u->expr);
+            repr_expr(buff, u->expr, caller_row);
             print(buff, ")");
         }break;
         case EXPR_COMPUTED_ARRAY:
             print(buff, "ComputedArray()");
             break;
+        case EXPR_NUMBER_ARRAY:
+            print(buff, "NumberArray()");
+            break;
     }
 }
 
 DRSP_INTERNAL
 FORMULAFUNC(drsp_repr){
-    (void)caller_col; (void)caller_row;
+    (void)caller_col;
     (void)sd;
     char buffer[4092];
     PrintBuff buff = {0, sizeof buffer, buffer};
     for(int i = 0; i < argc; i++){
         Expression* arg = argv[i];
-        repr_expr(&buff, arg);
+        repr_expr(&buff, arg, caller_row);
     }
     if(buff.error) return Error(ctx, "");
     DrspAtom str = drsp_intern_str(ctx, buffer, sizeof(buffer) - buff.len);
@@ -2024,11 +2245,8 @@ FORMULAFUNC(drsp_if){
         ComputedArray* cc = (ComputedArray*)cond;
         Expression* t = NULL;
         Expression* f = NULL;
-        // col or based on type
-        intptr_t tcol_or_row = IDX_UNSET, tstart = IDX_UNSET, tend = IDX_UNSET;
-        SheetData* tsd = sd;
-        intptr_t fcol_or_row = IDX_UNSET, fstart = IDX_UNSET, fend = IDX_UNSET;
-        SheetData* fsd = sd;
+        // Ranges are only evaluated at the elements that are picked.
+        RangeCursor tcur, fcur;
         for(intptr_t i = 0; i < cc->length; i++){
             Expression* e = cc->data[i];
             if(evaled_is_not_scalar(e))
@@ -2038,37 +2256,16 @@ FORMULAFUNC(drsp_if){
                     t = evaluate_expr(ctx, sd, argv[1], caller_row, caller_col);
                     if(!t || t->kind == EXPR_ERROR)
                         return t;
+                    if(expr_is_arraylike(t) && range_cursor_init(ctx, sd, t, &tcur, caller_row, caller_col))
+                        return Error(ctx, "Invalid range");
                 }
-                if(t->kind == EXPR_COMPUTED_ARRAY){
-                    ComputedArray* tc = (ComputedArray*)t;
-                    if(i >= tc->length){
-                        return Error(ctx, "true range out of bounds");
-                    }
-                    cc->data[i] = tc->data[i];
-                }
-                else if(expr_is_scalar(t)){
+                if(expr_is_scalar(t)){
                     cc->data[i] = t;
                 }
-                else if(t->kind == EXPR_RANGE1D_COLUMN || t->kind == EXPR_RANGE1D_COLUMN_FOREIGN){
-                    if(tcol_or_row == IDX_UNSET){
-                        if(get_range1dcol(ctx, sd, t, &tcol_or_row, &tstart, &tend, &tsd, caller_row, caller_col))
-                            return Error(ctx, "Invalid range");
-                    }
-                    if(tstart + i > tend)
-                        return Error(ctx, "true range out of bounds");
-                    Expression* te = evaluate(ctx, tsd, tstart+i, tcol_or_row);
-                    if(!te || te->kind == EXPR_ERROR)
-                        return te;
-                    cc->data[i] = te;
-                }
-                else if(t->kind == EXPR_RANGE1D_ROW || t->kind == EXPR_RANGE1D_ROW_FOREIGN){
-                    if(tcol_or_row == IDX_UNSET){
-                        if(get_range1drow(ctx, sd, t, &tcol_or_row, &tstart, &tend, &tsd, caller_row, caller_col))
-                            return Error(ctx, "Invalid range");
-                    }
-                    if(tstart + i > tend)
+                else if(expr_is_arraylike(t)){
+                    if(i >= tcur.length)
                         return Error(ctx, "true range out of bounds");
-                    Expression* te = evaluate(ctx, tsd, tcol_or_row, tstart+i);
+                    Expression* te = range_cursor_get(ctx, &tcur, i);
                     if(!te || te->kind == EXPR_ERROR)
                         return te;
                     cc->data[i] = te;
@@ -2082,37 +2279,16 @@ FORMULAFUNC(drsp_if){
                     f = evaluate_expr(ctx, sd, argv[2], caller_row, caller_col);
                     if(!f || f->kind == EXPR_ERROR)
                         return f;
+                    if(expr_is_arraylike(f) && range_cursor_init(ctx, sd, f, &fcur, caller_row, caller_col))
+                        return Error(ctx, "Invalid range");
                 }
-                if(f->kind == EXPR_COMPUTED_ARRAY){
-                    ComputedArray* fc = (ComputedArray*)f;
-                    if(i >= fc->length){
-                        return Error(ctx, "false range out of bounds");
-                    }
-                    cc->data[i] = fc->data[i];
-                }
-                else if(expr_is_scalar(f)){
+                if(expr_is_scalar(f)){
                     cc->data[i] = f;
                 }
-                else if(f->kind == EXPR_RANGE1D_COLUMN || f->kind == EXPR_RANGE1D_COLUMN_FOREIGN){
-                    if(fcol_or_row == IDX_UNSET){
-                        if(get_range1dcol(ctx, sd, f, &fcol_or_row, &fstart, &fend, &fsd, caller_row, caller_col))
-                            return Error(ctx, "Invalid range");
-                    }
-                    if(fstart + i > fend)
-                        return Error(ctx, "false range out of bounds");
-                    Expression* fe = evaluate(ctx, fsd, fstart+i, fcol_or_row);
-                    if(!fe || fe->kind == EXPR_ERROR)
-                        return fe;
-                    cc->data[i] = fe;
-                }
-                else if(f->kind == EXPR_RANGE1D_ROW || f->kind == EXPR_RANGE1D_ROW_FOREIGN){
-                    if(fcol_or_row == IDX_UNSET){
-                        if(get_range1drow(ctx, sd, f, &fcol_or_row, &fstart, &fend, &fsd, caller_row, caller_col))
-                            return Error(ctx, "Invalid range");
-                    }
-                    if(fstart + i > fend)
+                else if(expr_is_arraylike(f)){
+                    if(i >= fcur.length)
                         return Error(ctx, "false range out of bounds");
-                    Expression* fe = evaluate(ctx, fsd, fcol_or_row, fstart+i);
+                    Expression* fe = range_cursor_get(ctx, &fcur, i);
                     if(!fe || fe->kind == EXPR_ERROR)
                         return fe;
                     cc->data[i] = fe;
@@ -2216,6 +2392,7 @@ DRSP_INTERNAL
 const FuncInfo FUNC4[] = {
     {SVI("ceil"),  &drsp_ceil},
     {SVI("find"),  &drsp_find},
+    {SVI("stlu"),  &drsp_sorted_tablelookup},
     {SVI("cell"),  &drsp_cell},
     {SVI("eval"),  &drsp_eval},
     {SVI("call"),  &drsp_call},
@@ -2231,6 +2408,7 @@ const FuncInfo FUNC4[] = {
 DRSP_INTERNAL
 const FuncInfo FUNC5[] = {
     {SVI("count"), &drsp_count},
+    {SVI("sfind"), &drsp_sorted_find},
     {SVI("floor"), &drsp_floor},
     {SVI("trunc"), &drsp_trunc},
     {SVI("round"), &drsp_round},
@@ -5,4 +5,6 @@
 #define DRSPREAD_FORMULA_FUNCS_H
 #include "drspread_types.h"
 DRSP_INTERNAL FormulaFunc*_Nullable lookup_func(DrspAtom _Nonnull name);
+// The parser folds calls to if() with a constant condition.
+DRSP_INTERNAL FormulaFunc drsp_if;
 #endif
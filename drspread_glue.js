@@ -21,6 +21,56 @@ function drspread(wasm_path, sheet_set_display_number, sheet_set_display_string_
         const d = memview.getFloat64(p, true);
         return d;
     }
+    function refresh_views() {
+        if (mem.buffer !== exports.memory.buffer) {
+            mem = new Uint8Array(exports.memory.buffer);
+            memview = new DataView(mem.buffer);
+        }
+    }
+    function write_texts(p, ncols, texts, size) {
+        const n = texts.length;
+        const table = new Int32Array(mem.buffer, p, ncols * n);
+        const ptexts = (ncols - 2) * n;
+        const plens = (ncols - 1) * n;
+        let at = p + 4 * ncols * n;
+        const end = p + size;
+        for (let i = 0; i < n; i++) {
+            const { read, written } = encoder.encodeInto(texts[i], mem.subarray(at, end));
+            if (read != texts[i].length)
+                return 0;
+            table[ptexts + i] = at;
+            table[plens + i] = written;
+            at += written;
+        }
+        return 1;
+    }
+    function upload_size(ncols, texts) {
+        let nunits = 0;
+        for (const t of texts)
+            nunits += t.length;
+        return 4 * ncols * texts.length + 3 * nunits;
+    }
+    function apply_display_updates(ctx) {
+        const n = exports.drsp_get_display_updates(ctx, exports.wasm_display_updates.value);
+        refresh_views();
+        let p = read4(exports.wasm_display_updates.value);
+        for (let i = 0; i < n; i++, p += 32) {
+            const id = read4(p);
+            const row = read4(p + 4);
+            const col = read4(p + 8);
+            switch (read4(p + 16)) {
+                case 1:
+                    sheet_set_display_number(id, row, col, readdouble(p + 24));
+                    break;
+                case 2:
+                    sheet_set_display_string_(id, row, col, wasm_string_to_js(read4(p + 28), read4(p + 24)));
+                    break;
+                default:
+                    sheet_set_display_error(id, row, col, wasm_string_to_js(read4(p + 28), read4(p + 24)));
+                    break;
+            }
+        }
+    }
     const imports = {
         env: {
             round: (num) => {
@@ -58,6 +108,7 @@ function drspread(wasm_path, sheet_set_display_number, sheet_set_display_string_
                 evaluate_formulas: () => {
                     const ctx = result.id;
                     const e = exports.drsp_evaluate_formulas(ctx);
+                    apply_display_updates(ctx);
                     return e;
                 },
                 evaluate_string: (sheet, s) => {
@@ -91,6 +142,49 @@ function drspread(wasm_path, sheet_set_display_number, sheet_set_display_string_
                     const e = exports.drsp_set_cell_str(ctx, sheet, row, col, exports.wasm_str_buff.value, encoded.length);
                     return e;
                 },
+                set_cells: (sheet, rows, cols, texts) => {
+                    const n = texts.length;
+                    if (rows.length != n || cols.length != n)
+                        return 1;
+                    if (!n)
+                        return 0;
+                    const size = upload_size(4, texts);
+                    const p = exports.wasm_upload_buffer(size);
+                    if (!p)
+                        return 1;
+                    refresh_views();
+                    const table = new Int32Array(mem.buffer, p, 2 * n);
+                    for (let i = 0; i < n; i++) {
+                        table[i] = rows[i];
+                        table[n + i] = cols[i];
+                    }
+                    if (!write_texts(p, 4, texts, size))
+                        return 1;
+                    return exports.drsp_set_cells_bulk(result.id, sheet, n, p, p + 4 * n, p + 8 * n, p + 12 * n);
+                },
+                set_column: (sheet, col, row, texts) => {
+                    const n = texts.length;
+                    if (!n)
+                        return 0;
+                    const size = upload_size(2, texts);
+                    const p = exports.wasm_upload_buffer(size);
+                    if (!p)
+                        return 1;
+                    refresh_views();
+                    if (!write_texts(p, 2, texts, size))
+                        return 1;
+                    return exports.drsp_set_column_bulk(result.id, sheet, col, row, n, p, p + 4 * n);
+                },
+                load_delimited: (sheet, data, sep) => {
+                    if (!data.length)
+                        return 0;
+                    const p = exports.wasm_upload_buffer(data.length);
+                    if (!p)
+                        return 1;
+                    refresh_views();
+                    mem.set(data, p);
+                    return exports.drsp_load_delimited(result.id, sheet, p, data.length, sep.charCodeAt(0));
+                },
                 set_cell_name: (sheet, name, row, col) => {
                     const ctx = result.id;
                     const encoded = encoder.encode(name);
@@ -173,6 +267,7 @@ function drspread(wasm_path, sheet_set_display_number, sheet_set_display_string_
                     return e;
                 },
             };
+            exports.drsp_set_display_batching(result.id, 1);
             return result;
         }
         return { exports, make_ctx: create_ctx };
@@ -17,6 +17,9 @@ type DrSpreadCtx = {
     evaluate_formulas: () => number;
     evaluate_string: (sheet:number, s:string) => number | string;
     set_str:(sheet:number, row:number, col:number, s:string) => number;
+    set_cells:(sheet:number, rows:Array<number>, cols:Array<number>, texts:Array<string>) => number;
+    set_column:(sheet:number, col:number, row:number, texts:Array<string>) => number;
+    load_delimited:(sheet:number, data:Uint8Array, sep:string) => number;
     set_extra_str:(sheet:number, id:number, s:string) => number;
     make_sheet:(sheet:number, name:string) => number;
     set_sheet_alias:(sheet:number, name:string) => number;
@@ -36,8 +39,13 @@ type DrSpreadExports = {
     drsp_create_ctx: () => number;
     drsp_destroy_ctx: (ctx:number) => number;
     drsp_evaluate_formulas: (ctx:number) => number;
+    drsp_set_display_batching: (ctx:number, on:number) => number;
+    drsp_get_display_updates: (ctx:number, pupdates:number) => number;
     drsp_evaluate_string: (ctx:number, sheet:number, ptext:number, txtlen:number, result:number, caller_row:number, caller_col:number) => number;
     drsp_set_cell_str:(ctx:number, sheet:number, row:number, col:number, ptxt:number, txtlen:number) => number;
+    drsp_set_cells_bulk:(ctx:number, sheet:number, n:number, prows:number, pcols:number, ptexts:number, plengths:number) => number;
+    drsp_set_column_bulk:(ctx:number, sheet:number, col:number, row:number, n:number, ptexts:number, plengths:number) => number;
+    drsp_load_delimited:(ctx:number, sheet:number, data:number, length:number, sep:number) => number;
     drsp_set_extra_dimensional_str:(ctx:number, sheet:number, id:number, ptxt:number, txtlen:number) => number;
     drsp_set_named_cell: (ctx:number, sheet:number, ptxt:number, txtlen:number, row:number, col:number)=> number;
     drsp_clear_named_cell: (ctx:number, sheet:number, ptxt:number, txtlen:number) => number;
@@ -60,6 +68,8 @@ type DrSpreadExports = {
     wasm_result: {value:number};
     wasm_parambuff_row: {value:number};
     wasm_parambuff_col: {value:number};
+    wasm_display_updates: {value:number};
+    wasm_upload_buffer: (size:number) => number;
 };
 function drspread(
     wasm_path:string,
@@ -105,6 +115,62 @@ function readdouble(p:number):number{
     const d = memview.getFloat64(p, true);
     return d;
 }
+// The displays are recorded during evaluation and applied here in one go,
+// instead of calling out of wasm for every cell.
+// Allocating can grow the memory, which detaches the old views.
+function refresh_views():void{
+    if(mem.buffer !== exports.memory.buffer){
+        mem = new Uint8Array(exports.memory.buffer);
+        memview = new DataView(mem.buffer);
+    }
+}
+// The last two columns of the ncols*n table of int32s at p are filled with
+// the pointers to and lengths of the texts, which are written right after
+// the table. Returns 0 if they don't fit in size bytes.
+function write_texts(p:number, ncols:number, texts:Array<string>, size:number):number{
+    const n = texts.length;
+    const table = new Int32Array(mem.buffer, p, ncols*n);
+    const ptexts = (ncols-2)*n;
+    const plens = (ncols-1)*n;
+    let at = p + 4*ncols*n;
+    const end = p + size;
+    for(let i = 0; i < n; i++){
+        const {read, written} = encoder.encodeInto(texts[i], mem.subarray(at, end));
+        if(read != texts[i].length) return 0;
+        table[ptexts+i] = at;
+        table[plens+i] = written;
+        at += written;
+    }
+    return 1;
+}
+// Room for the table and the texts, which are at most 3 bytes per utf-16
+// code unit.
+function upload_size(ncols:number, texts:Array<string>):number{
+    let nunits = 0;
+    for(const t of texts) nunits += t.length;
+    return 4*ncols*texts.length + 3*nunits;
+}
+function apply_display_updates(ctx:number):void{
+    const n = exports.drsp_get_display_updates(ctx, exports.wasm_display_updates.value);
+    refresh_views();
+    let p = read4(exports.wasm_display_updates.value);
+    for(let i = 0; i < n; i++, p += 32){
+        const id = read4(p);
+        const row = read4(p+4);
+        const col = read4(p+8);
+        switch(read4(p+16)){
+            case DrspResultKind.NUMBER:
+                sheet_set_display_number(id, row, col, readdouble(p+24));
+                break;
+            case DrspResultKind.STRING:
+                sheet_set_display_string_(id, row, col, wasm_string_to_js(read4(p+28), read4(p+24)));
+                break;
+            default:
+                sheet_set_display_error(id, row, col, wasm_string_to_js(read4(p+28), read4(p+24)));
+                break;
+        }
+    }
+}
 const imports = {
     env:{
         // bizarrely, Math.round doesn't round correctly
@@ -144,6 +210,7 @@ return fetch(wasm_path)
                 evaluate_formulas: ():number =>{
                     const ctx = result.id;
                     const e = exports.drsp_evaluate_formulas(ctx);
+                    apply_display_updates(ctx);
                     return e;
                 },
                 evaluate_string: (sheet:number, s:string):number|string => {
@@ -170,6 +237,44 @@ return fetch(wasm_path)
                     const e = exports.drsp_set_cell_str(ctx, sheet, row, col, exports.wasm_str_buff.value, encoded.length);
                     return e;
                 },
+                // Writes all the cells into wasm memory and sets them with
+                // one call, instead of one call per cell.
+                set_cells: (sheet:number, rows:Array<number>, cols:Array<number>, texts:Array<string>):number => {
+                    const n = texts.length;
+                    if(rows.length != n || cols.length != n) return 1;
+                    if(!n) return 0;
+                    const size = upload_size(4, texts);
+                    const p = exports.wasm_upload_buffer(size);
+                    if(!p) return 1;
+                    refresh_views();
+                    const table = new Int32Array(mem.buffer, p, 2*n);
+                    for(let i = 0; i < n; i++){
+                        table[i] = rows[i];
+                        table[n+i] = cols[i];
+                    }
+                    if(!write_texts(p, 4, texts, size)) return 1;
+                    return exports.drsp_set_cells_bulk(result.id, sheet, n, p, p+4*n, p+8*n, p+12*n);
+                },
+                set_column: (sheet:number, col:number, row:number, texts:Array<string>):number => {
+                    const n = texts.length;
+                    if(!n) return 0;
+                    const size = upload_size(2, texts);
+                    const p = exports.wasm_upload_buffer(size);
+                    if(!p) return 1;
+                    refresh_views();
+                    if(!write_texts(p, 2, texts, size)) return 1;
+                    return exports.drsp_set_column_bulk(result.id, sheet, col, row, n, p, p+4*n);
+                },
+                // data is the bytes of the file, so it doesn't need to be
+                // decoded and encoded again.
+                load_delimited: (sheet:number, data:Uint8Array, sep:string):number => {
+                    if(!data.length) return 0;
+                    const p = exports.wasm_upload_buffer(data.length);
+                    if(!p) return 1;
+                    refresh_views();
+                    mem.set(data, p);
+                    return exports.drsp_load_delimited(result.id, sheet, p, data.length, sep.charCodeAt(0));
+                },
                 set_cell_name:(sheet:number, name:string, row:number, col:number):number=>{
                     const ctx = result.id;
                     const encoded = encoder.encode(name);
@@ -252,6 +357,7 @@ return fetch(wasm_path)
                 },
 
             };
+            exports.drsp_set_display_batching(result.id, 1);
             return result;
         }
         return {exports, make_ctx:create_ctx};
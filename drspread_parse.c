@@ -53,6 +53,11 @@
     case 'U': case 'V': case 'W': case 'X': case 'Y': case 'Z'
 #endif
 
+// Rows relative to the caller's row are written as this followed by the
+// signed offset in canonicalized formulas. It can't be typed as part of a
+// formula, so it doesn't clash with anything the user writes.
+enum {ROW_RELATIVE_MARKER = '\x01'};
+
 #define PARSEFUNC(x) Expression*_Nullable x(DrSpreadCtx* ctx, StringView* sv)
 DRSP_INTERNAL PARSEFUNC(parse_comparison);
 DRSP_INTERNAL PARSEFUNC(parse_addplus);
@@ -69,12 +74,40 @@ static inline
 Expression*_Nullable
 parse_other_range_syntax(DrSpreadCtx* ctx, StringView* sv, const char* cn, size_t cn_len);
 
+DRSP_INTERNAL
+Expression*_Nullable
+simplify(DrSpreadCtx* ctx, Expression* e);
+
+// Parse errors are the shared ctx->error, whose message gets overwritten by
+// the next error, so the cache needs its own copy.
+static inline
+void
+cache_parse_error(DrSpreadCtx* ctx, DrspAtom a, Expression* e){
+    ErrorExpression* copy = linked_arena_alloc(&heap_owner(ctx)->pheap.arena, sizeof *copy);
+    if(!copy) return;
+    *copy = *(ErrorExpression*)e;
+    cache_parse(ctx, a, &copy->e);
+}
+
+static
+Expression*_Nullable
+parse_(DrSpreadCtx* ctx, DrspAtom a);
+
 DRSP_INTERNAL
 Expression*_Nullable
 parse(DrSpreadCtx* ctx, DrspAtom a){
+    heap_lock(ctx);
+    Expression* e = parse_(ctx, a);
+    heap_unlock(ctx);
+    return e;
+}
+
+static
+Expression*_Nullable
+parse_(DrSpreadCtx* ctx, DrspAtom a){
     {
         Expression* cached = has_cached_parse(ctx, a);
-        if(cached) return expr_clone(ctx, cached);
+        if(cached) return cached;
     }
     StringView sv = {a->length, a->data};
     lstrip(&sv);
@@ -86,20 +119,119 @@ parse(DrSpreadCtx* ctx, DrspAtom a){
     if(!root || root->kind == EXPR_ERROR) {
         // XXX: free what we can
         if(root && root->kind == EXPR_ERROR)
-            cache_parse(ctx, a, root);
+            cache_parse_error(ctx, a, root);
         return root;
     }
     lstrip(&sv);
     if(sv.length != 0) {
         // XXX: free what we can
         Expression* e =  Error(ctx, "parsing expression did not consume all input");
-        cache_parse(ctx, a, e);
+        cache_parse_error(ctx, a, e);
         return e;
     }
+    root = simplify(ctx, root);
+    if(!root) return NULL;
     cache_parse(ctx, a, root);
     return root;
 }
 
+static inline
+_Bool
+is_constant(const Expression* e){
+    return e->kind == EXPR_NUMBER || e->kind == EXPR_STRING || e->kind == EXPR_BLANK;
+}
+
+// Folds the parts of the expression that don't depend on any cells, so
+// the cached parse is what actually needs to be evaluated.
+// Operations that would be an error are left alone so they still error
+// when evaluated.
+// This is only called on a fresh parse, so nodes are modified in place.
+DRSP_INTERNAL
+Expression*_Nullable
+simplify(DrSpreadCtx* ctx, Expression* e){
+    switch(e->kind){
+        case EXPR_GROUP:
+            return simplify(ctx, ((Group*)e)->expr);
+        case EXPR_UNARY:{
+            Unary* u = (Unary*)e;
+            Expression* v = simplify(ctx, u->expr);
+            if(!v) return NULL;
+            u->expr = v;
+            if(v->kind != EXPR_NUMBER) return e;
+            Number* n = (Number*)v;
+            switch(u->op){
+                case UN_PLUS: break;
+                case UN_NEG: n->value = -n->value; break;
+                case UN_NOT: n->value = !n->value; break;
+            }
+            return v;
+        }
+        case EXPR_BINARY:{
+            Binary* b = (Binary*)e;
+            Expression* l = simplify(ctx, b->lhs);
+            if(!l) return NULL;
+            b->lhs = l;
+            Expression* r = simplify(ctx, b->rhs);
+            if(!r) return NULL;
+            b->rhs = r;
+            if(!is_constant(l) || !is_constant(r)) return e;
+            if(l->kind == EXPR_BLANK) return l;
+            if(r->kind == EXPR_BLANK) return r;
+            if(l->kind == EXPR_NUMBER && r->kind == EXPR_NUMBER){
+                Number* n = (Number*)l;
+                n->value = double_bin_cmp(b->op, n->value, ((Number*)r)->value);
+                return l;
+            }
+            if(l->kind == EXPR_STRING && r->kind == EXPR_STRING){
+                _Bool cmp;
+                switch(b->op){
+                    case BIN_EQ: cmp = ((String*)l)->str == ((String*)r)->str; break;
+                    case BIN_NE: cmp = ((String*)l)->str != ((String*)r)->str; break;
+                    default: return e;
+                }
+                Number* n = parser_expr_alloc(ctx, EXPR_NUMBER);
+                if(!n) return NULL;
+                n->value = cmp;
+                return &n->e;
+            }
+            return e;
+        }
+        case EXPR_FUNCTION_CALL:{
+            FunctionCall* fc = (FunctionCall*)e;
+            for(int i = 0; i < fc->argc; i++){
+                Expression* arg = simplify(ctx, fc->argv[i]);
+                if(!arg) return NULL;
+                fc->argv[i] = arg;
+            }
+            if(fc->func == drsp_if && fc->argc == 3){
+                Expression* cond = fc->argv[0];
+                switch(cond->kind){
+                    case EXPR_NUMBER:
+                        return ((Number*)cond)->value?fc->argv[1]:fc->argv[2];
+                    case EXPR_STRING:
+                        return ((String*)cond)->str->length?fc->argv[1]:fc->argv[2];
+                    case EXPR_BLANK:
+                        return fc->argv[2];
+                    default:
+                        break;
+                }
+            }
+            return e;
+        }
+        case EXPR_USER_DEFINED_FUNC_CALL:{
+            UserFunctionCall* fc = (UserFunctionCall*)e;
+            for(int i = 0; i < fc->argc; i++){
+                Expression* arg = simplify(ctx, fc->argv[i]);
+                if(!arg) return NULL;
+                fc->argv[i] = arg;
+            }
+            return e;
+        }
+        default:
+            return e;
+    }
+}
+
 DRSP_INTERNAL
 PARSEFUNC(parse_comparison){
     Expression* lhs = parse_addplus(ctx, sv);
@@ -650,16 +782,19 @@ PARSEFUNC(parse_range){
         if(has_foreign){
             ForeignRange1DColumn* rng = parser_expr_alloc(ctx, EXPR_RANGE1D_COLUMN_FOREIGN);
             if(!rng) return NULL;
+            rng->r.col_binding = rng->r.cell_binding = 0;
             rng->r.col_name = colnames[0];
             if(!rng->r.col_name) return NULL;
             rng->r.row_start = 0;
             rng->r.row_end = -1;
             rng->sheet_name = sheetname;
+            rng->binding = 0;
             if(!rng->sheet_name) return NULL;
             return &rng->e;
         }
         Range1DColumn* rng = parser_expr_alloc(ctx, EXPR_RANGE1D_COLUMN);
         if(!rng) return NULL;
+        rng->col_binding = rng->cell_binding = 0;
         rng->col_name = colnames[0];
         if(!rng->col_name) return NULL;
         rng->row_start = 0;
@@ -672,14 +807,17 @@ PARSEFUNC(parse_range){
             if(has_foreign){
                 ForeignRange1DRow* rng = parser_expr_alloc(ctx, EXPR_RANGE1D_ROW_FOREIGN);
                 if(!rng) return NULL;
+                rng->r.start_binding = rng->r.end_binding = 0;
                 rng->r.col_start = colnames[0];
                 rng->r.col_end = colnames[1];
                 rng->r.row_idx = numbers[0];
                 rng->sheet_name = sheetname;
+                rng->binding = 0;
                 return &rng->e;
             }
             Range1DRow* rng = parser_expr_alloc(ctx, EXPR_RANGE1D_ROW);
             if(!rng) return NULL;
+            rng->start_binding = rng->end_binding = 0;
             rng->col_start = colnames[0];
             rng->col_end = colnames[1];
             rng->row_idx = numbers[0];
@@ -688,13 +826,16 @@ PARSEFUNC(parse_range){
         if(has_foreign){
             ForeignRange0D* rng = parser_expr_alloc(ctx, EXPR_RANGE0D_FOREIGN);
             if(!rng) return NULL;
+            rng->r.col_binding = 0;
             rng->sheet_name = sheetname;
+            rng->binding = 0;
             rng->r.col_name = colnames[0];
             rng->r.row = numbers[0];
             return &rng->e;
         }
         Range0D* rng = parser_expr_alloc(ctx, EXPR_RANGE0D);
         if(!rng) return NULL;
+        rng->col_binding = 0;
         rng->col_name = colnames[0];
         rng->row = numbers[0];
         return &rng->e;
@@ -706,14 +847,17 @@ PARSEFUNC(parse_range){
     if(has_foreign){
         ForeignRange1DColumn* rng = parser_expr_alloc(ctx, EXPR_RANGE1D_COLUMN_FOREIGN);
         if(!rng) return NULL;
+        rng->r.col_binding = rng->r.cell_binding = 0;
         rng->r.col_name = colnames[0];
         rng->r.row_start = numbers[0];
         rng->r.row_end = numbers[1];
         rng->sheet_name = sheetname;
+        rng->binding = 0;
         return &rng->e;
     }
     Range1DColumn* rng = parser_expr_alloc(ctx, EXPR_RANGE1D_COLUMN);
     if(!rng) return NULL;
+    rng->col_binding = rng->cell_binding = 0;
     rng->col_name = colnames[0];
     rng->row_start = numbers[0];
     rng->row_end = numbers[1];
@@ -761,6 +905,24 @@ PARSEFUNC(parse_group){
     return e;
 }
 
+// Parses the offset after a ROW_RELATIVE_MARKER.
+static inline
+int
+parse_relative_row(StringView* sv, intptr_t* row_idx){
+    assert(sv->length && sv->text[0] == ROW_RELATIVE_MARKER);
+    sv->text++, sv->length--;
+    const char* begin = sv->text;
+    if(sv->length && sv->text[0] == '-')
+        sv->text++, sv->length--;
+    while(sv->length && sv->text[0] >= '0' && sv->text[0] <= '9')
+        sv->text++, sv->length--;
+    Int32Result ir = parse_int32(begin, sv->text - begin);
+    if(ir.errored) return 1;
+    if(ir.result < -IDX_RELATIVE_WINDOW || ir.result > IDX_RELATIVE_WINDOW) return 1;
+    *row_idx = IDX_RELATIVE + ir.result;
+    return 0;
+}
+
 static inline
 Expression*_Nullable
 parse_other_range_syntax(DrSpreadCtx* ctx, StringView* sv, const char* cn, size_t cn_len){
@@ -772,7 +934,10 @@ parse_other_range_syntax(DrSpreadCtx* ctx, StringView* sv, const char* cn, size_
     {
         const char* begin = sv->text;
         const char* end = begin;
-        for(;sv->length; end++, sv->length--, sv->text++){
+        if(sv->length && sv->text[0] == ROW_RELATIVE_MARKER){
+            if(parse_relative_row(sv, &row_idx)) return Error(ctx, "");
+        }
+        else for(;sv->length; end++, sv->length--, sv->text++){
             switch(sv->text[0]){
                 case '$':
                 case CASE_0_9:
@@ -797,6 +962,7 @@ parse_other_range_syntax(DrSpreadCtx* ctx, StringView* sv, const char* cn, size_
             if(row_idx == IDX_UNSET){
                 Range1DColumn* rng = parser_expr_alloc(ctx, EXPR_RANGE1D_COLUMN);
                 if(!rng) return NULL;
+                rng->col_binding = rng->cell_binding = 0;
                 rng->col_name = colname;
                 rng->row_start = 0;
                 rng->row_end = -1;
@@ -804,6 +970,7 @@ parse_other_range_syntax(DrSpreadCtx* ctx, StringView* sv, const char* cn, size_
             }
             Range0D* rng = parser_expr_alloc(ctx, EXPR_RANGE0D);
             if(!rng) return NULL;
+            rng->col_binding = 0;
             rng->col_name = colname;
             rng->row = row_idx;
             return &rng->e;
@@ -825,6 +992,7 @@ parse_other_range_syntax(DrSpreadCtx* ctx, StringView* sv, const char* cn, size_
                         continue;
                     case '$':
                     case CASE_0_9:
+                    case ROW_RELATIVE_MARKER:
                         // if(end == begin) return Error(ctx, "");
                         colname2 = drsp_intern_str_lower(ctx, begin, end-begin);
                         if(!colname2) return NULL;
@@ -840,9 +1008,14 @@ parse_other_range_syntax(DrSpreadCtx* ctx, StringView* sv, const char* cn, size_
             }
         }
         parsenum:;
+        // 2nd number is optional
+        intptr_t row_idx2 = -1;
         const char* begin = sv->text;
         const char* end = begin;
-        for(;sv->length; end++, sv->length--, sv->text++){
+        if(sv->length && sv->text[0] == ROW_RELATIVE_MARKER){
+            if(parse_relative_row(sv, &row_idx2)) return Error(ctx, "");
+        }
+        else for(;sv->length; end++, sv->length--, sv->text++){
             switch(sv->text[0]){
                 case '$':
                 case CASE_0_9:
@@ -853,8 +1026,6 @@ parse_other_range_syntax(DrSpreadCtx* ctx, StringView* sv, const char* cn, size_
             break;
         }
         lstrip(sv);
-        // 2nd number is optional
-        intptr_t row_idx2 = -1;
         if(begin != end){
             if(end == begin + 1 && *begin == '$'){
                 row_idx2 = IDX_DOLLAR;
@@ -870,6 +1041,7 @@ parse_other_range_syntax(DrSpreadCtx* ctx, StringView* sv, const char* cn, size_
         if(colname2 == drsp_nil_atom() || colname == colname2){
             Range1DColumn* rng = parser_expr_alloc(ctx, EXPR_RANGE1D_COLUMN);
             if(!rng) return NULL;
+            rng->col_binding = rng->cell_binding = 0;
             rng->col_name = colname;
             rng->row_start = row_idx;
             rng->row_end = row_idx2;
@@ -878,6 +1050,7 @@ parse_other_range_syntax(DrSpreadCtx* ctx, StringView* sv, const char* cn, size_
         else if(row_idx == row_idx2 || (row_idx != -1 && row_idx2 == -1)){
             Range1DRow* rng = parser_expr_alloc(ctx, EXPR_RANGE1D_ROW);
             if(!rng) return NULL;
+            rng->start_binding = rng->end_binding = 0;
             rng->col_start = colname;
             rng->col_end = colname2;
             rng->row_idx = row_idx;
@@ -901,7 +1074,8 @@ PARSEFUNC(parse_func_call){
             case ' ': // allow spaces in identifiers
                 continue;
             case '$':
-            case CASE_0_9:{
+            case CASE_0_9:
+            case ROW_RELATIVE_MARKER:{
                 if(begin == end) return Error(ctx, ""); // when does this happen
                 return parse_other_range_syntax(ctx, sv, begin, end-begin);
             }
@@ -925,7 +1099,7 @@ PARSEFUNC(parse_func_call){
     // This is pretty sloppy - always allocates space
     // for exactly 4 args - can't do less or more.
     enum {argmax=4};
-    Expression** argv = linked_arena_alloc(&ctx->pheap.arena, argmax * sizeof *argv);
+    Expression** argv = linked_arena_alloc(&heap_owner(ctx)->pheap.arena, argmax * sizeof *argv);
     int argc;
     for(argc = 0; argc < argmax; argc++){
         lstripc(sv);
@@ -957,6 +1131,113 @@ PARSEFUNC(parse_func_call){
     }
 }
 
+DRSP_INTERNAL
+DrspAtom _Nullable
+canonicalize_formula(DrSpreadCtx* ctx, DrspAtom a, intptr_t row){
+    if(row < 0) return a;
+    BuffCheckpoint bc = buff_checkpoint(ctx->a);
+    // Worst case is a one digit row turning into the marker and "-64".
+    char* out = buff_alloc(ctx->a, 4*a->length);
+    if(!out) return a;
+    char* o = out;
+    const char* p = a->data;
+    const char* end = p + a->length;
+    _Bool changed = 0;
+    // Digits directly after an identifier or a ':' are a row, anywhere else
+    // they are a number.
+    _Bool row_next = 0;
+    while(p != end){
+        const char* begin = p;
+        switch(*p){
+            case '\'':
+            case '"':{
+                char terminator = *p++;
+                while(p != end && *p != terminator) p++;
+                if(p != end) p++;
+                row_next = 0;
+            }break;
+            case '[':
+                // The rows in brackets are left alone.
+                while(p != end && *p != ']'){
+                    if(*p == '\'' || *p == '"'){
+                        char terminator = *p++;
+                        while(p != end && *p != terminator) p++;
+                        if(p == end) break;
+                    }
+                    p++;
+                }
+                if(p != end) p++;
+                row_next = 0;
+                break;
+            case CASE_a_z:
+            case CASE_A_Z:
+                // spaces are allowed in identifiers
+                while(p != end && ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || *p == ' '))
+                    p++;
+                row_next = 1;
+                break;
+            case ':':
+                p++;
+                while(p != end && *p == ' ') p++;
+                row_next = 1;
+                break;
+            case '$':
+            case CASE_0_9:
+                if(row_next){
+                    while(p != end && ((*p >= '0' && *p <= '9') || *p == '$'))
+                        p++;
+                    row_next = 0;
+                    if(p - begin > 9) break;
+                    intptr_t n = 0;
+                    const char* q = begin;
+                    for(; q != p; q++){
+                        if(*q == '$') break;
+                        n = n*10 + (*q - '0');
+                    }
+                    if(q != p) break;
+                    // Rows far away (headers, totals) stay absolute so
+                    // every row still shares them.
+                    intptr_t offset = n - 1 - row;
+                    if(n < 1 || offset < -IDX_RELATIVE_WINDOW || offset > IDX_RELATIVE_WINDOW)
+                        break;
+                    *o++ = ROW_RELATIVE_MARKER;
+                    if(offset < 0){
+                        *o++ = '-';
+                        offset = -offset;
+                    }
+                    if(offset >= 10)
+                        *o++ = (char)('0' + offset / 10);
+                    *o++ = (char)('0' + offset % 10);
+                    changed = 1;
+                    continue;
+                }
+                if(*p == '$'){
+                    p++;
+                    break;
+                }
+                while(p != end && ((*p >= '0' && *p <= '9') || *p == '.' || *p == 'e' || *p == 'E'))
+                    p++;
+                break;
+            case '.':
+                while(p != end && ((*p >= '0' && *p <= '9') || *p == '.' || *p == 'e' || *p == 'E'))
+                    p++;
+                row_next = 0;
+                break;
+            default:
+                p++;
+                row_next = 0;
+                break;
+        }
+        __builtin_memcpy(o, begin, p - begin);
+        o += p - begin;
+    }
+    DrspAtom result = a;
+    if(changed)
+        result = drsp_intern_str(ctx, out, o - out);
+    buff_set(ctx->a, bc);
+    return result;
+}
+
 #ifdef __clang__
 #pragma clang assume_nonnull end
 #endif
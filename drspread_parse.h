@@ -11,10 +11,19 @@
 #define _Nullable
 #endif
 #endif
+// The returned expression is the cached parse, which is shared by every
+// evaluation of the same formula, so it must not be modified.
 DRSP_INTERNAL
 Expression*_Nullable
 parse(DrSpreadCtx* ctx, DrspAtom a);
 
+// Returns the formula with the rows close to `row` rewritten relative to it,
+// so that formulas that were filled down (=a1*b1, =a2*b2, ...) become the same
+// atom and share a parse. Returns `a` if there was nothing to rewrite.
+DRSP_INTERNAL
+DrspAtom _Nullable
+canonicalize_formula(DrSpreadCtx* ctx, DrspAtom a, intptr_t row);
+
 #ifdef __clang__
 #pragma clang assume_nonnull end
 #endif
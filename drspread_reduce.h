@@ -0,0 +1,222 @@
+//
+// Copyright © 2023-2025, David Priver <david@davidpriver.com>
+//
+#ifndef DRSPREAD_REDUCE_H
+#define DRSPREAD_REDUCE_H
+#include "drspread_types.h"
+#include <stddef.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+// The intrinsics headers define _mm_malloc, which uses the functions
+// drspread_allocators.h poisons.
+#pragma push_macro("malloc")
+#pragma push_macro("free")
+#undef malloc
+#undef free
+#include <immintrin.h>
+#pragma pop_macro("free")
+#pragma pop_macro("malloc")
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#ifdef __clang__
+#pragma clang assume_nonnull begin
+#endif
+
+// Folds the numbers of a range for the aggregate functions (sum(), min(),
+// etc.).
+// Element i is always folded into lane i%4 and the lanes are combined in the
+// same order at the end, so the simd kernels and the scalar fallback agree
+// bit for bit, no matter how the numbers were gathered.
+
+TYPED_ENUM(ReduceOp, uint8_t){
+    REDUCE_SUM,
+    REDUCE_PROD,
+    REDUCE_MIN, // NaN is skipped, like `if(x < v) v = x;`
+    REDUCE_MAX,
+};
+
+enum {REDUCE_LANES = 4, REDUCE_BLOCK = 256};
+
+typedef struct Reducer Reducer;
+struct Reducer {
+    ReduceOp op;
+    unsigned nbuf;
+    size_t count;
+    double lanes[REDUCE_LANES];
+    double buf[REDUCE_BLOCK];
+};
+
+static inline
+void
+reducer_init(Reducer* r, ReduceOp op, double init){
+    r->op = op;
+    r->nbuf = 0;
+    r->count = 0;
+    for(int i = 0; i < REDUCE_LANES; i++)
+        r->lanes[i] = init;
+}
+
+static inline
+double
+reduce_op(ReduceOp op, double acc, double x){
+    switch(op){
+        case REDUCE_SUM:  return acc + x;
+        case REDUCE_PROD: return acc * x;
+        case REDUCE_MIN:  return x < acc? x : acc;
+        case REDUCE_MAX:  return x > acc? x : acc;
+    }
+    return acc;
+}
+
+// n must be a multiple of REDUCE_LANES.
+static inline
+void
+reduce_lanes(ReduceOp op, double* lanes, const double* x, size_t n){
+#if defined(__AVX2__)
+    __m256d acc = _mm256_loadu_pd(lanes);
+    switch(op){
+        case REDUCE_SUM:
+            for(size_t i = 0; i < n; i += 4)
+                acc = _mm256_add_pd(acc, _mm256_loadu_pd(x+i));
+            break;
+        case REDUCE_PROD:
+            for(size_t i = 0; i < n; i += 4)
+                acc = _mm256_mul_pd(acc, _mm256_loadu_pd(x+i));
+            break;
+        // min_pd(a, b) is a < b? a : b, which is what reduce_op does.
+        case REDUCE_MIN:
+            for(size_t i = 0; i < n; i += 4)
+                acc = _mm256_min_pd(_mm256_loadu_pd(x+i), acc);
+            break;
+        case REDUCE_MAX:
+            for(size_t i = 0; i < n; i += 4)
+                acc = _mm256_max_pd(_mm256_loadu_pd(x+i), acc);
+            break;
+    }
+    _mm256_storeu_pd(lanes, acc);
+#elif defined(__SSE2__)
+    __m128d lo = _mm_loadu_pd(lanes);
+    __m128d hi = _mm_loadu_pd(lanes+2);
+    switch(op){
+        case REDUCE_SUM:
+            for(size_t i = 0; i < n; i += 4){
+                lo = _mm_add_pd(lo, _mm_loadu_pd(x+i));
+                hi = _mm_add_pd(hi, _mm_loadu_pd(x+i+2));
+            }
+            break;
+        case REDUCE_PROD:
+            for(size_t i = 0; i < n; i += 4){
+                lo = _mm_mul_pd(lo, _mm_loadu_pd(x+i));
+                hi = _mm_mul_pd(hi, _mm_loadu_pd(x+i+2));
+            }
+            break;
+        case REDUCE_MIN:
+            for(size_t i = 0; i < n; i += 4){
+                lo = _mm_min_pd(_mm_loadu_pd(x+i), lo);
+                hi = _mm_min_pd(_mm_loadu_pd(x+i+2), hi);
+            }
+            break;
+        case REDUCE_MAX:
+            for(size_t i = 0; i < n; i += 4){
+                lo = _mm_max_pd(_mm_loadu_pd(x+i), lo);
+                hi = _mm_max_pd(_mm_loadu_pd(x+i+2), hi);
+            }
+            break;
+    }
+    _mm_storeu_pd(lanes, lo);
+    _mm_storeu_pd(lanes+2, hi);
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    float64x2_t lo = vld1q_f64(lanes);
+    float64x2_t hi = vld1q_f64(lanes+2);
+    switch(op){
+        case REDUCE_SUM:
+            for(size_t i = 0; i < n; i += 4){
+                lo = vaddq_f64(lo, vld1q_f64(x+i));
+                hi = vaddq_f64(hi, vld1q_f64(x+i+2));
+            }
+            break;
+        case REDUCE_PROD:
+            for(size_t i = 0; i < n; i += 4){
+                lo = vmulq_f64(lo, vld1q_f64(x+i));
+                hi = vmulq_f64(hi, vld1q_f64(x+i+2));
+            }
+            break;
+        // vminq/vmaxq propagate NaN, so select with a compare instead.
+        case REDUCE_MIN:
+            for(size_t i = 0; i < n; i += 4){
+                float64x2_t a = vld1q_f64(x+i);
+                float64x2_t b = vld1q_f64(x+i+2);
+                lo = vbslq_f64(vcltq_f64(a, lo), a, lo);
+                hi = vbslq_f64(vcltq_f64(b, hi), b, hi);
+            }
+            break;
+        case REDUCE_MAX:
+            for(size_t i = 0; i < n; i += 4){
+                float64x2_t a = vld1q_f64(x+i);
+                float64x2_t b = vld1q_f64(x+i+2);
+                lo = vbslq_f64(vcgtq_f64(a, lo), a, lo);
+                hi = vbslq_f64(vcgtq_f64(b, hi), b, hi);
+            }
+            break;
+    }
+    vst1q_f64(lanes, lo);
+    vst1q_f64(lanes+2, hi);
+#else
+    for(size_t i = 0; i < n; i += REDUCE_LANES)
+        for(int j = 0; j < REDUCE_LANES; j++)
+            lanes[j] = reduce_op(op, lanes[j], x[i+j]);
+#endif
+}
+
+static inline
+void
+reducer_flush(Reducer* r){
+    reduce_lanes(r->op, r->lanes, r->buf, r->nbuf);
+    r->count += r->nbuf;
+    r->nbuf = 0;
+}
+
+static inline
+void
+reducer_push(Reducer* r, double x){
+    r->buf[r->nbuf++] = x;
+    if(unlikely(r->nbuf == REDUCE_BLOCK))
+        reducer_flush(r);
+}
+
+// Folds x[0..n] in place when the block is empty, which keeps the lanes
+// lined up as the block is always flushed at a multiple of REDUCE_LANES.
+static inline
+void
+reducer_push_n(Reducer* r, const double* x, size_t n){
+    size_t i = 0;
+    if(!r->nbuf){
+        size_t direct = n - n % REDUCE_LANES;
+        reduce_lanes(r->op, r->lanes, x, direct);
+        r->count += direct;
+        i = direct;
+    }
+    for(; i < n; i++)
+        reducer_push(r, x[i]);
+}
+
+static inline
+double
+reducer_finish(Reducer* r){
+    unsigned full = r->nbuf - r->nbuf % REDUCE_LANES;
+    reduce_lanes(r->op, r->lanes, r->buf, full);
+    for(unsigned i = full; i < r->nbuf; i++)
+        r->lanes[i-full] = reduce_op(r->op, r->lanes[i-full], r->buf[i]);
+    r->count += r->nbuf;
+    r->nbuf = 0;
+    double lo = reduce_op(r->op, r->lanes[0], r->lanes[1]);
+    double hi = reduce_op(r->op, r->lanes[2], r->lanes[3]);
+    return reduce_op(r->op, lo, hi);
+}
+
+#ifdef __clang__
+#pragma clang assume_nonnull end
+#endif
+#endif
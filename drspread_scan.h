@@ -0,0 +1,117 @@
+//
+// Copyright © 2023-2025, David Priver <david@davidpriver.com>
+//
+#ifndef DRSPREAD_SCAN_H
+#define DRSPREAD_SCAN_H
+#include <stdint.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+// The intrinsics headers define _mm_malloc, which uses the functions
+// drspread_allocators.h poisons.
+#pragma push_macro("malloc")
+#pragma push_macro("free")
+#undef malloc
+#undef free
+#include <immintrin.h>
+#pragma pop_macro("free")
+#pragma pop_macro("malloc")
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+
+#ifndef force_inline
+#if defined(__GNUC__) || defined(__clang__)
+#define force_inline static inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#define force_inline static inline __forceinline
+#else
+#define force_inline static inline
+#endif
+#endif
+
+#ifdef __clang__
+#pragma clang assume_nonnull begin
+#endif
+
+// Finding the ends of the fields of delimited text (tsv, etc.) 64 bytes at a
+// time. Instead of searching for the next separator from every field, each
+// block gives a mask of where the separators and newlines are and the fields
+// are walked off of the set bits.
+
+enum {SCAN_BLOCK = 64};
+
+// Bit i is set if p[i] is '\n' or sep. p must have SCAN_BLOCK readable bytes.
+force_inline
+uint64_t
+delimiter_mask(const char* p, char sep){
+#if defined(__AVX2__)
+    __m256i nl = _mm256_set1_epi8('\n');
+    __m256i s = _mm256_set1_epi8(sep);
+    __m256i a = _mm256_loadu_si256((const __m256i*)p);
+    __m256i b = _mm256_loadu_si256((const __m256i*)(p+32));
+    uint32_t lo = (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(a, nl), _mm256_cmpeq_epi8(a, s)));
+    uint32_t hi = (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(b, nl), _mm256_cmpeq_epi8(b, s)));
+    return (uint64_t)hi << 32 | lo;
+#elif defined(__SSE2__)
+    __m128i nl = _mm_set1_epi8('\n');
+    __m128i s = _mm_set1_epi8(sep);
+    uint64_t mask = 0;
+    for(int i = 0; i < 4; i++){
+        __m128i v = _mm_loadu_si128((const __m128i*)(p+16*i));
+        uint16_t m = (uint16_t)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, s)));
+        mask |= (uint64_t)m << 16*i;
+    }
+    return mask;
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    // No movemask, so weight each byte by its bit and add them up.
+    static const uint8_t bits[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+    uint8x16_t weights = vld1q_u8(bits);
+    uint8x16_t nl = vdupq_n_u8('\n');
+    uint8x16_t s = vdupq_n_u8((uint8_t)sep);
+    uint64_t mask = 0;
+    for(int i = 0; i < 4; i++){
+        uint8x16_t v = vld1q_u8((const uint8_t*)p+16*i);
+        uint8x16_t m = vandq_u8(vorrq_u8(vceqq_u8(v, nl), vceqq_u8(v, s)), weights);
+        uint64_t lo = vaddv_u8(vget_low_u8(m));
+        uint64_t hi = vaddv_u8(vget_high_u8(m));
+        mask |= (lo | hi << 8) << 16*i;
+    }
+    return mask;
+#else
+    uint64_t mask = 0;
+    for(int i = 0; i < SCAN_BLOCK; i++)
+        if(p[i] == '\n' || p[i] == sep)
+            mask |= (uint64_t)1 << i;
+    return mask;
+#endif
+}
+
+// Index of the lowest set bit. mask must not be 0.
+force_inline
+unsigned
+lowest_bit(uint64_t mask){
+#if defined(__GNUC__) || defined(__clang__)
+    return (unsigned)__builtin_ctzll(mask);
+#elif defined(_MSC_VER) && defined(_M_X64)
+    unsigned long idx;
+    _BitScanForward64(&idx, mask);
+    return idx;
+#else
+    unsigned idx = 0;
+    while(!(mask & 1)){
+        mask >>= 1;
+        idx++;
+    }
+    return idx;
+#endif
+}
+
+#ifdef __clang__
+#pragma clang assume_nonnull end
+#endif
+
+#endif
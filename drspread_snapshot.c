@@ -0,0 +1,581 @@
+//
+// Copyright © 2023-2025, David Priver <david@davidpriver.com>
+//
+#ifndef DRSPREAD_SNAPSHOT_C
+#define DRSPREAD_SNAPSHOT_C
+#include <stddef.h>
+#include "drspread.h"
+#include "drspread_types.h"
+#include "hash_func.h"
+#ifdef __clang__
+#pragma clang assume_nonnull begin
+#endif
+
+// The snapshot is the header followed by arrays of the structs below, found
+// by their offsets from the start. Strings are referred to by their index in
+// the string table and sheets by their index in the sheet table, so nothing
+// in it is a pointer and it can be loaded from wherever it ends up (an
+// mmapped file). The strings are laid out as DrspStrs, which the loaded
+// context uses in place.
+//
+// The layout is that of the machine that wrote it, which is checked on
+// loading. Bump the version whenever any of it changes.
+enum {SNAPSHOT_VERSION = 2};
+enum {SNAPSHOT_BYTE_ORDER = 0x01020304};
+enum {SNAPSHOT_NONE = UINT32_MAX};
+
+typedef struct SnapshotArray SnapshotArray;
+struct SnapshotArray {
+    uint64_t offset, count;
+};
+
+typedef struct SnapshotHeader SnapshotHeader;
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t size;
+    SnapshotArray strings; // SnapshotString
+    SnapshotArray sheets;  // SnapshotSheet
+};
+
+static const char SNAPSHOT_MAGIC[8] = "drspsnap";
+
+typedef struct SnapshotString SnapshotString;
+struct SnapshotString {
+    uint64_t offset; // of the DrspStr
+};
+
+typedef struct SnapshotColumn SnapshotColumn;
+struct SnapshotColumn {
+    int64_t len;
+    uint64_t count;
+    // len each of uint32_t string indexes, doubles and CellKinds.
+    uint64_t atoms, numbers, kinds;
+};
+
+typedef struct SnapshotCell SnapshotCell;
+struct SnapshotCell {
+    RowCol loc;
+    uint32_t str;
+};
+
+// Column names only use col.
+typedef struct SnapshotName SnapshotName;
+struct SnapshotName {
+    uint32_t str;
+    uint32_t _pad;
+    int64_t row, col;
+};
+
+typedef struct SnapshotResult SnapshotResult;
+struct SnapshotResult {
+    RowCol loc;
+    uint32_t kind;
+    uint32_t str;
+    double number;
+};
+
+typedef struct SnapshotDep SnapshotDep;
+struct SnapshotDep {
+    RowCol src, dst;
+};
+
+typedef struct SnapshotSheet SnapshotSheet;
+struct SnapshotSheet {
+    uint32_t name, alias;
+    uint32_t flags;
+    int32_t paramc;
+    int64_t params[4][2];
+    int64_t out_row, out_col;
+    int64_t width, height;
+    uint32_t dirty;
+    uint32_t nextra;
+    int64_t extra[8];
+    SnapshotArray columns;        // SnapshotColumn
+    SnapshotArray sparse;         // SnapshotCell
+    SnapshotArray col_names;      // SnapshotName
+    SnapshotArray named_cells;    // SnapshotName
+    SnapshotArray output_results; // SnapshotResult
+    SnapshotArray results;        // SnapshotResult
+    SnapshotArray deps;           // SnapshotDep
+    SnapshotArray dirty_cells;    // RowCol
+    SnapshotArray dependants;     // uint32_t sheet indexes
+};
+
+_Static_assert(arrlen(((SnapshotSheet*)0)->extra) == arrlen(((ExtraDimensionalCellCache*)0)->cells), "");
+_Static_assert(arrlen(((SnapshotSheet*)0)->params) == arrlen(((SheetData*)0)->params), "");
+
+typedef struct SnapshotWriter SnapshotWriter;
+struct SnapshotWriter {
+    SnapshotBuffer* buf;
+    _Bool oom;
+    // The strings written so far, in the order of their indexes, and a hash
+    // table of indexes into them.
+    DrspAtom _Nullable* atoms;
+    size_t natoms, atomcap;
+    uint32_t*_Nullable indexes;
+    size_t index_cap;
+};
+
+// Appends size bytes at the next multiple of align and returns their offset.
+static
+uint64_t
+snapshot_write(SnapshotWriter* w, const void*_Nullable p, size_t size, size_t align){
+    SnapshotBuffer* buf = w->buf;
+    size_t start = (buf->size + align - 1) & ~(align - 1);
+    if(start + size > buf->capacity){
+        size_t new_cap = buf->capacity?buf->capacity*2:4096;
+        while(new_cap < start + size) new_cap *= 2;
+        unsigned char* data = drsp_alloc(buf->capacity, buf->data, new_cap, 8);
+        if(!data){
+            w->oom = 1;
+            return 0;
+        }
+        buf->data = data;
+        buf->capacity = new_cap;
+    }
+    __builtin_memset(buf->data + buf->size, 0, start - buf->size);
+    if(p) __builtin_memcpy(buf->data + start, p, size);
+    else __builtin_memset(buf->data + start, 0, size);
+    buf->size = start + size;
+    return start;
+}
+
+static
+SnapshotArray
+snapshot_write_array(SnapshotWriter* w, const void*_Nullable p, size_t count, size_t size, size_t align){
+    if(!count) return (SnapshotArray){0};
+    return (SnapshotArray){snapshot_write(w, p, count*size, align), count};
+}
+
+static
+uint32_t
+snapshot_atom(SnapshotWriter* w, DrspAtom _Nullable a){
+    if(!a) return SNAPSHOT_NONE;
+    if(w->natoms*2 >= w->index_cap){
+        size_t new_cap = w->index_cap?w->index_cap*2:256;
+        uint32_t* indexes = drsp_alloc(0, NULL, new_cap*sizeof *indexes, _Alignof(uint32_t));
+        DrspAtom* atoms = drsp_alloc(w->atomcap*sizeof *atoms, w->atoms, new_cap/2*sizeof *atoms, _Alignof(DrspAtom));
+        if(atoms){
+            w->atoms = atoms;
+            w->atomcap = new_cap/2;
+        }
+        if(!indexes || !atoms){
+            drsp_alloc(new_cap*sizeof *indexes, indexes, 0, _Alignof(uint32_t));
+            w->oom = 1;
+            return SNAPSHOT_NONE;
+        }
+        __builtin_memset(indexes, 0xff, new_cap*sizeof *indexes);
+        for(size_t i = 0; i < w->natoms; i++){
+            uint32_t idx = fast_reduce32(hash_alignany(&w->atoms[i], sizeof w->atoms[i]), (uint32_t)new_cap);
+            while(indexes[idx] != UINT32_MAX){
+                idx++;
+                if(unlikely(idx >= new_cap)) idx = 0;
+            }
+            indexes[idx] = (uint32_t)i;
+        }
+        drsp_alloc(w->index_cap*sizeof *w->indexes, w->indexes, 0, _Alignof(uint32_t));
+        w->indexes = indexes;
+        w->index_cap = new_cap;
+    }
+    uint32_t idx = fast_reduce32(hash_alignany(&a, sizeof a), (uint32_t)w->index_cap);
+    for(;;){
+        uint32_t i = w->indexes[idx];
+        if(i == UINT32_MAX){
+            w->indexes[idx] = (uint32_t)w->natoms;
+            w->atoms[w->natoms] = a;
+            return (uint32_t)w->natoms++;
+        }
+        if(w->atoms[i] == a) return i;
+        idx++;
+        if(unlikely(idx >= w->index_cap)) idx = 0;
+    }
+}
+
+static
+SnapshotArray
+snapshot_write_results(SnapshotWriter* w, const OutputResultCache* cache){
+    SnapshotArray result = {0};
+    const CachedResult* items = (const CachedResult*)cache->data;
+    for(size_t i = 0; i < cache->n; i++){
+        const CachedResult* cr = &items[i];
+        SnapshotResult r = {cr->loc, cr->kind, SNAPSHOT_NONE, 0};
+        if(cr->kind == CACHED_RESULT_NUMBER)
+            r.number = cr->number;
+        else if(cr->kind != CACHED_RESULT_NULL)
+            r.str = snapshot_atom(w, cr->string);
+        uint64_t off = snapshot_write(w, &r, sizeof r, _Alignof(SnapshotResult));
+        if(!i) result.offset = off;
+    }
+    result.count = cache->n;
+    return result;
+}
+
+static
+void
+snapshot_write_sheet(SnapshotWriter* w, const DrSpreadCtx* ctx, const SheetData* sd, SnapshotSheet* out){
+    *out = (SnapshotSheet){
+        .name = snapshot_atom(w, sd->name),
+        .alias = snapshot_atom(w, sd->alias),
+        .flags = sd->flags,
+        .paramc = sd->paramc,
+        .out_row = sd->out_row,
+        .out_col = sd->out_col,
+        .width = sd->width,
+        .height = sd->height,
+        .dirty = sd->dirty,
+        .nextra = sd->extra_dimensional.count,
+    };
+    for(int i = 0; i < sd->paramc; i++){
+        out->params[i][0] = sd->params[i].row;
+        out->params[i][1] = sd->params[i].col;
+    }
+    for(unsigned i = 0; i < sd->extra_dimensional.count; i++)
+        out->extra[i] = sd->extra_dimensional.cells[i].id;
+
+    const CellCache* cache = &sd->cell_cache;
+    // The columns' arrays are written first so the table of them is in one
+    // piece.
+    BuffCheckpoint bc = buff_checkpoint(ctx->a);
+    SnapshotColumn* columns = buff_alloc(ctx->a, (cache->ncolumns+1)*sizeof *columns);
+    if(!columns){
+        w->oom = 1;
+        return;
+    }
+    for(size_t c = 0; c < cache->ncolumns; c++){
+        const CellColumn* column = &cache->columns[c];
+        SnapshotColumn* sc = &columns[c];
+        *sc = (SnapshotColumn){.len = column->len, .count = column->count};
+        if(!column->len) continue;
+        sc->atoms = snapshot_write(w, NULL, column->len*sizeof(uint32_t), _Alignof(uint32_t));
+        if(w->oom) break;
+        for(intptr_t r = 0; r < column->len; r++){
+            uint32_t s = snapshot_atom(w, column->atoms[r]);
+            __builtin_memcpy(w->buf->data + sc->atoms + r*sizeof s, &s, sizeof s);
+        }
+        sc->numbers = snapshot_write(w, column->numbers, column->len*sizeof *column->numbers, _Alignof(double));
+        sc->kinds = snapshot_write(w, column->kinds, column->len*sizeof *column->kinds, 1);
+    }
+    out->columns = snapshot_write_array(w, columns, cache->ncolumns, sizeof *columns, _Alignof(SnapshotColumn));
+    buff_set(ctx->a, bc);
+
+    const RowColSv* sparse = (const RowColSv*)cache->data;
+    out->sparse = (SnapshotArray){0, cache->n};
+    for(size_t i = 0; i < cache->n; i++){
+        SnapshotCell cell = {sparse[i].rc, snapshot_atom(w, sparse[i].sv)};
+        uint64_t off = snapshot_write(w, &cell, sizeof cell, _Alignof(SnapshotCell));
+        if(!i) out->sparse.offset = off;
+    }
+
+    const ColName* col_names = (const ColName*)sd->col_cache.data;
+    out->col_names = (SnapshotArray){0, sd->col_cache.n};
+    for(size_t i = 0; i < sd->col_cache.n; i++){
+        SnapshotName name = {snapshot_atom(w, col_names[i].name), 0, 0, col_names[i].idx};
+        uint64_t off = snapshot_write(w, &name, sizeof name, _Alignof(SnapshotName));
+        if(!i) out->col_names.offset = off;
+    }
+
+    out->named_cells = (SnapshotArray){0, sd->named_cells.count};
+    for(size_t i = 0; i < sd->named_cells.count; i++){
+        const NamedCell* nc = &sd->named_cells.data[i];
+        SnapshotName name = {snapshot_atom(w, nc->name), 0, nc->row, nc->col};
+        uint64_t off = snapshot_write(w, &name, sizeof name, _Alignof(SnapshotName));
+        if(!i) out->named_cells.offset = off;
+    }
+
+    out->output_results = snapshot_write_results(w, &sd->output_result_cache);
+    out->results = snapshot_write_results(w, &sd->result_cache);
+
+    // Just the edges, the head entries are made again when they are added.
+    const CellDep* deps = (const CellDep*)sd->deps.data;
+    for(size_t i = 0; i < sd->deps.n; i++){
+        if(deps[i].dst.row == IDX_UNSET && deps[i].dst.col == IDX_UNSET) continue;
+        SnapshotDep dep = {deps[i].src, deps[i].dst};
+        uint64_t off = snapshot_write(w, &dep, sizeof dep, _Alignof(SnapshotDep));
+        if(!out->deps.count++) out->deps.offset = off;
+    }
+
+    out->dirty_cells = snapshot_write_array(w, sd->dirty_cells.data, sd->dirty_cells.n, sizeof(RowCol), _Alignof(RowCol));
+
+    for(size_t i = 0; i < sd->dependants.count; i++){
+        const SheetData* dep = sheet_lookup_by_handle(ctx, sd->dependants.data[i]);
+        if(!dep) continue;
+        uint32_t idx = (uint32_t)(dep - ctx->map.data);
+        uint64_t off = snapshot_write(w, &idx, sizeof idx, _Alignof(uint32_t));
+        if(!out->dependants.count++) out->dependants.offset = off;
+    }
+}
+
+DRSP_EXPORT
+size_t
+drsp_save_snapshot(DrSpreadCtx* ctx, const void*_Nullable*_Nonnull data){
+    *data = NULL;
+    SnapshotWriter w = {.buf = &ctx->snapshot};
+    ctx->snapshot.size = 0;
+    SnapshotHeader header = {
+        .version = SNAPSHOT_VERSION,
+        .byte_order = SNAPSHOT_BYTE_ORDER,
+    };
+    __builtin_memcpy(header.magic, SNAPSHOT_MAGIC, sizeof header.magic);
+    snapshot_write(&w, &header, sizeof header, 8);
+    size_t nsheets = ctx->map.n;
+    header.sheets = (SnapshotArray){snapshot_write(&w, NULL, nsheets*sizeof(SnapshotSheet), _Alignof(SnapshotSheet)), nsheets};
+    for(size_t i = 0; i < nsheets && !w.oom; i++){
+        SnapshotSheet sheet;
+        snapshot_write_sheet(&w, ctx, &ctx->map.data[i], &sheet);
+        if(w.oom) break;
+        __builtin_memcpy(ctx->snapshot.data + header.sheets.offset + i*sizeof sheet, &sheet, sizeof sheet);
+    }
+    if(!w.oom){
+        header.strings = (SnapshotArray){snapshot_write(&w, NULL, w.natoms*sizeof(SnapshotString), _Alignof(SnapshotString)), w.natoms};
+        for(size_t i = 0; i < w.natoms && !w.oom; i++){
+            DrspAtom a = w.atoms[i];
+            SnapshotString s = {
+                .offset = snapshot_write(&w, a, offsetof(DrspStr, data)+a->length, _Alignof(DrspStr)),
+            };
+            if(w.oom) break;
+            __builtin_memcpy(ctx->snapshot.data + header.strings.offset + i*sizeof s, &s, sizeof s);
+        }
+    }
+    drsp_alloc(w.atomcap*sizeof *w.atoms, w.atoms, 0, _Alignof(DrspAtom));
+    drsp_alloc(w.index_cap*sizeof *w.indexes, w.indexes, 0, _Alignof(uint32_t));
+    if(w.oom){
+        ctx->snapshot.size = 0;
+        return 0;
+    }
+    header.size = ctx->snapshot.size;
+    __builtin_memcpy(ctx->snapshot.data, &header, sizeof header);
+    *data = ctx->snapshot.data;
+    return ctx->snapshot.size;
+}
+
+typedef struct SnapshotReader SnapshotReader;
+struct SnapshotReader {
+    const unsigned char* data;
+    size_t size;
+    DrspAtom _Nullable* atoms;
+    size_t natoms;
+};
+
+// The array if it is in bounds and aligned, else NULL.
+static
+const void*_Nullable
+snapshot_array(const SnapshotReader* r, SnapshotArray a, size_t size, size_t align){
+    if(!a.count) return r->data;
+    if(a.offset > r->size || a.offset % align) return NULL;
+    if(a.count > (r->size - a.offset) / size) return NULL;
+    return r->data + a.offset;
+}
+
+// Whether the string index is valid. Sets *out to the atom (NULL for
+// SNAPSHOT_NONE).
+static
+_Bool
+snapshot_atom_at(const SnapshotReader* r, uint32_t idx, DrspAtom _Nullable* out){
+    if(idx == SNAPSHOT_NONE){
+        *out = NULL;
+        return 1;
+    }
+    if(idx >= r->natoms) return 0;
+    *out = r->atoms[idx];
+    return 1;
+}
+
+static
+int
+snapshot_load_results(SnapshotReader* r, SnapshotArray a, OutputResultCache* cache){
+    const SnapshotResult* results = snapshot_array(r, a, sizeof *results, _Alignof(SnapshotResult));
+    if(!results) return 1;
+    for(size_t i = 0; i < a.count; i++){
+        const SnapshotResult* sr = &results[i];
+        CachedResult result = {.loc = sr->loc, .kind = sr->kind};
+        switch(sr->kind){
+            case CACHED_RESULT_NULL:
+                break;
+            case CACHED_RESULT_NUMBER:
+                result.number = sr->number;
+                break;
+            case CACHED_RESULT_STRING:
+                if(!snapshot_atom_at(r, sr->str, &result.string) || !result.string) return 1;
+                break;
+            case CACHED_RESULT_ERROR:
+                if(!snapshot_atom_at(r, sr->str, &result.string)) return 1;
+                break;
+            default:
+                return 1;
+        }
+        CachedResult* cr = get_cached_output_result(cache, result.loc.row, result.loc.col);
+        if(!cr) return 1;
+        *cr = result;
+    }
+    return 0;
+}
+
+static
+int
+snapshot_load_sheet(DrSpreadCtx* ctx, SnapshotReader* r, const SnapshotSheet* ss, SheetData* sd, SheetData*const* sheets, size_t nsheets){
+    if(ss->paramc < 0 || (size_t)ss->paramc > arrlen(sd->params)) return 1;
+    if(ss->nextra > arrlen(sd->extra_dimensional.cells)) return 1;
+    if(!snapshot_atom_at(r, ss->alias, &sd->alias)) return 1;
+    sd->flags = ss->flags;
+    sd->paramc = ss->paramc;
+    for(int i = 0; i < ss->paramc; i++)
+        sd->params[i] = (UserDefinedFunctionParameter){ss->params[i][0], ss->params[i][1]};
+    sd->out_row = ss->out_row;
+    sd->out_col = ss->out_col;
+    sd->width = ss->width;
+    sd->height = ss->height;
+    sd->extra_dimensional.count = ss->nextra;
+    for(unsigned i = 0; i < ss->nextra; i++)
+        sd->extra_dimensional.cells[i].id = ss->extra[i];
+
+    CellCache* cache = &sd->cell_cache;
+    const SnapshotColumn* columns = snapshot_array(r, ss->columns, sizeof *columns, _Alignof(SnapshotColumn));
+    if(!columns) return 1;
+    if(ss->columns.count && add_cell_columns(cache, ss->columns.count-1)) return 1;
+    for(size_t c = 0; c < ss->columns.count; c++){
+        const SnapshotColumn* sc = &columns[c];
+        if(sc->len < 0 || sc->count > (uint64_t)sc->len) return 1;
+        if(!sc->len) continue;
+        size_t len = sc->len;
+        const uint32_t* atoms = snapshot_array(r, (SnapshotArray){sc->atoms, len}, sizeof *atoms, _Alignof(uint32_t));
+        const double* numbers = snapshot_array(r, (SnapshotArray){sc->numbers, len}, sizeof *numbers, _Alignof(double));
+        const CellKind* kinds = snapshot_array(r, (SnapshotArray){sc->kinds, len}, sizeof *kinds, 1);
+        if(!atoms || !numbers || !kinds) return 1;
+        CellColumn* column = &cache->columns[c];
+        if(extend_cell_column(column, sc->len)) return 1;
+        for(size_t row = 0; row < len; row++){
+            if(!snapshot_atom_at(r, atoms[row], &column->atoms[row])) return 1;
+            if(kinds[row] > CELL_FORMULA) return 1;
+        }
+        __builtin_memcpy(column->numbers, numbers, len*sizeof *numbers);
+        __builtin_memcpy(column->kinds, kinds, len*sizeof *kinds);
+        column->count = sc->count;
+    }
+
+    const SnapshotCell* sparse = snapshot_array(r, ss->sparse, sizeof *sparse, _Alignof(SnapshotCell));
+    if(!sparse) return 1;
+    for(size_t i = 0; i < ss->sparse.count; i++){
+        DrspAtom a;
+        if(!snapshot_atom_at(r, sparse[i].str, &a) || !a) return 1;
+        if(set_sparse_cell(cache, sparse[i].loc.row, sparse[i].loc.col, a)) return 1;
+    }
+
+    const SnapshotName* names = snapshot_array(r, ss->col_names, sizeof *names, _Alignof(SnapshotName));
+    if(!names) return 1;
+    for(size_t i = 0; i < ss->col_names.count; i++){
+        DrspAtom a;
+        if(!snapshot_atom_at(r, names[i].str, &a) || !a) return 1;
+        if(set_cached_col_name(&sd->col_cache, a, names[i].col)) return 1;
+    }
+
+    names = snapshot_array(r, ss->named_cells, sizeof *names, _Alignof(SnapshotName));
+    if(!names) return 1;
+    for(size_t i = 0; i < ss->named_cells.count; i++){
+        DrspAtom a;
+        if(!snapshot_atom_at(r, names[i].str, &a) || !a) return 1;
+        if(set_named_cell(&sd->named_cells, a, names[i].row, names[i].col)) return 1;
+    }
+
+    if(snapshot_load_results(r, ss->output_results, &sd->output_result_cache)) return 1;
+    if(snapshot_load_results(r, ss->results, &sd->result_cache)) return 1;
+
+    const SnapshotDep* deps = snapshot_array(r, ss->deps, sizeof *deps, _Alignof(SnapshotDep));
+    if(!deps) return 1;
+    for(size_t i = 0; i < ss->deps.count; i++)
+        if(cell_deps_add(&sd->deps, deps[i].src, deps[i].dst)) return 1;
+
+    const RowCol* dirty = snapshot_array(r, ss->dirty_cells, sizeof *dirty, _Alignof(RowCol));
+    if(!dirty) return 1;
+    for(size_t i = 0; i < ss->dirty_cells.count; i++)
+        if(cell_set_add(&sd->dirty_cells, dirty[i])) return 1;
+
+    const uint32_t* dependants = snapshot_array(r, ss->dependants, sizeof *dependants, _Alignof(uint32_t));
+    if(!dependants) return 1;
+    for(size_t i = 0; i < ss->dependants.count; i++){
+        if(dependants[i] >= nsheets) return 1;
+        if(unique_add(&sd->dependants, sheets[dependants[i]]->handle)) return 1;
+    }
+
+    sd->dirty = !!ss->dirty;
+    sheet_new_layout(&ctx->map, sd);
+    return 0;
+}
+
+DRSP_EXPORT
+int
+drsp_load_snapshot(DrSpreadCtx* ctx, const void* data, size_t length){
+    SnapshotHeader header;
+    if(length < sizeof header || (uintptr_t)data % 8) return 1;
+    __builtin_memcpy(&header, data, sizeof header);
+    if(__builtin_memcmp(header.magic, SNAPSHOT_MAGIC, sizeof header.magic) != 0) return 1;
+    if(header.version != SNAPSHOT_VERSION || header.byte_order != SNAPSHOT_BYTE_ORDER) return 1;
+    if(header.size > length) return 1;
+    SnapshotReader r = {.data = data, .size = header.size};
+    const SnapshotString* strings = snapshot_array(&r, header.strings, sizeof *strings, _Alignof(SnapshotString));
+    const SnapshotSheet* ssheets = snapshot_array(&r, header.sheets, sizeof *ssheets, _Alignof(SnapshotSheet));
+    if(!strings || !ssheets) return 1;
+    for(size_t i = 0; i < header.strings.count; i++){
+        uint64_t off = strings[i].offset;
+        if(off % _Alignof(DrspStr) || off > r.size || r.size - off < offsetof(DrspStr, data)) return 1;
+        const DrspStr* s = (const DrspStr*)(r.data + off);
+        if(s->length > r.size - off - offsetof(DrspStr, data)) return 1;
+    }
+
+    int err = 1;
+    BuffCheckpoint bc = buff_checkpoint(ctx->a);
+    size_t nsheets = header.sheets.count;
+    SheetData** sheets = buff_alloc(ctx->a, (nsheets+1)*sizeof *sheets);
+    r.natoms = header.strings.count;
+    r.atoms = buff_alloc(ctx->a, (r.natoms+1)*sizeof *r.atoms);
+    if(!sheets || !r.atoms) goto finish;
+    for(size_t i = 0; i < r.natoms; i++){
+        const DrspStr* s = (const DrspStr*)(r.data + strings[i].offset);
+        // The short ones aren't in the heap. The hashes aren't stored as a
+        // wrong one would put a second copy of the string in the heap.
+        if(s->length < 2)
+            r.atoms[i] = drsp_intern_str(ctx, s->data, s->length);
+        else
+            r.atoms[i] = string_heap_adopt(&ctx->sheap, hash_align1(s->data, s->length), s);
+        if(!r.atoms[i]) goto finish;
+    }
+    // The sheets are all matched up before any of them are touched.
+    for(size_t i = 0; i < nsheets; i++){
+        DrspAtom name;
+        if(!snapshot_atom_at(&r, ssheets[i].name, &name) || !name) goto finish;
+        sheets[i] = NULL;
+        for(size_t j = 0; j < ctx->map.n; j++){
+            SheetData* sd = &ctx->map.data[j];
+            if(sd->name != name) continue;
+            if(sd->cell_cache.ncolumns || sd->cell_cache.n) goto finish;
+            sheets[i] = sd;
+            break;
+        }
+        if(!sheets[i]) goto finish;
+        for(size_t j = 0; j < i; j++)
+            if(sheets[j] == sheets[i]) goto finish;
+    }
+    for(size_t i = 0; i < nsheets; i++)
+        if(snapshot_load_sheet(ctx, &r, &ssheets[i], sheets[i], sheets, nsheets)) goto finish;
+    ctx->map.generation++;
+    sheet_map_reindex(&ctx->map);
+    // Show what was saved, the same way drsp_evaluate_formulas would.
+    ctx->updates.count = 0;
+    for(size_t i = 0; i < nsheets; i++){
+        SheetData* sd = sheets[i];
+        const CachedResult* items = (const CachedResult*)sd->output_result_cache.data;
+        for(size_t j = 0; j < sd->output_result_cache.n; j++)
+            show_result(ctx, sd, &items[j]);
+    }
+    if(ctx->batch_display) sort_display_updates(ctx);
+    err = 0;
+    finish:
+    buff_set(ctx->a, bc);
+    return err;
+}
+
+#ifdef __clang__
+#pragma clang assume_nonnull end
+#endif
+#endif
@@ -6,6 +6,8 @@
 #include <stddef.h>
 #include "drspread_types.h"
 #include "hash_func.h"
+#include "parse_numbers.h"
+#include "drspread_scan.h"
 #ifdef __clang__
 #pragma clang assume_nonnull begin
 #endif
@@ -27,21 +29,53 @@ drsp_create_ctx(ARGS){
     #ifndef DRSPREAD_DIRECT_OPS
         __builtin_memcpy((void*)&ctx->_ops, ops, sizeof *ops);
     #endif
-    BuffAllocator a = {(char*)(ctx+1), (char*)(ctx+1), CTX_EXTRA+(char*)(ctx+1)};
-    __builtin_memcpy((void*)&ctx->_a, &a, sizeof a);
+    buff_init(&ctx->_a, ctx+1, CTX_EXTRA);
     ctx->a = &ctx->_a;
     ctx->null.kind = EXPR_BLANK;
     ctx->error.e.kind = EXPR_ERROR;
     return ctx;
 }
 
+DRSP_INTERNAL
+DrSpreadCtx*_Nullable
+create_worker_ctx(DrSpreadCtx* ctx, LOCK_T* heap_lock){
+    size_t sz = (CTX_EXTRA+sizeof(DrSpreadCtx));
+    DrSpreadCtx* worker = drsp_alloc(0, NULL, sz, _Alignof(DrSpreadCtx));
+    if(!worker) return NULL;
+    __builtin_memset(worker, 0, sizeof *worker);
+    #ifndef DRSPREAD_DIRECT_OPS
+        __builtin_memcpy((void*)&worker->_ops, &ctx->_ops, sizeof ctx->_ops);
+    #endif
+    worker->map = ctx->map;
+    buff_init(&worker->_a, worker+1, CTX_EXTRA);
+    worker->a = &worker->_a;
+    worker->null.kind = EXPR_BLANK;
+    worker->error.e.kind = EXPR_ERROR;
+    worker->parent = ctx;
+    worker->heap_lock = heap_lock;
+    return worker;
+}
+
+DRSP_INTERNAL
+void
+destroy_worker_ctx(DrSpreadCtx* worker){
+    buff_release_all(&worker->_a);
+    free_linked_arenas(worker->temp_string_arena);
+    drsp_alloc(worker->pending.capacity*sizeof *worker->pending.data, worker->pending.data, 0, _Alignof(PendingCell));
+    drsp_alloc(sizeof*worker+CTX_EXTRA, worker, 0, _Alignof(DrSpreadCtx));
+}
+
 static
 void
 drsp_destroy_ctx_(DrSpreadCtx* ctx){
+    buff_release_all(&ctx->_a);
     free_linked_arenas(ctx->temp_string_arena);
     free_sheet_datas(ctx);
     destroy_string_heap(&ctx->sheap);
     destroy_parse_heap(&ctx->pheap);
+    drsp_alloc(ctx->pending.capacity*sizeof *ctx->pending.data, ctx->pending.data, 0, _Alignof(PendingCell));
+    drsp_alloc(ctx->updates.capacity*sizeof *ctx->updates.data, ctx->updates.data, 0, _Alignof(DrspDisplayUpdate));
+    drsp_alloc(ctx->snapshot.capacity, ctx->snapshot.data, 0, 8);
     memset(ctx, 0xfe, sizeof(DrSpreadCtx));
 }
 
@@ -54,6 +88,56 @@ drsp_destroy_ctx(DrSpreadCtx*_Nullable ctx){
     return 0;
 }
 
+DRSP_EXPORT
+int
+drsp_set_thread_count(DrSpreadCtx* ctx, int nthreads){
+    if(nthreads < 0)
+        nthreads = num_cpus();
+    if(nthreads > EVAL_MAX_THREADS)
+        nthreads = EVAL_MAX_THREADS;
+    ctx->nthreads = nthreads;
+    return 0;
+}
+
+DRSP_EXPORT
+int
+drsp_set_display_batching(DrSpreadCtx* ctx, int on){
+    ctx->batch_display = !!on;
+    ctx->updates.count = 0;
+    return 0;
+}
+
+DRSP_EXPORT
+size_t
+drsp_get_display_updates(DrSpreadCtx* ctx, const DrspDisplayUpdate*_Nullable*_Nonnull updates){
+    *updates = ctx->updates.data;
+    return ctx->updates.count;
+}
+
+DRSP_EXPORT
+int
+drsp_next_changed(DrSpreadCtx* ctx, DrspChangeIter* iter, SheetHandle* sheet, intptr_t* row, intptr_t* col, DrSpreadResult* result){
+    if(iter->next >= ctx->updates.count) return 0;
+    const DrspDisplayUpdate* u = &ctx->updates.data[iter->next++];
+    *sheet = u->sheet;
+    *row = u->row;
+    *col = u->col;
+    *result = u->value;
+    return 1;
+}
+
+// Formulas that name a sheet can now find a different sheet (or find one
+// where they didn't before), and only the sheets that found this one are its
+// dependants, so every sheet is evaluated again.
+static
+void
+sheet_names_changed(DrSpreadCtx* ctx){
+    ctx->map.generation++;
+    sheet_map_reindex(&ctx->map);
+    for(size_t i = 0; i < ctx->map.n; i++)
+        sheet_mark_dirty(ctx, &ctx->map.data[i]);
+}
+
 // This has to be called before any other usage of that sheet.
 DRSP_EXPORT
 int
@@ -63,7 +147,7 @@ drsp_set_sheet_name(DrSpreadCtx*restrict ctx, SheetHandle sheet, const char*rest
     DrspAtom str = drsp_intern_str_lower(ctx, name, length);
     if(!str) return 1;
     sd->name = str;
-    sheet_mark_dirty(ctx, sd);
+    sheet_names_changed(ctx);
     return 0;
 }
 
@@ -75,7 +159,30 @@ drsp_set_sheet_alias(DrSpreadCtx*restrict ctx, SheetHandle sheet, const char*res
     DrspAtom str = drsp_intern_str_lower(ctx, name, length);
     if(!str) return 1;
     sd->alias = str;
-    sheet_mark_dirty(ctx, sd);
+    sheet_names_changed(ctx);
+    return 0;
+}
+
+static
+int
+sheet_set_cell(DrSpreadCtx* ctx, SheetData* sd, intptr_t row, intptr_t col, DrspAtom str){
+    // Growing the sheet changes what whole column/row ranges cover, which
+    // isn't captured by the cell dependencies.
+    _Bool grew = 0;
+    if(row+1 > sd->height){
+        sd->height = row+1;
+        grew = 1;
+    }
+    if(col+1 > sd->width){
+        sd->width = col+1;
+        grew = 1;
+    }
+    int err = set_cached_cell(&sd->cell_cache, row, col, str);
+    if(err) return err;
+    if(grew)
+        sheet_mark_dirty(ctx, sd);
+    else
+        sheet_mark_cell_dirty(ctx, sd, row, col);
     return 0;
 }
 
@@ -84,19 +191,12 @@ int
 drsp_set_cell_str(DrSpreadCtx*restrict ctx, SheetHandle sheet, intptr_t row, intptr_t col, const char*restrict text, size_t length){
     SheetData* sd = sheet_lookup_by_handle(ctx, sheet);
     if(!sd) return 1;
-    if(row+1 > sd->height)
-        sd->height = row+1;
-    if(col+1 > sd->width)
-        sd->width = col+1;
     StringView sv = stripped2(text, length);
     text = sv.text;
     length = sv.length;
     DrspAtom str = drsp_intern_str(ctx, text, length);
     if(!str) return 1;
-    int err = set_cached_cell(&sd->cell_cache, row, col, str);
-    if(err) return err;
-    sheet_mark_dirty(ctx, sd);
-    return 0;
+    return sheet_set_cell(ctx, sd, row, col, str);
 }
 
 DRSP_EXPORT
@@ -105,16 +205,205 @@ drsp_set_cell_atom(DrSpreadCtx*restrict ctx, SheetHandle sheet, intptr_t row, in
     if(!str) return 1;
     SheetData* sd = sheet_lookup_by_handle(ctx, sheet);
     if(!sd) return 1;
-    if(row+1 > sd->height)
-        sd->height = row+1;
-    if(col+1 > sd->width)
-        sd->width = col+1;
-    int err = set_cached_cell(&sd->cell_cache, row, col, str);
-    if(err) return err;
-    sheet_mark_dirty(ctx, sd);
+    return sheet_set_cell(ctx, sd, row, col, str);
+}
+
+static inline
+_Bool
+dense_fits(intptr_t idx, intptr_t len, size_t count);
+
+// rows or cols can be NULL, in which case the cells are in consecutive rows
+// starting at `row` or all in `col`.
+static
+int
+sheet_set_cells(DrSpreadCtx* ctx, SheetData* sd, size_t n, const intptr_t*_Nullable rows, const intptr_t*_Nullable cols, intptr_t row, intptr_t col, const char*const* texts, const size_t* lengths){
+    if(!n) return 0;
+    intptr_t maxrow = rows?-1:row+(intptr_t)n-1;
+    intptr_t maxcol = cols?-1:col;
+    for(size_t i = 0; i < n; i++){
+        if(rows && rows[i] > maxrow) maxrow = rows[i];
+        if(cols && cols[i] > maxcol) maxcol = cols[i];
+    }
+    // Size the columns up front instead of doubling them as we go.
+    int err = 0;
+    if(!cols)
+        err = reserve_cached_cells(&sd->cell_cache, col, maxrow+1, n);
+    else if(maxcol >= 0 && dense_fits(maxcol, sd->cell_cache.ncolumns, sd->cell_cache.ncolumns)){
+        BuffCheckpoint bc = buff_checkpoint(ctx->a);
+        size_t ncols = maxcol+1;
+        intptr_t* lens = buff_alloc(ctx->a, ncols*sizeof *lens);
+        size_t* counts = buff_alloc(ctx->a, ncols*sizeof *counts);
+        if(lens && counts){
+            __builtin_memset(lens, 0, ncols*sizeof *lens);
+            __builtin_memset(counts, 0, ncols*sizeof *counts);
+            for(size_t i = 0; i < n; i++){
+                intptr_t r = rows?rows[i]:row+(intptr_t)i;
+                if(cols[i] < 0 || r < 0) continue;
+                if(r+1 > lens[cols[i]]) lens[cols[i]] = r+1;
+                counts[cols[i]]++;
+            }
+            for(size_t c = 0; c < ncols && !err; c++)
+                if(counts[c]) err = reserve_cached_cells(&sd->cell_cache, c, lens[c], counts[c]);
+        }
+        buff_set(ctx->a, bc);
+    }
+    // What drsp_set_cell_str does for each cell, except that the sheet is
+    // only marked dirty once if it needs to be.
+    _Bool whole_sheet = sd->dirty || (sd->flags & DRSP_SHEET_FLAGS_IS_FUNCTION);
+    if(maxrow+1 > sd->height){
+        sd->height = maxrow+1;
+        whole_sheet = 1;
+    }
+    if(maxcol+1 > sd->width){
+        sd->width = maxcol+1;
+        whole_sheet = 1;
+    }
+    size_t i = 0;
+    for(; i < n && !err; i++){
+        StringView sv = stripped2(texts[i], lengths[i]);
+        DrspAtom str = drsp_intern_str(ctx, sv.text, sv.length);
+        if(!str){
+            err = 1;
+            break;
+        }
+        err = set_cached_cell(&sd->cell_cache, rows?rows[i]:row+(intptr_t)i, cols?cols[i]:col, str);
+    }
+    if(whole_sheet)
+        sheet_mark_dirty(ctx, sd);
+    else {
+        // Only the ones that were actually set.
+        for(size_t j = 0; j < i; j++)
+            sheet_mark_cell_dirty(ctx, sd, rows?rows[j]:row+(intptr_t)j, cols?cols[j]:col);
+    }
+    return err;
+}
+
+DRSP_EXPORT
+int
+drsp_set_cells_bulk(DrSpreadCtx*restrict ctx, SheetHandle sheet, size_t n, const intptr_t* rows, const intptr_t* cols, const char*const* texts, const size_t* lengths){
+    SheetData* sd = sheet_lookup_by_handle(ctx, sheet);
+    if(!sd) return 1;
+    return sheet_set_cells(ctx, sd, n, rows, cols, 0, 0, texts, lengths);
+}
+
+DRSP_EXPORT
+int
+drsp_set_column_bulk(DrSpreadCtx*restrict ctx, SheetHandle sheet, intptr_t col, intptr_t row, size_t n, const char*const* texts, const size_t* lengths){
+    SheetData* sd = sheet_lookup_by_handle(ctx, sheet);
+    if(!sd) return 1;
+    return sheet_set_cells(ctx, sd, n, NULL, NULL, row, col, texts, lengths);
+}
+
+// For interning a batch of strings: the slots of all of them are prefetched
+// first so the cache misses overlap instead of being taken one at a time.
+static
+uint32_t
+drsp_prefetch_str(DrSpreadCtx* ctx, const char* txt, size_t length);
+
+static
+DrspAtom _Nullable
+drsp_intern_str_hashed(DrSpreadCtx* ctx, const char* txt, size_t length, uint32_t hash);
+
+typedef struct LoadedField LoadedField;
+struct LoadedField {
+    intptr_t row, col;
+    StringView sv;
+    uint32_t hash;
+};
+
+enum {LOAD_BATCH = 32};
+
+static
+int
+store_fields(DrSpreadCtx* ctx, SheetData* sd, LoadedField* fields, size_t n){
+    for(size_t i = 0; i < n; i++)
+        fields[i].hash = drsp_prefetch_str(ctx, fields[i].sv.text, fields[i].sv.length);
+    for(size_t i = 0; i < n; i++){
+        DrspAtom str = drsp_intern_str_hashed(ctx, fields[i].sv.text, fields[i].sv.length, fields[i].hash);
+        if(!str) return 1;
+        if(set_cached_cell(&sd->cell_cache, fields[i].row, fields[i].col, str)) return 1;
+    }
     return 0;
 }
 
+static inline
+int
+load_field(DrSpreadCtx* ctx, SheetData* sd, LoadedField* fields, size_t* n, intptr_t row, intptr_t col, const char* text, size_t length){
+    StringView sv = stripped2(text, length);
+    if(!sv.length) return 0;
+    fields[(*n)++] = (LoadedField){row, col, sv, 0};
+    if(*n < LOAD_BATCH) return 0;
+    *n = 0;
+    return store_fields(ctx, sd, fields, LOAD_BATCH);
+}
+
+DRSP_EXPORT
+int
+drsp_load_delimited(DrSpreadCtx*restrict ctx, SheetHandle sheet, const char*restrict data, size_t length, char sep){
+    if(!sep || sep == '\n') return 1;
+    SheetData* sd = sheet_lookup_by_handle(ctx, sheet);
+    if(!sd) return 1;
+    int err = 0;
+    intptr_t row = 0, col = 0, width = 0;
+    size_t start = 0; // of the current field
+    LoadedField fields[LOAD_BATCH];
+    size_t nfields = 0;
+    // Once the first few lines say how many columns there are and how long a
+    // line is, the columns are sized for the rest of the lines instead of
+    // doubling as they go. It's only a guess, so no rows are added to them,
+    // short first lines can't reserve more than ESTIMATE_MAX rows and if the
+    // room can't be had the columns grow as usual.
+    enum {ESTIMATE_LINES = 16, ESTIMATE_MAX = 1 << 20};
+    for(size_t off = 0; off < length && !err; off += SCAN_BLOCK){
+        uint64_t mask;
+        if(length - off >= SCAN_BLOCK)
+            mask = delimiter_mask(data+off, sep);
+        else {
+            // Pad the last partial block with bytes that can't match.
+            char tail[SCAN_BLOCK] = {0};
+            __builtin_memcpy(tail, data+off, length-off);
+            mask = delimiter_mask(tail, sep);
+        }
+        for(; mask; mask &= mask-1){
+            size_t end = off + lowest_bit(mask);
+            _Bool newline = data[end] == '\n';
+            size_t flen = end - start;
+            if(newline && flen && data[end-1] == '\r') flen--;
+            err = load_field(ctx, sd, fields, &nfields, row, col, data+start, flen);
+            if(err) break;
+            if(col+1 > width) width = col+1;
+            if(newline){
+                if(row == ESTIMATE_LINES-1){
+                    size_t nlines = length / ((end+1) / ESTIMATE_LINES) + 1;
+                    if(nlines > ESTIMATE_MAX) nlines = ESTIMATE_MAX;
+                    for(intptr_t c = 0; c < width; c++)
+                        if(reserve_cell_column(&sd->cell_cache, c, (intptr_t)nlines))
+                            break;
+                }
+                row++;
+                col = 0;
+            }
+            else
+                col++;
+            start = end+1;
+        }
+    }
+    // The last line, if it isn't terminated.
+    if(!err && length && data[length-1] != '\n'){
+        size_t flen = length - start;
+        if(flen && data[length-1] == '\r') flen--;
+        err = load_field(ctx, sd, fields, &nfields, row, col, data+start, flen);
+        if(col+1 > width) width = col+1;
+        row++;
+    }
+    if(!err)
+        err = store_fields(ctx, sd, fields, nfields);
+    if(row > sd->height) sd->height = row;
+    if(width > sd->width) sd->width = width;
+    sheet_mark_dirty(ctx, sd);
+    return err;
+}
+
 DRSP_EXPORT
 int
 drsp_set_extra_dimensional_str(DrSpreadCtx*restrict ctx, SheetHandle sheet, intptr_t id, const char*restrict text, size_t length){
@@ -146,6 +435,7 @@ drsp_set_col_name(DrSpreadCtx*restrict ctx, SheetHandle sheet, intptr_t idx, con
     if(!str) return 1;
     int err = set_cached_col_name(&sd->col_cache, str, idx);
     if(err) return err;
+    sheet_new_layout(&ctx->map, sd);
     sheet_mark_dirty(ctx, sd);
     return 0;
 }
@@ -168,6 +458,8 @@ drsp_del_sheet(DrSpreadCtx*restrict ctx, SheetHandle sheet){
             ctx->map.data[i] = ctx->map.data[--ctx->map.n];
         else
             --ctx->map.n;
+        ctx->map.generation++;
+        sheet_map_reindex(&ctx->map);
         return 0;
     }
     return 1;
@@ -176,12 +468,61 @@ drsp_del_sheet(DrSpreadCtx*restrict ctx, SheetHandle sheet){
 DRSP_INTERNAL
 void
 cleanup_sheet_data(SheetData* d){
-    drsp_alloc(d->cell_cache.cap*(sizeof(RowColSv)+2*sizeof(uint32_t)), d->cell_cache.data, 0, _Alignof(RowColSv));
+    cleanup_cell_cache(&d->cell_cache);
     cleanup_col_cache(&d->col_cache);
     drsp_alloc(d->output_result_cache.cap*(sizeof(CachedResult)+2*sizeof(uint32_t)), d->output_result_cache.data, 0, _Alignof(CachedResult));
     drsp_alloc(d->result_cache.cap*(sizeof(CachedResult)+2*sizeof(uint32_t)), d->result_cache.data, 0, _Alignof(CachedResult));
     cleanup_named_cells(&d->named_cells);
     unique_cleanup(&d->dependants);
+    drsp_alloc(d->deps.cap*(sizeof(CellDep)+2*sizeof(uint32_t)), d->deps.data, 0, _Alignof(CellDep));
+    drsp_alloc(d->dirty_cells.cap*(sizeof(RowCol)+2*sizeof(uint32_t)), d->dirty_cells.data, 0, _Alignof(RowCol));
+    cleanup_column_indexes(&d->col_indexes);
+}
+
+DRSP_INTERNAL
+SheetData*_Nullable
+create_sheet_shadow(SheetData* sd){
+    SheetData* shadow = drsp_alloc(0, NULL, sizeof *shadow, _Alignof(SheetData));
+    if(!shadow) return NULL;
+    *shadow = *sd;
+    __builtin_memset(&shadow->output_result_cache, 0, sizeof shadow->output_result_cache);
+    __builtin_memset(&shadow->result_cache, 0, sizeof shadow->result_cache);
+    __builtin_memset(&shadow->dependants, 0, sizeof shadow->dependants);
+    __builtin_memset(&shadow->deps, 0, sizeof shadow->deps);
+    __builtin_memset(&shadow->dirty_cells, 0, sizeof shadow->dirty_cells);
+    __builtin_memset(&shadow->col_indexes, 0, sizeof shadow->col_indexes);
+    shadow->base = sd;
+    return shadow;
+}
+
+DRSP_INTERNAL
+int
+merge_sheet_shadow(SheetData* shadow){
+    SheetData* sd = shadow->base;
+    const CachedResult* results = (const CachedResult*)shadow->result_cache.data;
+    for(size_t i = 0; i < shadow->result_cache.n; i++){
+        CachedResult* cr = get_cached_output_result(&sd->result_cache, results[i].loc.row, results[i].loc.col);
+        // The results are just a cache.
+        if(!cr) break;
+        *cr = results[i];
+    }
+    const CellDep* items = (const CellDep*)shadow->deps.data;
+    for(size_t i = 0; i < shadow->deps.n; i++){
+        if(items[i].dst.row == IDX_UNSET && items[i].dst.col == IDX_UNSET)
+            continue;
+        if(cell_deps_add(&sd->deps, items[i].src, items[i].dst))
+            return 1;
+    }
+    return 0;
+}
+
+DRSP_INTERNAL
+void
+destroy_sheet_shadow(SheetData* shadow){
+    drsp_alloc(shadow->result_cache.cap*(sizeof(CachedResult)+2*sizeof(uint32_t)), shadow->result_cache.data, 0, _Alignof(CachedResult));
+    drsp_alloc(shadow->deps.cap*(sizeof(CellDep)+2*sizeof(uint32_t)), shadow->deps.data, 0, _Alignof(CellDep));
+    cleanup_column_indexes(&shadow->col_indexes);
+    drsp_alloc(sizeof *shadow, shadow, 0, _Alignof(SheetData));
 }
 
 // preload empty string and length 1 strings
@@ -293,65 +634,155 @@ drsp_atom_lower(DrSpreadCtx* ctx, DrspAtom a){
 
 static
 DrspAtom _Nullable
-drsp_create_str_(DrSpreadCtx* ctx, const char* txt, size_t length){
-    StringHeap* heap = &ctx->sheap;
-    size_t sz = offsetof(DrspStr, data)+length;
-    size_t cap = heap->cap;
+string_table_find(const StringTable* table, uint32_t hash, const char* txt, size_t length){
+    const uint32_t* hashes = string_table_hashes(table);
+    uint32_t idx = fast_reduce32(hash, table->cap);
+    for(;;){
+        DrspAtom item = __atomic_load_n(&table->slots[idx], __ATOMIC_ACQUIRE);
+        if(!item) return NULL;
+        // Written before the slot was published.
+        if(hashes[idx] == hash && sv_equals2((StringView){item->length, item->data}, txt, length))
+            return item;
+        idx++;
+        if(unlikely(idx >= table->cap)) idx = 0;
+    }
+}
+
+static
+void
+string_table_put(StringTable* table, uint32_t hash, DrspAtom str){
+    uint32_t idx = fast_reduce32(hash, table->cap);
+    while(table->slots[idx]){
+        idx++;
+        if(unlikely(idx >= table->cap)) idx = 0;
+    }
+    string_table_hashes(table)[idx] = hash;
+    __atomic_store_n(&table->slots[idx], str, __ATOMIC_RELEASE);
+}
+
+// Makes room in the shard's table for one more string. The shard has to be
+// locked if it is shared.
+static
+StringTable*_Nullable
+string_shard_room(StringShard* shard){
+    StringTable* table = shard->table;
     // XXX overflow checking
-    if(unlikely(heap->n >= cap)){
-        size_t old_cap = cap;
-        size_t new_cap = old_cap?old_cap*2:1024;
-        size_t new_size = new_cap * (sizeof(DrspAtom)+2*sizeof(uint32_t));
-        size_t old_size = old_cap * (sizeof(DrspAtom)+2*sizeof(uint32_t));
-        unsigned char* new_data = drsp_alloc(old_size, heap->data, new_size, _Alignof(DrspStr));
-        if(!new_data) return NULL;
-        heap->data = new_data;
-        heap->cap = new_cap;
-        cap = new_cap;
-        uint32_t* indexes = (uint32_t*)(new_data + sizeof(DrspAtom)*new_cap);
-        __builtin_memset(indexes, 0xff, 2*sizeof(*indexes)*new_cap);
-        DrspAtom* items = (DrspAtom*)new_data;
-        for(size_t i = 0; i < heap->n; i++){
-            DrspAtom item = items[i];
-            uint32_t hash = hash_align1(item->data, item->length);
-            uint32_t idx = fast_reduce32(hash, (uint32_t)2*new_cap);
-            while(indexes[idx] != UINT32_MAX){
-                idx++;
-                if(unlikely(idx >= 2*new_cap)) idx = 0;
-            }
-            indexes[idx] = i;
+    if(table && shard->n < table->cap/2) return table;
+    uint32_t new_cap = table?table->cap*2:128;
+    StringTable* grown = drsp_alloc(0, NULL, sizeof *grown + new_cap*STRING_TABLE_SLOT_SIZE, _Alignof(StringTable));
+    if(!grown) return NULL;
+    __builtin_memset(grown->slots, 0, new_cap*sizeof *grown->slots);
+    grown->cap = new_cap;
+    grown->retired = table;
+    if(table){
+        const uint32_t* hashes = string_table_hashes(table);
+        for(uint32_t i = 0; i < table->cap; i++){
+            DrspAtom item = table->slots[i];
+            if(item) string_table_put(grown, hashes[i], item);
         }
     }
-    uint32_t hash = hash_align1(txt, length);
-    uint32_t* indexes = (uint32_t*)(heap->data + sizeof(DrspAtom)*cap);
-    DrspAtom* items = (DrspAtom*)heap->data;
-    uint32_t idx = fast_reduce32(hash, (uint32_t)2*cap);
-    for(;;){
-        uint32_t i = indexes[idx];
-        if(i == UINT32_MAX){ // empty slot
-            DrspStr* str = linked_arena_alloc(&heap->arena, sz);
-            // DrspAtom str = malloc(sz);
-            if(!str) return NULL;
-            str->length = length;
-            __builtin_memcpy(str->data, txt, length);
-            indexes[idx]= heap->n;
-            items[heap->n++] = str;
-            return str;
-        }
-        DrspAtom item = items[i];
-        if(sv_equals2((StringView){item->length, item->data}, txt, length)){
-            return item;
+    __atomic_store_n(&shard->table, grown, __ATOMIC_RELEASE);
+    return grown;
+}
+
+// `shared` is set when other threads could be using the heap.
+static
+DrspAtom _Nullable
+string_heap_insert(StringHeap* heap, uint32_t hash, const char* txt, size_t length, _Bool shared){
+    // The low bits pick the shard, fast_reduce32 uses the high bits.
+    StringShard* shard = &heap->shards[hash % STRING_HEAP_SHARDS];
+    StringTable* table = __atomic_load_n(&shard->table, __ATOMIC_ACQUIRE);
+    DrspAtom result = NULL;
+    if(table){
+        result = string_table_find(table, hash, txt, length);
+        if(result) return result;
+    }
+    if(shared){
+        while(__atomic_test_and_set(&shard->lock, __ATOMIC_ACQUIRE))
+            ;
+        // Someone else could have inserted it or grown the table meanwhile.
+        table = shard->table;
+        if(table){
+            result = string_table_find(table, hash, txt, length);
+            if(result) goto finish;
         }
-        idx++;
-        if(unlikely(idx >= 2*cap)) idx = 0;
     }
+    table = string_shard_room(shard);
+    if(!table) goto finish;
+    DrspStr* str = linked_arena_alloc(&shard->arena, offsetof(DrspStr, data)+length);
+    if(!str) goto finish;
+    str->length = length;
+    __builtin_memcpy(str->data, txt, length);
+    string_table_put(table, hash, str);
+    shard->n++;
+    result = str;
+    finish:
+    if(shared)
+        __atomic_clear(&shard->lock, __ATOMIC_RELEASE);
+    return result;
+}
+
+// Puts a string that lives outside of the heap (in a loaded snapshot) into
+// it, unless there already is one with the same text, which is returned
+// instead. Only for the main context.
+static
+DrspAtom _Nullable
+string_heap_adopt(StringHeap* heap, uint32_t hash, DrspAtom str){
+    StringShard* shard = &heap->shards[hash % STRING_HEAP_SHARDS];
+    StringTable* table = shard->table;
+    if(table){
+        DrspAtom found = string_table_find(table, hash, str->data, str->length);
+        if(found) return found;
+    }
+    table = string_shard_room(shard);
+    if(!table) return NULL;
+    string_table_put(table, hash, str);
+    shard->n++;
+    return str;
+}
+
+static
+DrspAtom _Nullable
+drsp_create_str_(DrSpreadCtx* ctx, const char* txt, size_t length){
+    return string_heap_insert(&heap_owner(ctx)->sheap, hash_align1(txt, length), txt, length, !!ctx->parent);
+}
+
+static
+uint32_t
+drsp_prefetch_str(DrSpreadCtx* ctx, const char* txt, size_t length){
+    uint32_t hash = hash_align1(txt, length);
+    StringShard* shard = &heap_owner(ctx)->sheap.shards[hash % STRING_HEAP_SHARDS];
+    StringTable* table = __atomic_load_n(&shard->table, __ATOMIC_ACQUIRE);
+    if(table){
+        uint32_t idx = fast_reduce32(hash, table->cap);
+        __builtin_prefetch(&table->slots[idx]);
+        __builtin_prefetch(&string_table_hashes(table)[idx]);
+    }
+    return hash;
+}
+
+static
+DrspAtom _Nullable
+drsp_intern_str_hashed(DrSpreadCtx* ctx, const char* txt, size_t length, uint32_t hash){
+    if(length > UINT16_MAX) return NULL;
+    if(!length) return drsp_nil_atom();
+    if(length == 1 && (uint8_t)*txt <= 127)
+        return drsp_intern_str(ctx, txt, length);
+    return string_heap_insert(&heap_owner(ctx)->sheap, hash, txt, length, !!ctx->parent);
 }
 
 DRSP_INTERNAL
 void
 destroy_string_heap(StringHeap* heap){
-    free_linked_arenas(heap->arena);
-    drsp_alloc(heap->cap*(sizeof(DrspAtom)+2*sizeof(uint32_t)), heap->data, 0, _Alignof(DrspStr));
+    for(size_t i = 0; i < STRING_HEAP_SHARDS; i++){
+        StringShard* shard = &heap->shards[i];
+        free_linked_arenas(shard->arena);
+        for(StringTable* table = shard->table; table;){
+            StringTable* retired = table->retired;
+            drsp_alloc(sizeof *table + table->cap*STRING_TABLE_SLOT_SIZE, table, 0, _Alignof(StringTable));
+            table = retired;
+        }
+    }
     __builtin_memset(heap, 0, sizeof *heap);
 }
 
@@ -359,6 +790,8 @@ typedef struct ParsePair ParsePair;
 struct ParsePair {
     DrspAtom key;
     Expression* value;
+    // NULL until we've tried to compile it.
+    const BcProgram*_Nullable program;
 };
 
 DRSP_INTERNAL
@@ -373,7 +806,7 @@ destroy_parse_heap(ParseHeap* heap){
 DRSP_INTERNAL
 Expression*_Null_unspecified*_Nullable
 getsert_cached_parse(DrSpreadCtx* ctx, DrspAtom a){
-    ParseHeap* heap = &ctx->pheap;
+    ParseHeap* heap = &heap_owner(ctx)->pheap;
     size_t cap = heap->cap;
     // XXX overflow checking
     if(unlikely(heap->n >= cap)){
@@ -410,6 +843,7 @@ getsert_cached_parse(DrSpreadCtx* ctx, DrspAtom a){
         if(i == UINT32_MAX){ // empty slot
             indexes[idx] = heap->n;
             items[heap->n].key = a;
+            items[heap->n].program = NULL;
             return &items[heap->n++].value;
         }
         ParsePair* item = &items[i];
@@ -420,6 +854,28 @@ getsert_cached_parse(DrSpreadCtx* ctx, DrspAtom a){
     }
 }
 
+DRSP_INTERNAL
+const BcProgram*_Nullable*_Nullable
+cached_program_slot(DrSpreadCtx* ctx, DrspAtom a){
+    ParseHeap* heap = &heap_owner(ctx)->pheap;
+    size_t cap = heap->cap;
+    if(!cap) return NULL;
+    uint32_t hash = hash_alignany(&a, sizeof a);
+    uint32_t* indexes = (uint32_t*)(heap->data + sizeof(ParsePair)*cap);
+    ParsePair* items = (ParsePair*)heap->data;
+    uint32_t idx = fast_reduce32(hash, (uint32_t)2*cap);
+    for(;;){
+        uint32_t i = indexes[idx];
+        if(i == UINT32_MAX) // empty slot
+            return NULL;
+        ParsePair* item = &items[i];
+        if(item->key == a)
+            return &item->program;
+        idx++;
+        if(unlikely(idx >= 2*cap)) idx = 0;
+    }
+}
+
 DRSP_INTERNAL
 void
 cache_parse(DrSpreadCtx* ctx, DrspAtom a, Expression*_Nonnull e){
@@ -430,7 +886,7 @@ cache_parse(DrSpreadCtx* ctx, DrspAtom a, Expression*_Nonnull e){
 DRSP_INTERNAL
 Expression*_Nullable
 has_cached_parse(DrSpreadCtx* ctx, DrspAtom a){
-    ParseHeap* heap = &ctx->pheap;
+    ParseHeap* heap = &heap_owner(ctx)->pheap;
     size_t cap = heap->cap;
     if(!cap) return NULL;
     uint32_t hash = hash_alignany(&a, sizeof a);
@@ -469,11 +925,12 @@ free_sheet_datas(DrSpreadCtx* ctx){
         cleanup_sheet_data(d);
     }
     drsp_alloc(ctx->map.cap*sizeof *ctx->map.data, ctx->map.data, 0, _Alignof(SheetData));
+    drsp_alloc(2*ctx->map.index_cap*sizeof(uint32_t), ctx->map.by_handle, 0, _Alignof(uint32_t));
 }
 
 static inline
 DrspAtom _Nullable
-get_cached_cell(CellCache* cache, intptr_t row, intptr_t col){
+get_sparse_cell(const CellCache* cache, intptr_t row, intptr_t col){
     size_t cap = cache->cap;
     if(!cap) return NULL;
     RowCol key = {row, col};
@@ -497,7 +954,7 @@ get_cached_cell(CellCache* cache, intptr_t row, intptr_t col){
 
 static inline
 int
-set_cached_cell(CellCache* cache, intptr_t row, intptr_t col, DrspAtom str){
+set_sparse_cell(CellCache* cache, intptr_t row, intptr_t col, DrspAtom str){
     if(unlikely(cache->n >= cache->cap)){
         size_t old_cap = cache->cap;
         size_t new_cap = old_cap?old_cap*2:128;
@@ -544,6 +1001,156 @@ set_cached_cell(CellCache* cache, intptr_t row, intptr_t col, DrspAtom str){
     }
 }
 
+// Numbers are parsed here, so that reading the cell doesn't have to.
+static inline
+CellKind
+cell_kind(DrspAtom a, double* number){
+    if(!a->length) return CELL_BLANK;
+    char c = a->data[0];
+    if(c == '=') return CELL_FORMULA;
+    if((c >= '0' && c <= '9') || c == '.' || c == '-'){
+        DoubleResult dr = parse_double(a->data, a->length);
+        if(dr.errored) return CELL_STRING;
+        *number = dr.result;
+        return CELL_NUMBER;
+    }
+    return CELL_STRING;
+}
+
+enum {CELL_COLUMN_ROW_SIZE = sizeof(DrspAtom) + sizeof(double) + sizeof(CellKind)};
+
+// Whether idx can go in a dense array of length len holding count items
+// without the array ending up mostly empty.
+static inline
+_Bool
+dense_fits(intptr_t idx, intptr_t len, size_t count){
+    return idx < len || (size_t)idx < 2*count + 64;
+}
+
+static inline
+DrspAtom _Nullable
+get_cached_cell(const CellCache* cache, intptr_t row, intptr_t col){
+    if(col >= 0 && (size_t)col < cache->ncolumns){
+        const CellColumn* column = &cache->columns[col];
+        if(row >= 0 && row < column->len){
+            DrspAtom a = column->atoms[row];
+            if(a) return a;
+        }
+    }
+    if(!cache->n) return NULL;
+    return get_sparse_cell(cache, row, col);
+}
+
+// Adds columns up to col.
+static
+int
+add_cell_columns(CellCache* cache, intptr_t col){
+    if((size_t)col < cache->ncolumns) return 0;
+    if((size_t)col >= cache->colcap){
+        size_t new_cap = cache->colcap?cache->colcap*2:8;
+        while(new_cap <= (size_t)col) new_cap *= 2;
+        CellColumn* columns = drsp_alloc(cache->colcap*sizeof *columns, cache->columns, new_cap*sizeof *columns, _Alignof(CellColumn));
+        if(!columns) return 1;
+        cache->columns = columns;
+        cache->colcap = new_cap;
+    }
+    __builtin_memset(cache->columns+cache->ncolumns, 0, (col+1-cache->ncolumns)*sizeof *cache->columns);
+    cache->ncolumns = col+1;
+    return 0;
+}
+
+// Makes room for the rows up to `cap` without adding them.
+static
+int
+grow_cell_column(CellColumn* column, intptr_t cap){
+    if(cap > column->cap){
+        intptr_t new_cap = column->cap?column->cap*2:64;
+        while(new_cap < cap) new_cap *= 2;
+        // The numbers and kinds are after the atoms in the same allocation.
+        unsigned char* data = drsp_alloc(0, NULL, new_cap*CELL_COLUMN_ROW_SIZE, _Alignof(double));
+        if(!data) return 1;
+        DrspAtom _Nullable* atoms = (DrspAtom _Nullable*)data;
+        double* numbers = (double*)(data + new_cap*sizeof(DrspAtom));
+        CellKind* kinds = (CellKind*)(data + new_cap*(sizeof(DrspAtom)+sizeof(double)));
+        if(column->len){
+            __builtin_memcpy(atoms, column->atoms, column->len*sizeof *atoms);
+            __builtin_memcpy(numbers, column->numbers, column->len*sizeof *numbers);
+            __builtin_memcpy(kinds, column->kinds, column->len*sizeof *kinds);
+        }
+        drsp_alloc(column->cap*CELL_COLUMN_ROW_SIZE, column->atoms, 0, _Alignof(double));
+        column->atoms = atoms;
+        column->numbers = numbers;
+        column->kinds = kinds;
+        column->cap = new_cap;
+    }
+    return 0;
+}
+
+// Makes room for (and empties) the rows up to `len`.
+static
+int
+extend_cell_column(CellColumn* column, intptr_t len){
+    if(grow_cell_column(column, len)) return 1;
+    if(len > column->len){
+        __builtin_memset(column->atoms+column->len, 0, (len-column->len)*sizeof *column->atoms);
+        __builtin_memset(column->kinds+column->len, 0, (len-column->len)*sizeof *column->kinds);
+        column->len = len;
+    }
+    return 0;
+}
+
+static inline
+int
+set_cached_cell(CellCache* cache, intptr_t row, intptr_t col, DrspAtom str){
+    // Cells stay where they were first put.
+    if(cache->n && get_sparse_cell(cache, row, col))
+        return set_sparse_cell(cache, row, col, str);
+    if(row < 0 || col < 0 || !dense_fits(col, cache->ncolumns, cache->ncolumns))
+        return set_sparse_cell(cache, row, col, str);
+    if(add_cell_columns(cache, col)) return 1;
+    CellColumn* column = &cache->columns[col];
+    if(!dense_fits(row, column->len, column->count))
+        return set_sparse_cell(cache, row, col, str);
+    if(row >= column->len && extend_cell_column(column, row+1))
+        return 1;
+    if(!column->atoms[row]) column->count++;
+    column->atoms[row] = str;
+    column->kinds[row] = cell_kind(str, &column->numbers[row]);
+    return 0;
+}
+
+DRSP_INTERNAL
+int
+reserve_cached_cells(CellCache* cache, intptr_t col, intptr_t len, size_t count){
+    if(col < 0 || len <= 0 || !dense_fits(col, cache->ncolumns, cache->ncolumns))
+        return 0;
+    if(add_cell_columns(cache, col)) return 1;
+    CellColumn* column = &cache->columns[col];
+    if(!dense_fits(len-1, column->len, column->count+count))
+        return 0;
+    return extend_cell_column(column, len);
+}
+
+DRSP_INTERNAL
+int
+reserve_cell_column(CellCache* cache, intptr_t col, intptr_t cap){
+    if(col < 0 || cap <= 0 || !dense_fits(col, cache->ncolumns, cache->ncolumns))
+        return 0;
+    if(add_cell_columns(cache, col)) return 1;
+    return grow_cell_column(&cache->columns[col], cap);
+}
+
+DRSP_INTERNAL
+void
+cleanup_cell_cache(CellCache* cache){
+    for(size_t i = 0; i < cache->ncolumns; i++){
+        CellColumn* column = &cache->columns[i];
+        drsp_alloc(column->cap*CELL_COLUMN_ROW_SIZE, column->atoms, 0, _Alignof(double));
+    }
+    drsp_alloc(cache->colcap*sizeof *cache->columns, cache->columns, 0, _Alignof(CellColumn));
+    drsp_alloc(cache->cap*(sizeof(RowColSv)+2*sizeof(uint32_t)), cache->data, 0, _Alignof(RowColSv));
+}
+
 DRSP_INTERNAL
 CachedResult*_Nullable
 get_cached_output_result(OutputResultCache* cache, intptr_t row, intptr_t col){
@@ -570,7 +1177,7 @@ get_cached_output_result(OutputResultCache* cache, intptr_t row, intptr_t col){
             uint32_t idx = fast_reduce32(hash, (uint32_t)new_cap*2);
             while(indexes[idx] != UINT32_MAX){
                 idx++;
-                if(unlikely(idx >= new_cap)) idx = 0;
+                if(unlikely(idx >= new_cap*2)) idx = 0;
             }
             indexes[idx] = i;
         }
@@ -632,11 +1239,501 @@ clear_cached_output_result(OutputResultCache* cache){
     cache->n = 0;
 }
 
+DRSP_INTERNAL
+void
+del_cached_output_result(OutputResultCache* cache, intptr_t row, intptr_t col){
+    size_t cap = cache->cap;
+    if(!cap) return;
+    RowCol key = {row, col};
+    uint32_t hash = hash_alignany(&key, sizeof key);
+    CachedResult *items = (CachedResult*)cache->data;
+    uint32_t* indexes = (uint32_t*)(cache->data + sizeof(CachedResult)*cap);
+    uint32_t idx = fast_reduce32(hash, (uint32_t)cap*2);
+    for(;;){
+        uint32_t i = indexes[idx];
+        if(i == UINT32_MAX) // empty slot
+            return;
+        if(items[i].loc.row == row && items[i].loc.col == col)
+            break;
+        idx++;
+        if(unlikely(idx >= cap*2)) idx = 0;
+    }
+    uint32_t removed = indexes[idx];
+    // Backward shift deletion so we don't need tombstones.
+    uint32_t hole = idx;
+    for(uint32_t j = hole;;){
+        j++;
+        if(unlikely(j >= cap*2)) j = 0;
+        uint32_t i = indexes[j];
+        if(i == UINT32_MAX) break;
+        RowCol k = items[i].loc;
+        uint32_t home = fast_reduce32(hash_alignany(&k, sizeof k), (uint32_t)cap*2);
+        _Bool can_move = hole <= j
+            ? (home <= hole || home > j)
+            : (home <= hole && home > j);
+        if(!can_move) continue;
+        indexes[hole] = i;
+        hole = j;
+    }
+    indexes[hole] = UINT32_MAX;
+    // Move the last item into the removed item's spot.
+    size_t last = --cache->n;
+    if(removed == last) return;
+    items[removed] = items[last];
+    RowCol k = items[removed].loc;
+    idx = fast_reduce32(hash_alignany(&k, sizeof k), (uint32_t)cap*2);
+    while(indexes[idx] != last){
+        idx++;
+        if(unlikely(idx >= cap*2)) idx = 0;
+    }
+    indexes[idx] = removed;
+}
+
+// Returns the index slot for the edge, which is either empty or points
+// at the matching edge.
+static inline
+uint32_t*
+cell_deps_slot(const CellDeps* deps, RowCol src, RowCol dst){
+    size_t cap = deps->cap;
+    RowCol key[2] = {src, dst};
+    uint32_t hash = hash_alignany(key, sizeof key);
+    const CellDep* items = (const CellDep*)deps->data;
+    uint32_t* indexes = (uint32_t*)(deps->data + sizeof(CellDep)*cap);
+    uint32_t idx = fast_reduce32(hash, (uint32_t)2*cap);
+    for(;;){
+        uint32_t i = indexes[idx];
+        if(i == UINT32_MAX) // empty slot
+            return &indexes[idx];
+        const CellDep* item = &items[i];
+        if(item->src.row == src.row && item->src.col == src.col && item->dst.row == dst.row && item->dst.col == dst.col)
+            return &indexes[idx];
+        idx++;
+        if(unlikely(idx >= 2*cap)) idx = 0;
+    }
+}
+
+DRSP_INTERNAL
+int
+cell_deps_add(CellDeps* deps, RowCol src, RowCol dst){
+    // Adding an edge can also add the head entry, so make room for both.
+    if(unlikely(deps->n+2 > deps->cap)){
+        size_t old_cap = deps->cap;
+        size_t new_cap = old_cap?old_cap*2:128;
+        size_t new_size = new_cap*(sizeof(CellDep)+2*sizeof(uint32_t));
+        size_t old_size = old_cap*(sizeof(CellDep)+2*sizeof(uint32_t));
+        unsigned char* new_data = drsp_alloc(old_size, deps->data, new_size, _Alignof(CellDep));
+        if(!new_data) return 1;
+        deps->data = new_data;
+        deps->cap = new_cap;
+        uint32_t* indexes = (uint32_t*)(new_data + sizeof(CellDep)*new_cap);
+        __builtin_memset(indexes, 0xff, 2*sizeof(*indexes)*new_cap);
+        CellDep* items = (CellDep*)new_data;
+        for(size_t i = 0; i < deps->n; i++){
+            RowCol k[2] = {items[i].src, items[i].dst};
+            uint32_t hash = hash_alignany(k, sizeof k);
+            uint32_t idx = fast_reduce32(hash, (uint32_t)2*new_cap);
+            while(indexes[idx] != UINT32_MAX){
+                idx++;
+                if(unlikely(idx >= 2*new_cap)) idx = 0;
+            }
+            indexes[idx] = i;
+        }
+    }
+    CellDep* items = (CellDep*)deps->data;
+    uint32_t* slot = cell_deps_slot(deps, src, dst);
+    if(*slot != UINT32_MAX) return 0; // already have this edge
+    uint32_t e = deps->n++;
+    *slot = e;
+    items[e] = (CellDep){src, dst, UINT32_MAX};
+    const RowCol head_key = {IDX_UNSET, IDX_UNSET};
+    slot = cell_deps_slot(deps, src, head_key);
+    if(*slot == UINT32_MAX){
+        *slot = deps->n;
+        items[deps->n++] = (CellDep){src, head_key, UINT32_MAX};
+    }
+    CellDep* head = &items[*slot];
+    items[e].next = head->next;
+    head->next = e;
+    return 0;
+}
+
+DRSP_INTERNAL
+void
+clear_cell_deps(CellDeps* deps){
+    if(deps->n){
+        uint32_t* indexes = (uint32_t*)(deps->data + sizeof(CellDep)*deps->cap);
+        __builtin_memset(indexes, 0xff, 2*sizeof(*indexes)*deps->cap);
+    }
+    deps->n = 0;
+}
+
+DRSP_INTERNAL
+_Bool
+cell_set_has(const CellSet* set, RowCol rc){
+    size_t cap = set->cap;
+    if(!cap) return 0;
+    uint32_t hash = hash_alignany(&rc, sizeof rc);
+    const RowCol* items = (const RowCol*)set->data;
+    const uint32_t* indexes = (const uint32_t*)(set->data + sizeof(RowCol)*cap);
+    uint32_t idx = fast_reduce32(hash, (uint32_t)2*cap);
+    for(;;){
+        uint32_t i = indexes[idx];
+        if(i == UINT32_MAX) // empty slot
+            return 0;
+        if(items[i].row == rc.row && items[i].col == rc.col)
+            return 1;
+        idx++;
+        if(unlikely(idx >= 2*cap)) idx = 0;
+    }
+}
+
+DRSP_INTERNAL
+int
+cell_set_add(CellSet* set, RowCol rc){
+    if(unlikely(set->n >= set->cap)){
+        size_t old_cap = set->cap;
+        size_t new_cap = old_cap?old_cap*2:32;
+        size_t new_size = new_cap*(sizeof(RowCol)+2*sizeof(uint32_t));
+        size_t old_size = old_cap*(sizeof(RowCol)+2*sizeof(uint32_t));
+        unsigned char* new_data = drsp_alloc(old_size, set->data, new_size, _Alignof(RowCol));
+        if(!new_data) return 1;
+        set->data = new_data;
+        set->cap = new_cap;
+        uint32_t* indexes = (uint32_t*)(new_data + sizeof(RowCol)*new_cap);
+        __builtin_memset(indexes, 0xff, 2*sizeof(*indexes)*new_cap);
+        RowCol* items = (RowCol*)new_data;
+        for(size_t i = 0; i < set->n; i++){
+            uint32_t hash = hash_alignany(&items[i], sizeof items[i]);
+            uint32_t idx = fast_reduce32(hash, (uint32_t)2*new_cap);
+            while(indexes[idx] != UINT32_MAX){
+                idx++;
+                if(unlikely(idx >= 2*new_cap)) idx = 0;
+            }
+            indexes[idx] = i;
+        }
+    }
+    size_t cap = set->cap;
+    uint32_t hash = hash_alignany(&rc, sizeof rc);
+    RowCol* items = (RowCol*)set->data;
+    uint32_t* indexes = (uint32_t*)(set->data + sizeof(RowCol)*cap);
+    uint32_t idx = fast_reduce32(hash, (uint32_t)2*cap);
+    for(;;){
+        uint32_t i = indexes[idx];
+        if(i == UINT32_MAX){ // empty slot
+            indexes[idx] = set->n;
+            items[set->n++] = rc;
+            return 0;
+        }
+        if(items[i].row == rc.row && items[i].col == rc.col)
+            return 0;
+        idx++;
+        if(unlikely(idx >= 2*cap)) idx = 0;
+    }
+}
+
+DRSP_INTERNAL
+void
+clear_cell_set(CellSet* set){
+    if(set->n){
+        uint32_t* indexes = (uint32_t*)(set->data + sizeof(RowCol)*set->cap);
+        __builtin_memset(indexes, 0xff, 2*sizeof(*indexes)*set->cap);
+    }
+    set->n = 0;
+}
+
+static
+uint32_t*
+column_index_slot(const ColumnIndex* ci, uint32_t kind, uint64_t key){
+    size_t cap = ci->cap;
+    uint64_t k[2] = {key, kind};
+    uint32_t hash = hash_alignany(k, sizeof k);
+    const ColumnIndexEntry* items = (const ColumnIndexEntry*)ci->data;
+    uint32_t* indexes = (uint32_t*)(ci->data + sizeof(ColumnIndexEntry)*cap);
+    uint32_t idx = fast_reduce32(hash, (uint32_t)2*cap);
+    for(;;){
+        uint32_t i = indexes[idx];
+        if(i == UINT32_MAX) // empty slot
+            return &indexes[idx];
+        if(items[i].key == key && items[i].kind == kind)
+            return &indexes[idx];
+        idx++;
+        if(unlikely(idx >= 2*cap)) idx = 0;
+    }
+}
+
+DRSP_INTERNAL
+const ColumnIndexEntry*_Nullable
+column_index_find(const ColumnIndex* ci, uint32_t kind, uint64_t key){
+    if(!ci->n) return NULL;
+    uint32_t i = *column_index_slot(ci, kind, key);
+    if(i == UINT32_MAX) return NULL;
+    return &((const ColumnIndexEntry*)ci->data)[i];
+}
+
+static
+int
+column_index_add(ColumnIndex* ci, intptr_t row, uint32_t kind, uint64_t key){
+    if(unlikely((size_t)row >= ci->next_cap)){
+        size_t new_cap = ci->next_cap?ci->next_cap*2:256;
+        while(new_cap <= (size_t)row) new_cap *= 2;
+        int32_t* next = drsp_alloc(ci->next_cap*sizeof *next, ci->next, new_cap*sizeof *next, _Alignof(int32_t));
+        if(!next) return 1;
+        ci->next = next;
+        ci->next_cap = new_cap;
+    }
+    ci->next[row] = -1;
+    if(unlikely(ci->n+1 > ci->cap)){
+        size_t old_cap = ci->cap;
+        size_t new_cap = old_cap?old_cap*2:128;
+        size_t new_size = new_cap*(sizeof(ColumnIndexEntry)+2*sizeof(uint32_t));
+        size_t old_size = old_cap*(sizeof(ColumnIndexEntry)+2*sizeof(uint32_t));
+        unsigned char* new_data = drsp_alloc(old_size, ci->data, new_size, _Alignof(ColumnIndexEntry));
+        if(!new_data) return 1;
+        ci->data = new_data;
+        ci->cap = new_cap;
+        uint32_t* indexes = (uint32_t*)(new_data + sizeof(ColumnIndexEntry)*new_cap);
+        __builtin_memset(indexes, 0xff, 2*sizeof(*indexes)*new_cap);
+        ColumnIndexEntry* items = (ColumnIndexEntry*)new_data;
+        for(size_t i = 0; i < ci->n; i++){
+            uint64_t k[2] = {items[i].key, items[i].kind};
+            uint32_t hash = hash_alignany(k, sizeof k);
+            uint32_t idx = fast_reduce32(hash, (uint32_t)2*new_cap);
+            while(indexes[idx] != UINT32_MAX){
+                idx++;
+                if(unlikely(idx >= 2*new_cap)) idx = 0;
+            }
+            indexes[idx] = i;
+        }
+    }
+    ColumnIndexEntry* items = (ColumnIndexEntry*)ci->data;
+    uint32_t* slot = column_index_slot(ci, kind, key);
+    if(*slot == UINT32_MAX){
+        *slot = ci->n;
+        items[ci->n++] = (ColumnIndexEntry){key, kind, (int32_t)row, (int32_t)row};
+        return 0;
+    }
+    ColumnIndexEntry* e = &items[*slot];
+    ci->next[e->last] = (int32_t)row;
+    e->last = (int32_t)row;
+    return 0;
+}
+
+// Indexes the rows from ci->nrows on, up to the first one whose value isn't
+// known without evaluating it.
+static
+int
+column_index_extend(DrSpreadCtx* ctx, SheetData* sd, ColumnIndex* ci){
+    DrspAtom circular = drsp_atomize(ctx, "circular reference", sizeof "circular reference" - 1);
+    if(!circular) return 1;
+    const intptr_t col = ci->col;
+    intptr_t row = ci->nrows;
+    for(; row < sd->height; row++){
+        CellKind kind;
+        double number;
+        DrspAtom a = sp_cell_atom(sd, row, col, &kind, &number);
+        if(kind == CELL_FORMULA){
+            const CachedResult* cr = lookup_cached_result(sd, row, col);
+            if(!cr) break;
+            switch(cr->kind){
+                case CACHED_RESULT_NULL:
+                    kind = CELL_BLANK;
+                    break;
+                case CACHED_RESULT_NUMBER:
+                    kind = CELL_NUMBER;
+                    number = cr->number;
+                    break;
+                case CACHED_RESULT_STRING:
+                    kind = CELL_STRING;
+                    a = cr->string;
+                    break;
+                default:
+                    // Cells that are in progress are marked as cycles, and
+                    // evaluate() has to be the one to read them.
+                    if(cr->string == circular) goto stop;
+                    // Errors never match.
+                    continue;
+            }
+        }
+        int err = 0;
+        switch(kind){
+            case CELL_BLANK:
+                err = column_index_add(ci, row, EXPR_BLANK, 0);
+                break;
+            case CELL_NUMBER:
+                // NaN never matches.
+                if(number != number) continue;
+                err = column_index_add(ci, row, EXPR_NUMBER, column_index_number_key(number));
+                break;
+            case CELL_STRING:
+                err = column_index_add(ci, row, EXPR_STRING, (uintptr_t)a);
+                break;
+            case CELL_FORMULA:
+                __builtin_unreachable();
+        }
+        if(err){
+            ci->nrows = row;
+            return 1;
+        }
+    }
+    stop:
+    ci->nrows = row;
+    return 0;
+}
+
+DRSP_INTERNAL
+ColumnIndex*_Nullable
+get_column_index(DrSpreadCtx* ctx, SheetData* sd, intptr_t col){
+    // The arguments of a user defined function are only visible to evaluate.
+    if(sd->flags & DRSP_SHEET_FLAGS_IS_FUNCTION) return NULL;
+    ColumnIndexes* indexes = &sd->col_indexes;
+    ColumnIndex* ci = NULL;
+    for(size_t i = 0; i < indexes->count; i++){
+        if(indexes->data[i].col == col){
+            ci = &indexes->data[i];
+            break;
+        }
+    }
+    if(!ci){
+        if(indexes->count == indexes->capacity){
+            size_t new_cap = indexes->capacity?indexes->capacity*2:4;
+            ColumnIndex* data = drsp_alloc(indexes->capacity*sizeof *data, indexes->data, new_cap*sizeof *data, _Alignof(ColumnIndex));
+            if(!data) return NULL;
+            indexes->data = data;
+            indexes->capacity = new_cap;
+        }
+        ci = &indexes->data[indexes->count++];
+        *ci = (ColumnIndex){.col = col};
+    }
+    if(ci->nrows < sd->height && column_index_extend(ctx, sd, ci))
+        return NULL;
+    return ci;
+}
+
+static
+void
+free_column_index(ColumnIndex* ci){
+    drsp_alloc(ci->next_cap*sizeof *ci->next, ci->next, 0, _Alignof(int32_t));
+    drsp_alloc(ci->cap*(sizeof(ColumnIndexEntry)+2*sizeof(uint32_t)), ci->data, 0, _Alignof(ColumnIndexEntry));
+}
+
+DRSP_INTERNAL
+void
+drop_column_index(ColumnIndexes* indexes, intptr_t col){
+    for(size_t i = 0; i < indexes->count; i++){
+        if(indexes->data[i].col != col) continue;
+        free_column_index(&indexes->data[i]);
+        // unordered remove
+        indexes->data[i] = indexes->data[--indexes->count];
+        return;
+    }
+}
+
+DRSP_INTERNAL
+void
+clear_column_indexes(ColumnIndexes* indexes){
+    for(size_t i = 0; i < indexes->count; i++)
+        free_column_index(&indexes->data[i]);
+    indexes->count = 0;
+}
+
+DRSP_INTERNAL
+void
+cleanup_column_indexes(ColumnIndexes* indexes){
+    clear_column_indexes(indexes);
+    drsp_alloc(indexes->capacity*sizeof *indexes->data, indexes->data, 0, _Alignof(ColumnIndex));
+    indexes->data = NULL;
+    indexes->capacity = 0;
+}
+
+static inline
+uint32_t
+sheet_index_slot(uint32_t cap, const void* key){
+    return fast_reduce32(hash_alignany(&key, sizeof key), cap);
+}
+
+// Rebuilds the indexes from scratch. A name goes to the first sheet it is
+// the name or alias of, same as scanning the sheets in order.
+static
+void
+sheet_index_add_handle(SheetMap* map, uint32_t i){
+    uint32_t idx = sheet_index_slot(map->index_cap, map->data[i].handle);
+    while(map->by_handle[idx] != UINT32_MAX){
+        idx++;
+        if(unlikely(idx >= map->index_cap)) idx = 0;
+    }
+    map->by_handle[idx] = i;
+}
+
+// Keeps the tables at most half full, counting a name and an alias for each
+// sheet.
+static inline
+_Bool
+sheet_index_fits(const SheetMap* map){
+    return 4*map->n+16 <= map->index_cap;
+}
+
+DRSP_INTERNAL
+void
+sheet_map_reindex(SheetMap* map){
+    if(!map->by_handle || !sheet_index_fits(map)){
+        uint32_t cap = 8*(uint32_t)map->n + 32;
+        drsp_alloc(2*map->index_cap*sizeof(uint32_t), map->by_handle, 0, _Alignof(uint32_t));
+        map->by_handle = drsp_alloc(0, NULL, 2*cap*sizeof(uint32_t), _Alignof(uint32_t));
+        map->by_name = map->by_handle?map->by_handle+cap:NULL;
+        map->index_cap = map->by_handle?cap:0;
+        if(!map->by_handle) return;
+    }
+    uint32_t cap = map->index_cap;
+    __builtin_memset(map->by_handle, 0xff, 2*cap*sizeof(uint32_t));
+    for(uint32_t i = 0; i < map->n; i++){
+        const SheetData* sd = &map->data[i];
+        sheet_index_add_handle(map, i);
+        uint32_t idx;
+        DrspAtom names[2] = {sd->name, sd->alias};
+        for(int k = 0; k < 2; k++){
+            if(!names[k]) continue;
+            idx = sheet_index_slot(cap, names[k]);
+            for(;;){
+                uint32_t j = map->by_name[idx];
+                if(j == UINT32_MAX){
+                    map->by_name[idx] = i;
+                    break;
+                }
+                // Already taken by an earlier sheet.
+                if(map->data[j].name == names[k] || map->data[j].alias == names[k])
+                    break;
+                idx++;
+                if(unlikely(idx >= cap)) idx = 0;
+            }
+        }
+    }
+}
+
+DRSP_INTERNAL
+void
+sheet_new_layout(SheetMap* map, SheetData* sd){
+    // 0 is never handed out, so a zeroed binding doesn't match anything.
+    if(unlikely(!++map->layouts)) ++map->layouts;
+    sd->layout = map->layouts;
+}
+
 DRSP_INTERNAL
 SheetData*_Nullable
 sheet_lookup_by_handle(const DrSpreadCtx* ctx, SheetHandle handle){
-    for(size_t i = 0; i < ctx->map.n; i++){
-        SheetData* data = &ctx->map.data[i];
+    const SheetMap* map = &ctx->map;
+    if(likely(map->by_handle)){
+        uint32_t idx = sheet_index_slot(map->index_cap, handle);
+        for(;;){
+            uint32_t i = map->by_handle[idx];
+            if(i == UINT32_MAX) return NULL;
+            if(map->data[i].handle == handle)
+                return &map->data[i];
+            idx++;
+            if(unlikely(idx >= map->index_cap)) idx = 0;
+        }
+    }
+    for(size_t i = 0; i < map->n; i++){
+        SheetData* data = &map->data[i];
         if(data->handle == handle)
             return data;
     }
@@ -662,34 +1759,105 @@ sheet_get_or_create_by_handle(DrSpreadCtx* ctx, SheetHandle handle){
     sd = &ctx->map.data[ctx->map.n++];
     memset(sd, 0, sizeof *sd);
     sd->handle = handle;
+    sheet_new_layout(&ctx->map, sd);
+    // It doesn't have a name yet.
+    if(ctx->map.by_handle && sheet_index_fits(&ctx->map))
+        sheet_index_add_handle(&ctx->map, (uint32_t)(ctx->map.n-1));
+    else
+        sheet_map_reindex(&ctx->map);
     return sd;
 }
 
+static
+SheetData*_Nullable
+sheet_find_by_name(const SheetMap* map, DrspAtom name){
+    if(likely(map->by_name)){
+        uint32_t idx = sheet_index_slot(map->index_cap, name);
+        for(;;){
+            uint32_t i = map->by_name[idx];
+            if(i == UINT32_MAX) return NULL;
+            SheetData* data = &map->data[i];
+            if(data->name == name || data->alias == name)
+                return data;
+            idx++;
+            if(unlikely(idx >= map->index_cap)) idx = 0;
+        }
+    }
+    for(size_t i = 0; i < map->n; i++){
+        SheetData* data = &map->data[i];
+        if(data->name != name && (!data->alias || data->alias != name))
+            continue;
+        return data;
+    }
+    return NULL;
+}
+
+// Workers only get to see the sheet they are evaluating.
+static inline
+SheetData*_Nullable
+worker_visible_sheet(DrSpreadCtx* ctx, SheetData*_Nullable data){
+    SheetData* own = ctx->worker_sheet;
+    if(!own || !data) return data;
+    if(data == own || data == own->base)
+        return own;
+    // Another worker could be evaluating it, so the whole sheet is
+    // redone on the calling thread instead.
+    ctx->bailed = 1;
+    return NULL;
+}
+
 DRSP_INTERNAL
 SheetData*_Nullable
 sheet_lookup_by_name(DrSpreadCtx* ctx, DrspAtom name){
-    for(size_t i = 0; i < ctx->map.n; i++){
-        SheetData* data = &ctx->map.data[i];
-        if(data->name == name)
-            return data;
-        if(!data->alias) continue;
-        if(data->alias == name)
-            return data;
+    return worker_visible_sheet(ctx, sheet_find_by_name(&ctx->map, name));
+}
+
+// The binding is the generation in the high half and the index of the sheet
+// plus 1 in the low half, or UINT32_MAX if there is no such sheet. Nodes are
+// shared between workers, hence the atomics.
+DRSP_INTERNAL
+SheetData*_Nullable
+foreign_sheet_lookup(DrSpreadCtx* ctx, DrspAtom name, uint64_t* binding){
+    const SheetMap* map = &ctx->map;
+    uint64_t b = __atomic_load_n(binding, __ATOMIC_RELAXED);
+    SheetData* data;
+    if((uint32_t)(b >> 32) == map->generation && (uint32_t)b){
+        uint32_t i = (uint32_t)b;
+        data = i == UINT32_MAX? NULL : &map->data[i-1];
     }
-    return NULL;
+    else {
+        data = sheet_find_by_name(map, name);
+        uint32_t i = data? (uint32_t)(data - map->data)+1 : UINT32_MAX;
+        __atomic_store_n(binding, (uint64_t)map->generation << 32 | i, __ATOMIC_RELAXED);
+    }
+    return worker_visible_sheet(ctx, data);
 }
 
 DRSP_INTERNAL
 DrspAtom
-sp_cell_atom(SheetData* sd, intptr_t row, intptr_t col){
+sp_cell_atom(SheetData* sd, intptr_t row, intptr_t col, CellKind* kind, double* number){
     if(row != IDX_EXTRA_DIMENSIONAL)
         if(row < 0 || col < 0 || row >= sd->height || col >= sd->width)
-            return drsp_nil_atom();
+            goto blank;
     CellCache* cache = &sd->cell_cache;
-    DrspAtom cached = get_cached_cell(cache, row, col);
-    if(!cached)
-        return drsp_nil_atom();
-    return cached;
+    if(likely(row >= 0 && (size_t)col < cache->ncolumns)){
+        const CellColumn* column = &cache->columns[col];
+        if(row < column->len && column->atoms[row]){
+            *kind = column->kinds[row];
+            *number = column->numbers[row];
+            return column->atoms[row];
+        }
+    }
+    if(cache->n){
+        DrspAtom cached = get_sparse_cell(cache, row, col);
+        if(cached){
+            *kind = cell_kind(cached, number);
+            return cached;
+        }
+    }
+    blank:
+    *kind = CELL_BLANK;
+    return drsp_nil_atom();
 }
 
 DRSP_INTERNAL
@@ -902,6 +2070,8 @@ drsp_set_named_cell(DrSpreadCtx* restrict ctx, SheetHandle sheet, const char* re
     DrspAtom a = drsp_intern_sv_lower(ctx, sv);
     if(!a) return 1;
     int err = set_named_cell(&sd->named_cells, a, row, col);
+    sheet_new_layout(&ctx->map, sd);
+    sheet_mark_dirty(ctx, sd);
     return err;
 }
 
@@ -916,6 +2086,8 @@ drsp_clear_named_cell(DrSpreadCtx* restrict ctx, SheetHandle sheet, const char*
     DrspAtom a = drsp_intern_sv_lower(ctx, sv);
     if(!a) return 1;
     clear_named_cell(&sd->named_cells, a);
+    sheet_new_layout(&ctx->map, sd);
+    sheet_mark_dirty(ctx, sd);
     return 0;
 }
 
@@ -958,6 +2130,11 @@ sheet_mark_dirty(DrSpreadCtx* ctx, SheetData* d){
     // We could have cached output despite being dirty due to someone
     // calling evaluate_string or from a single sheet being evaluated.
     clear_cached_output_result(&d->result_cache);
+    // Everything gets evaluated from scratch, which records the
+    // dependencies again.
+    clear_cell_deps(&d->deps);
+    clear_cell_set(&d->dirty_cells);
+    clear_column_indexes(&d->col_indexes);
     if(d->dirty) return;
     d->dirty = 1;
     for(size_t i = 0; i < d->dependants.count; i++){
@@ -971,6 +2148,64 @@ sheet_mark_dirty(DrSpreadCtx* ctx, SheetData* d){
     d->dependants.count = 0;
 }
 
+DRSP_INTERNAL
+void
+sheet_mark_cell_dirty(DrSpreadCtx* ctx, SheetData* d, intptr_t row, intptr_t col){
+    // Function sheets are evaluated with the caller's arguments, so
+    // we don't record their dependencies.
+    if(d->dirty || (d->flags & DRSP_SHEET_FLAGS_IS_FUNCTION))
+        goto whole_sheet;
+    {
+        CellSet* dirty = &d->dirty_cells;
+        RowCol rc = {row, col};
+        // The set is closed over dependants, so if the cell is already
+        // in there then so is everything downstream of it.
+        if(!cell_set_has(dirty, rc)){
+            size_t start = dirty->n;
+            if(cell_set_add(dirty, rc)) goto whole_sheet;
+            // Breadth-first, using the set itself as the queue.
+            for(size_t i = start; i < dirty->n; i++){
+                RowCol src = ((RowCol*)dirty->data)[i];
+                // Marks that the column's readers were visited, it
+                // isn't a cell.
+                if(src.row == IDX_UNSET) continue;
+                del_cached_output_result(&d->result_cache, src.row, src.col);
+                drop_column_index(&d->col_indexes, src.col);
+                if(!d->deps.n) continue;
+                RowCol column = {IDX_UNSET, src.col};
+                RowCol keys[2] = {src, column};
+                for(int k = 0; k < 2; k++){
+                    const CellDep* items = (const CellDep*)d->deps.data;
+                    uint32_t h = *cell_deps_slot(&d->deps, keys[k], (RowCol){IDX_UNSET, IDX_UNSET});
+                    if(h == UINT32_MAX) continue;
+                    // Lookups that used the column's index depend on the
+                    // whole column, so they only need to be visited once.
+                    if(k){
+                        if(cell_set_has(dirty, column)) continue;
+                        if(cell_set_add(dirty, column)) goto whole_sheet;
+                    }
+                    for(uint32_t e = items[h].next; e != UINT32_MAX; e = items[e].next){
+                        RowCol dst = items[e].dst;
+                        if(cell_set_has(dirty, dst)) continue;
+                        if(cell_set_add(dirty, dst)) goto whole_sheet;
+                    }
+                }
+            }
+        }
+    }
+    // We don't track individual cells across sheets.
+    for(size_t i = 0; i < d->dependants.count; i++){
+        SheetData* s = sheet_lookup_by_handle(ctx, d->dependants.data[i]);
+        if(!s) continue;
+        sheet_mark_dirty(ctx, s);
+    }
+    d->dependants.count = 0;
+    return;
+
+    whole_sheet:
+    sheet_mark_dirty(ctx, d);
+}
+
 static inline
 Expression*
 Error_(DrSpreadCtx* ctx, const char* mess, size_t len){
@@ -1053,7 +2288,8 @@ expr_to_cached_result(DrSpreadCtx* ctx, Expression* e, CachedResult* out){
         case EXPR_RANGE1D_ROW_FOREIGN:
         case EXPR_RANGE1D_COLUMN:
         case EXPR_RANGE1D_COLUMN_FOREIGN:
-        case EXPR_COMPUTED_ARRAY:{
+        case EXPR_COMPUTED_ARRAY:
+        case EXPR_NUMBER_ARRAY:{
             DrspAtom str = drsp_intern_str(ctx, "[[array]]", sizeof("[[array]]")-1);
             if(!str) return 1;
             out->kind = CACHED_RESULT_STRING;
@@ -1095,6 +2331,7 @@ expr_to_cached_result_no_array(DrSpreadCtx* ctx, Expression* e, CachedResult* ou
         case EXPR_RANGE1D_COLUMN:
         case EXPR_RANGE1D_COLUMN_FOREIGN:
         case EXPR_COMPUTED_ARRAY:
+        case EXPR_NUMBER_ARRAY:
             return 1;
         default:
         case EXPR_ERROR:{
@@ -8,9 +8,12 @@
 #include <stddef.h>
 #include "drspread.h"
 #include "drspread_colcache.h"
-#include "buff_allocator.h"
 #include "stringview.h"
+#include "thread_utils.h"
 #include "drspread_allocators.h"
+#define BUFF_SEGMENT_ALLOC(size) drsp_alloc(0, NULL, size, _Alignof(BuffSegment))
+#define BUFF_SEGMENT_FREE(ptr, size) drsp_alloc(size, ptr, 0, _Alignof(BuffSegment))
+#include "buff_allocator.h"
 
 #if defined(__IMPORTC__)
 __import ldc.intrinsics;
@@ -32,6 +35,7 @@ __import ldc.intrinsics;
 #define __builtin_memcpy memcpy
 #define __builtin_trap abort
 #define __builtin_unreachable abort
+#define __builtin_prefetch(p) ((void)(p))
 #endif
 
 #ifndef force_inline
@@ -138,6 +142,7 @@ TYPED_ENUM(ExpressionKind, uintptr_t){
     EXPR_UNARY                  = 13,
     EXPR_COMPUTED_ARRAY         = 14,
     EXPR_USER_DEFINED_FUNC_CALL = 15,
+    EXPR_NUMBER_ARRAY           = 16,
 };
 
 typedef struct Expression Expression;
@@ -195,11 +200,35 @@ enum {IDX_DOLLAR            = -2147483647  }; // INT32_MIN+1
 enum {IDX_BLANK             = -2147483646  }; // INT32_MIN+2
 enum {IDX_EXTRA_DIMENSIONAL = DRSP_IDX_EXTRA_DIMENSIONAL}; // INT32_MIN+3
 
+// Formulas are canonicalized so that rows close to the row of the cell being
+// evaluated are stored relative to it (see canonicalize_formula), which lets
+// filled down formulas share a parse. IDX_RELATIVE is the caller's row,
+// IDX_RELATIVE+1 the row after, etc.
+enum {IDX_RELATIVE_WINDOW   = 64};
+enum {IDX_RELATIVE          = IDX_EXTRA_DIMENSIONAL + 1 + IDX_RELATIVE_WINDOW};
+
+static inline
+intptr_t
+resolve_relative_idx(intptr_t idx, intptr_t caller_row){
+    if(idx >= IDX_RELATIVE - IDX_RELATIVE_WINDOW && idx <= IDX_RELATIVE + IDX_RELATIVE_WINDOW)
+        return caller_row + (idx - IDX_RELATIVE);
+    return idx;
+}
+
+static inline
+intptr_t
+resolve_row_idx(intptr_t idx, intptr_t caller_row){
+    if(idx == IDX_DOLLAR) return caller_row;
+    return resolve_relative_idx(idx, caller_row);
+}
+
 typedef struct Range0D Range0D;
 struct Range0D {
     Expression e;
     DrspAtom col_name;
     intptr_t row;
+    // See sp_bound_col_idx.
+    uint64_t col_binding;
 };
 
 typedef struct ForeignRange0D ForeignRange0D;
@@ -209,6 +238,8 @@ struct ForeignRange0D {
         Range0D r;
     };
     DrspAtom sheet_name;
+    // See foreign_sheet_lookup.
+    uint64_t binding;
 };
 
 typedef struct Range1DColumn Range1DColumn;
@@ -216,6 +247,8 @@ struct Range1DColumn {
     Expression e;
     DrspAtom col_name;
     intptr_t row_start, row_end; // inclusive
+    // See sp_bound_col_idx and sp_bound_named_cell.
+    uint64_t col_binding, cell_binding;
 };
 
 typedef struct Range1DRow Range1DRow;
@@ -223,6 +256,8 @@ struct Range1DRow {
     Expression e;
     intptr_t row_idx;
     DrspAtom col_start, col_end; // inclusive
+    // See sp_bound_col_idx.
+    uint64_t start_binding, end_binding;
 };
 
 typedef struct ForeignRange1DColumn ForeignRange1DColumn;
@@ -232,6 +267,7 @@ struct ForeignRange1DColumn {
         Expression e;
     };
     DrspAtom sheet_name;
+    uint64_t binding;
 };
 
 typedef struct ForeignRange1DRow ForeignRange1DRow;
@@ -241,6 +277,7 @@ struct ForeignRange1DRow {
         Expression e;
     };
     DrspAtom sheet_name;
+    uint64_t binding;
 };
 
 typedef struct Binary Binary;
@@ -275,9 +312,44 @@ struct ComputedArray {
     _Alignas(uintptr_t) Expression*_Nonnull data[];
 };
 
-// This is a hash table
+// An array whose elements are all numbers or blanks, held unboxed so the
+// element-wise operations and the aggregates run over flat memory.
+typedef struct NumberArray NumberArray;
+struct NumberArray {
+    Expression e;
+    intptr_t length;
+    // blank[i] is nonzero if element i is blank. NULL if none are.
+    unsigned char*_Nullable blank;
+    double data[];
+};
+
+// What evaluate() will make of a cell, decided when it is set.
+TYPED_ENUM(CellKind, uint8_t){
+    CELL_BLANK   = 0,
+    CELL_STRING  = 1,
+    CELL_NUMBER  = 2, // Already parsed.
+    CELL_FORMULA = 3,
+};
+
+// One column of cells, indexed by row. Rows that were never set are NULL.
+typedef struct CellColumn CellColumn;
+struct CellColumn {
+    intptr_t len, cap;
+    size_t count; // rows that were set
+    DrspAtom _Nullable* atoms;
+    // These are in the same allocation as atoms.
+    double* numbers; // Only meaningful for CELL_NUMBER.
+    CellKind* kinds;
+};
+
+// Cells are stored by column so that reading a range is a walk over an array.
+// Cells that would leave most of a column (or the columns) empty go in a hash
+// table instead, as do extra dimensional cells.
 typedef struct CellCache CellCache;
 struct CellCache {
+    CellColumn* columns;
+    size_t ncolumns, colcap;
+    // The sparse cells.
     size_t n;
     size_t cap;
     unsigned char* data;
@@ -296,12 +368,139 @@ struct RowColSv {
 };
 static inline
 DrspAtom _Nullable
-get_cached_cell(CellCache* cache, intptr_t row, intptr_t col);
+get_cached_cell(const CellCache* cache, intptr_t row, intptr_t col);
 
 static inline
 int
 set_cached_cell(CellCache* cache, intptr_t row, intptr_t col, DrspAtom txt);
 
+// Makes room for `count` cells that are about to be set in rows [0, len) of
+// the column, if they would be stored in it.
+DRSP_INTERNAL
+int
+reserve_cached_cells(CellCache* cache, intptr_t col, intptr_t len, size_t count);
+
+// Makes room for rows [0, cap) of the column, if it would be stored densely,
+// without adding them. For when the rows are about to be set in order.
+DRSP_INTERNAL
+int
+reserve_cell_column(CellCache* cache, intptr_t col, intptr_t cap);
+
+DRSP_INTERNAL
+void
+cleanup_cell_cache(CellCache* cache);
+
+// Cell-level dependency graph.
+// This is a hash table of (src, dst) edges, where dst is a formula cell
+// that read src while it was being evaluated.
+// Each src also gets a head entry (dst of {IDX_UNSET, IDX_UNSET}) whose
+// `next` starts a linked list through all of the edges out of that src,
+// so we can find the dependants of a cell without scanning the table.
+typedef struct CellDep CellDep;
+struct CellDep {
+    RowCol src, dst;
+    uint32_t next;
+};
+
+typedef struct CellDeps CellDeps;
+struct CellDeps {
+    size_t n, cap;
+    unsigned char* data;
+};
+
+DRSP_INTERNAL
+int
+cell_deps_add(CellDeps* deps, RowCol src, RowCol dst);
+
+DRSP_INTERNAL
+void
+clear_cell_deps(CellDeps* deps);
+
+// This is a hash set. The items are stored in insertion order, so it can
+// also be walked as a list.
+typedef struct CellSet CellSet;
+struct CellSet {
+    size_t n, cap;
+    unsigned char* data;
+};
+
+DRSP_INTERNAL
+_Bool
+cell_set_has(const CellSet* set, RowCol rc);
+
+DRSP_INTERNAL
+int
+cell_set_add(CellSet* set, RowCol rc);
+
+DRSP_INTERNAL
+void
+clear_cell_set(CellSet* set);
+
+// Where each value of a column is, so tlu() and find() don't have to
+// evaluate every row. The values are hashed to the first row they are in and
+// later rows with the same value are chained through `next`.
+// It is built lazily from literals and cached formula results, stopping at
+// the first formula that hasn't been computed yet, and is dropped as soon as
+// any cell of the column is invalidated.
+// A cell that looks something up through the index depends on the whole
+// column, which is recorded as a dependency on {IDX_UNSET, col}.
+typedef struct ColumnIndexEntry ColumnIndexEntry;
+struct ColumnIndexEntry {
+    uint64_t key; // The bits of the number or the atom.
+    uint32_t kind; // EXPR_NUMBER, EXPR_STRING or EXPR_BLANK
+    int32_t first, last;
+};
+
+typedef struct ColumnIndex ColumnIndex;
+struct ColumnIndex {
+    intptr_t col;
+    // Rows [0, nrows) are indexed.
+    intptr_t nrows;
+    int32_t* next;
+    size_t next_cap;
+    // Hash table of the entries.
+    size_t n, cap;
+    unsigned char* data;
+};
+
+typedef struct ColumnIndexes ColumnIndexes;
+struct ColumnIndexes {
+    ColumnIndex* data;
+    size_t count, capacity;
+};
+
+// Returns the index of the column, extended as far as it can go, or NULL if
+// the column can't be indexed.
+DRSP_INTERNAL
+ColumnIndex*_Nullable
+get_column_index(DrSpreadCtx* ctx, SheetData* sd, intptr_t col);
+
+DRSP_INTERNAL
+const ColumnIndexEntry*_Nullable
+column_index_find(const ColumnIndex* ci, uint32_t kind, uint64_t key);
+
+DRSP_INTERNAL
+void
+drop_column_index(ColumnIndexes* indexes, intptr_t col);
+
+DRSP_INTERNAL
+void
+cleanup_column_indexes(ColumnIndexes* indexes);
+
+DRSP_INTERNAL
+void
+clear_column_indexes(ColumnIndexes* indexes);
+
+static inline
+uint64_t
+column_index_number_key(double d){
+    // -0 and 0 are equal.
+    if(d == 0) d = 0;
+    uint64_t bits;
+    __builtin_memcpy(&bits, &d, sizeof bits);
+    return bits;
+}
+
 
 
 enum {LINKED_ARENA_SIZE=16*1024 - sizeof(void*) - sizeof(size_t)};
@@ -346,11 +545,42 @@ force_inline
 DrspAtom
 drsp_nil_atom(void);
 
+// The interned strings, so atoms can be compared by pointer.
+// The heap is split into shards by hash, each with its own lock for
+// inserting. Lookups don't lock: a table is never rehashed in place, slots
+// only go from empty to full, and a grown table replaces the old one, which is
+// kept around until the heap is destroyed as a lookup could still be reading
+// it.
+enum {STRING_HEAP_SHARDS = 8};
+
+// The hash of each slot is stored after the slots, so probing only has to
+// look at a string when its hash matches.
+typedef struct StringTable StringTable;
+struct StringTable {
+    StringTable*_Nullable retired;
+    uint32_t cap;
+    DrspAtom _Nullable slots[];
+};
+
+enum {STRING_TABLE_SLOT_SIZE = sizeof(DrspAtom)+sizeof(uint32_t)};
+
+static inline
+uint32_t*
+string_table_hashes(const StringTable* table){
+    return (uint32_t*)(table->slots + table->cap);
+}
+
+typedef struct StringShard StringShard;
+struct StringShard {
+    StringTable*_Nullable table;
+    LinkedArena*_Nullable arena;
+    uint32_t n;
+    _Bool lock;
+};
+
 typedef struct StringHeap StringHeap;
 struct StringHeap {
-    LinkedArena*_Nullable arena;
-    size_t n, cap;
-    unsigned char* data;
+    StringShard shards[STRING_HEAP_SHARDS];
 };
 
 DRSP_INTERNAL
@@ -380,6 +610,14 @@ DRSP_INTERNAL
 void
 cache_parse(DrSpreadCtx* ctx, DrspAtom a, Expression*_Nonnull e);
 
+typedef struct BcProgram BcProgram;
+
+// Where the compiled form of an already parsed formula is kept.
+// Returns NULL if the formula hasn't been parsed.
+DRSP_INTERNAL
+const BcProgram*_Nullable*_Nullable
+cached_program_slot(DrSpreadCtx* ctx, DrspAtom a);
+
 typedef struct OutputResultCache OutputResultCache;
 struct OutputResultCache {
     size_t n, cap;
@@ -437,6 +675,10 @@ DRSP_INTERNAL
 void
 clear_cached_output_result(OutputResultCache* cache);
 
+DRSP_INTERNAL
+void
+del_cached_output_result(OutputResultCache* cache, intptr_t row, intptr_t col);
+
 
 typedef struct UserDefinedFunctionParameter UserDefinedFunctionParameter;
 struct UserDefinedFunctionParameter {
@@ -482,6 +724,19 @@ DRSP_INTERNAL
 void
 cleanup_named_cells(NamedCells* cells);
 
+typedef struct DisplayUpdates DisplayUpdates;
+struct DisplayUpdates {
+    DrspDisplayUpdate*_Null_unspecified data;
+    size_t count, capacity;
+};
+
+// See drsp_save_snapshot.
+typedef struct SnapshotBuffer SnapshotBuffer;
+struct SnapshotBuffer {
+    unsigned char*_Null_unspecified data;
+    size_t size, capacity;
+};
+
 typedef struct UniqueSheets UniqueSheets;
 // Dynamic array, but
 struct UniqueSheets {
@@ -520,6 +775,19 @@ struct SheetData {
         Expression* e;
     }hacky_func_args[4];
     UniqueSheets dependants;
+    CellDeps deps;
+    // Cells that need to be recalculated when the sheet as a whole is not
+    // dirty.
+    CellSet dirty_cells;
+    ColumnIndexes col_indexes;
+    // Set on a shadow of the sheet, which shares the cells of `base` but
+    // has its own caches, so that parts of the sheet can be evaluated on
+    // different threads.
+    SheetData*_Nullable base;
+    // Changes whenever the column names or named cells do and is unique
+    // among the sheets, so ranges can remember what their names resolved
+    // to. 0 for sheets that aren't in the map.
+    uint32_t layout;
     _Bool dirty : 1;
 };
 
@@ -527,6 +795,31 @@ DRSP_INTERNAL
 void
 cleanup_sheet_data(SheetData*);
 
+DRSP_INTERNAL
+SheetData*_Nullable
+create_sheet_shadow(SheetData* sd);
+
+// Moves what the shadow cached and recorded into its base sheet.
+// Returns 1 on oom, in which case the dependencies of the base are
+// incomplete.
+DRSP_INTERNAL
+int
+merge_sheet_shadow(SheetData* shadow);
+
+DRSP_INTERNAL
+void
+destroy_sheet_shadow(SheetData* shadow);
+
+// A shadow falls back to the results its base already had.
+force_inline
+const CachedResult*_Nullable
+lookup_cached_result(const SheetData* sd, intptr_t row, intptr_t col){
+    const CachedResult* cr = has_cached_output_result(&sd->result_cache, row, col);
+    if(!cr && sd->base)
+        cr = has_cached_output_result(&sd->base->result_cache, row, col);
+    return cr;
+}
+
 DRSP_INTERNAL
 int
 sheet_add_dependant(DrSpreadCtx* ctx, SheetData* sd, SheetHandle h);
@@ -535,13 +828,42 @@ DRSP_INTERNAL
 void
 sheet_mark_dirty(DrSpreadCtx* ctx, SheetData* h);
 
-// Note: this is just a dynamic array, it is not a hash table.
-// It could be turned into a hash table though, idk.
+// Marks just the cell and everything downstream of it as needing to be
+// recalculated, falling back to sheet_mark_dirty when the dependency graph
+// can't be trusted.
+DRSP_INTERNAL
+void
+sheet_mark_cell_dirty(DrSpreadCtx* ctx, SheetData* h, intptr_t row, intptr_t col);
+
+typedef struct PendingCell PendingCell;
+struct PendingCell {
+    SheetData* sd;
+    intptr_t row, col;
+};
+
+typedef struct PendingCells PendingCells;
+struct PendingCells {
+    PendingCell* data;
+    size_t count, capacity;
+};
+
+// The sheets, with hash indexes by handle and by name (or alias).
+// The indexes are rebuilt whenever they change, which isn't often. If that
+// fails they are NULL and the sheets are scanned instead.
 typedef struct SheetMap SheetMap;
 struct SheetMap {
     size_t cap;
     size_t n;
     SheetData* data;
+    // Both are index_cap slots of indexes into data, UINT32_MAX if empty.
+    uint32_t*_Nullable by_handle;
+    uint32_t*_Nullable by_name;
+    uint32_t index_cap;
+    // Bumped whenever a name could refer to a different sheet than before
+    // or sheets move around in data.
+    uint32_t generation;
+    // The last SheetData.layout handed out.
+    uint32_t layouts;
 };
 typedef struct ErrorExpression ErrorExpression;
 struct ErrorExpression {
@@ -549,6 +871,18 @@ struct ErrorExpression {
     DrspAtom message;
 };
 
+// Formula cells nested deeper than EVAL_DEFER_DEPTH are deferred and
+// evaluated later from the top level, so long chains of references don't use
+// up the native stack. EVAL_MAX_DEPTH is the hard limit for what can't be
+// deferred (user defined function bodies).
+#ifdef __wasm__
+enum {EVAL_DEFER_DEPTH = 16, EVAL_MAX_DEPTH = 48};
+#else
+enum {EVAL_DEFER_DEPTH = 64, EVAL_MAX_DEPTH = 256};
+#endif
+
+enum {EVAL_MAX_THREADS = 64};
+
 struct DrSpreadCtx {
 #ifndef DRSPREAD_DIRECT_OPS
     const SheetOps _ops; // don't call these directly
@@ -561,12 +895,88 @@ struct DrSpreadCtx {
     BuffAllocator _a;
     Expression null;
     ErrorExpression error;
-#ifndef __wasm__
-    uintptr_t limit; // this sucks but is to avoid stack overflow;
-#endif
+    // How many formula cells are currently being evaluated natively.
+    unsigned depth;
+    // Set once a cell has been pushed onto `pending` during the current
+    // pass, so that the pending stack stays a single chain of dependencies.
+    _Bool pushed_pending;
+    // Set when a deferred cell could not be cached, which would make
+    // retrying pointless. Evaluation then just recurses to EVAL_MAX_DEPTH.
+    _Bool no_defer;
+    // Bumped every time a cell is deferred. Anything evaluated while this
+    // changed depended on a cell that has not been computed yet.
+    size_t ndeferred;
+    // Bumped every time a cell in a cycle is read.
+    size_t ncircular;
+    // Cells that were too deep to evaluate recursively and will be evaluated
+    // from the top level instead.
+    PendingCells pending;
+    // The formula cell currently being evaluated, used to record the
+    // cells it reads into its sheet's dependency graph.
+    SheetData*_Nullable dep_sheet;
+    RowCol dep_loc;
+    // How many threads drsp_evaluate_formulas spreads the sheets over.
+    int nthreads;
+    // Set on the copies of the context that evaluate sheets on worker
+    // threads. The string and parse heaps are the parent's. The parse heap
+    // is only touched while holding heap_lock, the string heap locks its
+    // shards itself.
+    DrSpreadCtx*_Nullable parent;
+    LOCK_T*_Nullable heap_lock;
+    unsigned heap_lock_depth;
+    // The sheet a worker is evaluating. Reaching any other sheet sets
+    // `bailed`, as that sheet could be in use by another worker.
+    SheetData*_Nullable worker_sheet;
+    _Bool bailed;
+    // See drsp_set_display_batching.
+    _Bool batch_display;
+    DisplayUpdates updates;
+    SnapshotBuffer snapshot;
     // _Alignas(double) char buff[];
 };
 
+force_inline
+DrSpreadCtx*
+heap_owner(DrSpreadCtx* ctx){
+    return ctx->parent?ctx->parent:ctx;
+}
+
+// Locks are counted, as parsing interns strings.
+force_inline
+void
+heap_lock(DrSpreadCtx* ctx){
+    if(ctx->parent && !ctx->heap_lock_depth++)
+        LOCK_T_lock(ctx->heap_lock);
+}
+
+force_inline
+void
+heap_unlock(DrSpreadCtx* ctx){
+    if(ctx->parent && !--ctx->heap_lock_depth)
+        LOCK_T_unlock(ctx->heap_lock);
+}
+
+// A context for evaluating sheets on another thread. It has its own scratch
+// allocator and shares everything else with `ctx`.
+DRSP_INTERNAL
+DrSpreadCtx*_Nullable
+create_worker_ctx(DrSpreadCtx* ctx, LOCK_T* heap_lock);
+
+DRSP_INTERNAL
+void
+destroy_worker_ctx(DrSpreadCtx* worker);
+
+// Has to be called after changing the names or the order of the sheets.
+DRSP_INTERNAL
+void
+sheet_map_reindex(SheetMap* map);
+
+// Has to be called after changing the column names or named cells of the
+// sheet.
+DRSP_INTERNAL
+void
+sheet_new_layout(SheetMap* map, SheetData* sd);
+
 DRSP_INTERNAL
 SheetData*_Nullable
 sheet_lookup_by_handle(const DrSpreadCtx* ctx, SheetHandle handle);
@@ -579,6 +989,13 @@ DRSP_INTERNAL
 SheetData*_Nullable
 sheet_lookup_by_name(DrSpreadCtx* ctx, DrspAtom name);
 
+// sheet_lookup_by_name for the sheet of a foreign reference. The sheet is
+// remembered in the node's `binding` (which starts out as 0) until
+// ctx->map.generation changes.
+DRSP_INTERNAL
+SheetData*_Nullable
+foreign_sheet_lookup(DrSpreadCtx* ctx, DrspAtom name, uint64_t* binding);
+
 DRSP_INTERNAL
 SheetData*_Nullable
 udf_lookup_by_handle(const DrSpreadCtx* ctx, SheetHandle handle);
@@ -625,6 +1042,7 @@ expr_alloc(DrSpreadCtx* ctx, ExpressionKind kind){
             return &ctx->null;
             break;
         case EXPR_COMPUTED_ARRAY:
+        case EXPR_NUMBER_ARRAY:
             __builtin_trap();
         case EXPR_USER_DEFINED_FUNC_CALL:      sz = sizeof(UserFunctionCall); break;
         default: __builtin_trap();
@@ -660,11 +1078,12 @@ parser_expr_alloc(DrSpreadCtx* ctx, ExpressionKind kind){
             return &ctx->null;
             break;
         case EXPR_COMPUTED_ARRAY:
+        case EXPR_NUMBER_ARRAY:
             __builtin_trap();
         case EXPR_USER_DEFINED_FUNC_CALL:      sz = sizeof(UserFunctionCall); break;
         default: __builtin_trap();
     }
-    void* result = linked_arena_alloc(&ctx->pheap.arena, sz);
+    void* result = linked_arena_alloc(&heap_owner(ctx)->pheap.arena, sz);
     if(!result) return NULL;
     ((Expression*)result)->kind = kind;
     return result;
@@ -679,6 +1098,50 @@ computed_array_alloc(DrSpreadCtx* ctx, size_t nitems){
     cc->length = nitems;
     return cc;
 }
+
+// Room for the blank mask is allocated after the numbers, but it is only
+// cleared and used once an element is set to blank.
+force_inline
+NumberArray*_Nullable
+number_array_alloc(DrSpreadCtx* ctx, size_t nitems){
+    size_t sz = offsetof(NumberArray, data)+(sizeof(double)+1)*nitems;
+    sz = (sz + _Alignof(NumberArray)-1) & ~(size_t)(_Alignof(NumberArray)-1);
+    NumberArray* na = buff_alloc(ctx->a, sz);
+    if(!na) return NULL;
+    na->e.kind = EXPR_NUMBER_ARRAY;
+    na->length = nitems;
+    na->blank = NULL;
+    return na;
+}
+
+static inline
+void
+number_array_set_blank(NumberArray* na, intptr_t i){
+    if(!na->blank){
+        na->blank = (unsigned char*)(na->data + na->length);
+        __builtin_memset(na->blank, 0, na->length);
+    }
+    na->blank[i] = 1;
+    na->data[i] = 0;
+}
+
+static inline
+_Bool
+number_array_is_blank(const NumberArray* na, intptr_t i){
+    return na->blank && na->blank[i];
+}
+
+// Boxes element i.
+static inline
+Expression*_Nullable
+number_array_get(DrSpreadCtx* ctx, const NumberArray* na, intptr_t i){
+    if(number_array_is_blank(na, i))
+        return expr_alloc(ctx, EXPR_BLANK);
+    Number* n = expr_alloc(ctx, EXPR_NUMBER);
+    if(!n) return NULL;
+    n->value = na->data[i];
+    return &n->e;
+}
 // GCOV_EXCL_STOP
 
 
@@ -706,13 +1169,35 @@ sv_cat(DrSpreadCtx* ctx, size_t n, const DrspAtom _Nonnull* const _Nonnull strs,
     return 0;
 }
 
+static inline
+double
+double_bin_cmp(BinaryKind op, double l, double r){
+    double value;
+    switch(op){
+        case BIN_ADD: value = l +  r; break;
+        case BIN_SUB: value = l -  r; break;
+        case BIN_MUL: value = l *  r; break;
+        case BIN_DIV: value = l /  r; break;
+        case BIN_LT:  value = l <  r; break;
+        case BIN_LE:  value = l <= r; break;
+        case BIN_GT:  value = l >  r; break;
+        case BIN_GE:  value = l >= r; break;
+        case BIN_EQ:  value = l == r; break;
+        case BIN_NE:  value = l != r; break;
+        // GCOV_EXCL_START
+        default: __builtin_trap();
+    }
+        // GCOV_EXCL_STOP
+    return value;
+}
+
 // GCOV_EXCL_START
 static inline
 size_t
 expr_size(ExpressionKind kind){
     size_t sz;
     switch(kind){
-        case EXPR_ERROR:                  sz = sizeof(Expression); break;
+        case EXPR_ERROR:                  sz = sizeof(ErrorExpression); break;
         case EXPR_NUMBER:                 sz = sizeof(Number); break;
         case EXPR_FUNCTION_CALL:          sz = sizeof(FunctionCall); break;
         case EXPR_RANGE0D_FOREIGN:        sz = sizeof(ForeignRange0D); break;
@@ -727,6 +1212,7 @@ expr_size(ExpressionKind kind){
         case EXPR_STRING:                 sz = sizeof(String); break;
         case EXPR_BLANK:                  sz = sizeof(Expression); break;
         case EXPR_COMPUTED_ARRAY: __builtin_trap();
+        case EXPR_NUMBER_ARRAY: __builtin_trap();
         case EXPR_USER_DEFINED_FUNC_CALL: sz = sizeof(UserFunctionCall); break;
         default: __builtin_trap();
     }
@@ -734,64 +1220,6 @@ expr_size(ExpressionKind kind){
 }
 // GCOV_EXCL_STOP
 
-static
-void*_Nullable
-expr_clone(DrSpreadCtx* ctx, Expression* e){
-    if(e->kind == EXPR_COMPUTED_ARRAY){
-        abort();
-    }
-    else {
-        void* result = expr_alloc(ctx, e->kind);
-        if(!result) return NULL;
-        __builtin_memcpy(result, e, expr_size(e->kind));
-        switch(e->kind){
-            case EXPR_GROUP:{
-                Group* g = result;
-                g->expr = expr_clone(ctx, g->expr);
-                if(!g->expr) return NULL;
-            }break;
-            case EXPR_UNARY:{
-                Unary* u = result;
-                u->expr = expr_clone(ctx, u->expr);
-                if(!u->expr) return NULL;
-            }break;
-            case EXPR_BINARY:{
-                Binary* b = result;
-                b->lhs = expr_clone(ctx, b->lhs);
-                if(!b->lhs) return NULL;
-                b->rhs = expr_clone(ctx, b->rhs);
-                if(!b->rhs) return NULL;
-            }break;
-            case EXPR_FUNCTION_CALL:{
-                FunctionCall* fc = result;
-                void* p = buff_alloc(ctx->a, fc->argc * sizeof *fc->argv);
-                if(!p) return NULL;
-                __builtin_memcpy(p, fc->argv, fc->argc * sizeof *fc->argv);
-                fc->argv = p;
-                for(int i = 0; i < fc->argc; i++){
-                    fc->argv[i] = expr_clone(ctx, fc->argv[i]);
-                    if(!fc->argv[i]) return NULL;
-                }
-            }break;
-            case EXPR_USER_DEFINED_FUNC_CALL:{
-                UserFunctionCall* fc = result;
-                void* p = buff_alloc(ctx->a, fc->argc * sizeof *fc->argv);
-                if(!p) return NULL;
-                __builtin_memcpy(p, fc->argv, fc->argc * sizeof *fc->argv);
-                fc->argv = p;
-                for(int i = 0; i < fc->argc; i++){
-                    fc->argv[i] = expr_clone(ctx, fc->argv[i]);
-                    if(!fc->argv[i]) return NULL;
-                }
-            }break;
-            default:
-                break;
-
-        }
-        return result;
-    }
-}
-
 union ExprU{
     Expression e;
     Number n;
@@ -823,7 +1251,7 @@ struct FuncInfo {
 
 DRSP_INTERNAL
 DrspAtom
-sp_cell_atom(SheetData* sd, intptr_t row, intptr_t col);
+sp_cell_atom(SheetData* sd, intptr_t row, intptr_t col, CellKind* kind, double* number);
 
 // We pretend that we support ragged sheets, even though we don't.
 force_inline
@@ -865,6 +1293,36 @@ sp_name_to_col_idx(SheetData* sd, DrspAtom name){
     return -1;
 }
 
+// The binding is the sheet's layout in the high half and the column in the
+// low half. Nodes are shared between sheets and threads, hence the atomics.
+force_inline
+intptr_t
+sp_bound_col_idx(SheetData* sd, DrspAtom name, uint64_t* binding){
+    uint64_t b = __atomic_load_n(binding, __ATOMIC_RELAXED);
+    if(likely(sd->layout && (uint32_t)(b >> 32) == sd->layout))
+        return (int32_t)(uint32_t)b;
+    intptr_t c = sp_name_to_col_idx(sd, name);
+    if(sd->layout && c == (int32_t)c)
+        __atomic_store_n(binding, (uint64_t)sd->layout << 32 | (uint32_t)c, __ATOMIC_RELAXED);
+    return c;
+}
+
+// Same as above, but the low half is the index of the named cell plus 1, or 0
+// if there isn't one.
+force_inline
+const NamedCell*_Nullable
+sp_bound_named_cell(SheetData* sd, DrspAtom name, uint64_t* binding){
+    uint64_t b = __atomic_load_n(binding, __ATOMIC_RELAXED);
+    if(likely(sd->layout && (uint32_t)(b >> 32) == sd->layout))
+        return (uint32_t)b? &sd->named_cells.data[(uint32_t)b-1] : NULL;
+    const NamedCell* cell = get_named_cell(&sd->named_cells, name);
+    if(sd->layout){
+        uint32_t i = cell? (uint32_t)(cell - sd->named_cells.data)+1 : 0;
+        __atomic_store_n(binding, (uint64_t)sd->layout << 32 | i, __ATOMIC_RELAXED);
+    }
+    return cell;
+}
+
 #ifdef __clang__
 #pragma clang assume_nonnull end
 #endif
@@ -15,8 +15,8 @@ get_range1dcol(DrSpreadCtx*ctx, SheetData* sd, Expression* arg, intptr_t* col, i
     if(arg->kind != EXPR_RANGE1D_COLUMN && arg->kind != EXPR_RANGE1D_COLUMN_FOREIGN)
         return 1;
     if(arg->kind == EXPR_RANGE1D_COLUMN_FOREIGN){
-        DrspAtom sheet_name = ((ForeignRange1DColumn*)arg)->sheet_name;
-        SheetData* hd = sheet_lookup_by_name(ctx, sheet_name);
+        ForeignRange1DColumn* rng = (ForeignRange1DColumn*)arg;
+        SheetData* hd = foreign_sheet_lookup(ctx, rng->sheet_name, &rng->binding);
         if(!hd) return 1;
         assert(hd);
         sd = hd;
@@ -24,19 +24,19 @@ get_range1dcol(DrSpreadCtx*ctx, SheetData* sd, Expression* arg, intptr_t* col, i
     }
     Range1DColumn* rng = (Range1DColumn*)arg;
     intptr_t start = rng->row_start;
-    if(start == IDX_DOLLAR) start = caller_row;
+    start = resolve_row_idx(start, caller_row);
     intptr_t colnum;
     if(rng->col_name == drsp_dollar_atom())
         colnum = caller_col;
     else if(!rng->col_name->length)
         colnum = 0;
     else {
-        colnum = sp_name_to_col_idx(sd, rng->col_name);
+        colnum = sp_bound_col_idx(sd, rng->col_name, &rng->col_binding);
         if(colnum == -1) return 1;
     }
     if(start < 0) start += sp_col_height(sd, colnum);
     intptr_t end = rng->row_end;
-    if(end == IDX_DOLLAR) end = caller_row;
+    end = resolve_row_idx(end, caller_row);
     if(end < 0) end += sp_col_height(sd, colnum);
     if(end < start){
         intptr_t tmp = end;
@@ -59,8 +59,8 @@ get_range1drow(DrSpreadCtx*ctx, SheetData* sd, Expression* arg, intptr_t* row, i
     if(arg->kind != EXPR_RANGE1D_ROW && arg->kind != EXPR_RANGE1D_ROW_FOREIGN)
         return 1;
     if(arg->kind == EXPR_RANGE1D_ROW_FOREIGN){
-        DrspAtom sheet_name = ((ForeignRange1DRow*)arg)->sheet_name;
-        SheetData* hd = sheet_lookup_by_name(ctx, sheet_name);
+        ForeignRange1DRow* rng = (ForeignRange1DRow*)arg;
+        SheetData* hd = foreign_sheet_lookup(ctx, rng->sheet_name, &rng->binding);
         if(!hd) return 1;
         sd = hd;
         *rsd = hd;
@@ -73,10 +73,10 @@ get_range1drow(DrSpreadCtx*ctx, SheetData* sd, Expression* arg, intptr_t* row, i
         start = 0;
     }
     else
-        start = sp_name_to_col_idx(sd, rng->col_start);
+        start = sp_bound_col_idx(sd, rng->col_start, &rng->start_binding);
     if(start == -1) return 1;
     intptr_t row_idx = rng->row_idx;
-    if(row_idx == IDX_DOLLAR) row_idx = caller_row;
+    row_idx = resolve_row_idx(row_idx, caller_row);
     intptr_t end;
     if(rng->col_end == drsp_dollar_atom())
         end = caller_col;
@@ -84,7 +84,7 @@ get_range1drow(DrSpreadCtx*ctx, SheetData* sd, Expression* arg, intptr_t* row, i
         end = sp_row_width(sd, row_idx);
     }
     else
-        end = sp_name_to_col_idx(sd, rng->col_end);
+        end = sp_bound_col_idx(sd, rng->col_end, &rng->end_binding);
     if(end == -1) return 1;
     if(end < start){
         intptr_t tmp = end;
@@ -149,6 +149,7 @@ expr_is_arraylike(Expression* e){
         case EXPR_RANGE1D_COLUMN:
         case EXPR_RANGE1D_COLUMN_FOREIGN:
         case EXPR_COMPUTED_ARRAY:
+        case EXPR_NUMBER_ARRAY:
         case EXPR_RANGE1D_ROW:
         case EXPR_RANGE1D_ROW_FOREIGN:
             return 1;
@@ -158,61 +159,142 @@ expr_is_arraylike(Expression* e){
 }
 // GCOV_EXCL_STOP
 
+// Walks the elements of an array-like expression. The cells of a range are
+// evaluated as they are reached instead of all being evaluated into a
+// ComputedArray first.
+typedef struct RangeCursor RangeCursor;
+struct RangeCursor {
+    ComputedArray*_Nullable array;
+    NumberArray*_Nullable numbers;
+    SheetData* sd;
+    intptr_t length;
+    intptr_t row, col;   // of the first element of a range
+    intptr_t drow, dcol; // 1, 0 for a column and 0, 1 for a row
+};
+
+// Returns nonzero if e is not a valid array-like expression.
 static inline
-Expression*_Nullable
-convert_to_computed_array(DrSpreadCtx* ctx, SheetData* sd, Expression* e, intptr_t caller_row, intptr_t caller_col){
-    if(e->kind == EXPR_COMPUTED_ARRAY)
-        return e;
-    if(e->kind == EXPR_RANGE1D_ROW || e->kind == EXPR_RANGE1D_ROW_FOREIGN){
-        SheetData* rsd = sd;
-        intptr_t row, colstart, colend;
-        if(get_range1drow(ctx, sd, e, &row, &colstart, &colend, &rsd, caller_row, caller_col))
-            return Error(ctx, "");
-        intptr_t len = colend - colstart + 1;
-        // Can't express a zero-length range
-        if(len <= 0) return Error(ctx, "");
-        ComputedArray* cc = computed_array_alloc(ctx, len);
-        if(!cc) return NULL;
-        Expression** data = cc->data;
-        intptr_t i = 0;
-        if(rsd != sd){
-            int err = sheet_add_dependant(ctx, rsd, sd->handle);
-            if(err) return Error(ctx, "oom");
-        }
-        for(intptr_t col = colstart; col <= colend; col++){
-            Expression* val = evaluate(ctx, rsd, row, col);
-            if(!val || val->kind == EXPR_ERROR) return val;
-            if(evaled_is_not_scalar(val)) return Error(ctx, "");
-            data[i++] = val;
-        }
-        assert(i == len);
-        return &cc->e;
+int
+range_cursor_init(DrSpreadCtx* ctx, SheetData* sd, Expression* e, RangeCursor* cur, intptr_t caller_row, intptr_t caller_col){
+    if(e->kind == EXPR_COMPUTED_ARRAY){
+        cur->array = (ComputedArray*)e;
+        cur->sd = sd;
+        cur->numbers = NULL;
+        cur->length = cur->array->length;
+        return 0;
+    }
+    cur->array = NULL;
+    if(e->kind == EXPR_NUMBER_ARRAY){
+        cur->numbers = (NumberArray*)e;
+        cur->sd = sd;
+        cur->length = cur->numbers->length;
+        return 0;
     }
+    cur->numbers = NULL;
     SheetData* rsd = sd;
-    intptr_t col, rstart, rend;
-    if(get_range1dcol(ctx, sd, e, &col, &rstart, &rend, &rsd, caller_row, caller_col))
-        return Error(ctx, "");
-    intptr_t len = rend - rstart + 1;
+    intptr_t start, end;
+    if(e->kind == EXPR_RANGE1D_ROW || e->kind == EXPR_RANGE1D_ROW_FOREIGN){
+        if(get_range1drow(ctx, sd, e, &cur->row, &start, &end, &rsd, caller_row, caller_col))
+            return 1;
+        cur->col = start;
+        cur->drow = 0;
+        cur->dcol = 1;
+    }
+    else {
+        if(get_range1dcol(ctx, sd, e, &cur->col, &start, &end, &rsd, caller_row, caller_col))
+            return 1;
+        cur->row = start;
+        cur->drow = 1;
+        cur->dcol = 0;
+    }
+    cur->sd = rsd;
+    cur->length = end - start + 1;
     // Can't express a zero-length range
-    if(len <= 0) return Error(ctx, "");
-    ComputedArray* cc = computed_array_alloc(ctx, len);
-    if(!cc) return NULL;
-    Expression** data = cc->data;
-    intptr_t i = 0;
+    if(cur->length <= 0) return 1;
     if(rsd != sd){
         int err = sheet_add_dependant(ctx, rsd, sd->handle);
-        if(err) return Error(ctx, "oom");
+        if(err) return 1;
     }
-    for(intptr_t row = rstart; row <= rend; row++){
-        Expression* val = evaluate(ctx, rsd, row, col);
+    return 0;
+}
+
+// Returns element i, which is an error if it is not a scalar.
+static inline
+Expression*_Nullable
+range_cursor_get(DrSpreadCtx* ctx, const RangeCursor* cur, intptr_t i){
+    if(cur->array) return cur->array->data[i];
+    if(cur->numbers) return number_array_get(ctx, cur->numbers, i);
+    Expression* e = evaluate(ctx, cur->sd, cur->row + i*cur->drow, cur->col + i*cur->dcol);
+    if(!e || e->kind == EXPR_ERROR) return e;
+    if(evaled_is_not_scalar(e)) return Error(ctx, "");
+    return e;
+}
+
+static inline
+Expression*_Nullable
+convert_to_computed_array(DrSpreadCtx* ctx, SheetData* sd, Expression* e, intptr_t caller_row, intptr_t caller_col){
+    if(e->kind == EXPR_COMPUTED_ARRAY)
+        return e;
+    RangeCursor cur;
+    if(range_cursor_init(ctx, sd, e, &cur, caller_row, caller_col))
+        return Error(ctx, "");
+    ComputedArray* cc = computed_array_alloc(ctx, cur.length);
+    if(!cc) return NULL;
+    for(intptr_t i = 0; i < cur.length; i++){
+        Expression* val = range_cursor_get(ctx, &cur, i);
         if(!val || val->kind == EXPR_ERROR) return val;
-        if(evaled_is_not_scalar(val)) return Error(ctx, "");
-        data[i++] = val;
+        cc->data[i] = val;
     }
-    assert(i == len);
     return &cc->e;
 }
 
+// For when an element of an array failed a check (its type, usually) before
+// the rest of the array was evaluated. An element from start on that is an
+// error is returned instead of err, as it would have been if the array had
+// been evaluated first.
+static inline
+Expression*_Nullable
+first_element_error(DrSpreadCtx* ctx, const RangeCursor* cur, intptr_t start, Expression* err){
+    DrspAtom message = ((ErrorExpression*)err)->message;
+    BuffCheckpoint bc = buff_checkpoint(ctx->a);
+    for(intptr_t i = start; i < cur->length; i++){
+        Expression* e = range_cursor_get(ctx, cur, i);
+        if(!e || e->kind == EXPR_ERROR) return e;
+        buff_set(ctx->a, bc);
+    }
+    // Evaluating the elements could have reused the context's error.
+    ctx->error.message = message;
+    return &ctx->error.e;
+}
+
+// Like convert_to_computed_array, but the elements must be numbers or
+// blanks and are stored unboxed. Anything else is an error with the given
+// message (see first_element_error).
+static inline
+Expression*_Nullable
+convert_to_number_array(DrSpreadCtx* ctx, SheetData* sd, Expression* e, intptr_t caller_row, intptr_t caller_col, StringView not_number){
+    if(e->kind == EXPR_NUMBER_ARRAY)
+        return e;
+    RangeCursor cur;
+    if(range_cursor_init(ctx, sd, e, &cur, caller_row, caller_col))
+        return Error(ctx, "");
+    NumberArray* na = number_array_alloc(ctx, cur.length);
+    if(!na) return NULL;
+    for(intptr_t i = 0; i < cur.length; i++){
+        BuffCheckpoint bc = buff_checkpoint(ctx->a);
+        Expression* val = range_cursor_get(ctx, &cur, i);
+        if(!val || val->kind == EXPR_ERROR) return val;
+        if(val->kind == EXPR_NUMBER)
+            na->data[i] = ((Number*)val)->value;
+        else if(val->kind == EXPR_BLANK)
+            number_array_set_blank(na, i);
+        else
+            return first_element_error(ctx, &cur, i+1, Error_(ctx, not_number.text, not_number.length));
+        buff_set(ctx->a, bc);
+    }
+    return &na->e;
+}
+
 
 
 #ifdef __clang__
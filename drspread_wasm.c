@@ -10,6 +10,10 @@ _Static_assert(16 == sizeof(DrSpreadResult), "");
 _Static_assert(__builtin_offsetof(DrSpreadResult, d)==8, "");
 _Static_assert(__builtin_offsetof(DrSpreadResult, s.length)==8, "");
 _Static_assert(__builtin_offsetof(DrSpreadResult, s.text)==12, "");
+_Static_assert(32 == sizeof(DrspDisplayUpdate), "");
+_Static_assert(__builtin_offsetof(DrspDisplayUpdate, row)==4, "");
+_Static_assert(__builtin_offsetof(DrspDisplayUpdate, col)==8, "");
+_Static_assert(__builtin_offsetof(DrspDisplayUpdate, value)==16, "");
 
 DRSP_EXPORT unsigned char wasm_str_buff[4*1024];
 unsigned char wasm_str_buff[4*1024] = {0};
@@ -23,4 +27,25 @@ int32_t wasm_parambuff_row[4] = {0};
 DRSP_EXPORT int32_t wasm_parambuff_col[4];
 int32_t wasm_parambuff_col[4] = {0};
 
+DRSP_EXPORT const DrspDisplayUpdate* wasm_display_updates;
+const DrspDisplayUpdate* wasm_display_updates = 0;
+
 #include "drspread.c"
+
+static void*_Nullable wasm_upload;
+static size_t wasm_upload_size;
+
+// Returns a buffer of at least size bytes for js to write a table of cells
+// into, which is then passed to drsp_set_cells_bulk or drsp_set_column_bulk
+// as is. The buffer is reused between calls, size 0 frees it.
+DRSP_EXPORT
+void*_Nullable
+wasm_upload_buffer(size_t size){
+    if(!size || size > wasm_upload_size){
+        void* p = drsp_alloc(wasm_upload_size, wasm_upload, size, _Alignof(double));
+        if(size && !p) return NULL;
+        wasm_upload = p;
+        wasm_upload_size = size;
+    }
+    return wasm_upload;
+}
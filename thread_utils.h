@@ -277,6 +277,27 @@ void
 join_thread(ThreadHandle handle){
     (void)handle;
 }
+
+// No threads, so nothing to lock.
+typedef int LOCK_T;
+static inline
+void
+LOCK_T_init(LOCK_T* lock){
+    *lock = 0;
+}
+
+static inline
+void
+LOCK_T_lock(LOCK_T* lock){
+    (void)lock;
+}
+
+static inline
+void
+LOCK_T_unlock(LOCK_T* lock){
+    (void)lock;
+}
+
 static int num_cpus(void){
     return 1;
 }